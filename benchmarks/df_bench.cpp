@@ -0,0 +1,78 @@
+// Distance field generation time: exact separable EDT against the serial raster-scan modes.
+// Input is a synthetic atlas of discs, sizes are given in pixels per side.
+#include "Render/Image/Image.h"
+#include "utils/thread_pool.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+
+namespace
+{
+	Image MakeDiscs(int side)
+	{
+		Image im = Image::Empty(glm::ivec2(side), Image::RGB8);
+		int cell = 64;
+		PARALLEL_BEGIN(side)
+		{
+			for (int j = p_begin; j < p_end; ++j)
+			{
+				Image::pixelRGB8* row = im.GetRow<Image::pixelRGB8>(j);
+				for (int i = 0; i < side; ++i)
+				{
+					int dx = i % cell - cell / 2;
+					int dy = j % cell - cell / 2;
+					row[i] = Image::pixelRGB8(dx * dx + dy * dy < 20 * 20 ? 255 : 0);
+				}
+			}
+		}
+		PARALLEL_END();
+		return im;
+	}
+
+	double Measure(const Image& im, Image::DFType type)
+	{
+		auto start = std::chrono::steady_clock::now();
+		im.ComputeDF(type);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count();
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	std::vector<int> sides;
+	int threads = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			threads = atoi(argv[++i]);
+		}
+		else
+		{
+			sides.push_back(atoi(argv[i]));
+		}
+	}
+	if (sides.empty())
+	{
+		sides = {4096, 8192, 16384};
+	}
+	utils::ThreadPool::Get().SetThreadCount(threads);
+
+	printf("threads: %d\n", utils::ThreadPool::Get().GetThreadCount());
+	printf("%-8s %16s %16s %16s\n", "size", "DeadReckoning3x3", "DeadReckoning5x5", "ExactEuclidean");
+	for (int side: sides)
+	{
+		Image im = MakeDiscs(side);
+		double dr3 = Measure(im, Image::DeadReckoning3x3);
+		double dr5 = Measure(im, Image::DeadReckoning5x5);
+		double edt = Measure(im, Image::ExactEuclidean);
+		printf("%-8d %14.3f s %14.3f s %14.3f s\n", side, dr3, dr5, edt);
+	}
+	return 0;
+}
@@ -0,0 +1,273 @@
+// Encode and decode throughput of 2D draw commands: the fsal::File command queue written field by field, as the
+// Encoder did before, against the CommandArena of POD records. A frame is a list of rects, every eighth rounded, with
+// scissors pushed and popped around groups of them. Results are written to stdout as JSON, both paths have to decode
+// the same frame.
+//
+// Usage: encoder_bench [--commands 10000] [--min-time 0.25]
+#include "2DEngine/Encoder.h"
+#include "2DEngine/Commands.h"
+#include <MemRefFile.h>
+#include <fsal.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+namespace
+{
+	// Command queue of the previous Encoder, one virtual Write per field
+	enum FileCommand : uint8_t
+	{
+		F_RectCol,
+		F_SetScissors,
+		F_ResetScissors,
+		F_End
+	};
+
+	class FileEncoder
+	{
+	public:
+		FileEncoder(): m_queue(new fsal::MemRefFile())
+		{}
+
+		void PushScissors(glm::aabb2 box)
+		{
+			m_queue.Write(F_SetScissors);
+			m_queue.Write(box);
+		}
+
+		void PopScissors()
+		{
+			m_queue.Write(F_ResetScissors);
+		}
+
+		void Rect(glm::aabb2 rect, Render::color col, glm::vec4 radius)
+		{
+			m_queue.Write(F_RectCol);
+			m_queue.Write(rect);
+			m_queue.Write(radius);
+			m_queue.Write(col);
+		}
+
+		fsal::File& GetQueue() { return m_queue; }
+
+	private:
+		fsal::File m_queue;
+	};
+
+	// Rect `i` of a frame
+	void GetRect(int i, glm::aabb2& rect, Render::color& col, glm::vec4& radius)
+	{
+		glm::vec2 p(float(i % 100) * 10.0f, float(i / 100) * 10.0f);
+		rect = glm::aabb2(p, p + glm::vec2(8.0f));
+		col = Render::color(i & 0xff, (i >> 8) & 0xff, 128, 255);
+		radius = i % 8 == 0 ? glm::vec4(2.0f) : glm::vec4(0.0f);
+	}
+
+	template<typename E>
+	void EncodeFrame(E& encoder, int commands)
+	{
+		for (int i = 0; i < commands; ++i)
+		{
+			if (i % 64 == 0)
+			{
+				encoder.PushScissors(glm::aabb2(glm::vec2(0.0f), glm::vec2(500.0f)));
+			}
+			glm::aabb2 rect;
+			Render::color col;
+			glm::vec4 radius;
+			GetRect(i, rect, col, radius);
+			encoder.Rect(rect, col, radius);
+			if (i % 64 == 63 || i == commands - 1)
+			{
+				encoder.PopScissors();
+			}
+		}
+	}
+
+	// The queue is rewritten from the start and terminated, as the previous Encoder did for every frame
+	void EncodeFileFrame(FileEncoder& encoder, int commands)
+	{
+		encoder.GetQueue().Seek(0);
+		EncodeFrame(encoder, commands);
+		encoder.GetQueue().Write(F_End);
+	}
+
+	// Decoders return a checksum of what they read and leave the frame intact, so it can be decoded again
+	double DecodeFile(fsal::File& queue)
+	{
+		queue.Seek(0);
+		double sum = 0.0;
+		FileCommand cmd;
+		while (queue.Read(cmd) && cmd != F_End)
+		{
+			switch (cmd)
+			{
+				case F_RectCol:
+				{
+					glm::aabb2 rect;
+					glm::vec4 radius;
+					Render::color col;
+					queue.Read(rect);
+					queue.Read(radius);
+					queue.Read(col);
+					sum += rect.minp.x + rect.maxp.y + radius.x + col.r;
+				}
+				break;
+				case F_SetScissors:
+				{
+					glm::aabb2 box;
+					queue.Read(box);
+					sum += box.maxp.x;
+				}
+				break;
+				default:
+					sum -= 1.0;
+					break;
+			}
+		}
+		return sum;
+	}
+
+	double DecodeArena(const Render::CommandArena& commands)
+	{
+		using namespace Render;
+		double sum = 0.0;
+		const uint8_t* p = commands.begin();
+		while (p < commands.end())
+		{
+			switch (Command(*p))
+			{
+				case C_RectCol:
+				{
+					RectColCmd cmd;
+					p = CommandArena::Read(p, cmd);
+					sum += cmd.rect.minp.x + cmd.rect.maxp.y + cmd.col.r;
+				}
+				break;
+				case C_RectColRounded:
+				{
+					RectColRoundedCmd cmd;
+					p = CommandArena::Read(p, cmd);
+					sum += cmd.rect.minp.x + cmd.rect.maxp.y + cmd.radius.x + cmd.col.r;
+				}
+				break;
+				case C_SetScissors:
+				{
+					SetScissorsCmd cmd;
+					p = CommandArena::Read(p, cmd);
+					sum += cmd.box.maxp.x;
+				}
+				break;
+				case C_ResetScissors:
+				{
+					ResetScissorsCmd cmd;
+					p = CommandArena::Read(p, cmd);
+					sum -= 1.0;
+				}
+				break;
+				default:
+					return -1.0;
+			}
+		}
+		return sum;
+	}
+
+	// Runs `f` until `minTime` passes, returns the number of runs
+	long long Measure(const std::function<double()>& f, double minTime, double& elapsed, double& sink)
+	{
+		long long runs = 0;
+		auto start = std::chrono::steady_clock::now();
+		do
+		{
+			sink += f();
+			++runs;
+			elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		while (elapsed < minTime);
+		return runs;
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	int commands = 10000;
+	double minTime = 0.25;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--commands") == 0 && i + 1 < argc)
+		{
+			commands = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+		{
+			minTime = atof(argv[++i]);
+		}
+		else
+		{
+			fprintf(stderr, "Unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	FileEncoder fileEncoder;
+	Render::Encoder arenaEncoder;
+
+	struct Case
+	{
+		const char* path;
+		const char* stage;
+		std::function<double()> run;
+	};
+	// Decoding reads the frame encoded by the last encode run
+	const Case cases[] = {
+		{"fsal", "encode", [&]
+		{
+			EncodeFileFrame(fileEncoder, commands);
+			return 0.0;
+		}},
+		{"fsal", "decode", [&] { return DecodeFile(fileEncoder.GetQueue()); }},
+		{"arena", "encode", [&]
+		{
+			arenaEncoder.Reset();
+			EncodeFrame(arenaEncoder, commands);
+			return 0.0;
+		}},
+		{"arena", "decode", [&] { return DecodeArena(arenaEncoder.GetCommands()); }},
+	};
+
+	EncodeFileFrame(fileEncoder, commands);
+	arenaEncoder.Reset();
+	EncodeFrame(arenaEncoder, commands);
+	size_t fileBytes = fileEncoder.GetQueue().Tell();
+	double fileSum = DecodeFile(fileEncoder.GetQueue());
+	double arenaSum = DecodeArena(arenaEncoder.GetCommands());
+	if (fileSum != arenaSum || DecodeFile(fileEncoder.GetQueue()) != fileSum)
+	{
+		fprintf(stderr, "Decoded frames differ: %.17g and %.17g\n", fileSum, arenaSum);
+		return 1;
+	}
+
+	printf("{\n");
+	printf("\t\"commands\": %d,\n", commands);
+	printf("\t\"bytes\": {\"fsal\": %zu, \"arena\": %zu},\n", fileBytes, arenaEncoder.GetCommands().GetSize());
+	printf("\t\"results\": [");
+	double sink = 0.0;
+	bool first = true;
+	for (const Case& c: cases)
+	{
+		double elapsed = 0.0;
+		long long runs = Measure(c.run, minTime, elapsed, sink);
+		printf("%s\n\t\t{\"path\": \"%s\", \"stage\": \"%s\", \"frames\": %lld, \"seconds\": %.6f, \"ns_per_command\": %.3f}",
+			first ? "" : ",", c.path, c.stage, runs, elapsed, elapsed * 1e9 / (runs * (double)commands));
+		fflush(stdout);
+		first = false;
+	}
+	printf("\n\t]\n}\n");
+	return 0;
+}
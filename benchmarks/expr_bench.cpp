@@ -0,0 +1,224 @@
+// Evaluation speed of compiled expressions for each engine: the stack bytecode interpreter, the register bytecode
+// interpreter, the JIT, and batches of instances with `x` and `y` read from arrays by the interpreter and the JIT.
+// Results are written to stdout as JSON, every engine has to produce the same value.
+//
+// Usage: expr_bench [--engines stack,register,jit,register-batch,jit-batch] [--min-time 0.25]
+#include "ExpressionEvaluator/ExpressionEvaluator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+namespace
+{
+	// Shapes of the constraints found in UI layouts
+	const char* k_expressions[] = {
+		"w * 0.5 - x",
+		"(w - 2 * margin) / 3 + x",
+		"x * scale + offset",
+		"clamp(x * 2 + y, 0, w)",
+		"mix(x, w, t) * scale + 10",
+		"min(w, h) * 0.25 + max(x, y) - margin * 2 * 0.5",
+		"(w - margin * 4) / 5 * 2 + margin * 3 + x * scale + y * scale - offset",
+		"sqrt(x * x + y * y) / (w * 0.5 + 1) - step(t, 0.5) * (3 * 4 - 2)",
+	};
+
+	struct Vars
+	{
+		double x = 13.0;
+		double y = 7.5;
+		double w = 1280.0;
+		double h = 720.0;
+		double t = 0.25;
+		double margin = 8.0;
+		double scale = 1.5;
+		double offset = -3.0;
+	};
+
+	template<typename C>
+	void Bind(C& ctx, Vars& v)
+	{
+		ctx.var("x", &v.x);
+		ctx.var("y", &v.y);
+		ctx.var("w", &v.w);
+		ctx.var("h", &v.h);
+		ctx.var("t", &v.t);
+		ctx.var("margin", &v.margin);
+		ctx.var("scale", &v.scale);
+		ctx.var("offset", &v.offset);
+	}
+
+	// Instances per call of the batch engines
+	const int k_batchSize = 1024;
+
+	// Repeats `f`, which evaluates `instances` instances, until `minTime` seconds pass. Returns the number of evaluated
+	// instances and the elapsed time.
+	long long Measure(const std::function<double()>& f, int instances, double minTime, double& elapsed, double& sink)
+	{
+		const int batch = std::max(1000 / instances, 1);
+		long long calls = 0;
+		auto start = std::chrono::steady_clock::now();
+		do
+		{
+			for (int i = 0; i < batch; ++i)
+			{
+				sink += f();
+			}
+			calls += (long long)batch * instances;
+			elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		while (elapsed < minTime);
+		return calls;
+	}
+
+	std::vector<std::string> SplitList(const char* s)
+	{
+		std::vector<std::string> items;
+		std::string item;
+		for (const char* p = s; ; ++p)
+		{
+			if (*p == ',' || *p == 0)
+			{
+				if (!item.empty())
+				{
+					items.push_back(item);
+				}
+				item.clear();
+				if (*p == 0)
+				{
+					break;
+				}
+			}
+			else
+			{
+				item += *p;
+			}
+		}
+		return items;
+	}
+
+	bool Selected(const std::vector<std::string>& filter, const char* name)
+	{
+		if (filter.empty())
+		{
+			return true;
+		}
+		for (const std::string& f: filter)
+		{
+			if (f == name)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	std::vector<std::string> engineFilter;
+	double minTime = 0.25;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--engines") == 0 && i + 1 < argc)
+		{
+			engineFilter = SplitList(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+		{
+			minTime = atof(argv[++i]);
+		}
+		else
+		{
+			fprintf(stderr, "Unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	Vars vars;
+	// Every instance of a batch has the values of `vars`, so batches give the same result as single evaluations
+	std::vector<double> xs(k_batchSize, vars.x);
+	std::vector<double> ys(k_batchSize, vars.y);
+	std::vector<double> out(k_batchSize);
+	ExpessionEvaluator::INTContext interpreted;
+	ExpessionEvaluator::JITContext jit;
+	Bind(interpreted, vars);
+	Bind(jit, vars);
+
+	printf("{\n");
+	printf("\t\"results\": [");
+	bool first = true;
+	int failures = 0;
+	double sink = 0.0;
+
+	for (size_t e = 0; e < sizeof(k_expressions) / sizeof(k_expressions[0]); ++e)
+	{
+		const char* expr = k_expressions[e];
+		std::string name = "e" + std::to_string(e);
+		interpreted.func(name.c_str(), expr);
+		interpreted.Link(interpreted.get_func(name.c_str()));
+		jit.func(name.c_str(), expr);
+		jit.Link(jit.get_func(name.c_str()));
+		const ExpessionEvaluator::InterpretedProgram& ip = interpreted.get_func(name.c_str());
+		const ExpessionEvaluator::JitProgram& jp = jit.get_func(name.c_str());
+
+		const ExpessionEvaluator::BatchVar batchVars[] = {
+			{ &vars.x, xs.data(), sizeof(double) },
+			{ &vars.y, ys.data(), sizeof(double) },
+		};
+
+		struct Engine
+		{
+			const char* name;
+			int instances;
+			std::function<double()> eval;
+		};
+		const Engine engines[] = {
+			{"stack", 1, [&ip] { return ip.EvalStack(); }},
+			{"register", 1, [&ip] { return ip.Eval(); }},
+			{"jit", 1, [&jp] { return jp.Eval(); }},
+			{"register-batch", k_batchSize, [&]
+			{
+				ip.EvalBatch(batchVars, 2, out.data(), sizeof(double), k_batchSize);
+				return out[k_batchSize - 1];
+			}},
+			{"jit-batch", k_batchSize, [&]
+			{
+				jp.EvalBatch(batchVars, 2, out.data(), sizeof(double), k_batchSize);
+				return out[k_batchSize - 1];
+			}},
+		};
+
+		double reference = ip.EvalStack();
+		for (const Engine& engine: engines)
+		{
+			if (!Selected(engineFilter, engine.name))
+			{
+				continue;
+			}
+			double value = engine.eval();
+			if (fabs(value - reference) > 1e-12 * fabs(reference))
+			{
+				fprintf(stderr, "%s: %s gives %.17g, expected %.17g\n", expr, engine.name, value, reference);
+				++failures;
+			}
+
+			double elapsed = 0.0;
+			long long calls = Measure(engine.eval, engine.instances, minTime, elapsed, sink);
+			printf("%s\n\t\t{\"expr\": \"%s\", \"engine\": \"%s\", \"calls\": %lld, \"seconds\": %.6f, \"ns_per_eval\": %.3f}",
+				first ? "" : ",", expr, engine.name, calls, elapsed, elapsed * 1e9 / calls);
+			fflush(stdout);
+			first = false;
+		}
+	}
+	printf("\n\t]\n}\n");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,343 @@
+// Throughput of Image operations for every DataType they accept and several image sizes.
+// Results are written to stdout as JSON, throughput is in megapixels of the source image per second.
+//
+// Usage: image_bench [--sizes 256,1024,4096] [--ops add,resample] [--types RGBA8,RF] [--min-time 0.25]
+//                    [--threads N] [--isa all|best]
+// With --isa all every case is repeated for each instruction set supported by the CPU.
+#include "Render/Image/Image.h"
+#include "Render/Image/simd_kernels.h"
+#include "utils/thread_pool.h"
+
+#include <chrono>
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+namespace
+{
+	const Image::DataType k_types[] = {
+		Image::R8, Image::R16, Image::R32, Image::RG16, Image::RGB8, Image::RGBA8,
+		Image::RF, Image::RGF, Image::RGBF, Image::RGBAF
+	};
+
+	const char* GetTypeName(Image::DataType type)
+	{
+		switch (type)
+		{
+		case Image::R8: return "R8";
+		case Image::R16: return "R16";
+		case Image::R32: return "R32";
+		case Image::RG16: return "RG16";
+		case Image::RGB8: return "RGB8";
+		case Image::RGBA8: return "RGBA8";
+		case Image::RF: return "RF";
+		case Image::RGF: return "RGF";
+		case Image::RGBF: return "RGBF";
+		case Image::RGBAF: return "RGBAF";
+		default: return "unknown";
+		}
+	}
+
+	// Integer images get no zero components when `nonzero` is set, so they are safe divisors
+	Image MakeNoise(glm::ivec2 size, Image::DataType type, unsigned seed, bool nonzero = false)
+	{
+		Image im = Image::Empty(size, type);
+		srand(seed);
+		for (int j = 0; j < size.y; ++j)
+		{
+			if (type & Image::FLOAT_POINT)
+			{
+				float* row = im.GetRow<float>(j);
+				for (size_t i = 0, n = im.GetRowSize() / sizeof(float); i < n; ++i)
+				{
+					row[i] = (rand() + 1) / ((float)RAND_MAX + 1);
+				}
+			}
+			else
+			{
+				uint8_t* row = im.GetRow<uint8_t>(j);
+				for (size_t i = 0, n = im.GetRowSize(); i < n; ++i)
+				{
+					row[i] = (uint8_t)rand() | (nonzero ? 1 : 0);
+				}
+			}
+		}
+		return im;
+	}
+
+	// Blobs on a dark background, input for distance fields and connected components
+	Image MakeBlobs(glm::ivec2 size, Image::DataType type)
+	{
+		Image im = Image::Empty(size, type);
+		int cell = 32;
+		for (int j = 0; j < size.y; ++j)
+		{
+			uint8_t* row = im.GetRow<uint8_t>(j);
+			for (int i = 0; i < size.x; ++i)
+			{
+				int dx = i % cell - cell / 2;
+				int dy = j % cell - cell / 2;
+				int r = 4 + (i / cell * 7 + j / cell * 3) % 10;
+				memset(row + i * im.GetBPP(), dx * dx + dy * dy < r * r ? 255 : 0, im.GetBPP());
+			}
+		}
+		return im;
+	}
+
+	bool IsFloat(Image::DataType t) { return (t & Image::FLOAT_POINT) != 0; }
+
+	Image ResizeBySeams(const Image& im, const Image& seamMap, glm::ivec2 newSize)
+	{
+		switch (im.GetType())
+		{
+		case Image::R8: return im.ResizeSimple<Image::pixelR8>(Image(), seamMap, newSize);
+		case Image::R16: return im.ResizeSimple<Image::pixelR16>(Image(), seamMap, newSize);
+		case Image::RF: return im.ResizeSimple<Image::pixelRF>(Image(), seamMap, newSize);
+		case Image::RGB8: return im.ResizeSimple<Image::pixelRGB8>(Image(), seamMap, newSize);
+		case Image::RGBF: return im.ResizeSimple<Image::pixelRGBF>(Image(), seamMap, newSize);
+		default: return Image();
+		}
+	}
+
+	struct Input
+	{
+		Image a;
+		Image b;
+		Image blobs;
+		Image seamMap;
+	};
+
+	enum
+	{
+		Seams = 32,
+		SeamLevels = 2
+	};
+
+	struct Op
+	{
+		const char* name;
+		std::function<bool(Image::DataType)> supports;
+		std::function<void(const Input&)> run;
+		// Prepared inputs needed besides noise
+		bool blobs;
+		bool seamMap;
+	};
+
+	std::vector<Op> MakeOps()
+	{
+		auto any = [](Image::DataType) { return true; };
+		auto convertible = [](Image::DataType t) { return IsFloat(t) || t == Image::R8 || t == Image::RGB8 || t == Image::RGBA8; };
+		auto seamTypes = [](Image::DataType t) { return t == Image::R8 || t == Image::R16 || t == Image::RF || t == Image::RGB8 || t == Image::RGBF; };
+
+		std::vector<Op> ops = {
+			{"add", any, [](const Input& in) { in.a.Add(in.b); }, false, false},
+			{"sub", any, [](const Input& in) { in.a.Sub(in.b); }, false, false},
+			{"mul", any, [](const Input& in) { in.a.Mul(in.b); }, false, false},
+			{"div", any, [](const Input& in) { in.a.Div(in.b); }, false, false},
+			{"mul_scalar", any, [](const Input& in) { IsFloat(in.a.GetType()) ? in.a.Mul(0.5f) : in.a.Mul(3); }, false, false},
+			{"add_scalar", any, [](const Input& in) { IsFloat(in.a.GetType()) ? in.a.Add(0.5f) : in.a.Add(3); }, false, false},
+			{"step", [](Image::DataType t) { return t == Image::R8 || t == Image::RF || t == Image::RGBF || t == Image::RGBAF; },
+				[](const Input& in) { in.a.Step(0.5f); }, false, false},
+			{"scale_bias", [](Image::DataType t) { return IsFloat(t) || t == Image::R8 || t == Image::RGB8 || t == Image::RGBA8; },
+				[](const Input& in) { in.a.ScaleBias(0.5f, 0.25f); }, false, false},
+			{"cast_rf", any, [](const Input& in) { in.a.Cast<Image::pixelRF>(); }, false, false},
+			{"cast_r8", any, [](const Input& in) { in.a.Cast<Image::pixelR8>(); }, false, false},
+			{"cast_rgbaf", [](Image::DataType t) { return t == Image::RGBA8; },
+				[](const Input& in) { Image out = Image::Empty(in.a.GetSize(), Image::RGBAF); in.a._Cast<Image::pixelRGBA8, Image::pixelRGBAF>(out); }, false, false},
+			{"cast_rgba8", [](Image::DataType t) { return t == Image::RGBAF; },
+				[](const Input& in) { Image out = Image::Empty(in.a.GetSize(), Image::RGBA8); in.a._Cast<Image::pixelRGBAF, Image::pixelRGBA8>(out); }, false, false},
+			{"convert_rgbaf", convertible, [](const Input& in) { in.a.Convert(Image::RGBAF); }, false, false},
+			{"convert_rgbaf_srgb", convertible, [](const Input& in) { in.a.Convert(Image::RGBAF, true); }, false, false},
+			{"convert_rgba8", convertible, [](const Input& in) { in.a.Convert(Image::RGBA8); }, false, false},
+			{"convert_rgba8_srgb", convertible, [](const Input& in) { in.a.Convert(Image::RGBA8, true); }, false, false},
+			// Bandwidth baseline for transpose and the other memory bound ops
+			{"copy", any, [](const Input& in) { in.a.Copy(); }, false, false},
+			{"transpose", any, [](const Input& in) { in.a.Transpose(); }, false, false},
+			{"resample_lanczos3_half", any, [](const Input& in) { in.a.Resample(in.a.GetSize() / 2, Image::ResampleLanczos3); }, false, false},
+			{"resample_bspline_double", any, [](const Input& in) { in.a.Resample(in.a.GetSize() * 2, Image::ResampleBSpline); }, false, false},
+			{"mipmaps", any, [](const Input& in) { in.a.GenerateMipmaps(); }, false, false},
+			{"gauss_blur_r4", any, [](const Input& in) { in.a.GaussBlur(4.0f); }, false, false},
+			{"gauss_blur_r32", any, [](const Input& in) { in.a.GaussBlur(32.0f); }, false, false},
+			{"df_exact", [](Image::DataType t) { return t == Image::RGB8; }, [](const Input& in) { in.blobs.ComputeDF(Image::ExactEuclidean); }, true, false},
+			{"df_dead_reckoning", [](Image::DataType t) { return t == Image::RGB8; }, [](const Input& in) { in.blobs.ComputeDF(Image::DeadReckoning3x3); }, true, false},
+			{"connected_components", [](Image::DataType t) { return t == Image::R8; }, [](const Input& in) { in.blobs.ConnectedComponents(); }, true, false},
+			{"seam_energy", any, [](const Input& in) { in.a.ComputeEnergy(); }, false, false},
+			{"seam_map", any, [](const Input& in) { in.a.ComputeSeamMap(true, Seams, SeamLevels); }, false, false},
+			{"seam_resize", seamTypes, [](const Input& in) { ResizeBySeams(in.a, in.seamMap, in.a.GetSize() - glm::ivec2(in.a.GetSize().x / 8, 0)); }, false, true},
+		};
+		return ops;
+	}
+
+	// Repeats `f` until `minTime` seconds pass, returns the number of iterations and the elapsed time
+	int Measure(const std::function<void()>& f, double minTime, double& elapsed)
+	{
+		f();
+		int iterations = 0;
+		auto start = std::chrono::steady_clock::now();
+		do
+		{
+			f();
+			++iterations;
+			elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		while (elapsed < minTime);
+		return iterations;
+	}
+
+	std::vector<std::string> SplitList(const char* s)
+	{
+		std::vector<std::string> items;
+		std::string item;
+		for (const char* p = s; ; ++p)
+		{
+			if (*p == ',' || *p == 0)
+			{
+				if (!item.empty())
+				{
+					items.push_back(item);
+				}
+				item.clear();
+				if (*p == 0)
+				{
+					break;
+				}
+			}
+			else
+			{
+				item += *p;
+			}
+		}
+		return items;
+	}
+
+	bool Selected(const std::vector<std::string>& filter, const char* name)
+	{
+		if (filter.empty())
+		{
+			return true;
+		}
+		for (const std::string& f: filter)
+		{
+			if (f == name)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	std::vector<int> sizes = {256, 1024, 4096};
+	std::vector<std::string> opFilter;
+	std::vector<std::string> typeFilter;
+	double minTime = 0.25;
+	int threads = 0;
+	bool allISA = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc)
+		{
+			sizes.clear();
+			for (const std::string& s: SplitList(argv[++i]))
+			{
+				sizes.push_back(atoi(s.c_str()));
+			}
+		}
+		else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc)
+		{
+			opFilter = SplitList(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--types") == 0 && i + 1 < argc)
+		{
+			typeFilter = SplitList(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+		{
+			minTime = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			threads = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc)
+		{
+			allISA = strcmp(argv[++i], "all") == 0;
+		}
+		else
+		{
+			fprintf(stderr, "Unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+	utils::ThreadPool::Get().SetThreadCount(threads);
+
+	simd::ISA best = simd::GetBestISA();
+	std::vector<Op> ops = MakeOps();
+
+	printf("{\n");
+	printf("\t\"threads\": %d,\n", utils::ThreadPool::Get().GetThreadCount());
+	printf("\t\"best_isa\": \"%s\",\n", simd::GetISAName(best));
+	printf("\t\"results\": [");
+	bool first = true;
+
+	for (int side: sizes)
+	{
+		glm::ivec2 size(side);
+		for (Image::DataType type: k_types)
+		{
+			if (!Selected(typeFilter, GetTypeName(type)))
+			{
+				continue;
+			}
+
+			Input in;
+			bool prepared = false;
+			for (const Op& op: ops)
+			{
+				if (!Selected(opFilter, op.name) || !op.supports(type))
+				{
+					continue;
+				}
+				if (!prepared)
+				{
+					in.a = MakeNoise(size, type, 1);
+					in.b = MakeNoise(size, type, 2, true);
+					prepared = true;
+				}
+				if (op.blobs && !in.blobs.IsValid())
+				{
+					in.blobs = MakeBlobs(size, type);
+				}
+				if (op.seamMap && !in.seamMap.IsValid())
+				{
+					in.seamMap = in.a.ComputeSeamMap(true, Seams, SeamLevels);
+				}
+
+				for (int isa = allISA ? simd::ISA_Scalar : best; isa <= best; ++isa)
+				{
+					simd::SetISA((simd::ISA)isa);
+					double elapsed = 0.0;
+					int iterations = Measure([&] { op.run(in); }, minTime, elapsed);
+					double mpix = (double)size.x * size.y * iterations / elapsed / 1e6;
+
+					printf("%s\n\t\t{\"op\": \"%s\", \"type\": \"%s\", \"width\": %d, \"height\": %d, \"isa\": \"%s\", "
+						"\"iterations\": %d, \"seconds\": %.6f, \"mpix_per_s\": %.3f}",
+						first ? "" : ",", op.name, GetTypeName(type), size.x, size.y, simd::GetISAName((simd::ISA)isa),
+						iterations, elapsed, mpix);
+					fflush(stdout);
+					first = false;
+				}
+				simd::SetISA(best);
+			}
+		}
+	}
+	printf("\n\t]\n}\n");
+	return 0;
+}
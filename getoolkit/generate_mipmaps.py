@@ -14,42 +14,27 @@
 # ==============================================================================
 
 import numpy as np
-import warnings
-from getoolkit.downsample2x import downsample2x
+import _getoolkit
 
 
-def is_power_of_two(n):
-    """Return True if n is a power of two."""
+_filters = {
+    'box': _getoolkit.ResampleFilter.Box,
+    'area_average': _getoolkit.ResampleFilter.Box,
+    'bspline': _getoolkit.ResampleFilter.BSpline,
+    'mitchell': _getoolkit.ResampleFilter.Mitchell,
+    'lanczos3': _getoolkit.ResampleFilter.Lanczos3,
+}
 
-    if isinstance(n, list) or isinstance(n, tuple):
-        return all(is_power_of_two(x) for x in n)
-    if n <= 0:
-        return False
-    else:
-        return n & (n - 1) == 0
 
+def generate_mipmaps(image, gamma=2.2, filter='bspline'):
+    """Returns list of mip levels down to 1x1, starting with the image itself.
 
-def generate_mipmaps(image, gamma=2.2):
-    img = image.astype(np.float32)
-    img = np.power(img, gamma)
-
-    max_val = img.max()
-    img /= max_val
-
-    downsample_type = 'bspline'
-    if is_power_of_two(image.shape[:-1]) and image.dtype == np.float32:
-        downsample_type = 'area_average'
-        warnings.warn("bspline may produce artifacts with hdr. Texture is POT, so using area_average instead",
-                      UserWarning)
-
-    mipmaps = [image]
-    for _ in range(100):
-        img = downsample2x(img, type=downsample_type)
-        img_to_save = img * max_val
-        img_to_save = np.clip(img_to_save, 0, None)
-        img_to_save = np.power(img_to_save, 1.0 / gamma)
-        img_to_save = img_to_save.astype(image.dtype)
-        mipmaps.append(img_to_save)
-        if img_to_save.shape[0] == 1 and img_to_save.shape[1] == 1:
-            break
+    Filtering is done natively in linear light, each level is computed from the float result of the previous one.
+    Supported filters: 'box' ('area_average'), 'bspline', 'mitchell' and 'lanczos3'.
+    """
+    image = np.ascontiguousarray(image)
+    levels = _getoolkit.Image.from_buffer(image).generate_mipmaps(_filters[filter], gamma)
+    mipmaps = [np.array(level) for level in levels]
+    if image.ndim == 2:
+        mipmaps = [m[..., 0] for m in mipmaps]
     return mipmaps
@@ -0,0 +1,93 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+
+
+namespace Render
+{
+	// Linear memory for the commands of a frame. Reset keeps the capacity, so once it has grown to the size of a frame
+	// encoding allocates nothing. Records are POD and are copied in and out with one memcpy.
+	class CommandArena
+	{
+		CommandArena(const CommandArena&) = delete;
+		CommandArena& operator=(const CommandArena&) = delete;
+	public:
+		enum
+		{
+			// Records start at this alignment
+			Alignment = 8,
+			InitialCapacity = 64 * 1024
+		};
+
+		CommandArena(): m_data(nullptr), m_size(0), m_capacity(0)
+		{}
+
+		~CommandArena()
+		{
+			free(m_data);
+		}
+
+		void Reset()
+		{
+			m_size = 0;
+		}
+
+		// Room for `size` bytes at the end
+		uint8_t* Allocate(size_t size)
+		{
+			size_t offset = m_size;
+			size_t end = offset + Align(size);
+			if (end > m_capacity)
+			{
+				Grow(end);
+			}
+			m_size = end;
+			return m_data + offset;
+		}
+
+		template<typename T>
+		void Push(const T& record)
+		{
+			static_assert(std::is_trivially_copyable<T>::value, "Commands must be POD");
+			memcpy(Allocate(sizeof(T)), &record, sizeof(T));
+		}
+
+		// Copies the record at `p` to `record` and returns the position of the next one
+		template<typename T>
+		static const uint8_t* Read(const uint8_t* p, T& record)
+		{
+			static_assert(std::is_trivially_copyable<T>::value, "Commands must be POD");
+			memcpy(&record, p, sizeof(T));
+			return p + Align(sizeof(T));
+		}
+
+		static size_t Align(size_t size)
+		{
+			return (size + Alignment - 1) & ~size_t(Alignment - 1);
+		}
+
+		const uint8_t* begin() const { return m_data; }
+		const uint8_t* end() const { return m_data + m_size; }
+
+		size_t GetSize() const { return m_size; }
+		size_t GetCapacity() const { return m_capacity; }
+
+	private:
+		void Grow(size_t size)
+		{
+			size_t capacity = m_capacity == 0 ? (size_t)InitialCapacity : m_capacity;
+			while (capacity < size)
+			{
+				capacity *= 2;
+			}
+			m_data = (uint8_t*)realloc(m_data, capacity);
+			m_capacity = capacity;
+		}
+
+		uint8_t* m_data;
+		size_t m_size;
+		size_t m_capacity;
+	};
+}
@@ -1,16 +1,75 @@
 #pragma once
+#include "color.h"
+#include "utils/aabb.h"
 #include <inttypes.h>
+#include <glm/glm.hpp>
 
 namespace Render
 {
+	class Texture;
+
 	enum Command : uint8_t
 	{
 		C_RectCol,
+		C_RectColRounded,
 		C_RectTex,
 		C_RectTexTr,
 		C_Text,
 		C_SetScissors,
-		C_ResetScissors,
-		C_End
+		C_ResetScissors
+	};
+
+	// Records of the commands in a CommandArena, each starts with its Command. Rects with square corners leave the
+	// radius out.
+	struct RectColCmd
+	{
+		Command type;
+		color col;
+		glm::aabb2 rect;
+	};
+
+	struct RectColRoundedCmd
+	{
+		Command type;
+		color col;
+		glm::aabb2 rect;
+		glm::vec4 radius;
+	};
+
+	struct RectTexCmd
+	{
+		Command type;
+		glm::aabb2 rect;
+		glm::aabb2 uv;
+		glm::vec4 radius;
+		Texture* texture;
+	};
+
+	struct RectTexTrCmd
+	{
+		Command type;
+		glm::aabb2 rect;
+		glm::mat2x3 transform;
+		glm::aabb2 uv;
+		Texture* texture;
+	};
+
+	// Followed by `length` bytes of text and a terminating zero
+	struct TextCmd
+	{
+		Command type;
+		uint32_t length;
+		glm::aabb2 rect;
+	};
+
+	struct SetScissorsCmd
+	{
+		Command type;
+		glm::aabb2 box;
+	};
+
+	struct ResetScissorsCmd
+	{
+		Command type;
 	};
 }
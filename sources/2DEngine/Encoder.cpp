@@ -1,6 +1,5 @@
 #include "Encoder.h"
 #include "Commands.h"
-#include <MemRefFile.h>
 
 using namespace Render;
 
@@ -8,13 +7,10 @@ using namespace Render;
 Encoder::Encoder()
 {
 	m_sciscors.set_any();
-	m_command_queue = fsal::File(new fsal::MemRefFile());
 }
 
 void Encoder::PushScissors(glm::aabb2 box)
 {
-	m_command_queue.Write(C_SetScissors);
-
 	if (!scissors_stack.empty())
 	{
 		auto rect = scissors_stack.back();
@@ -22,7 +18,7 @@ void Encoder::PushScissors(glm::aabb2 box)
 	}
 	m_sciscors = box;
 	scissors_stack.push_back(box);
-	m_command_queue.Write(box);
+	m_commands.Push(SetScissorsCmd{C_SetScissors, box});
 }
 
 void Encoder::PopScissors()
@@ -31,34 +27,33 @@ void Encoder::PopScissors()
 	if (!scissors_stack.empty())
 	{
 		auto box = scissors_stack.back();
-		m_command_queue.Write(C_SetScissors);
-		m_command_queue.Write(box);
+		m_commands.Push(SetScissorsCmd{C_SetScissors, box});
 		m_sciscors = box;
 	}
 	else
 	{
-		m_command_queue.Write(C_ResetScissors);
+		m_commands.Push(ResetScissorsCmd{C_ResetScissors});
 		m_sciscors.set_any();
 	}
 }
 
 void Encoder::Rect(glm::aabb2 rect, color col, glm::vec4 radius)
 {
-	m_command_queue.Write(C_RectCol);
-	m_command_queue.Write(rect);
-	m_command_queue.Write(radius);
-	m_command_queue.Write(col);
+	if (radius == glm::vec4(0))
+	{
+		m_commands.Push(RectColCmd{C_RectCol, col, rect});
+	}
+	else
+	{
+		m_commands.Push(RectColRoundedCmd{C_RectColRounded, col, rect, radius});
+	}
 }
 
 void Encoder::Rect(glm::aabb2 rect, TexturePtr texture, glm::aabb2 uv, glm::vec4 radius)
 {
 	if (glm::is_overlapping(m_sciscors, rect))
 	{
-		m_command_queue.Write(C_RectTex);
-		m_command_queue.Write(rect);
-		m_command_queue.Write(radius);
-		m_command_queue.Write(uv);
-		m_command_queue.Write(texture.get());
+		m_commands.Push(RectTexCmd{C_RectTex, rect, uv, radius, texture.get()});
 	}
 }
 
@@ -66,23 +61,18 @@ void Encoder::Rect(glm::aabb2 rect, const glm::mat3& transform, TexturePtr textu
 {
 	if (glm::is_overlapping(m_sciscors, rect))
 	{
-		m_command_queue.Write(C_RectTex);
-		m_command_queue.Write(rect);
-		m_command_queue.Write(transform);
-		m_command_queue.Write(uv);
-		m_command_queue.Write(texture.get());
+		m_commands.Push(RectTexTrCmd{C_RectTexTr, rect, glm::mat2x3(transform), uv, texture.get()});
 	}
 }
 
 void Encoder::Text(glm::aabb2 rect, const char* text, size_t len)
 {
-	m_command_queue.Write(C_Text);
-	m_command_queue.Write(rect);
 	if (len == 0)
 	{
 		len = strlen(text);
 	}
-	m_command_queue.Write(len + 1);
-	m_command_queue.Write((const uint8_t*)text, len);
-	m_command_queue.Write(char(0));
+	m_commands.Push(TextCmd{C_Text, (uint32_t)len, rect});
+	auto dst = (char*)m_commands.Allocate(len + 1);
+	memcpy(dst, text, len);
+	dst[len] = 0;
 }
@@ -1,10 +1,11 @@
 #pragma once
 #include "Render/Texture.h"
+#include "CommandArena.h"
 #include "color.h"
 #include "utils/aabb.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
-#include <fsal.h>
+#include <vector>
 //#include <Scriber.h>
 
 
@@ -19,6 +20,10 @@ namespace Render
 
 		void PopScissors();
 
+		// Intersection of the pushed scissors, any box if there are none
+		glm::aabb2 GetScissors() const { return m_sciscors; }
+		bool HasScissors() const { return !scissors_stack.empty(); }
+
 		void Rect(glm::aabb2 rect, color c, glm::vec4 radius = glm::vec4(0));
 
 		void Rect(glm::aabb2 rect, TexturePtr texture, glm::aabb2 uv = glm::aabb2(glm::vec2(1.0), glm::vec2(0.0)), glm::vec4 radius = glm::vec4(0));
@@ -27,10 +32,13 @@ namespace Render
 
 		void Text(glm::aabb2 rect, const char* text, size_t len = 0);
 
-		fsal::File GetCommandQueue() { return m_command_queue; }
+		const CommandArena& GetCommands() const { return m_commands; }
+
+		// Drops the commands, called once they are drawn
+		void Reset() { m_commands.Reset(); }
 	private:
 		std::vector<glm::aabb2> scissors_stack;
 		glm::aabb2 m_sciscors;
-		fsal::File m_command_queue;
+		CommandArena m_commands;
 	};
 }
@@ -1,24 +1,42 @@
 #include "Mesher.h"
+#include <assert.h>
 
 using namespace Render;
 
 
+Mesher::Mesher(): m_vertices(nullptr), m_indices(nullptr), m_max_vertices(0), m_max_indices(0), m_index_size(2),
+	m_current_index(0), m_index_write_ptr(nullptr), m_vertex_write_ptr(nullptr)
+{
+}
+
+
+void Mesher::SetStorage(Vertex* vertices, int max_vertices, void* indices, int max_indices, int index_size)
+{
+	assert(index_size == 2 || index_size == 4);
+	m_vertices = vertices;
+	m_indices = (uint8_t*)indices;
+	m_max_vertices = max_vertices;
+	m_max_indices = max_indices;
+	m_index_size = index_size;
+	PrimReset();
+}
+
+
+// Storage is given up front, only checks that the primitive fits
 void Mesher::PrimReserve(int idx_count, int vtx_count)
 {
-	m_vertexArray.resize(m_vertexArray.size() + vtx_count);
-	m_indexArray.resize(m_indexArray.size() + idx_count);
-	m_index_write_ptr = &m_indexArray[m_indexArray.size() - idx_count];
-	m_vertex_write_ptr = &m_vertexArray[m_vertexArray.size() - vtx_count];
+	(void)idx_count;
+	(void)vtx_count;
+	assert(ifree() >= idx_count && vfree() >= vtx_count);
+	assert(m_index_size == 4 || m_current_index + vtx_count <= 0x10000);
 }
 
 
 void Mesher::PrimReset()
 {
-	m_vertexArray.resize(0);
-	m_indexArray.resize(0);
 	m_current_index = 0;
-	m_index_write_ptr = &m_indexArray[0];
-	m_vertex_write_ptr = &m_vertexArray[0];
+	m_index_write_ptr = m_indices;
+	m_vertex_write_ptr = m_vertices;
 }
 
 
@@ -27,15 +45,15 @@ void Mesher::PrimRect(const glm::vec2& a, const glm::vec2& c, const glm::vec2& u
 	PrimReserve(6, 4);
     glm::vec2 b(c.x, a.y), d(a.x, c.y), uv_b(uv_c.x, uv_a.y), uv_d(uv_a.x, uv_c.y);
     auto idx = m_current_index;
-    m_index_write_ptr[0] = idx; m_index_write_ptr[1] = idx+1; m_index_write_ptr[2] = idx+2;
-    m_index_write_ptr[3] = idx; m_index_write_ptr[4] = idx+2; m_index_write_ptr[5] = idx+3;
+    SetIndex(0, idx); SetIndex(1, idx+1); SetIndex(2, idx+2);
+    SetIndex(3, idx); SetIndex(4, idx+2); SetIndex(5, idx+3);
     m_vertex_write_ptr[0].pos = a; m_vertex_write_ptr[0].uv = uv_a; m_vertex_write_ptr[0].col = col;
     m_vertex_write_ptr[1].pos = b; m_vertex_write_ptr[1].uv = uv_b; m_vertex_write_ptr[1].col = col;
     m_vertex_write_ptr[2].pos = c; m_vertex_write_ptr[2].uv = uv_c; m_vertex_write_ptr[2].col = col;
     m_vertex_write_ptr[3].pos = d; m_vertex_write_ptr[3].uv = uv_d; m_vertex_write_ptr[3].col = col;
     m_vertex_write_ptr += 4;
     m_current_index += 4;
-    m_index_write_ptr += 6;
+    m_index_write_ptr += 6 * m_index_size;
 }
 
 
@@ -50,15 +68,15 @@ void Mesher::PrimRect(const glm::vec2& _a, const glm::vec2& _c, const glm::mat2x
     d = t * glm::vec3(d, 1.0f);
 
     auto idx = m_current_index;
-    m_index_write_ptr[0] = idx; m_index_write_ptr[1] = idx+1; m_index_write_ptr[2] = idx+2;
-    m_index_write_ptr[3] = idx; m_index_write_ptr[4] = idx+2; m_index_write_ptr[5] = idx+3;
+    SetIndex(0, idx); SetIndex(1, idx+1); SetIndex(2, idx+2);
+    SetIndex(3, idx); SetIndex(4, idx+2); SetIndex(5, idx+3);
     m_vertex_write_ptr[0].pos = a; m_vertex_write_ptr[0].uv = uv_a; m_vertex_write_ptr[0].col = col;
     m_vertex_write_ptr[1].pos = b; m_vertex_write_ptr[1].uv = uv_b; m_vertex_write_ptr[1].col = col;
     m_vertex_write_ptr[2].pos = c; m_vertex_write_ptr[2].uv = uv_c; m_vertex_write_ptr[2].col = col;
     m_vertex_write_ptr[3].pos = d; m_vertex_write_ptr[3].uv = uv_d; m_vertex_write_ptr[3].col = col;
     m_vertex_write_ptr += 4;
     m_current_index += 4;
-    m_index_write_ptr += 6;
+    m_index_write_ptr += 6 * m_index_size;
 }
 
 void Mesher::PrimRectRounded(const glm::vec2& a, const glm::vec2& c, const glm::vec4& radius, color col)
@@ -81,10 +99,10 @@ void Mesher::PrimConvexPolyFilled(const glm::vec2* points, int count, color col)
 
 	for (int i = 2; i < count; i++)
 	{
-		m_index_write_ptr[0] = m_current_index;
-		m_index_write_ptr[1] = m_current_index + 2 * i - 2;
-		m_index_write_ptr[2] = m_current_index + 2 * i - 0;
-		m_index_write_ptr += 3;
+		SetIndex(0, m_current_index);
+		SetIndex(1, m_current_index + 2 * i - 2);
+		SetIndex(2, m_current_index + 2 * i - 0);
+		m_index_write_ptr += 3 * m_index_size;
 	}
 
 	glm::vec2 p1 = points[count - 2];
@@ -115,13 +133,13 @@ void Mesher::PrimConvexPolyFilled(const glm::vec2* points, int count, color col)
 		m_vertex_write_ptr[1].col = col_trans;
 		m_vertex_write_ptr += 2;
 
-		m_index_write_ptr[0] = m_current_index + 2 * i1 + 0;
-		m_index_write_ptr[1] = m_current_index + 2 * i0 + 0;
-		m_index_write_ptr[2] = m_current_index + 2 * i0 + 1;
-		m_index_write_ptr[3] = m_current_index + 2 * i0 + 1;
-		m_index_write_ptr[4] = m_current_index + 2 * i1 + 1;
-		m_index_write_ptr[5] = m_current_index + 2 * i1 + 0;
-		m_index_write_ptr += 6;
+		SetIndex(0, m_current_index + 2 * i1 + 0);
+		SetIndex(1, m_current_index + 2 * i0 + 0);
+		SetIndex(2, m_current_index + 2 * i0 + 1);
+		SetIndex(3, m_current_index + 2 * i0 + 1);
+		SetIndex(4, m_current_index + 2 * i1 + 1);
+		SetIndex(5, m_current_index + 2 * i1 + 0);
+		m_index_write_ptr += 6 * m_index_size;
 	}
 	m_current_index += vtx_count;
 }
@@ -10,9 +10,15 @@
 
 namespace Render
 {
+	// Writes primitives straight into memory given by SetStorage, usually a mapped buffer
 	class Mesher
 	{
 	public:
+		Mesher();
+
+		// Indices are `index_size` bytes, 2 or 4. With 2 bytes at most 65536 vertices can be written before PrimReset.
+		void SetStorage(Vertex* vertices, int max_vertices, void* indices, int max_indices, int index_size);
+
 		void PrimReset();
 
 		void PrimReserve(int idx_count, int vtx_count);
@@ -24,18 +30,40 @@ namespace Render
 
 		void PrimConvexPolyFilled(const glm::vec2* points, int count, color col);
 
-		int vcount() const { return m_vertexArray.size(); }
-		int icount() const { return m_indexArray.size(); }
+		int vcount() const { return int(m_vertex_write_ptr - m_vertices); }
+		int icount() const { return int(m_index_write_ptr - m_indices) / m_index_size; }
+
+		// Room left in the storage
+		int vfree() const { return m_max_vertices - vcount(); }
+		int ifree() const { return m_max_indices - icount(); }
 
-		const uint16_t* iptr() const { return m_indexArray.data(); }
-		const Vertex* vptr() const { return m_vertexArray.data(); }
+		int isize() const { return m_index_size; }
+
+		const void* iptr() const { return m_indices; }
+		const Vertex* vptr() const { return m_vertices; }
 	private:
-		std::vector<uint16_t> m_indexArray;
-		std::vector<Vertex> m_vertexArray;
+		// Sets index `i` of the primitive being written
+		void SetIndex(int i, uint32_t index)
+		{
+			if (m_index_size == 2)
+			{
+				((uint16_t*)m_index_write_ptr)[i] = (uint16_t)index;
+			}
+			else
+			{
+				((uint32_t*)m_index_write_ptr)[i] = index;
+			}
+		}
+
+		Vertex* m_vertices;
+		uint8_t* m_indices;
+		int m_max_vertices;
+		int m_max_indices;
+		int m_index_size;
 		Path m_path;
 
-		uint16_t m_current_index;
-		uint16_t* m_index_write_ptr;
+		uint32_t m_current_index;
+		uint8_t* m_index_write_ptr;
 		Vertex* m_vertex_write_ptr;
 	};
 }
@@ -5,16 +5,44 @@
 #include <spdlog/spdlog.h>
 #include <fsal.h>
 #include <FileInterface.h>
+#include <algorithm>
+#include <assert.h>
 //#include <bgfx/bgfx.h>
 
 
 using namespace Render;
 
 
+namespace
+{
+	// Largest primitive, a rounded rect of four arcs of at most 181 points, two vertices per point
+	const int k_max_primitive_vertices = 4 * 181 * 2;
+	const int k_max_primitive_indices = (4 * 181 - 2) * 3 + 4 * 181 * 6;
+
+	// Indices are relative to the first vertex of a flush
+	const int k_max_flush_vertices16 = 0x10000;
+	const int k_max_flush_vertices = 0x40000;
+	// Enough for rects, rounded ones use more and flush earlier
+	const int k_max_flush_indices = k_max_flush_vertices * 3;
+
+	// Continues FNV-1a hash `state` with the bytes of `value`
+	template<typename T>
+	uint64_t Hash(uint64_t state, const T& value)
+	{
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(&value);
+		for (size_t i = 0; i < sizeof(T); ++i)
+		{
+			state = (state ^ p[i]) * 0x100000001b3ULL;
+		}
+		return state;
+	}
+}
+
 
 Renderer2D::Renderer2D(): m_gamma_correction(false)
 {
 	scissoring_enabled = false;
+	SetEncoderCount(1);
 }
 
 Renderer2D::~Renderer2D()
@@ -24,18 +52,21 @@ Renderer2D::~Renderer2D()
 
 void Renderer2D::Init()
 {
+	// Locations are fixed, so the vertex spec collected from one program is valid for both
 	const char* vertex_shader_src = R"(#version 300 es
-		in vec2 a_position;
-		in vec2 a_uv;
-		in vec4 a_color;
+		layout(location = 0) in vec2 a_position;
+		layout(location = 1) in vec2 a_uv;
+		layout(location = 2) in vec4 a_color;
 
 		uniform mat4 u_transform;
 
 		out vec4 v_color;
+		out vec2 v_uv;
 
 		void main()
 		{
 			v_color = a_color;
+			v_uv = a_uv;
 			gl_Position = u_transform * vec4(a_position, 0.0, 1.0);
 		}
 	)";
@@ -51,7 +82,22 @@ void Renderer2D::Init()
 		}
 	)";
 
+	const char* fragment_shader_tex_src = R"(#version 300 es
+		precision mediump float;
+		in vec4 v_color;
+		in vec2 v_uv;
+		out vec4 color;
+
+		uniform sampler2D u_texture;
+
+		void main()
+		{
+			color = texture(u_texture, v_uv) * v_color;
+		}
+	)";
+
 	m_program = Render::MakeProgram(vertex_shader_src, fragment_shader_src);
+	m_programTex = Render::MakeProgram(vertex_shader_src, fragment_shader_tex_src);
 
 	m_vertexSpec = Render::VertexSpecMaker()
 			.PushType<glm::vec2>("a_position")
@@ -61,12 +107,15 @@ void Renderer2D::Init()
 	m_vertexSpec.CollectHandles(m_program);
 
 	m_uniform_transform = m_program->GetUniformLocation("u_transform");
+	m_uniform_transform_tex = m_programTex->GetUniformLocation("u_transform");
+	m_uniform_texture = m_programTex->GetUniformLocation("u_texture");
 
-	glGenBuffers(1, &m_indexBufferHandle);
-	glGenBuffers(1, &m_vertexBufferHandle);
+	m_vertexStream.Init(k_max_flush_vertices * sizeof(Vertex));
+	m_indexStream.Init(k_max_flush_indices * sizeof(uint32_t));
+	MapStorage();
 
 	u_transform = m_program->GetUniform("u_transform");
-	u_texture = m_program->GetUniform("u_texture");
+	u_texture = m_programTex->GetUniform("u_texture");
 
 //	Scriber::Driver::SetCustomIOFunctions(
 //			[this](const char* filename, const char* mode)
@@ -130,206 +179,398 @@ void Renderer2D::SetUp(View view_box)
 }
 
 
-void Renderer2D::Draw()
+void Renderer2D::SetEncoderCount(int count)
 {
-	auto command_queue =  m_encoder.GetCommandQueue();
+	assert(count > 0);
+	while ((int)m_encoders.size() < count)
+	{
+		m_encoders.emplace_back(new Encoder());
+	}
+	m_encoder_count = count;
+}
 
-	command_queue.Write(C_End);
-	command_queue.Seek(0);
+
+void Renderer2D::Draw()
+{
 	m_mesher.PrimReset();
+	m_batches.clear();
+	m_stats = FrameStats();
+	m_wide_indices = false;
+	if (m_mesher.isize() != GetIndexSize())
+	{
+		MapStorage();
+	}
 
-	//bgfx::TextureHandle tex;
+	// Batches continue across encoders when the state matches
+	for (int i = 0; i < m_encoder_count; ++i)
+	{
+		current_sciscors.reset();
+		scissoring_enabled = false;
+		Decode(m_encoders[i]->GetCommands());
+		m_encoders[i]->Reset();
+	}
+	Flush();
+}
+
+void Renderer2D::Decode(const CommandArena& commands)
+{
+	auto correct = [this](color col)
+	{
+		if (m_gamma_correction)
+		{
+			col = glm::pow(glm::vec4(col) / 255.0f, glm::vec4(2.2f)) * 255.0f;
+		}
+		return col;
+	};
 
-	Command cmd;
-	while (command_queue.Read(cmd) && cmd != C_End)
+	const uint8_t* p = commands.begin();
+	while (p < commands.end())
 	{
-		bool need_flush = false;
-		switch(cmd)
+		switch(Command(*p))
 		{
 			case C_RectCol:
 			{
-				glm::aabb2 rect;
-				color col;
-				glm::vec4 radius;
-				command_queue.Read(rect);
-				command_queue.Read(radius);
-				command_queue.Read(col);
-
-				if (m_gamma_correction)
-				{
-					col = glm::pow(glm::vec4(col) / 255.0f, glm::vec4(2.2f)) * 255.0f;
-				}
+				RectColCmd cmd;
+				p = CommandArena::Read(p, cmd);
 
-				if (radius == glm::vec4(0))
-				{
-					m_mesher.PrimRect(rect.minp, rect.maxp, glm::vec2(0.0, 0.0), glm::vec2(0.0, 0.0), col);
-				}
-				else
-				{
-					m_mesher.PrimRectRounded(rect.minp, rect.maxp, radius, col);
-				}
+				Reserve();
+				int index_offset = m_mesher.icount();
+				m_mesher.PrimRect(cmd.rect.minp, cmd.rect.maxp, glm::vec2(0.0, 0.0), glm::vec2(0.0, 0.0), correct(cmd.col));
+				Submit(nullptr, index_offset);
+			}
+			break;
+
+			case C_RectColRounded:
+			{
+				RectColRoundedCmd cmd;
+				p = CommandArena::Read(p, cmd);
+
+				Reserve();
+				int index_offset = m_mesher.icount();
+				m_mesher.PrimRectRounded(cmd.rect.minp, cmd.rect.maxp, cmd.radius, correct(cmd.col));
+				Submit(nullptr, index_offset);
 			}
-			need_flush = true;
 			break;
 
 			case C_RectTex:
 			{
-				glm::aabb2 rect;
-				glm::aabb2 uv;
-				glm::vec4  radius;
-				command_queue.Read(rect);
-				command_queue.Read(radius);
-				command_queue.Read(uv);
-				//command_queue.Read(tex);
-
-				if (radius == glm::vec4(0))
-				{
-					m_mesher.PrimRect(rect.minp, rect.maxp, uv.minp, uv.maxp, color(0));
-				}
-				else
-				{
+				RectTexCmd cmd;
+				p = CommandArena::Read(p, cmd);
 
+				if (cmd.radius == glm::vec4(0))
+				{
+					Reserve();
+					int index_offset = m_mesher.icount();
+					m_mesher.PrimRect(cmd.rect.minp, cmd.rect.maxp, cmd.uv.minp, cmd.uv.maxp, color(255));
+					Submit(cmd.texture, index_offset);
 				}
 			}
-			need_flush = true;
 			break;
 
 			case C_RectTexTr:
 			{
-				glm::aabb2 rect;
-				glm::aabb2 uv;
-				glm::mat2x3 transoform;
-				command_queue.Read(rect);
-				command_queue.Read(transoform);
-				command_queue.Read(uv);
-				//command_queue.Read(tex);
-
-				m_mesher.PrimRect(rect.minp, rect.maxp, transoform, uv.minp, uv.maxp, color(0));
+				RectTexTrCmd cmd;
+				p = CommandArena::Read(p, cmd);
+
+				Reserve();
+				int index_offset = m_mesher.icount();
+				m_mesher.PrimRect(cmd.rect.minp, cmd.rect.maxp, cmd.transform, cmd.uv.minp, cmd.uv.maxp, color(255));
+				Submit(cmd.texture, index_offset);
 			}
-			need_flush = true;
 			break;
 
 			case C_Text:
 			{
-				glm::aabb2 rect;
-				size_t len;
-				command_queue.Read(rect);
-				command_queue.Read(len);
-				auto ptr = (const char*)command_queue.GetDataPointer() + command_queue.Tell();
-				command_queue.Seek(len, fsal::File::CurrentPosition);
-				m_text_driver.DrawLabel(ptr, rect.minp.x, rect.minp.y, Scriber::Font(0, 32, Scriber::FontStyle::Regular, 0xFFFFFFFF, 1));
+				TextCmd cmd;
+				p = CommandArena::Read(p, cmd);
+				auto text = (const char*)p;
+				p += CommandArena::Align(cmd.length + 1);
+
+				// Labels are drawn by the text driver, the geometry before them goes first
+				Flush();
+				m_text_driver.DrawLabel(text, cmd.rect.minp.x, cmd.rect.minp.y, Scriber::Font(0, 32, Scriber::FontStyle::Regular, 0xFFFFFFFF, 1));
+				m_text_driver.Render();
+				++m_stats.draws;
 			}
-			need_flush = true;
 			break;
+
+			// Scissors are part of the state of the batches that follow
 			case C_SetScissors:
 			{
-				command_queue.Read(current_sciscors);
+				SetScissorsCmd cmd;
+				p = CommandArena::Read(p, cmd);
+				current_sciscors = cmd.box;
 				scissoring_enabled = true;
 			}
-			need_flush = true;
 			break;
+
 			case C_ResetScissors:
 			{
+				ResetScissorsCmd cmd;
+				p = CommandArena::Read(p, cmd);
 				current_sciscors.reset();
 				scissoring_enabled = false;
 			}
-			need_flush = true;
 			break;
-		}
 
-		if (scissoring_enabled)
-		{
-//			bgfx::setScissor(
-//					(int)current_sciscors.minp.x,
-//					(int)current_sciscors.minp.y,
-//					(int)current_sciscors.size().x,
-//					(int)current_sciscors.size().y);
+			default:
+				assert(false);
+				p = commands.end();
+				break;
 		}
+	}
+}
 
-		switch(cmd)
-		{
-			case C_RectCol:
-			{
-				int num_vertex = m_mesher.vcount();
-				int num_index = m_mesher.icount();
+void Renderer2D::MapStorage()
+{
+	if (m_vertexStream.IsMapped())
+	{
+		m_vertexStream.Commit(0);
+		m_indexStream.Commit(0);
+	}
+	int index_size = GetIndexSize();
+	bool wide = index_size == sizeof(uint32_t);
+	auto vertices = (Vertex*)m_vertexStream.Map(k_max_primitive_vertices * sizeof(Vertex));
+	auto indices = m_indexStream.Map(k_max_primitive_indices * index_size);
+	int max_vertices = (int)std::min<size_t>(m_vertexStream.GetMappedSize() / sizeof(Vertex), wide ? k_max_flush_vertices : k_max_flush_vertices16);
+	int max_indices = (int)(m_indexStream.GetMappedSize() / index_size);
+	m_mesher.SetStorage(vertices, max_vertices, indices, max_indices, index_size);
+}
 
-				GLint id;
-				glGetIntegerv(GL_CURRENT_PROGRAM, &id);
+int Renderer2D::GetIndexSize() const
+{
+	bool wide = m_index_type == Index32 || (m_index_type == IndexAuto && m_wide_indices);
+	return wide ? sizeof(uint32_t) : sizeof(uint16_t);
+}
 
-				glDisable(GL_DEPTH_TEST);
-				glDisable(GL_SCISSOR_TEST);
-				glEnable(GL_BLEND);
-				glBlendEquationSeparate(GL_FUNC_ADD, GL_FUNC_ADD);
-				glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ZERO);
+void Renderer2D::Reserve()
+{
+	if (m_mesher.vfree() < k_max_primitive_vertices || m_mesher.ifree() < k_max_primitive_indices)
+	{
+		if (m_index_type == IndexAuto && m_mesher.isize() == sizeof(uint16_t)
+				&& m_mesher.vcount() + k_max_primitive_vertices > k_max_flush_vertices16)
+		{
+			m_wide_indices = true;
+		}
+		Flush();
+	}
+}
 
-				m_program->Use();
-				glUniformMatrix4fv(m_uniform_transform, 1, GL_FALSE, &m_prj[0][0]);
+void Renderer2D::Submit(Texture* texture, int index_offset)
+{
+	int index_count = m_mesher.icount() - index_offset;
+	if (index_count == 0)
+	{
+		return;
+	}
+	++m_stats.draws;
 
-				glBindBuffer(GL_ARRAY_BUFFER, m_vertexBufferHandle);
-				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBufferHandle);
+	if (!m_batches.empty())
+	{
+		Batch& last = m_batches.back();
+		bool same_scissors = last.scissoring == scissoring_enabled
+				&& (!scissoring_enabled || (last.scissors.minp == current_sciscors.minp && last.scissors.maxp == current_sciscors.maxp));
+		if (last.texture == texture && same_scissors && last.index_offset + last.index_count == index_offset)
+		{
+			last.index_count += index_count;
+			return;
+		}
+	}
+	m_batches.push_back({texture, scissoring_enabled, current_sciscors, index_offset, index_count});
+}
 
-				m_vertexSpec.Enable();
+void Renderer2D::Flush()
+{
+	if (m_batches.empty())
+	{
+		m_mesher.PrimReset();
+		return;
+	}
 
-				glBufferData(GL_ARRAY_BUFFER, num_vertex * sizeof(Vertex), m_mesher.vptr(), GL_DYNAMIC_DRAW);
-				glBufferData(GL_ELEMENT_ARRAY_BUFFER, num_index * sizeof(int), m_mesher.iptr(), GL_DYNAMIC_DRAW);
+	int num_vertex = m_mesher.vcount();
+	int num_index = m_mesher.icount();
+	int index_size = m_mesher.isize();
+	GLenum index_type = index_size == sizeof(uint16_t) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
 
-				m_mesher.PrimReset();
+	GLint id;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &id);
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
 
-				if (num_vertex > 2)
-				{
-					glDrawElements(GL_TRIANGLES, (GLsizei)num_index, GL_UNSIGNED_SHORT, 0); //m_indexArray.data());
-				}
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_SCISSOR_TEST);
+	glEnable(GL_BLEND);
+	glBlendEquationSeparate(GL_FUNC_ADD, GL_FUNC_ADD);
+	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ZERO);
 
-				glBindBuffer(GL_ARRAY_BUFFER, 0);
-				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	size_t vertex_offset = m_vertexStream.Commit(num_vertex * sizeof(Vertex));
+	size_t index_offset = m_indexStream.Commit(num_index * index_size);
+	m_stats.uploaded_bytes += num_vertex * sizeof(Vertex) + num_index * index_size;
+	++m_stats.flushes;
+	m_stats.flushes32 += index_size == sizeof(uint32_t);
 
-				m_vertexSpec.Disable();
+	glBindBuffer(GL_ARRAY_BUFFER, m_vertexStream.GetHandle());
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexStream.GetHandle());
 
-				//auto r = std::static_pointer_cast<TextBackend>(m_text_backend);
-				//r->m_transform = m_prj;
-				//m_text_driver.Render();
+	m_vertexSpec.Enable((const void*)vertex_offset);
 
-				glUseProgram(id);
+	const Program* program = nullptr;
+	bool scissoring = false;
+	for (const Batch& batch: m_batches)
+	{
+		const Program* batch_program = batch.texture != nullptr ? m_programTex.get() : m_program.get();
+		if (batch_program != program)
+		{
+			program = batch_program;
+			program->Use();
+			if (batch.texture != nullptr)
+			{
+				glUniformMatrix4fv(m_uniform_transform_tex, 1, GL_FALSE, &m_prj[0][0]);
+				glUniform1i(m_uniform_texture, 0);
 			}
-			break;
-			case C_RectTex:
+			else
 			{
-//				int num_vertex = m_mesher.vcount();
-//				int num_index = m_mesher.icount();
-//				bgfx::TransientVertexBuffer tvb;
-//				bgfx::TransientIndexBuffer tib;
-//
-//				bgfx::allocTransientVertexBuffer(&tvb, num_vertex, m_vertexSpec);
-//				bgfx::allocTransientIndexBuffer(&tib, num_index);
-//
-//				memcpy(tvb.data, m_mesher.vptr(), num_vertex * sizeof(Vertex));
-//				memcpy(tib.data, m_mesher.iptr(), num_index * sizeof(uint16_t));
-//
-//				m_mesher.PrimReset();
-//
-//				bgfx::setVertexBuffer(0, &tvb, 0, num_vertex);
-//				bgfx::setIndexBuffer(&tib, 0, num_index);
-//
-//				bgfx::setTexture(0, u_texture.m_handle, tex);
-//
-//				uint64_t state = 0
-//				                 | BGFX_STATE_WRITE_RGB
-//				                 | BGFX_STATE_BLEND_FUNC(BGFX_STATE_BLEND_SRC_ALPHA, BGFX_STATE_BLEND_INV_SRC_ALPHA);
-//				bgfx::setState(state);
-//
-//				bgfx::submit(ViewIds::GUI, m_programTex->GetHandle(), 0);
+				glUniformMatrix4fv(m_uniform_transform, 1, GL_FALSE, &m_prj[0][0]);
 			}
-			break;
-			case C_Text:
+		}
+		if (batch.texture != nullptr)
+		{
+			batch.texture->Bind(0);
+		}
+		if (batch.scissoring)
+		{
+			// View to window coordinates, scissors are given from the bottom-left corner
+			glm::vec4 a = m_prj * glm::vec4(batch.scissors.minp, 0.0f, 1.0f);
+			glm::vec4 b = m_prj * glm::vec4(batch.scissors.maxp, 0.0f, 1.0f);
+			glm::vec2 pa = (glm::min(glm::vec2(a), glm::vec2(b)) * 0.5f + 0.5f) * glm::vec2(viewport[2], viewport[3]);
+			glm::vec2 pb = (glm::max(glm::vec2(a), glm::vec2(b)) * 0.5f + 0.5f) * glm::vec2(viewport[2], viewport[3]);
+			glm::ivec2 origin = glm::ivec2(glm::floor(pa)) + glm::ivec2(viewport[0], viewport[1]);
+			glm::ivec2 size = glm::max(glm::ivec2(glm::ceil(pb) - glm::floor(pa)), glm::ivec2(0));
+			glScissor(origin.x, origin.y, size.x, size.y);
+		}
+		if (batch.scissoring != scissoring)
+		{
+			scissoring = batch.scissoring;
+			if (scissoring)
 			{
-				m_text_driver.Render();
+				glEnable(GL_SCISSOR_TEST);
+			}
+			else
+			{
+				glDisable(GL_SCISSOR_TEST);
 			}
-			break;
 		}
 
-		if (need_flush)
+		glDrawElements(GL_TRIANGLES, (GLsizei)batch.index_count, index_type, (const void*)(index_offset + batch.index_offset * index_size));
+		++m_stats.batches;
+		uint64_t hash = Hash(Hash(Hash(m_stats.batch_hash, batch.texture), batch.scissoring), batch.index_count);
+		m_stats.batch_hash = batch.scissoring ? Hash(Hash(hash, batch.scissors.minp), batch.scissors.maxp) : hash;
+	}
+
+	glDisable(GL_SCISSOR_TEST);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	m_vertexSpec.Disable();
+
+	glUseProgram(id);
+
+	m_batches.clear();
+	MapStorage();
+}
+
+
+#include "utils/thread_pool.h"
+#include <doctest.h>
+
+TEST_CASE("[2DEngine] Renderer2D 1M quads")
+{
+	const int count = 1000000;
+	const size_t quad_bytes = 4 * sizeof(Vertex);
+	for (auto type: {Renderer2D::Index16, Renderer2D::Index32, Renderer2D::IndexAuto})
+	{
+		Renderer2D renderer;
+		renderer.Init();
+		renderer.SetUp(View(glm::vec2(1000, 1000)));
+		renderer.SetIndexType(type);
+
+		Encoder* encoder = renderer.GetEncoder();
+		for (int i = 0; i < count; ++i)
+		{
+			glm::vec2 p(i % 1000, i / 1000);
+			encoder->Rect(glm::aabb2(p, p + glm::vec2(1.0f)), color(255, 0, 0, 255));
+		}
+		renderer.Draw();
+		CHECK(glGetError() == GL_NO_ERROR);
+
+		const Renderer2D::FrameStats& stats = renderer.GetFrameStats();
+		CHECK(stats.draws == count);
+		// Quads share the state, batches are only split by flushes
+		CHECK(stats.batches == stats.flushes);
+		switch (type)
 		{
+			case Renderer2D::Index16:
+				CHECK(stats.flushes >= count * 4 / 0x10000 + 1);
+				CHECK(stats.flushes32 == 0);
+				CHECK(stats.uploaded_bytes == count * (quad_bytes + 6 * sizeof(uint16_t)));
+				break;
+			case Renderer2D::Index32:
+				CHECK(stats.flushes == stats.flushes32);
+				CHECK(stats.uploaded_bytes == count * (quad_bytes + 6 * sizeof(uint32_t)));
+				break;
+			case Renderer2D::IndexAuto:
+				CHECK(stats.flushes == stats.flushes32 + 1);
+				CHECK(stats.uploaded_bytes > count * (quad_bytes + 6 * sizeof(uint16_t)));
+				CHECK(stats.uploaded_bytes < count * (quad_bytes + 6 * sizeof(uint32_t)));
+				break;
 		}
 	}
-	command_queue.Seek(0);
+}
+
+TEST_CASE("[2DEngine] Renderer2D merges encoders")
+{
+	const int count = 100000;
+	const int encoders = 4;
+	auto quad = [](Encoder* encoder, int i)
+	{
+		glm::vec2 p(i % 1000, i / 1000);
+		// Rounded ones are big enough for their corner arcs
+		bool rounded = i % 7 == 0;
+		encoder->Rect(glm::aabb2(p, p + glm::vec2(rounded ? 4.0f : 1.0f)), color(255, 0, 0, 255), glm::vec4(rounded ? 2.0f : 0.0f));
+	};
+
+	Renderer2D renderer;
+	renderer.Init();
+	renderer.SetUp(View(glm::vec2(1000, 1000)));
+	for (int i = 0; i < count; ++i)
+	{
+		quad(renderer.GetEncoder(), i);
+	}
+	renderer.Draw();
+	Renderer2D::FrameStats single = renderer.GetFrameStats();
+
+	// Runs of quads recorded in parallel draw the same geometry in the same order
+	renderer.SetEncoderCount(encoders);
+	utils::ThreadPool::Get().ParallelFor(0, encoders, [&](int begin, int end)
+	{
+		for (int e = begin; e < end; ++e)
+		{
+			Encoder* encoder = renderer.GetEncoder(e);
+			encoder->PushScissors(glm::aabb2(glm::vec2(0.0f), glm::vec2(1000.0f)));
+			for (int i = e * count / encoders; i < (e + 1) * count / encoders; ++i)
+			{
+				quad(encoder, i);
+			}
+			encoder->PopScissors();
+		}
+	}, 1);
+	renderer.Draw();
+	CHECK(glGetError() == GL_NO_ERROR);
+
+	const Renderer2D::FrameStats& merged = renderer.GetFrameStats();
+	CHECK(merged.draws == single.draws);
+	CHECK(merged.flushes == single.flushes);
+	CHECK(merged.uploaded_bytes == single.uploaded_bytes);
+	// Scissors of all runs are the same, so batches continue across encoders
+	CHECK(merged.batches == single.batches);
 }
@@ -5,9 +5,11 @@
 #include "Vertices.h"
 #include "Render/Shader.h"
 #include "Render/VertexSpec.h"
+#include "Render/StreamBuffer.h"
 #include "utils/aabb.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <memory>
 #include <vector>
 #include <Scriber.h>
 #include <IRenderAPI.h>
@@ -18,22 +20,85 @@ namespace Render
 	class Renderer2D
 	{
 	public:
+		// Size of the indices of a flush. With 16-bit indices geometry is flushed every 65536 vertices, IndexAuto
+		// starts every frame with them and switches to 32-bit indices once a flush runs out of them.
+		enum IndexType
+		{
+			Index16,
+			Index32,
+			IndexAuto
+		};
+
+		// Counters of the last Draw
+		struct FrameStats
+		{
+			// Primitives and labels submitted by the encoder
+			int draws = 0;
+			// Draw calls issued for them
+			int batches = 0;
+			// Geometry uploads, each followed by its batches
+			int flushes = 0;
+			int flushes32 = 0;
+			size_t uploaded_bytes = 0;
+			// Hash of the texture, scissors and indices of the batches in order, the same for frames drawn the same way
+			uint64_t batch_hash = 0;
+		};
 
 		Renderer2D();
 	    ~Renderer2D();
 
-	    Encoder* GetEncoder() { return &m_encoder; };
+	    Encoder* GetEncoder() { return m_encoders[0].get(); };
+
+		// Encoders may be recorded on different threads, Draw decodes them in the order of their indices. Each one
+		// starts with scissors disabled. The count has to be set before recording starts.
+		void SetEncoderCount(int count);
+		int GetEncoderCount() const { return m_encoder_count; }
+		Encoder* GetEncoder(int index) { return m_encoders[index].get(); }
 
 	    void SetUp(View view);
 		void Init();
 		void Draw();
 
+		const FrameStats& GetFrameStats() const { return m_stats; }
+
+		void SetIndexType(IndexType type) { m_index_type = type; }
+
 		bool m_gamma_correction;
 
 	private:
+		// Consecutive indices of the mesher drawn with the same state by one call
+		struct Batch
+		{
+			Texture* texture;
+			bool scissoring;
+			glm::aabb2 scissors;
+			int index_offset;
+			int index_count;
+		};
+
+		// Gives the mesher the free part of the stream buffers
+		void MapStorage();
+
+		// Size of the indices of the next flush
+		int GetIndexSize() const;
+
+		// Flushes if the mesher may not have room for another primitive, widening IndexAuto indices
+		void Reserve();
+
+		// Adds the indices appended to the mesher since `index_offset` to the last batch if the state matches
+		void Submit(Texture* texture, int index_offset);
+
+		// Commits the geometry written by the mesher and issues the batches
+		void Flush();
+
+		// Meshes the commands of one encoder
+		void Decode(const CommandArena& commands);
+
 		Scriber::Driver m_text_driver;
 
-		Encoder m_encoder;
+		// Kept when the count drops, so their arenas are reused
+		std::vector<std::unique_ptr<Encoder>> m_encoders;
+		int m_encoder_count = 1;
 		Mesher m_mesher;
 
 		bool scissoring_enabled = false;
@@ -50,7 +115,15 @@ namespace Render
 		glm::mat4 m_prj;
 		unsigned int m_uniform_transform;
 		Render::ProgramPtr m_program;
-		uint32_t m_vertexBufferHandle;
-		uint32_t m_indexBufferHandle;
+		Render::StreamBuffer m_vertexStream;
+		Render::StreamBuffer m_indexStream;
+		unsigned int m_uniform_transform_tex;
+		unsigned int m_uniform_texture;
+
+		std::vector<Batch> m_batches;
+		FrameStats m_stats;
+		IndexType m_index_type = IndexAuto;
+		// IndexAuto ran out of 16-bit indices this frame
+		bool m_wide_indices = false;
 	};
 }
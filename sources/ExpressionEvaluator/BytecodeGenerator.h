@@ -68,6 +68,7 @@ namespace ExpessionEvaluator
 			m_program.Write(InvokeInstruction);
 			uint16_t id = m_program.Symbol(detail::Mangle(node->m_name, node->args.size()));
 			m_program.Write(id);
+			m_program.Write((uint8_t)node->args.size());
 		}
 
 		template<uint8_t I, typename N>
@@ -118,6 +119,9 @@ namespace ExpessionEvaluator
 		class JITGenerator : public IIGenerator, public ErrorHandler
 		{
 		public:
+			JITGenerator(): m_depth(0), m_slot(0)
+			{}
+
 			void Dispatch(AST::FloatNode* node) override;
 
 			void Dispatch(AST::RVariableNode* node) override;
@@ -145,95 +149,219 @@ namespace ExpessionEvaluator
 
 			void Finalize()
 			{
-				m_program.pop_xmm(0);
-				m_program.ret();
+				m_program.Ret();
 				m_program.Translate();
 			}
 
 		private:
+			// Every node leaves its value in xmm`m_depth` and increments m_depth
+			void Binary(JitProgram::Instruction ins, AST::INode* lhs, AST::INode* rhs);
+
+			// Builtins of the context done with SSE instructions, returns false if `node` has to be called
+			bool Inline(AST::FunctionCallNode* node);
+
 			JitProgram m_program;
+			int m_depth;
+			// Frame slots in use by spilled registers
+			int m_slot;
 		};
 
 		inline void JITGenerator::Dispatch(AST::FloatNode* node)
 		{
-			m_program.movabs_rax();
-			m_program.write_v64b(node->m_value);
-			m_program.push_rax();
+			m_program.LoadConst(m_depth++, node->m_value);
 		}
 
 		inline void JITGenerator::Dispatch(AST::RVariableNode* node)
 		{
-			m_program.movabs_rax();
-			uint64_t id = m_program.Symbol(node->m_name);
-			m_program.write_m64b(id);
-			m_program.push_mrax();
+			m_program.LoadVar(m_depth++, m_program.Symbol(node->m_name));
+		}
+
+		inline void JITGenerator::Binary(JitProgram::Instruction ins, AST::INode* lhs, AST::INode* rhs)
+		{
+			lhs->Accept(this);
+			int d = m_depth - 1;
+			if (auto* k = dynamic_cast<AST::FloatNode*>(rhs))
+			{
+				m_program.OpConst(ins, d, k->m_value);
+			}
+			else if (auto* v = dynamic_cast<AST::RVariableNode*>(rhs))
+			{
+				m_program.OpVar(ins, d, m_program.Symbol(v->m_name));
+			}
+			else if (m_depth < JitProgram::ValueRegisters)
+			{
+				rhs->Accept(this);
+				m_program.Op(ins, d, d + 1);
+				--m_depth;
+			}
+			else
+			{
+				// Out of registers, the left operand waits in the frame
+				m_program.Store(m_slot++, d);
+				--m_depth;
+				rhs->Accept(this);
+				m_program.Op(JitProgram::movapd, JitProgram::Scratch, d);
+				m_program.Load(d, --m_slot);
+				m_program.Op(ins, d, JitProgram::Scratch);
+			}
+		}
+
+		inline bool JITGenerator::Inline(AST::FunctionCallNode* node)
+		{
+			const std::string& name = node->m_name;
+			int count = (int)node->args.size();
+			int d = m_depth;
+			auto args = [this, node]()
+			{
+				for (auto& expr : node->args)
+				{
+					expr->Accept(this);
+				}
+				m_depth -= (int)node->args.size() - 1;
+			};
+
+			if (count == 2 && (name == "min" || name == "max"))
+			{
+				// minsd and maxsd return the second operand unless the first one is less (greater), same as the builtins
+				Binary(name == "min" ? JitProgram::minsd : JitProgram::maxsd, node->args[0].get(), node->args[1].get());
+				return true;
+			}
+			if (count == 1 && (name == "sqrt" || name == "fabs" || name == "round"))
+			{
+				args();
+				if (name == "sqrt")
+				{
+					m_program.Op(JitProgram::sqrtsd, d, d);
+				}
+				else if (name == "fabs")
+				{
+					uint64_t mask = 0x7fffffffffffffffULL;
+					double k;
+					memcpy(&k, &mask, sizeof(k));
+					m_program.LoadConst(JitProgram::Scratch, k);
+					m_program.Op(JitProgram::andpd, d, JitProgram::Scratch);
+				}
+				else
+				{
+					m_program.OpConst(JitProgram::addsd, d, 0.5);
+					m_program.Truncate(d);
+				}
+				return true;
+			}
+			if (d + count > JitProgram::ValueRegisters)
+			{
+				return false;
+			}
+			if (count == 2 && name == "step")
+			{
+				// x < edge ? 0 : 1
+				args();
+				m_program.Cmp(JitProgram::CompareLT, d + 1, d);
+				m_program.LoadConst(d, 1.0);
+				m_program.Op(JitProgram::andnpd, d + 1, d);
+				m_program.Op(JitProgram::movapd, d, d + 1);
+				return true;
+			}
+			if (count == 3 && (name == "mix" || name == "lerp"))
+			{
+				// a * (1 - x) + b * x
+				args();
+				m_program.LoadConst(JitProgram::Scratch, 1.0);
+				m_program.Op(JitProgram::subsd, JitProgram::Scratch, d + 2);
+				m_program.Op(JitProgram::mulsd, d, JitProgram::Scratch);
+				m_program.Op(JitProgram::mulsd, d + 1, d + 2);
+				m_program.Op(JitProgram::addsd, d, d + 1);
+				return true;
+			}
+			if (count == 3 && name == "clamp")
+			{
+				// x > max ? max : (x < min ? min : x), maxsd gives the inner select
+				args();
+				m_program.Op(JitProgram::maxsd, d + 1, d);
+				m_program.Op(JitProgram::movapd, JitProgram::Scratch, d + 2);
+				m_program.Cmp(JitProgram::CompareLT, JitProgram::Scratch, d);
+				m_program.Op(JitProgram::andpd, d + 2, JitProgram::Scratch);
+				m_program.Op(JitProgram::andnpd, JitProgram::Scratch, d + 1);
+				m_program.Op(JitProgram::orpd, JitProgram::Scratch, d + 2);
+				m_program.Op(JitProgram::movapd, d, JitProgram::Scratch);
+				return true;
+			}
+			if (count == 3 && name == "select")
+			{
+				// x == 0 ? a : b
+				args();
+				m_program.Op(JitProgram::xorpd, JitProgram::Scratch, JitProgram::Scratch);
+				m_program.Cmp(JitProgram::CompareEQ, d + 2, JitProgram::Scratch);
+				m_program.Op(JitProgram::andpd, d, d + 2);
+				m_program.Op(JitProgram::andnpd, d + 2, d + 1);
+				m_program.Op(JitProgram::orpd, d, d + 2);
+				return true;
+			}
+			return false;
 		}
 
 		inline void JITGenerator::Dispatch(AST::FunctionCallNode* node)
 		{
+			if (Inline(node))
+			{
+				return;
+			}
+			if (node->args.size() > JitProgram::MaxArguments)
+			{
+				SetError("Error: '%s' has more than %d arguments\n", node->m_name.c_str(), (int)JitProgram::MaxArguments);
+				return;
+			}
+
+			// Calls don't preserve xmm registers, live values are kept in the frame and arguments are computed in place
+			int live = m_depth;
+			for (int i = 0; i < live; ++i)
+			{
+				m_program.Store(m_slot + i, i);
+			}
+			m_slot += live;
+			m_depth = 0;
 			for (auto& expr : node->args)
 			{
 				expr->Accept(this);
 			}
-
-			for (int i = (int)node->args.size()-1; i >= 0; --i)
+			m_program.Call(m_program.Symbol(detail::Mangle(node->m_name, node->args.size())));
+			m_slot -= live;
+			if (live != 0)
 			{
-				m_program.pop_xmm(i);
+				m_program.Op(JitProgram::movapd, live, 0);
 			}
-
-			m_program.movabs_rax();
-			uint64_t id = m_program.Symbol(detail::Mangle(node->m_name, node->args.size()));
-			m_program.write_m64b(id);
-			m_program.call_rax();
-			m_program.push_xmm(0);
+			for (int i = 0; i < live; ++i)
+			{
+				m_program.Load(i, m_slot + i);
+			}
+			m_depth = live + 1;
 		}
 
 		inline void JITGenerator::Dispatch(AST::AddNode* node)
 		{
-			node->LHS->Accept(this);
-			node->RHS->Accept(this);
-			m_program.pop_xmm(1);
-			m_program.pop_xmm(0);
-			m_program.add_xmm1_xmm0();
-			m_program.push_xmm(0);
+			Binary(JitProgram::addsd, node->LHS.get(), node->RHS.get());
 		}
 
 		inline void JITGenerator::Dispatch(AST::SubNode* node)
 		{
-			node->LHS->Accept(this);
-			node->RHS->Accept(this);
-			m_program.pop_xmm(1);
-			m_program.pop_xmm(0);
-			m_program.sub_xmm1_xmm0();
-			m_program.push_xmm(0);
+			Binary(JitProgram::subsd, node->LHS.get(), node->RHS.get());
 		}
 
 		inline void JITGenerator::Dispatch(AST::MulNode* node)
 		{
-			node->LHS->Accept(this);
-			node->RHS->Accept(this);
-			m_program.pop_xmm(1);
-			m_program.pop_xmm(0);
-			m_program.mul_xmm1_xmm0();
-			m_program.push_xmm(0);
+			Binary(JitProgram::mulsd, node->LHS.get(), node->RHS.get());
 		}
 
 		inline void JITGenerator::Dispatch(AST::DivNode* node)
 		{
-			node->LHS->Accept(this);
-			node->RHS->Accept(this);
-			m_program.pop_xmm(1);
-			m_program.pop_xmm(0);
-			m_program.div_xmm1_xmm0();
-			m_program.push_xmm(0);
+			Binary(JitProgram::divsd, node->LHS.get(), node->RHS.get());
 		}
 
 		inline void JITGenerator::Dispatch(AST::UnaryMinusNode* node)
 		{
 			node->child->Accept(this);
-			m_program.pop_xmm(0);
-			m_program.neg_xmm0();
-			m_program.push_xmm(0);
+			m_program.LoadConst(JitProgram::Scratch, -0.0);
+			m_program.Op(JitProgram::xorpd, m_depth - 1, JitProgram::Scratch);
 		}
 
 		inline void JITGenerator::Dispatch(AST::UnaryPlusNode* node)
@@ -244,6 +372,7 @@ namespace ExpessionEvaluator
 		inline void JITGenerator::Dispatch(AST::CombineNode* node)
 		{
 			node->childA->Accept(this);
+			--m_depth;
 			node->childB->Accept(this);
 		}
 	}
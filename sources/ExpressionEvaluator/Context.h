@@ -3,10 +3,13 @@
 #include <map>
 #include <type_traits>
 #include <list>
+#include <set>
+#include <string.h>
 #include <time.h>
 #include "Mangle.h"
 #include "InterpretedProgram.h"
 #include "JProgram.h"
+#include "ProgramCache.h"
 
 namespace ExpessionEvaluator
 {
@@ -74,7 +77,14 @@ namespace ExpessionEvaluator
 
 			return JitProgram();
 		}
-		return bcg.GetProgram();
+
+		detail::BytecodeGenerator batch;
+
+		parser.GenerateProgram(batch);
+
+		JitProgram& program = bcg.GetProgram();
+		program.bytecode = batch.GetProgram();
+		return program;
 	}
 
 	namespace detail
@@ -260,6 +270,11 @@ namespace ExpessionEvaluator
 					//error
 				}
 			}
+
+			void Set(const std::string& name, T var)
+			{
+				m_symbols[name] = var;
+			}
 		};
 
 		typedef SymbolTable<BuiltInFunction> FunctionTable;
@@ -269,7 +284,7 @@ namespace ExpessionEvaluator
 		void _func(FunctionTable&, const char *, Program<t>&) {};
 
 		template<>
-		void _func<Interpreted>(FunctionTable& table, const char *name, Program<Interpreted>& p)
+		inline void _func<Interpreted>(FunctionTable& table, const char *name, Program<Interpreted>& p)
 		{
 			detail::cpp_function function([&p]()
 			                              {
@@ -279,10 +294,11 @@ namespace ExpessionEvaluator
 		}
 
 		template<>
-		void _func<JIT>(FunctionTable& table, const char *name, Program<JIT>& p)
+		inline void _func<JIT>(FunctionTable& table, const char *name, Program<JIT>& p)
 		{
-			detail::cpp_function function(p.Eval);
-			table.Add(detail::Mangle(name, function.arg_count), {function.wrapper, function.func });
+			// Code of a redefined program moves, callers are linked again. Callers linked before `p` go through the entry.
+			detail::cpp_function function(p.MakeEntry());
+			table.Set(detail::Mangle(name, function.arg_count), {function.wrapper, function.func });
 		}
 	}
 
@@ -290,19 +306,19 @@ namespace ExpessionEvaluator
 	class Context
 	{
 	public:
-		Context(bool jit=true): use_jit(jit)
+		Context(bool jit=true): use_jit(jit), m_cache(nullptr), m_signature(0), m_signatureValid(false), m_generation(0)
 		{
-			func("round", detail::builtin::round);
-			func("max", detail::builtin::max);
-			func("min", detail::builtin::min);
-			func("step", detail::builtin::step);
-			func("mix", detail::builtin::mix);
-			func("lerp", detail::builtin::mix);
-			func("select", detail::builtin::select);
+			builtin("round", detail::builtin::round);
+			builtin("max", detail::builtin::max);
+			builtin("min", detail::builtin::min);
+			builtin("step", detail::builtin::step);
+			builtin("mix", detail::builtin::mix);
+			builtin("lerp", detail::builtin::mix);
+			builtin("select", detail::builtin::select);
 			func("clock", detail::builtin::clock_);
-			func("clamp", detail::builtin::clamp);
+			builtin("clamp", detail::builtin::clamp);
 
-#define MATH_OP(name) func( #name, +[](double x){ return name(x); })
+#define MATH_OP(name) builtin( #name, +[](double x){ return name(x); })
 			MATH_OP(log);
 			MATH_OP(exp);
 			MATH_OP(log10);
@@ -318,28 +334,69 @@ namespace ExpessionEvaluator
 			MATH_OP(fabs);
 			MATH_OP(sqrt);
 #undef MATH_OP
-			func("atan2", detail::builtin::atan2_);
-			func("pow", detail::builtin::pow_);
+			builtin("atan2", detail::builtin::atan2_);
+			builtin("pow", detail::builtin::pow_);
 		};
 
+		// Binding a variable again moves it, programs reading it are linked again by the next Link
 		void var(const std::string& name, double* val)
 		{
-			return m_symbolTable.Add(name, val);
+			m_symbolTable.Set(name, val);
+			Invalidate(name);
 		}
 
 		template <typename Function>
 		void func(const char *name, Function &&f)
 		{
 			detail::cpp_function function(f);
-			m_functionTable.Add(detail::Mangle(name, function.arg_count), {function.wrapper, function.func });
+			std::string symbol = detail::Mangle(name, function.arg_count);
+			m_functionTable.Add(symbol, {function.wrapper, function.func });
+			if (m_natives.insert(symbol).second)
+			{
+				m_signatureValid = false;
+			}
+			Invalidate(symbol);
 		}
 
+		// Programs are looked up in `cache` before compiling and added to it after, nullptr disables caching
+		void set_cache(ProgramCache* cache)
+		{
+			m_cache = cache;
+		}
+
+		// Compiles a program, it is linked by the next Link together with the programs that call it
 		void func(const char *name, const char* func)
 		{
-			Program<type> p = ExpessionEvaluator::Compile<type>(func);
+			auto it = m_programs.find(name);
+			if (it != m_programs.end())
+			{
+				Unregister(name, it->second);
+			}
+			Program<type> p;
+			uint64_t key = 0;
+			if (m_cache != nullptr)
+			{
+				key = ProgramCache::Key(func, Signature(), type == JIT ? 'J' : 'I');
+			}
+			if (m_cache == nullptr || !m_cache->Find(key, func, p))
+			{
+				p = ExpessionEvaluator::Compile<type>(func);
+				if (m_cache != nullptr && p.size > 0)
+				{
+					m_cache->Insert(key, func, p);
+				}
+			}
 			m_programs[name] = p;
 			auto& p_ = m_programs[name];
 			detail::_func<type>(m_functionTable, name, p_);
+			for (auto& symbol: p_.symbols)
+			{
+				m_dependents[symbol.first].insert(name);
+			}
+			std::string symbol = detail::Mangle(name, 0);
+			m_programSymbols[symbol] = name;
+			m_unlinked.insert(name);
+			Invalidate(symbol);
 		}
 
 		Program<type>& get_func(const char* name)
@@ -353,12 +410,64 @@ namespace ExpessionEvaluator
 			return none;
 		}
 
+		// Links programs compiled or affected by changed bindings since the last call
 		void Link()
 		{
-			for (auto& p: m_programs)
+			std::set<std::string> unlinked;
+			unlinked.swap(m_unlinked);
+			for (auto& name: unlinked)
+			{
+				auto it = m_programs.find(name);
+				if (it != m_programs.end())
+				{
+					Link(it->second);
+				}
+			}
+		}
+
+		// Value of program `name`, linking pending programs first. The last value is returned while the variables the
+		// program reads, directly or through the programs it calls, keep their values. Programs calling native functions
+		// other than the builtins without side effects are evaluated every time.
+		double Evaluate(const std::string& name)
+		{
+			Link();
+			auto it = m_programs.find(name);
+			if (it == m_programs.end())
+			{
+				return 0.0;
+			}
+			Memo& memo = m_memo[name];
+			if (memo.generation != m_generation)
+			{
+				std::set<std::string> visited;
+				memo.vars.clear();
+				memo.pure = CollectReads(name, memo.vars, visited);
+				memo.values.clear();
+				memo.generation = m_generation;
+			}
+			if (memo.pure && !memo.values.empty())
 			{
-				Link(p.second);
+				bool same = true;
+				for (size_t i = 0; same && i < memo.vars.size(); ++i)
+				{
+					same = memcmp(memo.vars[i], &memo.values[i], sizeof(double)) == 0;
+				}
+				if (same)
+				{
+					return memo.result;
+				}
 			}
+			memo.result = it->second.Eval();
+			if (memo.pure)
+			{
+				// Values are compared bitwise, so NaN counts as unchanged
+				memo.values.resize(memo.vars.size());
+				for (size_t i = 0; i < memo.vars.size(); ++i)
+				{
+					memo.values[i] = *memo.vars[i];
+				}
+			}
+			return memo.result;
 		}
 
 		void Link(InterpretedProgram& program)
@@ -367,7 +476,7 @@ namespace ExpessionEvaluator
 			std::vector<void*> wrapper;
 			pointers.resize(program.symbols.size(), nullptr);
 			wrapper.resize(program.symbols.size(), nullptr);
-			int func_count = 0;
+			program.callsPrograms = false;
 			for (auto& symbol : program.symbols)
 			{
 				void* p = (void*)m_symbolTable.Get(symbol.first);
@@ -377,12 +486,13 @@ namespace ExpessionEvaluator
 					if (!b)
 					{
 						printf("Error: Undefined symbol: '%s'\n", detail::Demangle(symbol.first).c_str());
-						program.size = 0;
+						program.code.clear();
+						program.batchCode = InterpretedProgram::BatchCode();
 						return;
 					}
+					program.callsPrograms |= m_programSymbols.count(symbol.first) != 0;
 					pointers[symbol.second] = b.func;
 					wrapper[symbol.second] = (void*)b.wrapper;
-					++func_count;
 				}
 				else
 				{
@@ -390,7 +500,28 @@ namespace ExpessionEvaluator
 				}
 			}
 
-			int size_rl = program.size + program.relocations.size() * (sizeof(void*) - sizeof(uint16_t)) + func_count * sizeof(void*);
+			program.stack = &m_stack;
+			if (program.linked)
+			{
+				// Relocations point at the pointers already, only their values change
+				for (auto& r: program.relocations)
+				{
+					*(void**)(program.data + r.second) = pointers[r.first];
+					if (wrapper[r.first] != nullptr)
+					{
+						*(void**)(program.data + r.second + sizeof(void*)) = wrapper[r.first];
+					}
+				}
+				program.Translate();
+				return;
+			}
+
+			// Every call site gets the wrapper after the function pointer
+			int size_rl = program.size;
+			for (auto& r: program.relocations)
+			{
+				size_rl += sizeof(void*) - sizeof(uint16_t) + (wrapper[r.first] != nullptr ? sizeof(void*) : 0);
+			}
 			auto* data_rl = (uint8_t*)malloc(size_rl);
 
 			int dst = 0;
@@ -401,6 +532,7 @@ namespace ExpessionEvaluator
 			{
 				if (r < (int)program.relocations.size() && src == program.relocations[r].second)
 				{
+					program.relocations[r].second = dst;
 					*(void**)(data_rl + dst) = pointers[program.relocations[r].first];
 					dst += sizeof(void*);
 					if (wrapper[program.relocations[r].first] != nullptr)
@@ -418,14 +550,15 @@ namespace ExpessionEvaluator
 			}
 			free(program.data);
 			program.data = data_rl;
+			program.capacity = size_rl;
 			program.size = dst;
-			program.stack = &m_stack;
+			program.linked = true;
 			assert(program.size == size_rl);
+			program.Translate();
 		}
 
 		void Link(JitProgram& program)
 		{
-			//hexDump(nullptr, mem, pointer);
 			std::vector<void*> pointers;
 			pointers.resize(program.symbols.size(), nullptr);
 			for (auto& symbol : program.symbols)
@@ -437,7 +570,7 @@ namespace ExpessionEvaluator
 					if (!b)
 					{
 						printf("Error: Undefined symbol: '%s'\n", detail::Demangle(symbol.first).c_str());
-						program.size = 0;
+						program.Eval = &JitProgram::Zero;
 						return;
 					}
 					pointers[symbol.second] = b.func;
@@ -448,31 +581,122 @@ namespace ExpessionEvaluator
 				}
 			}
 
-			int src = 0;
-			int r = 0;
+			program.Patch(pointers);
+			program.batchKernel.reset();
+			Link(program.bytecode);
+		}
+
+		Stack m_stack;
+		detail::VarTable m_symbolTable;
+		detail::FunctionTable m_functionTable;
+		std::map<std::string, Program<type> > m_programs;
+		bool use_jit;
+
+	private:
+		struct Memo
+		{
+			uint64_t generation = ~0ULL;
+			bool pure = false;
+			// Variables read by the program and their values at the last evaluation
+			std::vector<const double*> vars;
+			std::vector<double> values;
+			double result = 0.0;
+		};
 
-			while (src < program.size && r < (int)program.relocations_sym.size())
+		// Native function without side effects
+		template <typename Function>
+		void builtin(const char *name, Function &&f)
+		{
+			detail::cpp_function function(f);
+			m_pure.insert(detail::Mangle(name, function.arg_count));
+			func(name, f);
+		}
+
+		// Hash of the names of the native functions, programs compiled for contexts with different functions are
+		// cached apart
+		uint64_t Signature()
+		{
+			if (!m_signatureValid)
 			{
-				if (r < (int)program.relocations_sym.size() && src == program.relocations_pointer[r])
+				m_signature = ::detail::fnv_basis_k;
+				for (auto& name: m_natives)
 				{
-					*(void**) (program.mem + src) = pointers[program.relocations_sym[r]];
-					src += sizeof(void*);
-					++r;
+					m_signature = ::detail::string_hash(name.c_str(), name.size() + 1, 0, m_signature);
 				}
-				else
+				m_signatureValid = true;
+			}
+			return m_signature;
+		}
+
+		// Marks the programs referencing `symbol` for linking and drops memoized values
+		void Invalidate(const std::string& symbol)
+		{
+			++m_generation;
+			auto it = m_dependents.find(symbol);
+			if (it != m_dependents.end())
+			{
+				m_unlinked.insert(it->second.begin(), it->second.end());
+			}
+		}
+
+		void Unregister(const std::string& name, const Program<type>& program)
+		{
+			for (auto& symbol: program.symbols)
+			{
+				m_dependents[symbol.first].erase(name);
+			}
+		}
+
+		// Adds the variables read by program `name` and the programs it calls to `vars`. Returns false if it calls
+		// a function that may have side effects.
+		bool CollectReads(const std::string& name, std::vector<const double*>& vars, std::set<std::string>& visited)
+		{
+			if (!visited.insert(name).second)
+			{
+				return true;
+			}
+			for (auto& symbol: m_programs[name].symbols)
+			{
+				const double* v = m_symbolTable.Get(symbol.first);
+				if (v != nullptr)
+				{
+					if (std::find(vars.begin(), vars.end(), v) == vars.end())
+					{
+						vars.push_back(v);
+					}
+					continue;
+				}
+				auto program = m_programSymbols.find(symbol.first);
+				if (program != m_programSymbols.end())
+				{
+					if (!CollectReads(program->second, vars, visited))
+					{
+						return false;
+					}
+					continue;
+				}
+				if (m_pure.count(symbol.first) == 0)
 				{
-					++src;
+					return false;
 				}
 			}
-
-			hexDump(nullptr, program.mem, program.pointer);
+			return true;
 		}
 
-		Stack m_stack;
-		detail::VarTable m_symbolTable;
-		detail::FunctionTable m_functionTable;
-		std::map<std::string, Program<type> > m_programs;
-		bool use_jit;
+		// Names of the programs referencing each symbol
+		std::map<std::string, std::set<std::string> > m_dependents;
+		// Symbol of each compiled program and its name
+		std::map<std::string, std::string> m_programSymbols;
+		std::set<std::string> m_unlinked;
+		std::set<std::string> m_pure;
+		// Native functions, registered by func
+		std::set<std::string> m_natives;
+		ProgramCache* m_cache;
+		uint64_t m_signature;
+		bool m_signatureValid;
+		std::map<std::string, Memo> m_memo;
+		// Incremented whenever a binding changes, memoized reads are collected again after
+		uint64_t m_generation;
 	};
 
 	typedef Context<Interpreted> INTContext;
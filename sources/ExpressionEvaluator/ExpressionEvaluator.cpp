@@ -0,0 +1,64 @@
+#include "ExpressionEvaluator.h"
+
+#include <doctest.h>
+
+using namespace ExpessionEvaluator;
+
+template<Type T>
+static void TestNestedCalls()
+{
+	Context<T> ctx;
+	double x = 5;
+	ctx.var("x", &x);
+	ctx.func("a", "x * 2");
+	ctx.func("b", "a() + 1");
+	CHECK(ctx.Evaluate("b") == 11.0);
+
+	ctx.func("a", "x * 4 + 1");
+	CHECK(ctx.Evaluate("b") == 22.0);
+
+	x = 1;
+	CHECK(ctx.Evaluate("b") == 6.0);
+}
+
+TEST_CASE("[ExpressionEvaluator] nested calls")
+{
+	TestNestedCalls<Interpreted>();
+	TestNestedCalls<JIT>();
+}
+
+template<Type T>
+static void TestBatchCalls()
+{
+	Context<T> ctx;
+	double x = 0;
+	double y = 3;
+	ctx.var("x", &x);
+	ctx.var("y", &y);
+	ctx.func("a", "x * y");
+	ctx.func("b", "a() + x + y");
+	ctx.Link();
+
+	double xs[100];
+	double out[100];
+	for (int i = 0; i < 100; ++i)
+	{
+		xs[i] = i - 50;
+	}
+	BatchVar batch = { &x, xs, sizeof(double) };
+	for (y = 3; y < 5; ++y)
+	{
+		ctx.get_func("b").EvalBatch(&batch, 1, out, sizeof(double), 100);
+		CHECK(x == 0.0);
+		for (int i = 0; i < 100; ++i)
+		{
+			CHECK(out[i] == xs[i] * y + xs[i] + y);
+		}
+	}
+}
+
+TEST_CASE("[ExpressionEvaluator] batches of programs calling programs")
+{
+	TestBatchCalls<Interpreted>();
+	TestBatchCalls<JIT>();
+}
@@ -1,12 +1,20 @@
 #pragma once
 #include <memory>
 #include <vector>
+#include <algorithm>
 #include <inttypes.h>
 #include <assert.h>
 #include <map>
 #include <string>
+#include <stdio.h>
+#include <stdlib.h>
 #include "Stack.h"
 
+#if defined(__GNUC__) || defined(__clang__)
+// Labels as values, each handler jumps straight to the next one instead of going through a switch
+#define EE_THREADED_DISPATCH
+#endif
+
 
 namespace ExpessionEvaluator
 {
@@ -22,11 +30,125 @@ namespace ExpessionEvaluator
 		UnaryMinusInstruction,
 	};
 
+	// Binary ops of the register bytecode come in one form per kind of operands: R - register, K - constant,
+	// V - variable. Register operands are taken from `a`, `b`, constants and variables from `x`, `y` in order.
+#define EE_BINARY_FORMS(X, name) X(name##RR) X(name##RK) X(name##KR) X(name##RV) X(name##VR) X(name##VK) X(name##KV) X(name##VV)
+
+	// Superinstructions for a product followed by an add. Product forms are as above, the addend is r[c], z.k or *z.v.
+#define EE_MULADD_FORMS(X, name) X(name##R) X(name##K) X(name##V)
+
+#define EE_REGISTER_OPCODES(X) \
+	X(Const) X(Load) X(Move) X(Neg) X(Call) X(Ret) \
+	EE_BINARY_FORMS(X, Add) EE_BINARY_FORMS(X, Sub) EE_BINARY_FORMS(X, Mul) EE_BINARY_FORMS(X, Div) \
+	EE_MULADD_FORMS(X, MulAddRR) EE_MULADD_FORMS(X, MulAddRK) EE_MULADD_FORMS(X, MulAddRV) \
+	EE_MULADD_FORMS(X, MulAddVK) EE_MULADD_FORMS(X, MulAddVV)
+
+	enum RegisterOpcodes: uint8_t
+	{
+#define EE_OPCODE(name) Op##name,
+		EE_REGISTER_OPCODES(EE_OPCODE)
+#undef EE_OPCODE
+	};
+
+	enum BinaryForm: uint8_t
+	{
+		FormRR, FormRK, FormKR, FormRV, FormVR, FormVK, FormKV, FormVV
+	};
+
+	struct RegisterInstruction
+	{
+		union Operand
+		{
+			double k;
+			const double* v;
+			const void* p;
+			void (*w)(Stack*, const void*);
+		};
+
+		uint8_t op;
+		uint8_t dst;
+		uint8_t a;
+		uint8_t b;
+		uint8_t c;
+		Operand x;
+		Operand y;
+		Operand z;
+	};
+
+	// Variable read from a strided array by EvalBatch. `var` is the pointer the variable is bound to in the context,
+	// instance i reads the double at `data` + i * `stride` bytes.
+	struct BatchVar
+	{
+		const double* var;
+		const double* data;
+		ptrdiff_t stride;
+	};
+
+	namespace detail
+	{
+		// Calls the function of an OpCall instruction for each of `lanes` lanes, registers hold `lanes` values each
+		inline void CallLanes(const RegisterInstruction& ins, Stack* stack, double* r, int laneCount, int lanes)
+		{
+			for (int j = 0; j < lanes; ++j)
+			{
+				for (int i = 0; i < ins.b; ++i)
+				{
+					stack->Push<double>(r[(ins.a + i) * laneCount + j]);
+				}
+				ins.y.w(stack, ins.x.p);
+				r[ins.dst * laneCount + j] = stack->Pop<double>();
+			}
+		}
+	}
+
 	struct InterpretedProgram
 	{
-		InterpretedProgram(): pointer(0), idc(0), size(0), data(nullptr)
+		enum
+		{
+			InitialCapacity = 64,
+			// Registers are addressed by uint8_t, register count is the maximum stack depth of the expression
+			MaxRegisters = 255,
+			LocalRegisters = 32,
+			// Instances evaluated per dispatch of an instruction by EvalBatch
+			BatchLanes = 64
+		};
+
+		// Constant of batch code computed from variables that aren't batched: `op` is LoadVar for variable `v`,
+		// PushConstToStack for `k`, or an operation on the uniforms `lhs` and `rhs` computed before it
+		struct Uniform
+		{
+			uint8_t op;
+			double k;
+			const double* v;
+			int lhs;
+			int rhs;
+		};
+
+		// Operand x or the addend z of `instruction` is the value of `uniform`
+		struct UniformUse
+		{
+			int instruction;
+			int uniform;
+			bool addend;
+		};
+
+		// Register code for a set of batched variables, kept until the program is translated again. Constants read
+		// from variables are computed again from `uniforms` each time the code is run.
+		struct BatchCode
 		{
-			data = (uint8_t*)malloc(512);
+			bool valid = false;
+			std::vector<const double*> vars;
+			std::vector<RegisterInstruction> code;
+			int registers = 0;
+			std::vector<Uniform> uniforms;
+			std::vector<UniformUse> uses;
+			std::vector<double> values;
+		};
+
+		InterpretedProgram(): pointer(0), idc(0), size(0), capacity(InitialCapacity), data(nullptr), stack(nullptr), linked(false),
+			callsPrograms(false), registers(0)
+		{
+			data = (uint8_t*)malloc(capacity);
 		}
 
 		template<typename T>
@@ -40,6 +162,14 @@ namespace ExpessionEvaluator
 		template<typename T>
 		void Write(T val)
 		{
+			if (pointer + (int)sizeof(T) > capacity)
+			{
+				while (pointer + (int)sizeof(T) > capacity)
+				{
+					capacity *= 2;
+				}
+				data = (uint8_t*)realloc(data, capacity);
+			}
 			*reinterpret_cast<T*>(data + pointer) = val;
 			pointer += sizeof(T);
 		}
@@ -60,8 +190,90 @@ namespace ExpessionEvaluator
 			}
 		}
 
+		// Runs the register bytecode built by Translate
 		double Eval() const
 		{
+			if (code.empty())
+			{
+				return 0.0;
+			}
+			double local[LocalRegisters];
+			std::vector<double> heap;
+			double* r = local;
+			if (registers > LocalRegisters)
+			{
+				heap.resize(registers);
+				r = heap.data();
+			}
+			const RegisterInstruction* ip = code.data();
+
+#ifdef EE_THREADED_DISPATCH
+#define EE_LABEL(name) &&L_##name,
+			static const void* const labels[] = { EE_REGISTER_OPCODES(EE_LABEL) };
+#undef EE_LABEL
+#define EE_CASE(name) L_##name:
+#define EE_NEXT() goto *labels[(++ip)->op]
+			goto *labels[ip->op];
+#else
+#define EE_CASE(name) case Op##name:
+#define EE_NEXT() continue
+			for (;; ++ip) switch (ip->op)
+#endif
+			{
+				EE_CASE(Const) r[ip->dst] = ip->x.k; EE_NEXT();
+				EE_CASE(Load) r[ip->dst] = *ip->x.v; EE_NEXT();
+				EE_CASE(Move) r[ip->dst] = r[ip->a]; EE_NEXT();
+				EE_CASE(Neg) r[ip->dst] = -r[ip->a]; EE_NEXT();
+				EE_CASE(Call)
+				{
+					for (int i = 0; i < ip->b; ++i)
+					{
+						stack->Push<double>(r[ip->a + i]);
+					}
+					ip->y.w(stack, ip->x.p);
+					r[ip->dst] = stack->Pop<double>();
+					EE_NEXT();
+				}
+				EE_CASE(Ret) return r[ip->a];
+
+#define EE_BINARY(name, op) \
+				EE_CASE(name##RR) r[ip->dst] = r[ip->a] op r[ip->b]; EE_NEXT(); \
+				EE_CASE(name##RK) r[ip->dst] = r[ip->a] op ip->x.k; EE_NEXT(); \
+				EE_CASE(name##KR) r[ip->dst] = ip->x.k op r[ip->a]; EE_NEXT(); \
+				EE_CASE(name##RV) r[ip->dst] = r[ip->a] op *ip->x.v; EE_NEXT(); \
+				EE_CASE(name##VR) r[ip->dst] = *ip->x.v op r[ip->a]; EE_NEXT(); \
+				EE_CASE(name##VK) r[ip->dst] = *ip->x.v op ip->y.k; EE_NEXT(); \
+				EE_CASE(name##KV) r[ip->dst] = ip->x.k op *ip->y.v; EE_NEXT(); \
+				EE_CASE(name##VV) r[ip->dst] = *ip->x.v op *ip->y.v; EE_NEXT();
+				EE_BINARY(Add, +)
+				EE_BINARY(Sub, -)
+				EE_BINARY(Mul, *)
+				EE_BINARY(Div, /)
+#undef EE_BINARY
+
+#define EE_MULADD(name, product) \
+				EE_CASE(name##R) r[ip->dst] = (product) + r[ip->c]; EE_NEXT(); \
+				EE_CASE(name##K) r[ip->dst] = (product) + ip->z.k; EE_NEXT(); \
+				EE_CASE(name##V) r[ip->dst] = (product) + *ip->z.v; EE_NEXT();
+				EE_MULADD(MulAddRR, r[ip->a] * r[ip->b])
+				EE_MULADD(MulAddRK, r[ip->a] * ip->x.k)
+				EE_MULADD(MulAddRV, r[ip->a] * *ip->x.v)
+				EE_MULADD(MulAddVK, *ip->x.v * ip->y.k)
+				EE_MULADD(MulAddVV, *ip->x.v * *ip->y.v)
+#undef EE_MULADD
+			}
+#undef EE_CASE
+#undef EE_NEXT
+			return 0.0;
+		}
+
+		// Runs the linked stack bytecode directly, kept as the reference for the register bytecode
+		double EvalStack() const
+		{
+			if (!linked)
+			{
+				return 0.0;
+			}
 			pointer = 0;
 			while(pointer < size)
 			{
@@ -91,6 +303,8 @@ namespace ExpessionEvaluator
 				{
 					auto f = Read<const void*>();
 					auto w = Read<void (*const)(Stack*, const void*)>();
+					// Argument count, the wrapper pops its arguments itself
+					Read<uint8_t>();
 					w(stack, f);
 					break;
 				}
@@ -140,13 +354,526 @@ namespace ExpessionEvaluator
 			}
 		}
 
+		// Builds register bytecode from the linked stack bytecode
+		void Translate()
+		{
+			registers = TranslateTo(code, nullptr, 0, nullptr);
+			batchCode = BatchCode();
+		}
+
+		// Evaluates `count` instances of the expression. Variables in `vars` are read from their arrays, the others
+		// are the same for all instances and are read when the batch runs. Result i is stored at `out` + i * `outStride`
+		// bytes. Each instruction is dispatched once per BatchLanes instances.
+		// Programs called by the expression read the variables themselves, so an expression calling programs is
+		// evaluated one instance at a time with the batched variables set to the values of the instance.
+		void EvalBatch(const BatchVar* vars, int varCount, double* out, ptrdiff_t outStride, size_t count) const
+		{
+			if (callsPrograms)
+			{
+				EvalInstances(vars, varCount, out, outStride, count, [this]()
+				{
+					return Eval();
+				});
+				return;
+			}
+			const BatchCode& lanesCode = GetBatch(vars, varCount);
+			int result = lanesCode.code.empty() ? -1 : lanesCode.code.back().a;
+			RunBatch(vars, varCount, lanesCode.registers, result, out, outStride, count, [&](double* r, int lanes)
+			{
+				RunLanes(lanesCode.code.data(), r, lanes);
+			});
+		}
+
+		// Register code for batches of `vars`, translated when other variables are batched than in the last call.
+		// Constants read from variables are updated to their current values. The code is empty if the program isn't
+		// linked.
+		const BatchCode& GetBatch(const BatchVar* vars, int varCount) const
+		{
+			bool same = batchCode.valid && (int)batchCode.vars.size() == varCount;
+			for (int i = 0; same && i < varCount; ++i)
+			{
+				same = batchCode.vars[i] == vars[i].var;
+			}
+			if (!same)
+			{
+				batchCode = BatchCode();
+				batchCode.valid = true;
+				for (int i = 0; i < varCount; ++i)
+				{
+					batchCode.vars.push_back(vars[i].var);
+				}
+				batchCode.registers = code.empty() ? 0 : TranslateTo(batchCode.code, vars, varCount, &batchCode);
+			}
+
+			std::vector<double>& values = batchCode.values;
+			values.resize(batchCode.uniforms.size());
+			for (size_t i = 0; i < values.size(); ++i)
+			{
+				const Uniform& u = batchCode.uniforms[i];
+				switch (u.op)
+				{
+					case LoadVar: values[i] = *u.v; break;
+					case PushConstToStack: values[i] = u.k; break;
+					case UnaryMinusInstruction: values[i] = -values[u.lhs]; break;
+					default: values[i] = Fold(u.op, values[u.lhs], values[u.rhs]); break;
+				}
+			}
+			for (auto& use: batchCode.uses)
+			{
+				RegisterInstruction& ins = batchCode.code[use.instruction];
+				(use.addend ? ins.z : ins.x).k = values[use.uniform];
+			}
+			return batchCode;
+		}
+
+		// Evaluates instances one at a time with `eval`, the batched variables are set to the values of each instance
+		// and restored after
+		template<typename F>
+		static void EvalInstances(const BatchVar* vars, int varCount, double* out, ptrdiff_t outStride, size_t count,
+			F&& eval)
+		{
+			std::vector<double> saved(varCount);
+			for (int v = 0; v < varCount; ++v)
+			{
+				saved[v] = *vars[v].var;
+			}
+			for (size_t i = 0; i < count; ++i)
+			{
+				for (int v = 0; v < varCount; ++v)
+				{
+					*const_cast<double*>(vars[v].var) = *(const double*)((const uint8_t*)vars[v].data + (ptrdiff_t)i * vars[v].stride);
+				}
+				*(double*)((uint8_t*)out + (ptrdiff_t)i * outStride) = eval();
+			}
+			for (int v = 0; v < varCount; ++v)
+			{
+				*const_cast<double*>(vars[v].var) = saved[v];
+			}
+		}
+
+		// Runs register code built for a batch, each register holds BatchLanes values. Arithmetic is done for all lanes,
+		// functions are called for the first `lanes` only.
+		void RunLanes(const RegisterInstruction* ip, double* r, int lanes) const
+		{
+#define EE_LANES(expr) for (int j = 0; j < BatchLanes; ++j) { d[j] = expr; } break;
+			for (;; ++ip)
+			{
+				double* d = r + ip->dst * BatchLanes;
+				const double* a = r + ip->a * BatchLanes;
+				const double* b = r + ip->b * BatchLanes;
+				const double* c = r + ip->c * BatchLanes;
+				switch (ip->op)
+				{
+					case OpConst: { const double k = ip->x.k; EE_LANES(k) }
+					case OpLoad: { const double k = *ip->x.v; EE_LANES(k) }
+					case OpMove: EE_LANES(a[j])
+					case OpNeg: EE_LANES(-a[j])
+					case OpCall: detail::CallLanes(*ip, stack, r, BatchLanes, lanes); break;
+					case OpRet: return;
+
+#define EE_BINARY(name, op) \
+					case Op##name##RR: EE_LANES(a[j] op b[j]) \
+					case Op##name##RK: { const double k = ip->x.k; EE_LANES(a[j] op k) } \
+					case Op##name##KR: { const double k = ip->x.k; EE_LANES(k op a[j]) } \
+					case Op##name##RV: { const double k = *ip->x.v; EE_LANES(a[j] op k) } \
+					case Op##name##VR: { const double k = *ip->x.v; EE_LANES(k op a[j]) } \
+					case Op##name##VK: { const double k = *ip->x.v op ip->y.k; EE_LANES(k) } \
+					case Op##name##KV: { const double k = ip->x.k op *ip->y.v; EE_LANES(k) } \
+					case Op##name##VV: { const double k = *ip->x.v op *ip->y.v; EE_LANES(k) }
+					EE_BINARY(Add, +)
+					EE_BINARY(Sub, -)
+					EE_BINARY(Mul, *)
+					EE_BINARY(Div, /)
+#undef EE_BINARY
+
+#define EE_MULADD(name, scalars, product) \
+					case Op##name##R: { scalars EE_LANES((product) + c[j]) } \
+					case Op##name##K: { scalars const double z = ip->z.k; EE_LANES((product) + z) } \
+					case Op##name##V: { scalars const double z = *ip->z.v; EE_LANES((product) + z) }
+					EE_MULADD(MulAddRR, , a[j] * b[j])
+					EE_MULADD(MulAddRK, const double x = ip->x.k;, a[j] * x)
+					EE_MULADD(MulAddRV, const double x = *ip->x.v;, a[j] * x)
+					EE_MULADD(MulAddVK, const double x = *ip->x.v * ip->y.k;, x)
+					EE_MULADD(MulAddVV, const double x = *ip->x.v * *ip->y.v;, x)
+#undef EE_MULADD
+					default: assert(false); return;
+				}
+			}
+#undef EE_LANES
+		}
+
+		// Evaluates a batch in groups of BatchLanes instances: variables are gathered into registers 0..varCount - 1,
+		// `run(r, lanes)` computes register `result` from them. Results are 0 if `result` is negative.
+		template<typename F>
+		static void RunBatch(const BatchVar* vars, int varCount, int registers, int result, double* out, ptrdiff_t outStride,
+			size_t count, F&& run)
+		{
+			// Lanes past the end keep finite values from the previous group or zeros
+			std::vector<double> r(std::max(registers, 1) * BatchLanes, 0.0);
+			for (size_t base = 0; base < count; base += BatchLanes)
+			{
+				int lanes = (int)std::min<size_t>(BatchLanes, count - base);
+				for (int v = 0; v < varCount; ++v)
+				{
+					const uint8_t* src = (const uint8_t*)vars[v].data + (ptrdiff_t)base * vars[v].stride;
+					for (int j = 0; j < lanes; ++j)
+					{
+						r[v * BatchLanes + j] = *(const double*)(src + j * vars[v].stride);
+					}
+				}
+				if (result >= 0)
+				{
+					run(r.data(), lanes);
+				}
+				uint8_t* dst = (uint8_t*)out + (ptrdiff_t)base * outStride;
+				for (int j = 0; j < lanes; ++j)
+				{
+					*(double*)(dst + j * outStride) = result >= 0 ? r[result * BatchLanes + j] : 0.0;
+				}
+			}
+		}
+
+		// Builds register code into `out` and returns the number of registers. Stack slots are mapped to registers by
+		// depth. Constants and variables stay on the simulated stack until an instruction consumes them, so they become
+		// its operands, operations on constants only are folded, and a product followed by an add is fused.
+		// For a batch, variables in `batch` live in registers 0..batchCount - 1 and the stack starts after them, the other
+		// variables are read now and become constants. How these constants are computed is recorded in `uniforms`.
+		int TranslateTo(std::vector<RegisterInstruction>& out, const BatchVar* batch, int batchCount,
+			BatchCode* uniforms) const
+		{
+			struct Slot
+			{
+				char kind;
+				double k;
+				const double* v;
+				int reg;
+				// Uniform of a constant computed from variables, -1 for other constants
+				int u;
+			};
+			std::vector<Slot> slots;
+			out.clear();
+			const int base = batchCount;
+			int count = batchCount;
+
+			auto emit = [&](RegisterInstruction ins)
+			{
+				count = std::max(count, (int)ins.dst + 1);
+				out.push_back(ins);
+			};
+			auto uniform = [&](uint8_t op, double k, const double* v, int lhs, int rhs)
+			{
+				Uniform u = { op, k, v, lhs, rhs };
+				uniforms->uniforms.push_back(u);
+				return (int)uniforms->uniforms.size() - 1;
+			};
+			// Uniform of a constant operand, made for literals combined with uniforms
+			auto operand = [&](const Slot& s)
+			{
+				return s.u >= 0 ? s.u : uniform(PushConstToStack, s.k, nullptr, -1, -1);
+			};
+			// Records that operand x or z of the last instruction is constant `s`
+			auto use = [&](const Slot& s, bool addend)
+			{
+				if (s.kind == 'K' && s.u >= 0)
+				{
+					UniformUse u = { (int)out.size() - 1, s.u, addend };
+					uniforms->uses.push_back(u);
+				}
+			};
+			auto materialize = [&](int i)
+			{
+				Slot& s = slots[i];
+				if (s.kind == 'R' && s.reg == base + i)
+				{
+					return;
+				}
+				RegisterInstruction ins = {};
+				ins.dst = (uint8_t)(base + i);
+				if (s.kind == 'R')
+				{
+					ins.op = OpMove;
+					ins.a = (uint8_t)s.reg;
+				}
+				else if (s.kind == 'K')
+				{
+					ins.op = OpConst;
+					ins.x.k = s.k;
+				}
+				else
+				{
+					ins.op = OpLoad;
+					ins.x.v = s.v;
+				}
+				emit(ins);
+				use(s, false);
+				s.kind = 'R';
+				s.reg = base + i;
+			};
+			int p = 0;
+			while (p < size)
+			{
+				auto opcode = ReadAt<uint8_t>(p);
+				if (base + (int)slots.size() >= MaxRegisters)
+				{
+					printf("Error: Expression is too deep\n");
+					out.clear();
+					return 0;
+				}
+				int top = base + (int)slots.size();
+				switch (opcode)
+				{
+					case PushConstToStack:
+					{
+						Slot s = { 'K', ReadAt<double>(p), nullptr, top, -1 };
+						slots.push_back(s);
+						break;
+					}
+					case LoadVar:
+					{
+						Slot s = { 'V', 0.0, ReadAt<const double*>(p), top, -1 };
+						if (batch != nullptr)
+						{
+							const BatchVar* it = std::find_if(batch, batch + batchCount, [&s](const BatchVar& b)
+							{
+								return b.var == s.v;
+							});
+							if (it != batch + batchCount)
+							{
+								s.kind = 'R';
+								s.reg = (int)(it - batch);
+							}
+							else
+							{
+								s.kind = 'K';
+								s.k = *s.v;
+								s.u = uniform(LoadVar, 0.0, s.v, -1, -1);
+							}
+						}
+						slots.push_back(s);
+						break;
+					}
+					case InvokeInstruction:
+					{
+						RegisterInstruction ins = {};
+						ins.op = OpCall;
+						ins.x.p = ReadAt<const void*>(p);
+						ins.y.w = ReadAt<void (*)(Stack*, const void*)>(p);
+						ins.b = ReadAt<uint8_t>(p);
+						int first = (int)slots.size() - ins.b;
+						for (int i = first; i < (int)slots.size(); ++i)
+						{
+							materialize(i);
+						}
+						ins.dst = ins.a = (uint8_t)(base + first);
+						emit(ins);
+						slots.resize(first);
+						Slot s = { 'R', 0.0, nullptr, base + first, -1 };
+						slots.push_back(s);
+						break;
+					}
+					case AddInstruction:
+					case SubInstruction:
+					case MulInstruction:
+					case DivInstruction:
+					{
+						Slot rhs = slots.back();
+						slots.pop_back();
+						Slot lhs = slots.back();
+						int dst = top - 2;
+						if (lhs.kind == 'K' && rhs.kind == 'K')
+						{
+							slots.back().k = Fold(opcode, lhs.k, rhs.k);
+							if (lhs.u >= 0 || rhs.u >= 0)
+							{
+								slots.back().u = uniform(opcode, 0.0, nullptr, operand(lhs), operand(rhs));
+							}
+							break;
+						}
+						slots.back().kind = 'R';
+						slots.back().reg = dst;
+						if (opcode == AddInstruction && Fuse(out, dst, lhs, rhs))
+						{
+							// The product was the last instruction
+							use(lhs.kind == 'R' ? rhs : lhs, true);
+							break;
+						}
+						emit(MakeBinary(opcode, dst, lhs, rhs));
+						// Only one operand is a constant, it is x
+						use(lhs, false);
+						use(rhs, false);
+						break;
+					}
+					case UnaryMinusInstruction:
+					{
+						Slot& s = slots.back();
+						if (s.kind == 'K')
+						{
+							s.k = -s.k;
+							if (s.u >= 0)
+							{
+								s.u = uniform(UnaryMinusInstruction, 0.0, nullptr, s.u, -1);
+							}
+							break;
+						}
+						int i = (int)slots.size() - 1;
+						if (s.kind == 'V')
+						{
+							materialize(i);
+						}
+						RegisterInstruction ins = {};
+						ins.op = OpNeg;
+						ins.dst = (uint8_t)(base + i);
+						ins.a = (uint8_t)s.reg;
+						emit(ins);
+						s.reg = base + i;
+						break;
+					}
+					default:
+					{
+						break;
+					}
+				}
+			}
+
+			if (slots.empty())
+			{
+				return 0;
+			}
+			int result = (int)slots.size() - 1;
+			if (slots[result].kind != 'R')
+			{
+				materialize(result);
+			}
+			RegisterInstruction ins = {};
+			ins.op = OpRet;
+			ins.a = (uint8_t)slots[result].reg;
+			out.push_back(ins);
+			return count;
+		}
+
 		mutable int pointer;
 		uint16_t idc;
 
 		std::map<std::string, uint16_t> symbols;
-		std::vector<std::pair<uint16_t, uint16_t> > relocations;
+		// Symbol and offset of each reference, the offset of the pointer once linked
+		std::vector<std::pair<uint16_t, int> > relocations;
 		int size;
+		int capacity;
 		uint8_t* data;
 		Stack* stack;
+		bool linked;
+		// Set by Link if the expression calls other programs
+		bool callsPrograms;
+
+		std::vector<RegisterInstruction> code;
+		int registers;
+		mutable BatchCode batchCode;
+
+	private:
+		template<typename T>
+		T ReadAt(int& p) const
+		{
+			T val = *reinterpret_cast<const T*>(data + p);
+			p += sizeof(T);
+			return val;
+		}
+
+		static double Fold(uint8_t op, double lhs, double rhs)
+		{
+			switch (op)
+			{
+				case AddInstruction: return lhs + rhs;
+				case SubInstruction: return lhs - rhs;
+				case MulInstruction: return lhs * rhs;
+				default: return lhs / rhs;
+			}
+		}
+
+		template<typename S>
+		static RegisterInstruction MakeBinary(uint8_t opcode, int dst, const S& lhs, const S& rhs)
+		{
+			static const uint8_t forms[3][3] = {
+				// rhs: R, K, V
+				{ FormRR, FormRK, FormRV }, // lhs R
+				{ FormKR, 0, FormKV }, // lhs K
+				{ FormVR, FormVK, FormVV }, // lhs V
+			};
+			auto index = [](char kind) { return kind == 'R' ? 0 : (kind == 'K' ? 1 : 2); };
+			static const uint8_t first[] = { 0, 0, 0, 0, OpAddRR, OpSubRR, OpMulRR, OpDivRR };
+
+			RegisterInstruction ins = {};
+			ins.op = first[opcode] + forms[index(lhs.kind)][index(rhs.kind)];
+			ins.dst = (uint8_t)dst;
+			// Register operands go to a, b and the rest to x, y, keeping the order of the operands
+			uint8_t* reg = &ins.a;
+			RegisterInstruction::Operand* imm = &ins.x;
+			for (const S* s: { &lhs, &rhs })
+			{
+				if (s->kind == 'R')
+				{
+					*reg++ = (uint8_t)s->reg;
+				}
+				else if (s->kind == 'K')
+				{
+					(imm++)->k = s->k;
+				}
+				else
+				{
+					(imm++)->v = s->v;
+				}
+			}
+			return ins;
+		}
+
+		// Replaces the last instruction with a multiply-add if it is a product consumed by the add into `dst`
+		template<typename S>
+		static bool Fuse(std::vector<RegisterInstruction>& code, int dst, const S& lhs, const S& rhs)
+		{
+			int lhsReg = lhs.kind == 'R' ? lhs.reg : -1;
+			int rhsReg = rhs.kind == 'R' ? rhs.reg : -1;
+			if (code.empty())
+			{
+				return false;
+			}
+			RegisterInstruction& p = code.back();
+			if (p.op < OpMulRR || p.op > OpMulVV)
+			{
+				return false;
+			}
+			int product = p.dst == lhsReg ? lhsReg : (p.dst == rhsReg ? rhsReg : -1);
+			if (product < 0)
+			{
+				return false;
+			}
+			const S& addend = product == lhsReg ? rhs : lhs;
+			int addendReg = product == lhsReg ? rhsReg : lhsReg;
+
+			// Products are commutative, forms with the constant or the variable first are flipped
+			uint8_t first;
+			switch (p.op - OpMulRR)
+			{
+				case FormRR: first = OpMulAddRRR; break;
+				case FormRK: case FormKR: first = OpMulAddRKR; break;
+				case FormRV: case FormVR: first = OpMulAddRVR; break;
+				case FormVK: first = OpMulAddVKR; break;
+				case FormKV: first = OpMulAddVKR; std::swap(p.x, p.y); break;
+				default: first = OpMulAddVVR; break;
+			}
+			p.op = first + (addend.kind == 'R' ? 0 : (addend.kind == 'K' ? 1 : 2));
+			p.dst = (uint8_t)dst;
+			if (addend.kind == 'R')
+			{
+				p.c = (uint8_t)addendReg;
+			}
+			else if (addend.kind == 'K')
+			{
+				p.z.k = addend.k;
+			}
+			else
+			{
+				p.z.v = addend.v;
+			}
+			return true;
+		}
 	};
 }
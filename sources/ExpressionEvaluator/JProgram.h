@@ -1,410 +1,607 @@
 #pragma once
 #include <unistd.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <iostream>
 #include <list>
+#include <memory>
+#include "InterpretedProgram.h"
 
 namespace ExpessionEvaluator
 {
-	void hexDump(char *desc, void *addr, int len)
+	namespace detail
 	{
-		int i;
-		unsigned char buff[17];
-		unsigned char *pc = (unsigned char*)addr;
+		inline bool HasAVX()
+		{
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+			static const bool avx = __builtin_cpu_supports("avx");
+			return avx;
+#else
+			return false;
+#endif
+		}
 
-		// Output description if given.
-		if (desc != NULL)
-			printf ("%s:\n", desc);
+		// Pages for generated code, writable until made executable. Pages are never writable and executable at once.
+		inline uint8_t* AllocateCode(size_t size, size_t& mapped)
+		{
+			size_t page = sysconf(_SC_PAGE_SIZE);
+			mapped = std::max<size_t>((size + page - 1) / page * page, page);
+			void* mem = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			return mem == MAP_FAILED ? nullptr : (uint8_t*)mem;
+		}
 
-		// Process every byte in the data.
-		for (i = 0; i < len; i++) {
-			// Multiple of 16 means new line (with line offset).
+		inline bool ProtectCode(uint8_t* mem, size_t mapped, bool executable)
+		{
+			return mprotect(mem, mapped, executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE) == 0;
+		}
 
-			if ((i % 16) == 0) {
-				// Just don't print ASCII for the zeroth line.
-				if (i != 0)
-					printf("  %s\n", buff);
+		// Machine code for register code built for a batch: each instruction is a loop over the lanes of its registers
+		// with packed AVX arithmetic, 4 doubles per instruction. Registers are kept in memory, constants are read from
+		// a table passed with the registers, so a kernel is reused while the same variables are batched.
+		class BatchKernel
+		{
+		public:
+			enum
+			{
+				Lanes = InterpretedProgram::BatchLanes,
+				RegisterBytes = Lanes * sizeof(double)
+			};
+
+			BatchKernel(const BatchKernel&) = delete;
+			BatchKernel& operator=(const BatchKernel&) = delete;
 
-				// Output the offset.
-				printf("  %04x ", i);
+			~BatchKernel()
+			{
+				if (m_mem != nullptr)
+				{
+					munmap(m_mem, m_memSize);
+				}
 			}
 
-			// Now the hex code for the specific character.
-			printf(" %02x", pc[i]);
+			// Returns nullptr for code the kernel doesn't support, which is then run by the interpreter
+			static std::shared_ptr<BatchKernel> Build(const std::vector<RegisterInstruction>& code, Stack* stack)
+			{
+				std::shared_ptr<BatchKernel> kernel(new BatchKernel());
+				if (!kernel->Emit(code, stack))
+				{
+					return nullptr;
+				}
+				return kernel;
+			}
 
-			// And store a printable ASCII character for later.
-			if ((pc[i] < 0x20) || (pc[i] > 0x7e)) {
-				buff[i % 16] = '.';
-			} else {
-				buff[i % 16] = pc[i];
+			// Constants of `code` in the order the kernel reads them, `code` is the code the kernel was built from
+			const double* GetConstants(const std::vector<RegisterInstruction>& code)
+			{
+				m_table.resize(m_constants.size() + 1);
+				m_table[0] = -0.0;
+				for (size_t i = 0; i < m_constants.size(); ++i)
+				{
+					m_table[i + 1] = (code[m_constants[i].first].*m_constants[i].second).k;
+				}
+				return m_table.data();
 			}
 
-			buff[(i % 16) + 1] = '\0';
-		}
+			void Run(double* r, const double* constants, int lanes)
+			{
+				m_lanes = lanes;
+				m_entry(r, constants);
+			}
 
-		// Pad out last line if not exactly 16 characters.
-		while ((i % 16) != 0) {
-			printf("   ");
-			i++;
-		}
+			std::vector<const double*> vars;
 
-		// And print the final ASCII bit.
-		printf("  %s\n", buff);
-	}
+		private:
+			typedef RegisterInstruction::Operand RegisterInstruction::*Field;
 
-	struct JitProgram
-	{
-		JitProgram(): pointer(0), idc(0), size(0)
-		{
-			size_t page_size_multiple = sysconf(_SC_PAGE_SIZE);
-			mem = (uint8_t*) mmap(NULL, page_size_multiple * 8, PROT_READ | PROT_WRITE | PROT_EXEC,
-			                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-			if (mem == MAP_FAILED)
+			struct Call
 			{
-				std::cerr << "Can't allocate memory\n";
-				std::exit(1);
+				RegisterInstruction ins;
+				Stack* stack;
+				const int* lanes;
+			};
+
+			BatchKernel(): m_mem(nullptr), m_memSize(0), m_lanes(0), m_entry(nullptr)
+			{}
+
+			static void CallLanes(const Call* call, double* r)
+			{
+				detail::CallLanes(call->ins, call->stack, r, Lanes, *call->lanes);
 			}
-			pointer = 0;
-		}
 
-		enum IC: uint64_t
-		{
-			ic_movabs_rax,
-			ic_mov_mrax_xmm,
-			ic_mov_rax_xmm,
-			ic_mov_xmm_rax,
-			ic_add_xmm1_xmm0,
-			ic_sub_xmm1_xmm0,
-			ic_mul_xmm1_xmm0,
-			ic_div_xmm1_xmm0,
-			ic_pxor_xmm1_xmm0,
-			ic_push_rax,
-			ic_pop_rax,
-			ic_push_mrax,
-			ic_call_rax,
-			ic_ret,
-			ic_address,
-			ic_im_value,
-		};
+			template<typename T>
+			void Write(T val)
+			{
+				const uint8_t* p = reinterpret_cast<const uint8_t*>(&val);
+				m_code.insert(m_code.end(), p, p + sizeof(T));
+			}
 
-		void PrintIntermidiate()
-		{
-			auto it = m_intermidiate_code.begin();
-			while (it != m_intermidiate_code.end())
+			// VEX.256.66 prefix and opcode, `map` 1 is 0F, 2 is 0F38
+			void Vex(uint8_t map, uint8_t opcode, int vvvv)
 			{
-				uint64_t op = *it;
-				switch(op)
-				{
-					case ic_movabs_rax: printf("ic_movabs_rax\n"); break;
-					case ic_im_value: printf("ic_im_value\n"); ++it; break;
-					case ic_address: printf("ic_address\n"); ++it; break;
-					case ic_mov_mrax_xmm: printf("ic_mov_mrax_xmm %d\n", (int)*++it);break;
-					case ic_mov_rax_xmm: printf("ic_mov_rax_xmm %d\n", (int)*++it);break;
-					case ic_mov_xmm_rax: printf("ic_mov_xmm_rax %d\n", (int)*++it);break;
-					case ic_add_xmm1_xmm0: printf("ic_add_xmm1_xmm0\n"); break;
-					case ic_sub_xmm1_xmm0: printf("ic_sub_xmm1_xmm0\n"); break;
-					case ic_mul_xmm1_xmm0: printf("ic_mul_xmm1_xmm0\n"); break;
-					case ic_div_xmm1_xmm0: printf("ic_div_xmm1_xmm0\n"); break;
-					case ic_pxor_xmm1_xmm0: printf("ic_pxor_xmm1_xmm0\n"); break;
-					case ic_push_rax: printf("ic_push_rax\n"); break;
-					case ic_pop_rax: printf("ic_pop_rax\n"); break;
-					case ic_push_mrax: printf("ic_push_mrax\n"); break;
-					case ic_call_rax: printf("ic_call_rax\n"); break;
-					case ic_ret: printf("ic_ret\n"); break;
-					default: printf("ERROR\n"); break;
-				}
-				++it;
+				Write((uint8_t)0xc4);
+				Write((uint8_t)(0xe0 | map));
+				Write((uint8_t)(((~vvvv & 0xf) << 3) | 0x05));
+				Write(opcode);
 			}
-		}
 
-		void Translate()
-		{
-			Optimize();
-			auto it = m_intermidiate_code.begin();
-			while (it != m_intermidiate_code.end())
+			// ymm`reg` with register `r` of the current lanes, [rdi + rcx + r * RegisterBytes]
+			void LaneOperand(int reg, int r)
 			{
-				uint64_t op = *it;
-				switch(op)
-				{
-					case ic_movabs_rax:
-					{
-						Write((uint16_t) 0xb848);
-						break;
-					}
-					case ic_im_value:
-					{
-						++it;
-						uint64_t x = *it;
-						Write(x);
-						break;
-					}
-					case ic_address:
-					{
-						relocations_pointer.push_back(pointer);
-						++it;
-						uint64_t x = *it;
-						Write(x);
-						break;
-					}
-					case ic_mov_mrax_xmm:
-						{
-							++it;
-							uint8_t x = *it;
-							Write((uint32_t) (0x00100ff2 + 0x08000000 * x));
-						}
-						break;
-					case ic_mov_rax_xmm:
-						{
-							++it;
-							uint8_t x = *it;
-							Write((uint32_t) 0x6e0f4866);
-							Write((uint8_t) (0xc0 + 8 * x));
-						}
-						break;
-					case ic_mov_xmm_rax:
-						{
-							++it;
-							uint8_t x = *it;
-							Write((uint32_t) 0x7e0f4866);
-							Write((uint8_t) (0xc0 + 8 * x));
-						}
-						break;
-					case ic_add_xmm1_xmm0:
-						Write((uint32_t) 0xc1580ff2);
-						break;
-					case ic_sub_xmm1_xmm0:
-						Write((uint32_t) 0xc15c0ff2);
-						break;
-					case ic_mul_xmm1_xmm0:
-						Write((uint32_t) 0xc1590ff2);
-						break;
-					case ic_div_xmm1_xmm0:
-						Write((uint32_t) 0xc15e0ff2);
-						break;
-					case ic_pxor_xmm1_xmm0:
-						Write((uint32_t) 0xc1ef0f66);
-						break;
-					case ic_push_rax:
-						Write((uint8_t) 0x50);
-						break;
-					case ic_pop_rax:
-						Write((uint8_t) 0x58);
-						break;
-					case ic_push_mrax:
-						Write((uint16_t) 0x30ff);
-						break;
-					case ic_call_rax:
-						Write((uint16_t) 0xd0ff);
-						break;
-					case ic_ret:
-						Write((uint8_t) 0xc3);
-						break;
-					default:
-						assert(op != 0);
-						break;
-				}
-				++it;
+				Write((uint8_t)(0x84 | reg << 3));
+				Write((uint8_t)0x0f);
+				Write((int32_t)(r * RegisterBytes));
 			}
-			m_intermidiate_code.clear();
-			Eval = ((double (*)()) mem);
-		}
 
-		void Optimize()
-		{
-			//printf("Before:\n");
-			//PrintIntermidiate();
-			//printf("\n");
-			std::list<uint64_t> current_code;
-			std::list<uint64_t> optimized_code;
+			void LoadLanes(int ymm, int r)
+			{
+				Vex(1, 0x10, 0);
+				LaneOperand(ymm, r);
+			}
+
+			void StoreLanes(int r, int ymm)
+			{
+				Vex(1, 0x11, 0);
+				LaneOperand(ymm, r);
+			}
+
+			// ymm`dst` = ymm`lhs` op register `r`
+			void OpLanes(uint8_t opcode, int dst, int lhs, int r)
+			{
+				Vex(1, opcode, lhs);
+				LaneOperand(dst, r);
+			}
 
-			current_code = m_intermidiate_code;
+			// ymm`dst` = ymm`lhs` op ymm`rhs`
+			void OpRegisters(uint8_t opcode, int dst, int lhs, int rhs)
+			{
+				Vex(1, opcode, lhs);
+				Write((uint8_t)(0xc0 | dst << 3 | rhs));
+			}
 
-			for (int pass = 0; pass < 100; ++pass)
+			// Broadcasts constant `index` of the table in rsi
+			void Broadcast(int ymm, int index)
 			{
-				auto it = current_code.begin();
-				auto backup = it;
+				Vex(2, 0x19, 0);
+				Write((uint8_t)(0x86 | ymm << 3));
+				Write((int32_t)(index * sizeof(double)));
+			}
 
-				auto accept = [](uint64_t ic, std::list<uint64_t>::iterator& it)
+			int Constant(int instruction, Field field)
+			{
+				m_constants.push_back(std::make_pair(instruction, field));
+				return (int)m_constants.size();
+			}
+
+			// for (rcx = 0; rcx < RegisterBytes; rcx += 32), returns the start of the body
+			size_t BeginLoop()
+			{
+				Write((uint16_t)0xc931);
+				return m_code.size();
+			}
+
+			void EndLoop(size_t body)
+			{
+				Write((uint32_t)0x20c18348);
+				Write((uint8_t)0x48);
+				Write((uint16_t)0xf981);
+				Write((int32_t)RegisterBytes);
+				Write((uint16_t)0x850f);
+				Write((int32_t)((ptrdiff_t)body - (ptrdiff_t)(m_code.size() + sizeof(int32_t))));
+			}
+
+			bool Emit(const std::vector<RegisterInstruction>& code, Stack* stack)
+			{
+				enum: uint8_t
 				{
-					if (*it == ic)
-					{
-						++it;
-						return true;
-					}
-					return false;
+					vxorpd = 0x57,
+					vaddpd = 0x58,
+					vmulpd = 0x59,
+					vsubpd = 0x5c,
+					vdivpd = 0x5e
 				};
-				while (it != current_code.end())
+				static const uint8_t ops[] = { vaddpd, vsubpd, vmulpd, vdivpd };
+
+				// Pointers to calls have to stay valid
+				m_calls.reserve(code.size());
+
+				// push rbx; push r12; sub rsp, 8; mov rbx, rdi; mov r12, rsi
+				Write((uint8_t)0x53);
+				Write((uint16_t)0x5441);
+				Write((uint32_t)0x08ec8348);
+				Write((uint16_t)0x8948);
+				Write((uint8_t)0xfb);
+				Write((uint16_t)0x8949);
+				Write((uint8_t)0xf4);
+
+				for (int i = 0; i < (int)code.size(); ++i)
 				{
-					if (accept(ic_push_rax, it))
+					const RegisterInstruction& ins = code[i];
+					int form = ins.op >= OpAddRR && ins.op <= OpDivVV ? (ins.op - OpAddRR) % 8 : -1;
+					uint8_t op = form >= 0 ? ops[(ins.op - OpAddRR) / 8] : 0;
+					size_t body;
+					switch (ins.op)
 					{
-						if (accept(ic_pop_rax, it))
+						case OpConst:
+							Broadcast(1, Constant(i, &RegisterInstruction::x));
+							body = BeginLoop();
+							StoreLanes(ins.dst, 1);
+							break;
+						case OpMove:
+							body = BeginLoop();
+							LoadLanes(0, ins.a);
+							StoreLanes(ins.dst, 0);
+							break;
+						case OpNeg:
+							Broadcast(1, 0);
+							body = BeginLoop();
+							OpLanes(vxorpd, 0, 1, ins.a);
+							StoreLanes(ins.dst, 0);
+							break;
+						case OpCall:
 						{
+							Call call = { ins, stack, &m_lanes };
+							m_calls.push_back(call);
+							// mov rdi, call; mov rsi, rbx; mov rax, CallLanes; vzeroupper; call rax; mov rdi, rbx; mov rsi, r12
+							Write((uint16_t)0xbf48);
+							Write((uint64_t)&m_calls.back());
+							Write((uint16_t)0x8948);
+							Write((uint8_t)0xde);
+							Write((uint16_t)0xb848);
+							Write((uint64_t)&BatchKernel::CallLanes);
+							Write((uint16_t)0xf8c5);
+							Write((uint8_t)0x77);
+							Write((uint16_t)0xd0ff);
+							Write((uint16_t)0x8948);
+							Write((uint8_t)0xdf);
+							Write((uint16_t)0x894c);
+							Write((uint8_t)0xe6);
 							continue;
 						}
-						optimized_code.push_back(ic_push_rax);
-					}
-					else if (accept(ic_mov_xmm_rax, it))
-					{
-						uint64_t a = *it;
-						uint64_t b;
-						++it;
-						bool append_rax_xmm = false;
-						if (accept(ic_mov_rax_xmm, it))
+						case OpRet:
+							// vzeroupper; add rsp, 8; pop r12; pop rbx; ret
+							Write((uint16_t)0xf8c5);
+							Write((uint8_t)0x77);
+							Write((uint32_t)0x08c48348);
+							Write((uint16_t)0x5c41);
+							Write((uint16_t)0xc35b);
+							Finish();
+							return m_entry != nullptr;
+						case OpMulAddRRR:
+						case OpMulAddRRK:
+						case OpMulAddRKR:
+						case OpMulAddRKK:
 						{
-							b = *it;
-							++it;
-							if (a == b)
+							bool k = ins.op == OpMulAddRKR || ins.op == OpMulAddRKK;
+							bool addendK = ins.op == OpMulAddRRK || ins.op == OpMulAddRKK;
+							if (k)
+							{
+								Broadcast(1, Constant(i, &RegisterInstruction::x));
+							}
+							if (addendK)
+							{
+								Broadcast(2, Constant(i, &RegisterInstruction::z));
+							}
+							body = BeginLoop();
+							LoadLanes(0, ins.a);
+							if (k)
 							{
-								continue;
+								OpRegisters(vmulpd, 0, 0, 1);
 							}
 							else
 							{
-								append_rax_xmm = true;
+								OpLanes(vmulpd, 0, 0, ins.b);
 							}
+							if (addendK)
+							{
+								OpRegisters(vaddpd, 0, 0, 2);
+							}
+							else
+							{
+								OpLanes(vaddpd, 0, 0, ins.c);
+							}
+							StoreLanes(ins.dst, 0);
+							break;
 						}
-						optimized_code.push_back(ic_mov_xmm_rax);
-						optimized_code.push_back(a);
-						if (append_rax_xmm)
-						{
-							optimized_code.push_back(ic_mov_rax_xmm);
-							optimized_code.push_back(b);
-						}
-					}
-					else
-					{
-						optimized_code.push_back(*it);
-						++it;
+						default:
+							if (form == FormRR)
+							{
+								body = BeginLoop();
+								LoadLanes(0, ins.a);
+								OpLanes(op, 0, 0, ins.b);
+							}
+							else if (form == FormRK)
+							{
+								Broadcast(1, Constant(i, &RegisterInstruction::x));
+								body = BeginLoop();
+								LoadLanes(0, ins.a);
+								OpRegisters(op, 0, 0, 1);
+							}
+							else if (form == FormKR)
+							{
+								Broadcast(1, Constant(i, &RegisterInstruction::x));
+								body = BeginLoop();
+								OpLanes(op, 0, 1, ins.a);
+							}
+							else
+							{
+								// Variables are registers or constants in a batch
+								return false;
+							}
+							StoreLanes(ins.dst, 0);
+							break;
 					}
+					EndLoop(body);
 				}
-
-				current_code = optimized_code;
-				optimized_code.clear();
+				return false;
 			}
 
-			printf("Reduced by %d\n",(int)(m_intermidiate_code.size() - current_code.size()));
-			m_intermidiate_code = current_code;
-			//printf("After:\n");
-			PrintIntermidiate();
-			//printf("\n");
-		}
+			void Finish()
+			{
+				m_mem = AllocateCode(m_code.size(), m_memSize);
+				if (m_mem == nullptr)
+				{
+					return;
+				}
+				memcpy(m_mem, m_code.data(), m_code.size());
+				if (!ProtectCode(m_mem, m_memSize, true))
+				{
+					munmap(m_mem, m_memSize);
+					m_mem = nullptr;
+					return;
+				}
+				m_entry = (void (*)(double*, const double*))m_mem;
+				m_code.clear();
+			}
 
-		std::list<uint64_t> m_intermidiate_code;
+			std::vector<uint8_t> m_code;
+			// Instruction and operand of each constant, table entry 0 is the sign mask
+			std::vector<std::pair<int, Field> > m_constants;
+			std::vector<double> m_table;
+			std::vector<Call> m_calls;
+			uint8_t* m_mem;
+			size_t m_memSize;
+			int m_lanes;
+			void (*m_entry)(double* r, const double* constants);
+		};
+	}
 
-		template<typename T>
-		void Write(T val)
+	// Machine code of an expression. Values of the expression tree are kept in xmm registers, a value at depth d of
+	// the tree is in xmm`d`. Constants and variables are used as memory operands where an instruction allows it,
+	// registers are spilled to the frame only around calls and when the tree is deeper than the registers.
+	struct JitProgram
+	{
+		enum
 		{
-			*reinterpret_cast<T*>(mem + pointer) = val;
-			pointer += sizeof(T);
-		}
+			// xmm0..xmm13 hold values, xmm14 and xmm15 are scratch
+			ValueRegisters = 14,
+			Scratch = 15,
+			// Arguments of calls are passed in xmm0..xmm7
+			MaxArguments = 8,
+			// Changed with the code the generator emits, saved code of another version isn't used
+			CodegenVersion = 1
+		};
 
-		template<typename T>
-		void write_v64b(T val)
+		// SSE2 instructions, the mandatory prefix is in the high byte and the opcode after 0F in the low byte
+		enum Instruction: uint16_t
 		{
-			uint64_t x = *reinterpret_cast<uint64_t* >(&val);
-			m_intermidiate_code.push_back(ic_im_value);
-			m_intermidiate_code.push_back(x);
-		}
+			movsd_load = 0xf210,
+			movsd_store = 0xf211,
+			sqrtsd = 0xf251,
+			addsd = 0xf258,
+			mulsd = 0xf259,
+			subsd = 0xf25c,
+			minsd = 0xf25d,
+			divsd = 0xf25e,
+			maxsd = 0xf25f,
+			cmpsd = 0xf2c2,
+			cvtsi2sd = 0xf22a,
+			cvttsd2si = 0xf22c,
+			movapd = 0x6628,
+			andpd = 0x6654,
+			andnpd = 0x6655,
+			orpd = 0x6656,
+			xorpd = 0x6657
+		};
 
-		template<typename T>
-		void write_m64b(T val)
+		// Predicates of cmpsd
+		enum Compare: uint8_t
 		{
-			uint64_t x = *reinterpret_cast<uint64_t*>(&val);
-			m_intermidiate_code.push_back(ic_address);
-			m_intermidiate_code.push_back(x);
-		}
+			CompareEQ = 0,
+			CompareLT = 1
+		};
 
-		void movabs_rax()
+		// Eval of programs that are not linked yet or failed to compile or link
+		static double Zero()
 		{
-			m_intermidiate_code.push_back(ic_movabs_rax);
+			return 0.0;
 		}
 
-		void mov_mrax_xmm(uint8_t x)
+		JitProgram(): Eval(&Zero), pointer(0), idc(0), size(0), mem(nullptr), mapped_size(0), m_slots(0), m_calls(false)
+		{}
+
+		// xmm`dst` = xmm`dst` op xmm`src`
+		void Op(Instruction ins, int dst, int src)
 		{
-			m_intermidiate_code.push_back(ic_mov_mrax_xmm);
-			m_intermidiate_code.push_back(x);
+			Sse(ins, dst, src, 3);
 		}
 
-		void mov_rax_xmm(uint8_t x)
+		// cmpsd xmm`dst`, xmm`src`, predicate: all bits of xmm`dst` are set if the predicate holds
+		void Cmp(Compare predicate, int dst, int src)
 		{
-			m_intermidiate_code.push_back(ic_mov_rax_xmm);
-			m_intermidiate_code.push_back(x);
+			Op(cmpsd, dst, src);
+			Write((uint8_t)predicate);
 		}
 
-		void mov_xmm_rax(uint8_t x)
+		// xmm`dst` = xmm`dst` op constant `k`
+		void OpConst(Instruction ins, int dst, double k)
 		{
-			m_intermidiate_code.push_back(ic_mov_xmm_rax);
-			m_intermidiate_code.push_back(x);
+			Sse(ins, dst, 5, 0);
+			m_constantFixups.push_back(std::make_pair((int)code.size(), ConstantIndex(k)));
+			Write((int32_t)0);
 		}
 
-		void add_xmm1_xmm0()
+		// xmm`dst` = xmm`dst` op variable `symbol`
+		void OpVar(Instruction ins, int dst, uint16_t symbol)
 		{
-			m_intermidiate_code.push_back(ic_add_xmm1_xmm0);
+			MovabsRax(symbol);
+			Sse(ins, dst, 0, 0);
 		}
 
-		void sub_xmm1_xmm0()
+		void LoadConst(int dst, double k)
 		{
-			m_intermidiate_code.push_back(ic_sub_xmm1_xmm0);
+			OpConst(movsd_load, dst, k);
 		}
 
-		void mul_xmm1_xmm0()
+		void LoadVar(int dst, uint16_t symbol)
 		{
-			m_intermidiate_code.push_back(ic_mul_xmm1_xmm0);
+			OpVar(movsd_load, dst, symbol);
 		}
 
-		void div_xmm1_xmm0()
+		// Frame slots, addressed from rbp
+		void Store(int slot, int src)
 		{
-			m_intermidiate_code.push_back(ic_div_xmm1_xmm0);
+			m_slots = std::max(m_slots, slot + 1);
+			Sse(movsd_store, src, 5, 2);
+			Write((int32_t)(-8 * (slot + 1)));
 		}
 
-		void pxor_xmm1_xmm0()
+		void Load(int dst, int slot)
 		{
-			m_intermidiate_code.push_back(ic_pxor_xmm1_xmm0);
+			Sse(movsd_load, dst, 5, 2);
+			Write((int32_t)(-8 * (slot + 1)));
 		}
 
-		void neg_xmm0()
+		// xmm`x` = (int)xmm`x`, truncating like a C++ cast
+		void Truncate(int x)
 		{
-			movabs_rax();
-			write_v64b(0x8000000000000000ULL);
-			mov_rax_xmm(1);
-			pxor_xmm1_xmm0();
+			// cvttsd2si eax, xmm; cvtsi2sd xmm, eax
+			Sse(cvttsd2si, 0, x, 3);
+			Sse(cvtsi2sd, x, 0, 3);
 		}
 
-		void push_rax()
+		// Calls function `symbol` with arguments in xmm0..xmm7, the result is in xmm0 and the other registers are lost
+		void Call(uint16_t symbol)
 		{
-			m_intermidiate_code.push_back(ic_push_rax);
+			m_calls = true;
+			MovabsRax(symbol);
+			Write((uint16_t)0xd0ff);
 		}
 
-		void pop_rax()
+		// Returns xmm0, has to be the last instruction
+		void Ret()
 		{
-			m_intermidiate_code.push_back(ic_pop_rax);
+			if (HasFrame())
+			{
+				// leave
+				Write((uint8_t)0xc9);
+			}
+			Write((uint8_t)0xc3);
 		}
 
-		void push_mrax()
+		// Lays out the prologue, the code and the constants into pages of their own and makes them executable
+		void Translate()
 		{
-			m_intermidiate_code.push_back(ic_push_mrax);
+			std::vector<uint8_t> body;
+			body.swap(code);
+			if (HasFrame())
+			{
+				// push rbp; mov rbp, rsp; sub rsp, frame. Keeps rsp 16-byte aligned for calls.
+				Write((uint8_t)0x55);
+				Write((uint16_t)0x8948);
+				Write((uint8_t)0xe5);
+				Write((uint16_t)0x8148);
+				Write((uint8_t)0xec);
+				Write((int32_t)((m_slots * 8 + 15) / 16 * 16));
+			}
+			int prologue = (int)code.size();
+			code.insert(code.end(), body.begin(), body.end());
+			while (code.size() % sizeof(double) != 0)
+			{
+				// int3
+				Write((uint8_t)0xcc);
+			}
+			int pool = (int)code.size();
+			for (double k: m_constants)
+			{
+				Write(k);
+			}
 
-		}
+			for (auto& f: m_constantFixups)
+			{
+				int disp = prologue + f.first;
+				*(int32_t*)(code.data() + disp) = pool + f.second * (int)sizeof(double) - (disp + (int)sizeof(int32_t));
+			}
+			for (auto& r: relocations_pointer)
+			{
+				r += prologue;
+			}
 
-		void push_xmm(uint8_t x)
-		{
-			mov_xmm_rax(x);
-			push_rax();
+			Map(code.data(), (int)code.size());
+			code.clear();
+			m_constants.clear();
+			m_constantFixups.clear();
 		}
 
-		void pop_xmm(uint8_t x)
+		// Copies translated code, unlinked, into executable pages of its own. Eval returns 0 until Patch.
+		void Map(const uint8_t* image, int imageSize)
 		{
-			pop_rax();
-			mov_rax_xmm(x);
+			size_t mapped = 0;
+			uint8_t* pages = detail::AllocateCode(imageSize, mapped);
+			if (pages == nullptr)
+			{
+				std::cerr << "Can't allocate memory\n";
+				std::exit(1);
+			}
+			memcpy(pages, image, imageSize);
+			detail::ProtectCode(pages, mapped, true);
+			memory.reset(pages, [mapped](uint8_t* p)
+			{
+				munmap(p, mapped);
+			});
+			mem = pages;
+			mapped_size = mapped;
+			pointer = size = imageSize;
+			Eval = &Zero;
 		}
 
-		void call_rax()
+		// Writes the addresses of the symbols to the code, `pointers` are indexed by symbol id
+		void Patch(const std::vector<void*>& pointers)
 		{
-			m_intermidiate_code.push_back(ic_call_rax);
+			detail::ProtectCode(mem, mapped_size, false);
+			for (size_t r = 0; r < relocations_pointer.size(); ++r)
+			{
+				*(void**)(mem + relocations_pointer[r]) = pointers[relocations_sym[r]];
+			}
+			detail::ProtectCode(mem, mapped_size, true);
+			if (mem != nullptr)
+			{
+				Eval = (double (*)()) mem;
+			}
 		}
 
-		void ret()
+		// Code that jumps through Eval of this program, which must not move while the entry is in use. Programs calling
+		// this one are linked to the entry, so they get Zero until it is linked and its code once it is.
+		double (*MakeEntry())()
 		{
-			m_intermidiate_code.push_back(ic_ret);
+			size_t mapped = 0;
+			uint8_t* pages = detail::AllocateCode(16, mapped);
+			if (pages == nullptr)
+			{
+				std::cerr << "Can't allocate memory\n";
+				std::exit(1);
+			}
+			// movabs rax, &Eval; jmp [rax]
+			double (**target)() = &Eval;
+			pages[0] = 0x48;
+			pages[1] = 0xb8;
+			memcpy(pages + 2, &target, sizeof(target));
+			pages[10] = 0xff;
+			pages[11] = 0x20;
+			detail::ProtectCode(pages, mapped, true);
+			entry.reset(pages, [mapped](uint8_t* p)
+			{
+				munmap(p, mapped);
+			});
+			return (double (*)()) pages;
 		}
 
 		uint16_t Symbol(const std::string& name)
@@ -413,16 +610,65 @@ namespace ExpessionEvaluator
 			if (it == symbols.end())
 			{
 				symbols[name] = idc;
-				relocations_sym.push_back(idc);
 				return idc++;
 			}
 			else
 			{
-				relocations_sym.push_back(it->second);
 				return it->second;
 			}
 		}
 
+		// Same as InterpretedProgram::EvalBatch, runs a kernel of packed AVX arithmetic when the CPU supports it.
+		// Expressions calling programs are evaluated one instance at a time as well.
+		void EvalBatch(const BatchVar* vars, int varCount, double* out, ptrdiff_t outStride, size_t count) const
+		{
+			if (bytecode.callsPrograms)
+			{
+				InterpretedProgram::EvalInstances(vars, varCount, out, outStride, count, [this]()
+				{
+					return Eval();
+				});
+				return;
+			}
+			const InterpretedProgram::BatchCode& lanesCode = bytecode.GetBatch(vars, varCount);
+			if (lanesCode.code.empty() || !detail::HasAVX())
+			{
+				bytecode.EvalBatch(vars, varCount, out, outStride, count);
+				return;
+			}
+
+			// The kernel is built from the code cached for the same variables
+			bool same = batchKernel && (int)batchKernel->vars.size() == varCount;
+			for (int i = 0; same && i < varCount; ++i)
+			{
+				same = batchKernel->vars[i] == vars[i].var;
+			}
+			if (!same)
+			{
+				batchKernel = detail::BatchKernel::Build(lanesCode.code, bytecode.stack);
+				if (!batchKernel)
+				{
+					bytecode.EvalBatch(vars, varCount, out, outStride, count);
+					return;
+				}
+				for (int i = 0; i < varCount; ++i)
+				{
+					batchKernel->vars.push_back(vars[i].var);
+				}
+			}
+
+			detail::BatchKernel& kernel = *batchKernel;
+			const double* constants = kernel.GetConstants(lanesCode.code);
+			InterpretedProgram::RunBatch(vars, varCount, lanesCode.registers, lanesCode.code.back().a, out, outStride, count,
+				[&](double* r, int lanes)
+				{
+					kernel.Run(r, constants, lanes);
+				});
+		}
+
+		// Stack bytecode of the expression, batches are built from it
+		InterpretedProgram bytecode;
+		mutable std::shared_ptr<detail::BatchKernel> batchKernel;
 
 		double (*Eval)();
 
@@ -430,9 +676,71 @@ namespace ExpessionEvaluator
 		uint16_t idc;
 		int size;
 		uint8_t* mem;
+		size_t mapped_size;
+		std::shared_ptr<uint8_t> memory;
+		// Made by MakeEntry
+		std::shared_ptr<uint8_t> entry;
+
+		// Code being generated, moved to `mem` by Translate
+		std::vector<uint8_t> code;
 
 		std::map<std::string, uint16_t> symbols;
 		std::vector<uint16_t> relocations_sym;
-		std::vector<uint16_t> relocations_pointer;
+		std::vector<int> relocations_pointer;
+
+	private:
+		template<typename T>
+		void Write(T val)
+		{
+			const uint8_t* p = reinterpret_cast<const uint8_t*>(&val);
+			code.insert(code.end(), p, p + sizeof(T));
+		}
+
+		// Prefix, REX for xmm8..xmm15, 0F, opcode and ModRM. `mod` 3 addresses register `rm`, the others memory.
+		void Sse(Instruction ins, int reg, int rm, int mod)
+		{
+			Write((uint8_t)(ins >> 8));
+			uint8_t rex = (uint8_t)((reg >= 8 ? 0x04 : 0) | (mod == 3 && rm >= 8 ? 0x01 : 0));
+			if (rex != 0)
+			{
+				Write((uint8_t)(0x40 | rex));
+			}
+			Write((uint8_t)0x0f);
+			Write((uint8_t)ins);
+			Write((uint8_t)(mod << 6 | (reg & 7) << 3 | (rm & 7)));
+		}
+
+		// movabs rax, address of `symbol`, written by Patch
+		void MovabsRax(uint16_t symbol)
+		{
+			Write((uint16_t)0xb848);
+			relocations_sym.push_back(symbol);
+			relocations_pointer.push_back((int)code.size());
+			Write((uint64_t)symbol);
+		}
+
+		int ConstantIndex(double k)
+		{
+			for (size_t i = 0; i < m_constants.size(); ++i)
+			{
+				if (memcmp(&m_constants[i], &k, sizeof(double)) == 0)
+				{
+					return (int)i;
+				}
+			}
+			m_constants.push_back(k);
+			return (int)m_constants.size() - 1;
+		}
+
+		bool HasFrame() const
+		{
+			return m_slots > 0 || m_calls;
+		}
+
+		std::vector<double> m_constants;
+		// Offset of the displacement in the code and the constant it addresses
+		std::vector<std::pair<int, int> > m_constantFixups;
+		int m_slots;
+		bool m_calls;
 	};
 }
@@ -0,0 +1,438 @@
+#pragma once
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "utils/string_hash.h"
+#include "InterpretedProgram.h"
+#include "JProgram.h"
+
+namespace ExpessionEvaluator
+{
+	// Compiled programs by source text, so a program compiled once is only linked afterwards. Programs are stored
+	// unlinked: bytecode and JIT code refer to symbols by id, which makes them relocatable and lets the cache be
+	// saved to a file and loaded by a later run. Shared by contexts, methods are thread safe.
+	class ProgramCache
+	{
+	public:
+		// Without a file the cache lives in memory only, otherwise the file is loaded if it exists
+		explicit ProgramCache(const std::string& file = std::string()): m_file(file), m_hits(0), m_misses(0), m_changed(false)
+		{
+			if (!m_file.empty())
+			{
+				Load();
+			}
+		}
+
+		ProgramCache(const ProgramCache&) = delete;
+		ProgramCache& operator=(const ProgramCache&) = delete;
+
+		// Key of `source` compiled with native functions of signature `signature`, `kind` tells programs apart
+		static uint64_t Key(const char* source, uint64_t signature, char kind)
+		{
+			uint64_t state = ::detail::string_hash(source, strlen(source), 0, signature);
+			return ::detail::string_hash(&kind, 1, 0, state);
+		}
+
+		bool Find(uint64_t key, const char* source, InterpretedProgram& program)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			const Entry* entry = Lookup(key, source);
+			if (entry == nullptr)
+			{
+				return false;
+			}
+			program = MakeProgram(*entry);
+			return true;
+		}
+
+		bool Find(uint64_t key, const char* source, JitProgram& program)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			const Entry* entry = Lookup(key, source);
+			if (entry == nullptr || entry->machine.empty())
+			{
+				return false;
+			}
+			program = JitProgram();
+			program.Map(entry->machine.data(), (int)entry->machine.size());
+			program.relocations_sym = entry->machineSymbols;
+			program.relocations_pointer = entry->machineOffsets;
+			program.symbols = Symbols(entry->machineNames);
+			program.idc = (uint16_t)entry->machineNames.size();
+			program.bytecode = MakeProgram(*entry);
+			return true;
+		}
+
+		// `program` has to be unlinked
+		void Insert(uint64_t key, const char* source, const InterpretedProgram& program)
+		{
+			Entry entry = MakeEntry(source, program);
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_entries[key] = std::move(entry);
+			m_changed = true;
+		}
+
+		void Insert(uint64_t key, const char* source, const JitProgram& program)
+		{
+			Entry entry = MakeEntry(source, program.bytecode);
+			entry.machineNames = Names(program.symbols);
+			entry.machine.assign(program.mem, program.mem + program.size);
+			entry.machineSymbols = program.relocations_sym;
+			entry.machineOffsets = program.relocations_pointer;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_entries[key] = std::move(entry);
+			m_changed = true;
+		}
+
+		// Writes the cache to its file if programs were added since it was loaded or saved. The file is written next
+		// to the old one and renamed over it, so readers never see a partly written file.
+		bool Save()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_file.empty() || !m_changed)
+			{
+				return true;
+			}
+			std::string temp = m_file + ".tmp";
+			FILE* f = fopen(temp.c_str(), "wb");
+			if (f == nullptr)
+			{
+				return false;
+			}
+			bool ok = WriteHeader(f);
+			Put(f, (uint32_t)m_entries.size());
+			for (auto& e: m_entries)
+			{
+				const Entry& entry = e.second;
+				Put(f, e.first);
+				PutString(f, entry.source);
+				PutNames(f, entry.symbols);
+				PutVector(f, entry.bytecode);
+				PutVector(f, entry.bytecodeSymbols);
+				PutVector(f, entry.bytecodeOffsets);
+				PutNames(f, entry.machineNames);
+				PutVector(f, entry.machine);
+				PutVector(f, entry.machineSymbols);
+				PutVector(f, entry.machineOffsets);
+				Put(f, Checksum(e.first, entry));
+			}
+			ok = ok && !ferror(f);
+			ok = fclose(f) == 0 && ok;
+			ok = ok && rename(temp.c_str(), m_file.c_str()) == 0;
+			if (!ok)
+			{
+				remove(temp.c_str());
+			}
+			m_changed = !ok;
+			return ok;
+		}
+
+		size_t GetSize() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_entries.size();
+		}
+
+		size_t GetHits() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_hits;
+		}
+
+		size_t GetMisses() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_misses;
+		}
+
+	private:
+		enum
+		{
+			Version = 2
+		};
+
+		struct Entry
+		{
+			std::string source;
+			// Symbol names by id
+			std::vector<std::string> symbols;
+			std::vector<uint8_t> bytecode;
+			std::vector<uint16_t> bytecodeSymbols;
+			std::vector<int32_t> bytecodeOffsets;
+			// JIT code and its own symbols, empty for interpreted programs
+			std::vector<std::string> machineNames;
+			std::vector<uint8_t> machine;
+			std::vector<uint16_t> machineSymbols;
+			std::vector<int> machineOffsets;
+		};
+
+		const Entry* Lookup(uint64_t key, const char* source)
+		{
+			auto it = m_entries.find(key);
+			if (it == m_entries.end() || it->second.source != source)
+			{
+				++m_misses;
+				return nullptr;
+			}
+			++m_hits;
+			return &it->second;
+		}
+
+		static std::map<std::string, uint16_t> Symbols(const std::vector<std::string>& names)
+		{
+			std::map<std::string, uint16_t> symbols;
+			for (size_t i = 0; i < names.size(); ++i)
+			{
+				symbols[names[i]] = (uint16_t)i;
+			}
+			return symbols;
+		}
+
+		static std::vector<std::string> Names(const std::map<std::string, uint16_t>& symbols)
+		{
+			std::vector<std::string> names(symbols.size());
+			for (auto& s: symbols)
+			{
+				names[s.second] = s.first;
+			}
+			return names;
+		}
+
+		static Entry MakeEntry(const char* source, const InterpretedProgram& program)
+		{
+			assert(!program.linked);
+			Entry entry;
+			entry.source = source;
+			entry.symbols = Names(program.symbols);
+			entry.bytecode.assign(program.data, program.data + program.size);
+			for (auto& r: program.relocations)
+			{
+				entry.bytecodeSymbols.push_back(r.first);
+				entry.bytecodeOffsets.push_back(r.second);
+			}
+			return entry;
+		}
+
+		static InterpretedProgram MakeProgram(const Entry& entry)
+		{
+			InterpretedProgram program;
+			for (uint8_t b: entry.bytecode)
+			{
+				program.Write(b);
+			}
+			program.size = program.pointer;
+			program.symbols = Symbols(entry.symbols);
+			program.idc = (uint16_t)entry.symbols.size();
+			for (size_t i = 0; i < entry.bytecodeSymbols.size(); ++i)
+			{
+				program.relocations.push_back(std::make_pair(entry.bytecodeSymbols[i], (int)entry.bytecodeOffsets[i]));
+			}
+			return program;
+		}
+
+		// Code is only valid for the same kind of machine and the same generator
+		static bool WriteHeader(FILE* f)
+		{
+			return fwrite("EEPC", 4, 1, f) == 1 && Put(f, (uint32_t)Version) && Put(f, (uint32_t)sizeof(void*))
+				&& Put(f, (uint32_t)JitProgram::CodegenVersion);
+		}
+
+		// FNV-1a of `size` bytes continuing from `state`
+		static uint64_t Hash(const void* data, size_t size, uint64_t state)
+		{
+			const uint8_t* p = (const uint8_t*)data;
+			for (size_t i = 0; i < size; ++i)
+			{
+				state = (state ^ p[i]) * ::detail::fnv_prime_k;
+			}
+			return state;
+		}
+
+		template<typename T>
+		static uint64_t Hash(const std::vector<T>& v, uint64_t state)
+		{
+			uint32_t n = (uint32_t)v.size();
+			state = Hash(&n, sizeof(n), state);
+			return v.empty() ? state : Hash(v.data(), v.size() * sizeof(T), state);
+		}
+
+		static uint64_t Hash(const std::vector<std::string>& names, uint64_t state)
+		{
+			for (auto& s: names)
+			{
+				state = Hash(std::vector<char>(s.begin(), s.end()), state);
+			}
+			return state;
+		}
+
+		// Saved with each entry, an entry is only loaded if its key and content hash to it
+		static uint64_t Checksum(uint64_t key, const Entry& entry)
+		{
+			uint64_t state = Hash(&key, sizeof(key), ::detail::fnv_basis_k);
+			state = Hash(entry.source.data(), entry.source.size(), state);
+			state = Hash(entry.symbols, state);
+			state = Hash(entry.bytecode, state);
+			state = Hash(entry.bytecodeSymbols, state);
+			state = Hash(entry.bytecodeOffsets, state);
+			state = Hash(entry.machineNames, state);
+			state = Hash(entry.machine, state);
+			state = Hash(entry.machineSymbols, state);
+			return Hash(entry.machineOffsets, state);
+		}
+
+		template<typename T>
+		static bool Put(FILE* f, T val)
+		{
+			return fwrite(&val, sizeof(T), 1, f) == 1;
+		}
+
+		template<typename T>
+		static bool Get(FILE* f, T& val)
+		{
+			return fread(&val, sizeof(T), 1, f) == 1;
+		}
+
+		template<typename T>
+		static void PutVector(FILE* f, const std::vector<T>& v)
+		{
+			Put(f, (uint32_t)v.size());
+			if (!v.empty())
+			{
+				fwrite(v.data(), sizeof(T), v.size(), f);
+			}
+		}
+
+		template<typename T>
+		static bool GetVector(FILE* f, std::vector<T>& v)
+		{
+			uint32_t n = 0;
+			if (!Get(f, n) || n > (1u << 28) / sizeof(T))
+			{
+				return false;
+			}
+			v.resize(n);
+			return n == 0 || fread(v.data(), sizeof(T), n, f) == n;
+		}
+
+		static void PutString(FILE* f, const std::string& s)
+		{
+			PutVector(f, std::vector<char>(s.begin(), s.end()));
+		}
+
+		static bool GetString(FILE* f, std::string& s)
+		{
+			std::vector<char> v;
+			if (!GetVector(f, v))
+			{
+				return false;
+			}
+			s.assign(v.begin(), v.end());
+			return true;
+		}
+
+		static void PutNames(FILE* f, const std::vector<std::string>& names)
+		{
+			Put(f, (uint32_t)names.size());
+			for (auto& s: names)
+			{
+				PutString(f, s);
+			}
+		}
+
+		static bool GetNames(FILE* f, std::vector<std::string>& names)
+		{
+			uint32_t n = 0;
+			if (!Get(f, n) || n > 0xffff)
+			{
+				return false;
+			}
+			names.resize(n);
+			for (auto& s: names)
+			{
+				if (!GetString(f, s))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// A missing, foreign or damaged file, or one written by another code generator, leaves the cache empty
+		void Load()
+		{
+			FILE* f = fopen(m_file.c_str(), "rb");
+			if (f == nullptr)
+			{
+				return;
+			}
+			char magic[4];
+			uint32_t version = 0;
+			uint32_t pointerSize = 0;
+			uint32_t codegen = 0;
+			uint32_t count = 0;
+			bool ok = fread(magic, 4, 1, f) == 1 && memcmp(magic, "EEPC", 4) == 0 && Get(f, version) && version == Version
+				&& Get(f, pointerSize) && pointerSize == sizeof(void*) && Get(f, codegen)
+				&& codegen == (uint32_t)JitProgram::CodegenVersion && Get(f, count);
+			std::unordered_map<uint64_t, Entry> entries;
+			for (uint32_t i = 0; ok && i < count; ++i)
+			{
+				uint64_t key = 0;
+				uint64_t checksum = 0;
+				Entry entry;
+				ok = Get(f, key) && GetString(f, entry.source) && GetNames(f, entry.symbols) && GetVector(f, entry.bytecode)
+					&& GetVector(f, entry.bytecodeSymbols) && GetVector(f, entry.bytecodeOffsets) && GetNames(f, entry.machineNames)
+					&& GetVector(f, entry.machine) && GetVector(f, entry.machineSymbols) && GetVector(f, entry.machineOffsets)
+					&& Get(f, checksum);
+				ok = ok && checksum == Checksum(key, entry) && Valid(entry);
+				if (ok)
+				{
+					entries[key] = std::move(entry);
+				}
+			}
+			fclose(f);
+			if (ok)
+			{
+				m_entries.swap(entries);
+			}
+		}
+
+		// Relocations have to stay inside the code, so a damaged entry can't write outside of it when linked
+		static bool Valid(const Entry& entry)
+		{
+			if (entry.bytecodeSymbols.size() != entry.bytecodeOffsets.size()
+				|| entry.machineSymbols.size() != entry.machineOffsets.size())
+			{
+				return false;
+			}
+			for (size_t i = 0; i < entry.bytecodeSymbols.size(); ++i)
+			{
+				if (entry.bytecodeSymbols[i] >= entry.symbols.size() || entry.bytecodeOffsets[i] < 0
+					|| entry.bytecodeOffsets[i] + sizeof(uint16_t) > entry.bytecode.size())
+				{
+					return false;
+				}
+			}
+			for (size_t i = 0; i < entry.machineSymbols.size(); ++i)
+			{
+				if (entry.machineSymbols[i] >= entry.machineNames.size() || entry.machineOffsets[i] < 0
+					|| entry.machineOffsets[i] + sizeof(void*) > entry.machine.size())
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		std::string m_file;
+		mutable std::mutex m_mutex;
+		std::unordered_map<uint64_t, Entry> m_entries;
+		size_t m_hits;
+		size_t m_misses;
+		bool m_changed;
+	};
+}
@@ -1,13 +1,20 @@
 #include "Image.h"
+#include "ImagePool.h"
 #include "utils/gaussiun_kernel.h"
 #include "opencv_cc.h"
 #include "parallelisation.h"
+#include "simd_kernels.h"
+#include "utils/mapped_file.h"
+#include "Render/TextureReaders/TextureFormat.h"
 #include <assert.h>
+#include <functional>
 #include <math.h>
 #include <stb_image_resize.h>
 #include <thread>
 #include <algorithm>
 #include <string.h>
+#include <limits>
+#include <type_traits>
 
 #ifdef _MSC_VER
 #pragma warning( disable : 4244 )
@@ -21,7 +28,8 @@ Ty sqr(Ty a)
 
 bool Image::IsValid() const
 {
-	return (data_size != 0) && (misc::align(size.x * GetBPP(), Alignment) * size.y == data_size);
+	return (data_size != 0) && row_stride >= row_size && row_size == size.x * GetBPP()
+		&& offset + row_stride * (size.y - 1) + row_size <= data_size;
 }
 
 Image Image::Empty(glm::ivec2 size, Image::DataType d)
@@ -32,16 +40,14 @@ Image Image::Empty(glm::ivec2 size, Image::DataType d)
 	im.row_stride = misc::align(im.GetRowSize(), Alignment);
 	im.row_size = im.GetRowSize();
 	im.data_size = im.row_stride * (size_t)im.size.y;
-	im._ptr.reset(new byte[im.data_size]);
+	im._ptr = ImagePool::Get().Allocate(im.data_size);
 	memset(im._ptr.get(), 0, im.data_size);
 	return im;
 }
 
 Image Image::Empty(const Image& sameAs)
 {
-	Image im = Empty(sameAs.size, sameAs.dataType);
-	memset(im._ptr.get(), 0, im.data_size);
-	return im;
+	return Empty(sameAs.size, sameAs.dataType);
 }
 
 Image Image::FromRawData(const void* data, DataType d, glm::ivec2 size)
@@ -49,16 +55,92 @@ Image Image::FromRawData(const void* data, DataType d, glm::ivec2 size)
 	Image im = Empty(size, d);
 	//size_t bpp = im.GetBPP();
 
-	for (int j = 0; j < im.size.y; ++j)
+	PARALLEL_BEGIN(im.size.y)
 	{
-		memcpy(
-			im.GetRow<byte>(j),
-			(const char*)data + im.row_size * j,
-			im.row_size);
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			memcpy(
+				im.GetRow<byte>(j),
+				(const char*)data + im.row_size * j,
+				im.row_size);
+		}
+	}
+	PARALLEL_END();
+	return im;
+}
+
+Image Image::FromExternalData(void* data, DataType d, glm::ivec2 size, size_t rowStride, std::shared_ptr<void> owner, bool readOnly)
+{
+	Image im;
+	im.size = size;
+	im.dataType = d;
+	im.readOnly = readOnly;
+	im.row_size = im.GetRowSize();
+	im.row_stride = rowStride;
+	if (data == nullptr || size.x <= 0 || size.y <= 0 || rowStride < im.row_size)
+	{
+		throw utils::runtime_error("Invalid external image: %dx%d, row stride %d", size.x, size.y, (int)rowStride);
 	}
+	im.data_size = rowStride * (size_t)(size.y - 1) + im.row_size;
+	// Aliasing constructor: the image points to `data` but shares ownership with `owner`
+	im._ptr = std::shared_ptr<byte>(owner, (byte*)data);
 	return im;
 }
 
+Image Image::MapFile(const char* filename, DataType d, glm::ivec2 size, size_t offset, bool writable)
+{
+	auto file = utils::MappedFile::Open(filename, writable);
+	size_t row_size = GetBPP(d) * size.x;
+	if (size.x <= 0 || size.y <= 0 || offset + row_size * size.y > file->size)
+	{
+		throw utils::runtime_error("File %s is too small for %dx%d image at offset %d", filename, size.x, size.y, (int)offset);
+	}
+	return FromExternalData(file->data + offset, d, size, row_size, file, !writable);
+}
+
+Image Image::MapTGA(const char* filename, bool writable)
+{
+	auto file = utils::MappedFile::Open(filename, writable);
+	const uint8_t* header = file->data;
+	if (file->size < 18)
+	{
+		throw utils::runtime_error("File %s is not a TGA image", filename);
+	}
+	int id_length = header[0];
+	int colormap_type = header[1];
+	int image_type = header[2];
+	int colormap_size = (header[5] | header[6] << 8) * ((header[7] + 7) / 8);
+	int width = header[0xc] | header[0xd] << 8;
+	int height = header[0xe] | header[0xf] << 8;
+	int bits = header[0x10];
+	int descriptor = header[0x11];
+
+	if ((image_type != 2 && image_type != 3) || colormap_type != 0)
+	{
+		throw utils::runtime_error("TGA %s is not mappable, only uncompressed true-color and grayscale images are", filename);
+	}
+	if ((descriptor & 0x30) != 0x20)
+	{
+		throw utils::runtime_error("TGA %s is not mappable, only top-left origin is supported", filename);
+	}
+	DataType d;
+	if (bits == 8 && image_type == 3) d = R8;
+	else if (bits == 24 && image_type == 2) d = RGB8;
+	else if (bits == 32 && image_type == 2) d = RGBA8;
+	else
+	{
+		throw utils::runtime_error("TGA %s is not mappable, unsupported %d bits per pixel", filename, bits);
+	}
+
+	size_t offset = 18 + id_length + colormap_size;
+	size_t row_size = GetBPP(d) * width;
+	if (width == 0 || height == 0 || offset + row_size * height > file->size)
+	{
+		throw utils::runtime_error("TGA %s is truncated", filename);
+	}
+	return FromExternalData(file->data + offset, d, glm::ivec2(width, height), row_size, file, !writable);
+}
+
 void* Image::ToRawData()
 {
 	size_t bpp = GetBPP();
@@ -73,8 +155,17 @@ void* Image::ToRawData()
 	return p;
 }
 
+void Image::CheckWritable() const
+{
+	if (readOnly)
+	{
+		throw utils::runtime_error("Image is read-only");
+	}
+}
+
 void Image::Assign(const Image& x)
 {
+	CheckWritable();
 	assert(x.dataType == dataType);
 	assert(x.size == size || (size.x % x.size.x == 0 && size.y % x.size.y == 0));
 	auto lessoreq = glm::lessThanEqual(x.size, size);
@@ -124,6 +215,7 @@ Image Image::OpenView(const glm::ivec2 pos, const glm::ivec2 size)
 	view.offset = pos.y * row_stride + bpp * pos.x;
 	view.row_size = bpp * size.x;
 	view.row_stride = row_stride;
+	view.readOnly = readOnly;
 
 	return view;
 }
@@ -134,56 +226,117 @@ Image Image::Pad(int padding_x, int padding_y) const
 
 	size_t bpp = GetBPP();
 
-	for (int j = 0; j < im.size.y; ++j)
+	PARALLEL_BEGIN(im.size.y)
 	{
-		int j_ = inline_abs(padding_y - j - 1);
-		j_ = inline_abs(size.y - j_ - 1);
-		j_ = size.y - j_ - 1;
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			int j_ = inline_abs(padding_y - j - 1);
+			j_ = inline_abs(size.y - j_ - 1);
+			j_ = size.y - j_ - 1;
 
-		const uint8_t* src = GetRow<uint8_t>(j_);
-		uint8_t* dst = im.GetRow<uint8_t>(j);
+			const uint8_t* src = GetRow<uint8_t>(j_);
+			uint8_t* dst = im.GetRow<uint8_t>(j);
 
-		memcpy(
-			dst + bpp * padding_x,
-			src,
-			row_size);
+			memcpy(
+				dst + bpp * padding_x,
+				src,
+				row_size);
 
-		for (int i = 0; i < padding_x; ++i)
-		{
-			int i_ = padding_x - i - 1;
-			for (int k = 0; k < (int)bpp; ++k)
+			for (int i = 0; i < padding_x; ++i)
+			{
+				int i_ = padding_x - i - 1;
+				for (int k = 0; k < (int)bpp; ++k)
+				{
+					*(dst + bpp * i + k) = *(src + bpp * i_ + k);
+				}
+			}
+			for (int i = im.size.x - padding_x; i < im.size.x; ++i)
 			{
-				*(dst + bpp * i + k) = *(src + bpp * i_ + k);
+				int i_ = -padding_x + i + 1;
+				i_ = inline_abs(size.x - i_ - 1);
+				i_ = size.x - i_ - 1;
+				for (int k = 0; k < (int)bpp; ++k)
+				{
+					*(dst + bpp * i + k) = *(src + bpp * i_ + k);
+				}
 			}
 		}
-		for (int i = im.size.x - padding_x; i < im.size.x; ++i)
+	}
+	PARALLEL_END();
+	return im;
+}
+
+namespace
+{
+	typedef void (*TransposeBlockFn)(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h);
+
+	// Pixel sizes without a register kernel, copies with a constant size still compile to plain moves.
+	// Used with narrow tiles: rows of power of two images alias in cache and only a few of them fit in one set.
+	template<size_t BPP>
+	void TransposeBlock(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h)
+	{
+		for (size_t j = 0; j < h; ++j)
 		{
-			int i_ = -padding_x + i + 1;
-			i_ = inline_abs(size.x - i_ - 1);
-			i_ = size.x - i_ - 1;
-			for (int k = 0; k < (int)bpp; ++k)
+			const uint8_t* s = src + j * srcStride;
+			uint8_t* d = dst + j * BPP;
+			for (size_t i = 0; i < w; ++i, s += BPP, d += dstStride)
 			{
-				*(dst + bpp * i + k) = *(src + bpp * i_ + k);
+				memcpy(d, s, BPP);
 			}
 		}
 	}
-	return im;
+
+	TransposeBlockFn GetTransposeBlock(size_t bpp, int& tile)
+	{
+		const simd::Kernels& k = simd::Get();
+		tile = 64;
+		switch (bpp)
+		{
+			case 1: return k.transpose_8;
+			case 2: return k.transpose_16;
+			case 4: return k.transpose_32;
+			default: break;
+		}
+		tile = 8;
+		switch (bpp)
+		{
+			case 3: return TransposeBlock<3>;
+			case 8: return TransposeBlock<8>;
+			case 12: return TransposeBlock<12>;
+			case 16: return TransposeBlock<16>;
+			default: break;
+		}
+		assert(false);
+		return nullptr;
+	}
 }
 
+// Tiles are small enough for source and destination to stay in L1, threads take whole columns of tiles,
+// so each one writes a contiguous band of destination rows.
 Image Image::Transpose() const
 {
 	Image im = Empty(glm::ivec2(GetSize().y, GetSize().x), GetType());
 	size_t bpp = GetBPP();
+	int tile = 0;
+	TransposeBlockFn block = GetTransposeBlock(bpp, tile);
+	const int tilesX = (size.x + tile - 1) / tile;
+	const int tilesY = (size.y + tile - 1) / tile;
 
-	for (int j = 0; j < im.size.y; ++j)
+	PARALLEL_BEGIN(tilesX)
 	{
-		for (int i= 0; i < im.size.x; ++i)
+		for (int tx = p_begin; tx < p_end; ++tx)
 		{
-			uint8_t* dst = im.GetRow<uint8_t>(j) + i * bpp;
-			const uint8_t* src = GetRow<uint8_t>(i) + j * bpp;
-			memcpy(dst, src, bpp);
+			int x = tx * tile;
+			int w = std::min(tile, size.x - x);
+			for (int ty = 0; ty < tilesY; ++ty)
+			{
+				int y = ty * tile;
+				int h = std::min(tile, size.y - y);
+				block(im.GetRow<uint8_t>(x) + y * bpp, im.row_stride, GetRow<uint8_t>(y) + x * bpp, row_stride, w, h);
+			}
 		}
 	}
+	PARALLEL_END();
 	return im;
 }
 
@@ -317,11 +470,9 @@ void ResampleInternal(const Image& in, Image& out)
 		fint _ukx = (inSize.x - 1) * 0x500 / (outSize.x - 1);
 		fint _uky = (inSize.y - 1) * 0x500 / (outSize.y - 1);
 
-		ResampleRow(iR_dA, in.GetRow<T>(0), _ukx, outSize.x);
-		ResampleRow(iR_dB, in.GetRow<T>(1), _ukx, outSize.x);
-
-		int rL = 0;
-		int rH = 1;
+		// Source rows currently held in the L and H buffers. Tiles start anywhere, so nothing is cached upfront.
+		int rL = -1;
+		int rH = -1;
 
 		T * __restrict iR_dL = iR_dA;
 		T * __restrict iR_dH = iR_dB;
@@ -339,20 +490,18 @@ void ResampleInternal(const Image& in, Image& out)
 			{
 				if (il == rH)
 				{
-					auto tmp = iR_dL;
-					iR_dL = iR_dH;
-					iR_dH = tmp;
-					rL = rH;
+					std::swap(iR_dL, iR_dH);
+					std::swap(rL, rH);
 				}
 				else
 				{
-					ResampleRow(iR_dL, in.GetRow<T>(rL), _ukx, outSize.x);
+					ResampleRow(iR_dL, in.GetRow<T>(il), _ukx, outSize.x);
 					rL = il;
 				}
 			}
 			if (ih != rH)
 			{
-				ResampleRow(iR_dH, in.GetRow<T>(rH), _ukx, outSize.x);
+				ResampleRow(iR_dH, in.GetRow<T>(ih), _ukx, outSize.x);
 				rH = ih;
 			}
 
@@ -405,6 +554,7 @@ inline void ResampleRow(uint32_t* __restrict dst, const uint8_t* __restrict src,
 template<>
 void ResampleInternal<uint8_t>(const Image& in, Image& out)
 {
+	PARALLEL_BEGIN(out.GetSize().y)
 	{
 		auto outSize = out.GetSize();
 		auto inSize = in.GetSize();
@@ -415,21 +565,18 @@ void ResampleInternal<uint8_t>(const Image& in, Image& out)
 		fint _ukx = (inSize.x - 1) * 0x500 / (outSize.x - 1);
 		fint _uky = (inSize.y - 1) * 0x500 / (outSize.y - 1);
 
-		ResampleRow(iR_dA, in.GetRow<uint8_t>(0), _ukx, outSize.x);
-		ResampleRow(iR_dB, in.GetRow<uint8_t>(1), _ukx, outSize.x);
-
-		int rL = 0;
-		int rH = 1;
+		int rL = -1;
+		int rH = -1;
 
 		uint32_t* __restrict iR_dL = iR_dA;
 		uint32_t* __restrict iR_dH = iR_dB;
 
-		for (int j = 0; j < out.GetSize().y; ++j)
+		for (int j = p_begin; j < p_end; ++j)
 		{
 			fint fi = j * _uky;
 			int il = fi / 0x500;
 			fint ilf = il * 0x500;
-			int ih = il + 1;
+			int ih = std::min(il + 1, inSize.y - 1);
 			fint wi = fi - ilf;
 			fint _1_wi = 0x500 - wi;
 
@@ -437,14 +584,12 @@ void ResampleInternal<uint8_t>(const Image& in, Image& out)
 			{
 				if (il == rH)
 				{
-					auto tmp = iR_dL;
-					iR_dL = iR_dH;
-					iR_dH = tmp;
-					rL = rH;
+					std::swap(iR_dL, iR_dH);
+					std::swap(rL, rH);
 				}
 				else
 				{
-					ResampleRow(iR_dL, in.GetRow<uint8_t>(rL), _ukx, outSize.x);
+					ResampleRow(iR_dL, in.GetRow<uint8_t>(il), _ukx, outSize.x);
 					rL = il;
 				}
 			}
@@ -455,26 +600,12 @@ void ResampleInternal<uint8_t>(const Image& in, Image& out)
 			}
 			else if (ih != rH)
 			{
-				ResampleRow(iR_dH, in.GetRow<uint8_t>(rH), _ukx, outSize.x);
+				ResampleRow(iR_dH, in.GetRow<uint8_t>(ih), _ukx, outSize.x);
 				rH = ih;
-				iR_dH_f = iR_dH;
 			}
 
 			uint8_t* __restrict scanlineDst = out.GetRow<uint8_t>(j);
 
-			/*
-			int m = outSize.x - 3;
-			int i;
-			for (i = 0; i < m; i += 4)
-			{
-				scanlineDst[i] = ((iR_dL[i] * _1_wi + iR_dH_f[i] * wi) / (0x500 * 0x500) > 127) * 255;
-				scanlineDst[i + 1] = ((iR_dL[i + 1] * _1_wi + iR_dH_f[i + 1] * wi) / (0x500 * 0x500) > 127) * 255;
-				scanlineDst[i + 2] = ((iR_dL[i + 2] * _1_wi + iR_dH_f[i + 2] * wi) / (0x500 * 0x500) > 127) * 255;
-				scanlineDst[i + 3] = ((iR_dL[i + 3] * _1_wi + iR_dH_f[i + 3] * wi) / (0x500 * 0x500) > 127) * 255;
-			}
-			for (; i < outSize.x; i++)
-				scanlineDst[i] = ((iR_dL[i] * _1_wi + iR_dH_f[i] * wi) / (0x500 * 0x500) > 127) * 255;
-				*/
 			int m = outSize.x - 3;
 			int i;
 			for (i = 0; i < m; i += 4)
@@ -491,6 +622,7 @@ void ResampleInternal<uint8_t>(const Image& in, Image& out)
 		free(iR_dA);
 		free(iR_dB);
 	}
+	PARALLEL_END();
 }
 
 Image Image::Resample(glm::ivec2 size, bool fast) const
@@ -573,19 +705,24 @@ Image Image::CarveVertical(const std::vector<short>& seam) const
 {
 	Image out = Image::Empty(glm::ivec2(GetSize().x - 1, GetSize().y), GetType());
 	int bpp = (int)GetBPP();
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		const char* src = GetRow<char>(j);
-		char* dst = out.GetRow<char>(j);
-		memcpy(dst, src, seam[j] * bpp);
-		memcpy(dst + seam[j] * bpp, src + seam[j] * bpp + bpp, row_size - seam[j] * bpp - bpp);
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			const char* src = GetRow<char>(j);
+			char* dst = out.GetRow<char>(j);
+			memcpy(dst, src, seam[j] * bpp);
+			memcpy(dst + seam[j] * bpp, src + seam[j] * bpp + bpp, row_size - seam[j] * bpp - bpp);
+		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
 void Image::CarveVerticalInplace(const std::vector<short>& seam)
 {
 	//Profile(CarveVerticalInplace);
+	CheckWritable();
 	int bpp = (int)GetBPP();
 	int targetRowSize = misc::align((size.x - 1) * bpp, Alignment);
 
@@ -599,100 +736,335 @@ void Image::CarveVerticalInplace(const std::vector<short>& seam)
 	--size.x;
 }
 
-Image Image::Copy() const
+void CastRow(Image::pixelRF* dst, const Image::pixelR8* src, int n)
 {
-	Image im = Empty(size, dataType);
-	// size_t bpp = GetBPP();
+	simd::Get().u8_to_f32(dst, src, 1.0f, n);
+}
 
-	for (int j = 0; j < im.size.y; ++j)
-	{
-		memcpy(
-			im.GetRow<byte>(j),
-			GetRow<byte>(j),
-			im.row_size);
-	}
-	return im;
+void CastRow(Image::pixelRGBF* dst, const Image::pixelRGB8* src, int n)
+{
+	simd::Get().u8_to_f32(&dst->x, &src->x, 1.0f, (size_t)n * 3);
 }
 
-Image Image::Add(const Image& x) const
+void CastRow(Image::pixelRGBAF* dst, const Image::pixelRGBA8* src, int n)
 {
-	if (dataType == R8)
+	simd::Get().u8_to_f32(&dst->x, &src->x, 1.0f, (size_t)n * 4);
+}
+
+void CastRow(Image::pixelR8* dst, const Image::pixelRF* src, int n)
+{
+	simd::Get().f32_to_u8(dst, src, 1.0f, 0.0f, n);
+}
+
+void CastRow(Image::pixelRGB8* dst, const Image::pixelRGBF* src, int n)
+{
+	simd::Get().f32_to_u8(&dst->x, &src->x, 1.0f, 0.0f, (size_t)n * 3);
+}
+
+void CastRow(Image::pixelRGBA8* dst, const Image::pixelRGBAF* src, int n)
+{
+	simd::Get().f32_to_u8(&dst->x, &src->x, 1.0f, 0.0f, (size_t)n * 4);
+}
+
+namespace
+{
+	inline float SRGBToLinear(float c)
 	{
-		return _Add<byte>(x);
+		return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
 	}
-	else if (dataType == R16)
+
+	inline float LinearToSRGB(float c)
 	{
-		return _Add<uint16_t>(x);
+		return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
 	}
-	else if (dataType == R32)
+
+	// Decoding is a plain table. Encoding guesses the code from 12 bits of the value and corrects the guess
+	// against the decision thresholds, which gives exactly rounded codes at the cost of a compare or two.
+	struct SRGBTables
 	{
-		return _Add<uint32_t>(x);
-	}
-	else if (dataType == RG16)
+		float decode[256];
+		// Smallest linear value encoded as code c
+		float thresholds[256];
+		uint8_t guess[4096];
+
+		SRGBTables()
+		{
+			for (int c = 0; c < 256; ++c)
+			{
+				decode[c] = SRGBToLinear(c / 255.0f);
+				thresholds[c] = c == 0 ? -std::numeric_limits<float>::infinity() : SRGBToLinear((c - 0.5f) / 255.0f);
+			}
+			for (int i = 0; i < 4096; ++i)
+			{
+				guess[i] = (uint8_t)(LinearToSRGB(i / 4095.0f) * 255.0f + 0.5f);
+			}
+		}
+
+		uint8_t Encode(float x) const
+		{
+			if (!(x > 0.0f))
+			{
+				return 0;
+			}
+			if (x >= 1.0f)
+			{
+				return 255;
+			}
+			int c = guess[(int)(x * 4095.0f)];
+			while (c < 255 && x >= thresholds[c + 1])
+			{
+				++c;
+			}
+			while (x < thresholds[c])
+			{
+				--c;
+			}
+			return (uint8_t)c;
+		}
+	};
+
+	const SRGBTables& GetSRGBTables()
 	{
-		return _Add<pixelRG16>(x);
+		static SRGBTables tables;
+		return tables;
 	}
-	else if (dataType == RGB8)
+
+	// Color channels through the curve, alpha of 4-channel pixels is linear
+	void DecodeSRGBRow(float* dst, const uint8_t* src, size_t pixels, int channels)
 	{
-		return _Add<pixelRGB8>(x);
+		const SRGBTables& t = GetSRGBTables();
+		const int colors = channels == 4 ? 3 : channels;
+		for (size_t i = 0; i < pixels * channels; i += channels)
+		{
+			for (int c = 0; c < colors; ++c)
+			{
+				dst[i + c] = t.decode[src[i + c]];
+			}
+			if (colors != channels)
+			{
+				dst[i + 3] = src[i + 3] * (1.0f / 255.0f);
+			}
+		}
 	}
-	else if (dataType == RGBA8)
+
+	void EncodeSRGBRow(uint8_t* dst, const float* src, size_t pixels, int channels)
 	{
-		return _Add<pixelRGBA8>(x);
+		const SRGBTables& t = GetSRGBTables();
+		const int colors = channels == 4 ? 3 : channels;
+		for (size_t i = 0; i < pixels * channels; i += channels)
+		{
+			for (int c = 0; c < colors; ++c)
+			{
+				dst[i + c] = t.Encode(src[i + c]);
+			}
+			if (colors != channels)
+			{
+				float a = src[i + 3] * 255.0f + 0.5f;
+				dst[i + 3] = a > 0.0f ? (a < 255.0f ? (uint8_t)a : 255) : 0;
+			}
+		}
 	}
-	else if (dataType == RF)
+
+	template<typename T>
+	void RemapChannels(T* dst, const T* src, size_t pixels, int cin, int cout, T opaque)
 	{
-		return _Add<float>(x);
+		for (size_t i = 0; i < pixels; ++i, dst += cout, src += cin)
+		{
+			for (int c = 0; c < cout; ++c)
+			{
+				dst[c] = c == 3 ? (cin == 4 ? src[3] : opaque) : (c < cin ? src[c] : T(0));
+			}
+		}
 	}
-	else if (dataType == RGBF)
+
+	bool IsConvertible(Image::DataType d)
 	{
-		return _Add<pixelRGBF>(x);
+		return d == Image::R8 || d == Image::RGB8 || d == Image::RGBA8 || (d & Image::FLOAT_POINT) != 0;
 	}
-	else if (dataType == RGBAF)
+}
+
+LinearRowReader::LinearRowReader(const Image& image, bool srgb): m_image(image), m_srgb(srgb)
+{
+	Image::DataType d = image.GetType();
+	assert(IsConvertible(d) || d == Image::R16);
+	if (!(d & Image::FLOAT_POINT))
 	{
-		return _Add<pixelRGBAF>(x);
+		m_row.resize((size_t)image.GetSize().x * image.GetChannelCount());
 	}
-	assert(false);
-	return Image();
 }
 
-Image Image::Sub(const Image& x) const
+const float* LinearRowReader::GetRow(int j)
 {
-	if (dataType == R8)
+	const size_t pixels = m_image.GetSize().x;
+	const int channels = m_image.GetChannelCount();
+	switch (m_image.GetType())
 	{
-		return _Sub<byte>(x);
+		case Image::R8: case Image::RGB8: case Image::RGBA8:
+			if (m_srgb)
+			{
+				DecodeSRGBRow(m_row.data(), m_image.GetRow<uint8_t>(j), pixels, channels);
+			}
+			else
+			{
+				simd::Get().u8_to_f32(m_row.data(), m_image.GetRow<uint8_t>(j), 1.0f / 255.0f, pixels * channels);
+			}
+			return m_row.data();
+		case Image::R16:
+		{
+			const uint16_t* src = m_image.GetRow<uint16_t>(j);
+			for (size_t i = 0; i < pixels; ++i)
+			{
+				m_row[i] = src[i] * (1.0f / 65535.0f);
+			}
+			return m_row.data();
+		}
+		default:
+			return m_image.GetRow<float>(j);
 	}
-	else if (dataType == R16)
+}
+
+Image Image::Convert(DataType d, bool srgb) const
+{
+	assert(IsConvertible(dataType) && IsConvertible(d));
+	Image out = Empty(size, d);
+	const int cin = GetChannelCount();
+	const int cout = out.GetChannelCount();
+	const bool bytesIn = !(dataType & FLOAT_POINT);
+	const bool bytesOut = !(d & FLOAT_POINT);
+	const simd::Kernels& k = simd::Get();
+
+	PARALLEL_BEGIN(size.y)
 	{
-		return _Sub<uint16_t>(x);
+		LinearRowReader reader(*this, srgb);
+		std::vector<float> remapped(cin != cout ? (size_t)size.x * cout : 0);
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			uint8_t* dst = out.GetRow<uint8_t>(j);
+			if (bytesIn && bytesOut)
+			{
+				// Codes are not changed, so the color space does not matter
+				const uint8_t* src = GetRow<uint8_t>(j);
+				if (cin == cout)
+				{
+					memcpy(dst, src, row_size);
+				}
+				else if (cin == 3 && cout == 4)
+				{
+					k.rgb8_to_rgba8(dst, src, size.x);
+				}
+				else if (cin == 4 && cout == 3)
+				{
+					k.rgba8_to_rgb8(dst, src, size.x);
+				}
+				else
+				{
+					RemapChannels<uint8_t>(dst, src, size.x, cin, cout, 255);
+				}
+				continue;
+			}
+
+			const float* row = reader.GetRow(j);
+			if (cin != cout)
+			{
+				RemapChannels<float>(remapped.data(), row, size.x, cin, cout, 1.0f);
+				row = remapped.data();
+			}
+			if (!bytesOut)
+			{
+				memcpy(dst, row, out.row_size);
+			}
+			else if (srgb)
+			{
+				EncodeSRGBRow(dst, row, size.x, cout);
+			}
+			else
+			{
+				k.f32_to_u8(dst, row, 255.0f, 0.5f, (size_t)size.x * cout);
+			}
+		}
 	}
-	else if (dataType == R32)
+	PARALLEL_END();
+	return out;
+}
+
+Image Image::Copy() const
+{
+	Image im = Empty(size, dataType);
+	// size_t bpp = GetBPP();
+
+	PARALLEL_BEGIN(im.size.y)
 	{
-		return _Sub<uint32_t>(x);
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			memcpy(
+				im.GetRow<byte>(j),
+				GetRow<byte>(j),
+				im.row_size);
+		}
 	}
-	else if (dataType == RG16)
+	PARALLEL_END();
+	return im;
+}
+
+template<typename T, typename F>
+inline Image ElementwiseRowKernel(const Image& a, const Image& b, F kernel)
+{
+	Image out = Image::Empty(a);
+	size_t n = a.GetRowSize() / sizeof(T);
+	PARALLEL_BEGIN(a.GetSize().y)
 	{
-		return _Sub<pixelRG16>(x);
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			kernel(out.GetRow<T>(j), a.GetRow<T>(j), b.GetRow<T>(j), n);
+		}
 	}
-	else if (dataType == RGB8)
+	PARALLEL_END();
+	return out;
+}
+
+template<typename Tin, typename Tout, typename F>
+inline Image ScalarRowKernel(const Image& a, Image::DataType out_type, F kernel)
+{
+	Image out = Image::Empty(a.GetSize(), out_type);
+	size_t n = a.GetRowSize() / sizeof(Tin);
+	PARALLEL_BEGIN(a.GetSize().y)
 	{
-		return _Sub<pixelRGB8>(x);
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			kernel(out.GetRow<Tout>(j), a.GetRow<Tin>(j), n);
+		}
 	}
-	else if (dataType == RGBA8)
+	PARALLEL_END();
+	return out;
+}
+
+Image Image::Add(const Image& x) const
+{
+	assert(x.GetSize() == GetSize() && x.dataType == dataType);
+	const simd::Kernels& k = simd::Get();
+	switch (dataType)
 	{
-		return _Sub<pixelRGBA8>(x);
+		case R8: case RGB8: case RGBA8: return ElementwiseRowKernel<uint8_t>(*this, x, k.add_u8);
+		case R16: case RG16: return ElementwiseRowKernel<uint16_t>(*this, x, k.add_u16);
+		case R32: return ElementwiseRowKernel<uint32_t>(*this, x, k.add_u32);
+		case RF: case RGF: case RGBF: case RGBAF: return ElementwiseRowKernel<float>(*this, x, k.add_f32);
+		default: break;
 	}
-	else if (dataType == RF)
+	assert(false);
+	return Image();
+}
+
+Image Image::Sub(const Image& x) const
+{
+	assert(x.GetSize() == GetSize() && x.dataType == dataType);
+	const simd::Kernels& k = simd::Get();
+	switch (dataType)
 	{
-		return _Sub<float>(x);
-	}
-	else if (dataType == RGBF)
-	{
-		return _Sub<pixelRGBF>(x);
-	}
-	else if (dataType == RGBAF)
-	{
-		return _Sub<pixelRGBAF>(x);
+		case R8: case RGB8: case RGBA8: return ElementwiseRowKernel<uint8_t>(*this, x, k.sub_u8);
+		case R16: case RG16: return ElementwiseRowKernel<uint16_t>(*this, x, k.sub_u16);
+		case R32: return ElementwiseRowKernel<uint32_t>(*this, x, k.sub_u32);
+		case RF: case RGF: case RGBF: case RGBAF: return ElementwiseRowKernel<float>(*this, x, k.sub_f32);
+		default: break;
 	}
 	assert(false);
 	return Image();
@@ -724,17 +1096,9 @@ Image Image::Div(const Image& x) const
 	{
 		return _Div<pixelRGBA8>(x);
 	}
-	else if (dataType == RF)
-	{
-		return _Div<float>(x);
-	}
-	else if (dataType == RGBF)
-	{
-		return _Div<pixelRGBF>(x);
-	}
-	else if (dataType == RGBAF)
+	else if (dataType & FLOAT_POINT)
 	{
-		return _Div<pixelRGBAF>(x);
+		return ElementwiseRowKernel<float>(*this, x, simd::Get().div_f32);
 	}
 	assert(false);
 	return Image();
@@ -742,41 +1106,16 @@ Image Image::Div(const Image& x) const
 
 Image Image::Mul(const Image& x) const
 {
-	if (dataType == R8)
-	{
-		return _Mul<byte>(x);
-	}
-	else if (dataType == R16)
-	{
-		return _Mul<uint16_t>(x);
-	}
-	else if (dataType == R32)
-	{
-		return _Mul<uint32_t>(x);
-	}
-	else if (dataType == RG16)
-	{
-		return _Mul<pixelRG16>(x);
-	}
-	else if (dataType == RGB8)
-	{
-		return _Mul<pixelRGB8>(x);
-	}
-	else if (dataType == RGBA8)
-	{
-		return _Mul<pixelRGBA8>(x);
-	}
-	else if (dataType == RF)
+	assert(x.GetSize() == GetSize() && x.dataType == dataType);
+	const simd::Kernels& k = simd::Get();
+	switch (dataType)
 	{
-		return _Mul<float>(x);
-	}
-	else if (dataType == RGBF)
-	{
-		return _Mul<pixelRGBF>(x);
-	}
-	else if (dataType == RGBAF)
-	{
-		return _Mul<pixelRGBAF>(x);
+		case R8: case RGB8: case RGBA8: return ElementwiseRowKernel<uint8_t>(*this, x, k.mul_u8);
+		case R16: return ElementwiseRowKernel<uint16_t>(*this, x, k.mul_u16);
+		case RG16: return _Mul<pixelRG16>(x);
+		case R32: return ElementwiseRowKernel<uint32_t>(*this, x, k.mul_u32);
+		case RF: case RGF: case RGBF: case RGBAF: return ElementwiseRowKernel<float>(*this, x, k.mul_f32);
+		default: break;
 	}
 	assert(false);
 	return Image();
@@ -784,17 +1123,10 @@ Image Image::Mul(const Image& x) const
 
 Image Image::Mul(float x) const
 {
-	if (dataType == RF)
-	{
-		return _Mul<float, float>(x);
-	}
-	else if (dataType == RGBF)
-	{
-		return _Mul<float, pixelRGBF>(x);
-	}
-	else if (dataType == RGBAF)
+	if (dataType & FLOAT_POINT)
 	{
-		return _Mul<float, pixelRGBAF>(x);
+		auto kernel = simd::Get().mul_scalar_f32;
+		return ScalarRowKernel<float, float>(*this, dataType, [kernel, x](float* dst, const float* src, size_t n) { kernel(dst, src, x, n); });
 	}
 	assert(false);
 	return Image();
@@ -802,9 +1134,10 @@ Image Image::Mul(float x) const
 
 Image Image::Mul(int x) const
 {
-	if (dataType == R8)
+	if (dataType == R8 || dataType == RGB8 || dataType == RGBA8)
 	{
-		return _Mul<byte, byte>((byte)x);
+		auto kernel = simd::Get().mul_scalar_u8;
+		return ScalarRowKernel<byte, byte>(*this, dataType, [kernel, x](byte* dst, const byte* src, size_t n) { kernel(dst, src, x, n); });
 	}
 	else if (dataType == R16)
 	{
@@ -818,14 +1151,6 @@ Image Image::Mul(int x) const
 	{
 		return _Mul<int16_t, pixelRG16>(x);
 	}
-	else if (dataType == RGB8)
-	{
-		return _Mul<byte, pixelRGB8>((byte)x);
-	}
-	else if (dataType == RGBA8)
-	{
-		return _Mul<byte, pixelRGBA8>((byte)x);
-	}
 
 	assert(false);
 	return Image();
@@ -864,26 +1189,20 @@ Image Image::Div(int x) const
 
 Image Image::Add(float x) const
 {
-	if (dataType == RF)
-	{
-		return _Add<float, float>(x);
-	}
-	else if (dataType == RGBF)
-	{
-		return _Add<float, pixelRGBF>(x);
-	}
-	else if (dataType == RGBAF)
+	if (dataType & FLOAT_POINT)
 	{
-		return _Add<float, pixelRGBAF>(x);
+		auto kernel = simd::Get().add_scalar_f32;
+		return ScalarRowKernel<float, float>(*this, dataType, [kernel, x](float* dst, const float* src, size_t n) { kernel(dst, src, x, n); });
 	}
 	return Image();
 }
 
 Image Image::Add(int x) const
 {
-	if (dataType == R8)
+	if (dataType == R8 || dataType == RGB8 || dataType == RGBA8)
 	{
-		return _Add<byte, byte>((byte)x);
+		auto kernel = simd::Get().add_scalar_u8;
+		return ScalarRowKernel<byte, byte>(*this, dataType, [kernel, x](byte* dst, const byte* src, size_t n) { kernel(dst, src, x, n); });
 	}
 	else if (dataType == R16)
 	{
@@ -897,13 +1216,21 @@ Image Image::Add(int x) const
 	{
 		return _Add<int16_t, pixelRG16>(x);
 	}
-	else if (dataType == RGB8)
+	assert(false);
+	return Image();
+}
+
+Image Image::ScaleBias(float scale, float bias) const
+{
+	if (dataType & FLOAT_POINT)
 	{
-		return _Add<byte, pixelRGB8>((byte)x);
+		auto kernel = simd::Get().scale_bias_f32;
+		return ScalarRowKernel<float, float>(*this, dataType, [kernel, scale, bias](float* dst, const float* src, size_t n) { kernel(dst, src, scale, bias, n); });
 	}
-	else if (dataType == RGBA8)
+	else if (dataType == R8 || dataType == RGB8 || dataType == RGBA8)
 	{
-		return _Add<byte, pixelRGBA8>((byte)x);
+		auto kernel = simd::Get().scale_bias_u8;
+		return ScalarRowKernel<byte, byte>(*this, dataType, [kernel, scale, bias](byte* dst, const byte* src, size_t n) { kernel(dst, src, scale, bias, n); });
 	}
 	assert(false);
 	return Image();
@@ -913,11 +1240,14 @@ Image Image::Step(float x) const
 {
 	if (dataType == R8)
 	{
-		return _Step<uint8_t, uint8_t>(x * 127.0f);
+		auto kernel = simd::Get().step_u8;
+		byte t = (byte)(x * 127.0f);
+		return ScalarRowKernel<byte, byte>(*this, R8, [kernel, t](byte* dst, const byte* src, size_t n) { kernel(dst, src, t, n); });
 	}
 	else if (dataType == RF)
 	{
-		return _Step<float, float>(x);
+		auto kernel = simd::Get().step_f32;
+		return ScalarRowKernel<float, byte>(*this, R8, [kernel, x](byte* dst, const float* src, size_t n) { kernel(dst, src, x, n); });
 	}
 	else if (dataType == RGBF)
 	{
@@ -935,7 +1265,9 @@ Image Image::Step(int x) const
 {
 	if (dataType == R8)
 	{
-		return _Step<byte, byte>((byte)x);
+		auto kernel = simd::Get().step_u8;
+		byte t = (byte)x;
+		return ScalarRowKernel<byte, byte>(*this, R8, [kernel, t](byte* dst, const byte* src, size_t n) { kernel(dst, src, t, n); });
 	}
 	else if (dataType == R16)
 	{
@@ -1033,6 +1365,106 @@ for y = Y to 1 do begin
    end
 end
 }*/
+// Exact euclidean distance to the nearest boundary pixel, i.e. a pixel with a 4-neighbour of the other
+// binary value. Separable: a vertical scan gives the distance within each column, then the lower envelope of
+// parabolas along each row gives the 2D distance (Felzenszwalb-Huttenlocher). Both passes are parallel.
+inline void ExactDistanceTransform(const Image& binary, Image& d)
+{
+	const int width = binary.GetSize().x;
+	const int height = binary.GetSize().y;
+	const uint32_t inf = (uint32_t)(width + height);
+	Image g = Image::Empty(binary.GetSize(), Image::R32);
+
+	auto isBoundary = [&](int i, int j)
+	{
+		const uint8_t* row = binary.GetRow<uint8_t>(j);
+		uint8_t v = row[i];
+		return (i > 0 && row[i - 1] != v) || (i < width - 1 && row[i + 1] != v) ||
+			(j > 0 && binary.GetRow<uint8_t>(j - 1)[i] != v) || (j < height - 1 && binary.GetRow<uint8_t>(j + 1)[i] != v);
+	};
+
+	// Columns are processed in strips, so the scans walk rows in memory order
+	const int strip = 256;
+	PARALLEL_BEGIN((width + strip - 1) / strip)
+	{
+		for (int s = p_begin; s < p_end; ++s)
+		{
+			int x0 = s * strip;
+			int x1 = std::min(x0 + strip, width);
+			for (int j = 0; j < height; ++j)
+			{
+				uint32_t* g_ptr = g.GetRow<uint32_t>(j);
+				const uint32_t* g_ptr_ym = j > 0 ? g.GetRow<uint32_t>(j - 1) : nullptr;
+				for (int i = x0; i < x1; ++i)
+				{
+					g_ptr[i] = isBoundary(i, j) ? 0 : (g_ptr_ym ? std::min(g_ptr_ym[i] + 1, inf) : inf);
+				}
+			}
+			for (int j = height - 2; j >= 0; --j)
+			{
+				uint32_t* g_ptr = g.GetRow<uint32_t>(j);
+				const uint32_t* g_ptr_yp = g.GetRow<uint32_t>(j + 1);
+				for (int i = x0; i < x1; ++i)
+				{
+					g_ptr[i] = std::min(g_ptr[i], g_ptr_yp[i] + 1);
+				}
+			}
+		}
+	}
+	PARALLEL_END();
+
+	PARALLEL_BEGIN(height)
+	{
+		std::vector<int64_t> f(width);
+		std::vector<int> v(width);
+		std::vector<double> z(width + 1);
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			const uint32_t* g_ptr = g.GetRow<uint32_t>(j);
+			float* d_ptr = d.GetRow<float>(j);
+			for (int i = 0; i < width; ++i)
+			{
+				f[i] = (int64_t)g_ptr[i] * g_ptr[i];
+			}
+
+			// Lower envelope of parabolas rooted at (q, f[q])
+			int k = 0;
+			v[0] = 0;
+			z[0] = -std::numeric_limits<double>::infinity();
+			z[1] = std::numeric_limits<double>::infinity();
+			auto intersect = [&f](int q, int p)
+			{
+				return double((f[q] + (int64_t)q * q) - (f[p] + (int64_t)p * p)) / (2.0 * (q - p));
+			};
+			for (int q = 1; q < width; ++q)
+			{
+				double s = intersect(q, v[k]);
+				while (s <= z[k])
+				{
+					--k;
+					s = intersect(q, v[k]);
+				}
+				++k;
+				v[k] = q;
+				z[k] = s;
+				z[k + 1] = std::numeric_limits<double>::infinity();
+			}
+
+			k = 0;
+			for (int q = 0; q < width; ++q)
+			{
+				while (z[k + 1] < q)
+				{
+					++k;
+				}
+				int64_t dx = q - v[k];
+				d_ptr[q] = sqrtf((float)(dx * dx + f[v[k]]));
+			}
+		}
+	}
+	PARALLEL_END();
+}
+
 Image Image::ComputeDF(DFType type) const
 {
 	Image d = Image::Empty(GetSize(), RF);
@@ -1040,51 +1472,66 @@ Image Image::ComputeDF(DFType type) const
 	Image binary = Image::Empty(GetSize(), R8);
 
 	int width = d.GetSize().x;
-	for (int j = 1; j < GetSize().y - 1; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		byte* b_ptr = binary.GetRow<byte>(j);
-		const pixelRGB8* ptr = GetRow<pixelRGB8>(j);
-
-		for (int i = 1; i < width - 1; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			int av = ptr[i].x + ptr[i].y + ptr[i].z;
-			if (av > 128 * 3)
-			{
-				b_ptr[i] = (byte)255;
-			}
-			else
+			byte* b_ptr = binary.GetRow<byte>(j);
+			const pixelRGB8* ptr = GetRow<pixelRGB8>(j);
+
+			for (int i = 0; i < width; ++i)
 			{
-				b_ptr[i] = (byte)0;
+				int av = ptr[i].x + ptr[i].y + ptr[i].z;
+				if (av > 128 * 3)
+				{
+					b_ptr[i] = (byte)255;
+				}
+				else
+				{
+					b_ptr[i] = (byte)0;
+				}
 			}
 		}
 	}
+	PARALLEL_END();
 
 	constexpr float d1 = 1.f;
 	constexpr float d2 = 1.41421356237309504880f;
 	constexpr float d3 = 2.23606797749978969641f;
 
-	//initialize immediate interior & exterior elements
-	for (int j = 1; j < GetSize().y-1; ++j)
+	if (type == ExactEuclidean)
 	{
-		float* d_ptr = d.GetRow<float>(j);
-		pixelRG16* p_ptr = p.GetRow<pixelRG16>(j);
-		const byte* ptr = binary.GetRow<byte>(j);
-		const byte* ptr_yp = binary.GetRow<byte>(j+1);
-		const byte* ptr_ym = binary.GetRow<byte>(j - 1);
-
-		for (int i = 1; i < width -1; ++i)
+		ExactDistanceTransform(binary, d);
+	}
+	else
+	{
+		//initialize immediate interior & exterior elements
+		PARALLEL_BEGIN(GetSize().y - 1)
 		{
-			if (ptr[i - 1] != ptr[i] || ptr[i + 1] != ptr[i] || ptr_ym[i] != ptr[i] || ptr_yp[i] != ptr[i])
+			for (int j = std::max(p_begin, 1); j < p_end; ++j)
 			{
-				d_ptr[i] = 0.0f;
-				p_ptr[i] = pixelRG16(i, j);
+				float* d_ptr = d.GetRow<float>(j);
+				pixelRG16* p_ptr = p.GetRow<pixelRG16>(j);
+				const byte* ptr = binary.GetRow<byte>(j);
+				const byte* ptr_yp = binary.GetRow<byte>(j+1);
+				const byte* ptr_ym = binary.GetRow<byte>(j - 1);
+
+				for (int i = 1; i < width -1; ++i)
+				{
+					if (ptr[i - 1] != ptr[i] || ptr[i + 1] != ptr[i] || ptr_ym[i] != ptr[i] || ptr_yp[i] != ptr[i])
+					{
+						d_ptr[i] = 0.0f;
+						p_ptr[i] = pixelRG16(i, j);
+					}
+					else
+					{
+						d_ptr[i] = 1e8f;
+						p_ptr[i] = pixelRG16(-100);
+					}	
+				}
 			}
-			else
-			{
-				d_ptr[i] = 1e8f;
-				p_ptr[i] = pixelRG16(-100);
-			}	
 		}
+		PARALLEL_END();
 	}
 
 	if (type == Chamfer3x3)
@@ -1309,346 +1756,1621 @@ Image Image::ComputeDF(DFType type) const
 	}
 
 	//indicate inside & outside 
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		float* d_ptr = d.GetRow<float>(j);
-		const byte* ptr = binary.GetRow<byte>(j);
-		for (int i = 0; i < width - 0; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			if (ptr[i] == (byte)0)
+			float* d_ptr = d.GetRow<float>(j);
+			const byte* ptr = binary.GetRow<byte>(j);
+			for (int i = 0; i < width - 0; ++i)
 			{
-				d_ptr[i] = -d_ptr[i];
+				if (ptr[i] == (byte)0)
+				{
+					d_ptr[i] = -d_ptr[i];
+				}
 			}
 		}
 	}
+	PARALLEL_END();
 
 	return d;
 }
 
-Image Image::GaussBlur(float r) const
-{
-	return GaussBlurX(r).Transpose().GaussBlurX(r).Transpose();
-}
-
-template<typename T, typename I>
-Image Image::_GaussBlurX(float r) const
+// Gaussian blur works on rows of float channels. Pixels are flattened, so a tap at pixel offset k is a
+// channel offset k * channels, and all channels go through the same SIMD lanes with the same weight.
+// Borders are mirrored without repeating the edge pixel.
+enum
 {
-	int half = int(r);
-	std::vector<float> kv = misc::GaussKernel(r / 3.0f, half * 2 + 1);
-	const float* __restrict kernel = &kv[0];
-	// const int s = (int)kv.size();
-	Image out = Image::Empty(*this);
+	// Columns per tile of the vertical passes, chosen so that the rows of a tile stay in L1/L2
+	BlurStripWidth = 512,
 
-	int width = GetSize().x;
-	for (int j = 0; j < GetSize().y; ++j)
-	{
-		const T* __restrict src = GetRow<T>(j);
-		T* __restrict dst = out.GetRow<T>(j);
-		for (int i = 0; i < half; ++i)
-		{
-			I s = (I)src[i] * kernel[half];
-			for (int k = 1; k <= half; ++k)
-			{
-				s += (I)src[i + k] * kernel[k + half] + (I)src[abs(i - k)] * kernel[k + half];
-			}
-			dst[i] = (T)s;
-		}
-		for (int i = half; i < width - half; ++i)
-		{
-			I s = (I)src[i] * kernel[half];
-			for (int k = 1; k <= half; ++k)
-			{
-				s += (I)src[i + k] * kernel[k + half] + (I)src[i - k] * kernel[k + half];
-			}
-			dst[i] = (T)s;
-		}
-		for (int i = width - half; i < width; ++i)
-		{
-			I s = (I)src[i] * kernel[half];
-			for (int k = 1; k <= half; ++k)
-			{
-				s += (I)src[width - 1 - abs(width - 1 - i - k)] * kernel[k + half] + (I)src[i - k] * kernel[k + half];
-			}
-			dst[i] = (T)s;
-		}
-	}
-	return out;
-}
+	// Radius from which GaussAuto switches to the box cascade
+	BlurBoxCascadeRadius = 24
+};
 
-Image Image::GaussBlurX(float r) const
+inline int MirrorIndex(int i, int size)
 {
-	if (dataType == R8)
+	if (size == 1)
 	{
-		return _GaussBlurX<byte, float>(r);
+		return 0;
 	}
-	else if (dataType == R16)
+	while (i < 0 || i >= size)
 	{
-		return _GaussBlurX<uint16_t, float>(r);
+		i = i < 0 ? -i : 2 * (size - 1) - i;
 	}
-	else if (dataType == R32)
+	return i;
+}
+
+template<typename C>
+inline void LoadRowF(float* __restrict dst, const C* __restrict src, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
 	{
-		return _GaussBlurX<uint32_t, float>(r);
+		dst[i] = (float)src[i];
 	}
-	else if (dataType == RG16)
+}
+
+template<>
+inline void LoadRowF(float* __restrict dst, const uint8_t* __restrict src, size_t n)
+{
+	simd::Get().u8_to_f32(dst, src, 1.0f, n);
+}
+
+template<typename C>
+inline void StoreRowF(C* __restrict dst, const float* __restrict src, size_t n)
+{
+	if (std::is_integral<C>::value)
 	{
-		return _GaussBlurX<pixelRG16, pixelRGF>(r);
+		const float lo = (float)std::numeric_limits<C>::min();
+		// The max of 32-bit and wider types rounds up to 2^digits, which is out of range for the cast
+		const float limit = ldexpf(1.0f, std::numeric_limits<C>::digits);
+		const float hi = std::min((float)std::numeric_limits<C>::max(), nextafterf(limit, 0.0f));
+		for (size_t i = 0; i < n; ++i)
+		{
+			dst[i] = (C)std::min(std::max(src[i], lo), hi);
+		}
 	}
-	else if (dataType == RGB8)
+	else
 	{
-		return _GaussBlurX<pixelRGB8, pixelRGBF>(r);
+		for (size_t i = 0; i < n; ++i)
+		{
+			dst[i] = (C)src[i];
+		}
 	}
-	else if (dataType == RGBA8)
+}
+
+template<>
+inline void StoreRowF(uint8_t* __restrict dst, const float* __restrict src, size_t n)
+{
+	simd::Get().f32_to_u8(dst, src, 1.0f, 0.0f, n);
+}
+
+// `row` points at pixel 0, fills pixels [-pad, 0) and [width, width + pad)
+inline void PadMirrored(float* row, int width, int channels, int pad)
+{
+	for (int i = 1; i <= pad; ++i)
 	{
-		return _GaussBlurX<pixelRGBA8, pixelRGBAF>(r);
+		memcpy(row - i * channels, row + MirrorIndex(-i, width) * channels, channels * sizeof(float));
+		memcpy(row + (width - 1 + i) * channels, row + MirrorIndex(width - 1 + i, width) * channels, channels * sizeof(float));
 	}
-	else if (dataType == RF)
+}
+
+// Running sum over 2 * r + 1 pixels, `row` must be padded by r
+inline void BoxRow(float* __restrict dst, const float* __restrict row, int width, int channels, int r)
+{
+	float inv = 1.0f / (2 * r + 1);
+	float s[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+	for (int k = -r; k <= r; ++k)
 	{
-		return _GaussBlurX<float, float>(r);
+		for (int c = 0; c < channels; ++c)
+		{
+			s[c] += row[k * channels + c];
+		}
 	}
-	else if (dataType == RGF)
+	for (int i = 0; i < width; ++i)
 	{
-		return _GaussBlurX<pixelRGF, pixelRGF>(r);
+		for (int c = 0; c < channels; ++c)
+		{
+			dst[i * channels + c] = s[c] * inv;
+			s[c] += row[(i + r + 1) * channels + c] - row[(i - r) * channels + c];
+		}
 	}
-	else if (dataType == RGBF)
+}
+
+// Widths of `n` box filters whose cascade approximates a gaussian with the given sigma
+inline std::vector<int> BoxesForGauss(float sigma, int n)
+{
+	float wIdeal = sqrtf(12.0f * sigma * sigma / n + 1.0f);
+	int wl = (int)floorf(wIdeal);
+	if (wl % 2 == 0)
 	{
-		return _GaussBlurX<pixelRGBF, pixelRGBF>(r);
+		--wl;
 	}
-	else if (dataType == RGBAF)
+	int wu = wl + 2;
+	float mIdeal = (12.0f * sigma * sigma - n * wl * wl - 4.0f * n * wl - 3.0f * n) / (-4.0f * wl - 4.0f);
+	int m = (int)roundf(mIdeal);
+	std::vector<int> sizes(n);
+	for (int i = 0; i < n; ++i)
 	{
-		return _GaussBlurX<pixelRGBAF, pixelRGBAF>(r);
+		sizes[i] = i < m ? wl : wu;
 	}
-	assert(false);
-	return Image();
+	return sizes;
 }
 
-Image Image::ConnectedComponents(int* count) const
+// Horizontal pass, either a direct convolution with `kernel` or a cascade of box filters with radii `boxes`
+template<typename Cin, typename Cout>
+inline void GaussPassX(const Image& src, Image& dst, const std::vector<float>& kernel, const std::vector<int>& boxes)
 {
-	Image L = Image::Empty(GetSize(), R32);
-
-	assert(dataType == Image::R8);
-
-	int cc = cv::connectedComponents(*this, L, 8);
-
-	if (count != nullptr)
+	const int channels = src.GetChannelCount();
+	const int width = src.GetSize().x;
+	const size_t n = (size_t)width * channels;
+	int pad = (int)kernel.size() / 2;
+	for (int r: boxes)
 	{
-		*count = cc;
+		pad = std::max(pad, r + 1);
 	}
+	const simd::Kernels& k = simd::Get();
 
-	return L;
-}
-
-template<typename T>
-inline Image Image::ResizeX(Image seamMap, int reduction, bool fixCollisions) const
-{
-	Image out = Image::Empty(glm::ivec2(GetSize().x - reduction, GetSize().y), GetType());
-
-	byte* counter = new byte[GetSize().x];
-
-	int width = out.GetSize().x;
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(src.GetSize().y)
 	{
-		const T* src = GetRow<T>(j);
-		const short* srcIndex = seamMap.GetRow<short>(j);
-		T* dst = out.GetRow<T>(j);
-		int reduction_corrected = reduction;
-
-		if (fixCollisions)
+		std::vector<float> buffer((width + 2 * pad) * channels);
+		std::vector<float> result(n);
+		float* row = buffer.data() + pad * channels;
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			memset(counter, 0, GetSize().x);
-
-			for (int i = 0; i < GetSize().x; ++i)
+			LoadRowF(row, src.GetRow<Cin>(j), n);
+			if (boxes.empty())
 			{
-				counter[srcIndex[i] % GetSize().x]++;
+				PadMirrored(row, width, channels, pad);
+				k.convolve_f32(result.data(), row - pad * channels, kernel.data(), (int)kernel.size(), channels, n);
 			}
-			int red = 0;
-			int abs_red = abs(reduction);
-			for (int i = 0; i < GetSize().x; ++i)
+			else
 			{
-				red += counter[i];
-				if (red > abs_red)
+				for (size_t b = 0; b < boxes.size(); ++b)
 				{
-					if (reduction < 0)
-					{
-						reduction_corrected = -i + 1;
-					}
-					else
+					PadMirrored(row, width, channels, boxes[b] + 1);
+					BoxRow(result.data(), row, width, channels, boxes[b]);
+					if (b + 1 < boxes.size())
 					{
-						reduction_corrected = i - 1;
+						memcpy(row, result.data(), n * sizeof(float));
 					}
-					break;
 				}
 			}
-			memset(counter, 0, GetSize().x);
+			StoreRowF(dst.GetRow<Cout>(j), result.data(), n);
 		}
+	}
+	PARALLEL_END();
+}
 
-		if (reduction_corrected > 0)
-		{
-			int ii = 0;
-			for (int i = 0; i < GetSize().x; ++i)
-			{
-				if (((srcIndex[i] >= reduction_corrected)) && ii < width)
-				{
-					dst[ii] = src[i];
-					++ii;
-				}
-			}
-		}
-		else
+// Vertical convolution. Works on strips of columns so that the 2 * half + 1 source rows of a strip stay in
+// cache while the rows of a tile are produced, no transpose needed.
+template<typename Cout>
+inline void GaussPassY(const Image& src, Image& dst, const std::vector<float>& kernel)
+{
+	const int height = src.GetSize().y;
+	const size_t n = (size_t)src.GetSize().x * src.GetChannelCount();
+	const int half = (int)kernel.size() / 2;
+	const simd::Kernels& k = simd::Get();
+
+	PARALLEL_BEGIN(height)
+	{
+		float acc[BlurStripWidth];
+		for (size_t x = 0; x < n; x += BlurStripWidth)
 		{
-			int ii = 0;
-			for (int i = 0; i < GetSize().x; ++i)
+			size_t m = std::min((size_t)BlurStripWidth, n - x);
+			for (int j = p_begin; j < p_end; ++j)
 			{
-				if (ii < width)
+				memset(acc, 0, m * sizeof(float));
+				for (int t = -half; t <= half; ++t)
 				{
-					dst[ii] = src[i];
-					++ii;
-					if ((srcIndex[i] < -reduction_corrected) && ii < width)
-					{
-						dst[ii] = src[i];
-						++ii;
-					}
+					k.axpy_f32(acc, src.GetRow<float>(MirrorIndex(j + t, height)) + x, kernel[t + half], m);
 				}
+				StoreRowF(dst.GetRow<Cout>(j) + x, acc, m);
 			}
 		}
 	}
-	delete[] counter;
-	return out;
+	PARALLEL_END();
 }
 
-template<typename T>
-inline Image Image::ResizeX(const std::vector<uint16_t>& col, int reduction) const
+// Vertical box filter with a running sum per column, constant cost per pixel for any radius
+template<typename Cout>
+inline void BoxPassY(const Image& src, Image& dst, int r)
 {
-	Image out = Image::Empty(glm::ivec2(GetSize().x - reduction, GetSize().y), GetType());
+	const int height = src.GetSize().y;
+	const size_t n = (size_t)src.GetSize().x * src.GetChannelCount();
+	const float inv = 1.0f / (2 * r + 1);
+	const simd::Kernels& k = simd::Get();
 
-	int width = out.GetSize().x;
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(height)
 	{
-		const T* src = GetRow<T>(j);
-		T* dst = out.GetRow<T>(j);
-
-		if (reduction > 0)
+		float acc[BlurStripWidth];
+		float out[BlurStripWidth];
+		for (size_t x = 0; x < n; x += BlurStripWidth)
 		{
-			int ii = 0;
-			for (int i = 0; i < GetSize().x; ++i)
+			size_t m = std::min((size_t)BlurStripWidth, n - x);
+			memset(acc, 0, m * sizeof(float));
+			for (int t = -r; t <= r; ++t)
 			{
-				if (col[i] >= reduction && ii < width)
-				{
-					dst[ii] = src[i];
-					++ii;
-				}
+				k.add_f32(acc, acc, src.GetRow<float>(MirrorIndex(p_begin + t, height)) + x, m);
 			}
-		}
-		else
-		{
-			int ii = 0;
-			for (int i = 0; i < GetSize().x; ++i)
+			for (int j = p_begin; j < p_end; ++j)
 			{
-				if (ii < width)
-				{
-					dst[ii] = src[i];
-					++ii;
-					if (col[i] < -reduction && ii < width)
-					{
-						dst[ii] = src[i];
-						++ii;
+				k.mul_scalar_f32(out, acc, inv, m);
+				StoreRowF(dst.GetRow<Cout>(j) + x, out, m);
+				k.add_f32(acc, acc, src.GetRow<float>(MirrorIndex(j + r + 1, height)) + x, m);
+				k.sub_f32(acc, acc, src.GetRow<float>(MirrorIndex(j - r, height)) + x, m);
+			}
+		}
+	}
+	PARALLEL_END();
+}
+
+template<typename C>
+inline Image GaussBlurImpl(const Image& src, float r, Image::BlurType type, bool vertical)
+{
+	int half = int(r);
+	if (type == Image::GaussAuto)
+	{
+		type = half >= BlurBoxCascadeRadius ? Image::GaussBoxCascade : Image::GaussExact;
+	}
+	Image::DataType floatType = (Image::DataType)(Image::RF + src.GetChannelCount() - 1);
+	Image out = Image::Empty(src);
+
+	if (type == Image::GaussExact)
+	{
+		std::vector<float> kernel = misc::GaussKernel(r / 3.0f, half * 2 + 1);
+		if (!vertical)
+		{
+			GaussPassX<C, C>(src, out, kernel, std::vector<int>());
+			return out;
+		}
+		Image tmp = Image::Empty(src.GetSize(), floatType);
+		GaussPassX<C, float>(src, tmp, kernel, std::vector<int>());
+		GaussPassY<C>(tmp, out, kernel);
+		return out;
+	}
+
+	std::vector<int> boxes = BoxesForGauss(r / 3.0f, 3);
+	for (int& b: boxes)
+	{
+		b /= 2;
+	}
+	if (!vertical)
+	{
+		GaussPassX<C, C>(src, out, std::vector<float>(), boxes);
+		return out;
+	}
+	Image a = Image::Empty(src.GetSize(), floatType);
+	Image b = Image::Empty(src.GetSize(), floatType);
+	GaussPassX<C, float>(src, a, std::vector<float>(), boxes);
+	BoxPassY<float>(a, b, boxes[0]);
+	BoxPassY<float>(b, a, boxes[1]);
+	BoxPassY<C>(a, out, boxes[2]);
+	return out;
+}
+
+int Image::GetGaussBlurSupport(float r, BlurType type)
+{
+	int half = int(r);
+	if (type == GaussAuto)
+	{
+		type = half >= BlurBoxCascadeRadius ? GaussBoxCascade : GaussExact;
+	}
+	if (type == GaussExact)
+	{
+		return half;
+	}
+	int support = 0;
+	for (int b: BoxesForGauss(r / 3.0f, 3))
+	{
+		support += b / 2;
+	}
+	return support;
+}
+
+Image Image::GaussBlur(float r, BlurType type) const
+{
+	if (dataType == R8 || dataType == RGB8 || dataType == RGBA8)
+	{
+		return GaussBlurImpl<byte>(*this, r, type, true);
+	}
+	else if (dataType == R16)
+	{
+		return GaussBlurImpl<uint16_t>(*this, r, type, true);
+	}
+	else if (dataType == R32)
+	{
+		return GaussBlurImpl<uint32_t>(*this, r, type, true);
+	}
+	else if (dataType == RG16)
+	{
+		return GaussBlurImpl<int16_t>(*this, r, type, true);
+	}
+	else if (dataType & FLOAT_POINT)
+	{
+		return GaussBlurImpl<float>(*this, r, type, true);
+	}
+	assert(false);
+	return Image();
+}
+
+Image Image::GaussBlurX(float r, BlurType type) const
+{
+	if (dataType == R8 || dataType == RGB8 || dataType == RGBA8)
+	{
+		return GaussBlurImpl<byte>(*this, r, type, false);
+	}
+	else if (dataType == R16)
+	{
+		return GaussBlurImpl<uint16_t>(*this, r, type, false);
+	}
+	else if (dataType == R32)
+	{
+		return GaussBlurImpl<uint32_t>(*this, r, type, false);
+	}
+	else if (dataType == RG16)
+	{
+		return GaussBlurImpl<int16_t>(*this, r, type, false);
+	}
+	else if (dataType & FLOAT_POINT)
+	{
+		return GaussBlurImpl<float>(*this, r, type, false);
+	}
+	assert(false);
+	return Image();
+}
+
+inline float ResampleSupport(Image::ResampleFilter filter)
+{
+	switch (filter)
+	{
+		case Image::ResampleBox: return 0.5f;
+		case Image::ResampleBSpline: return 2.0f;
+		case Image::ResampleMitchell: return 2.0f;
+		case Image::ResampleLanczos3: return 3.0f;
+	}
+	return 0.0f;
+}
+
+inline float ResampleKernel(Image::ResampleFilter filter, float x)
+{
+	x = fabsf(x);
+	switch (filter)
+	{
+		case Image::ResampleBox:
+			return x < 0.5f ? 1.0f : 0.0f;
+		case Image::ResampleBSpline:
+			if (x < 1.0f) return (4.0f + x * x * (3.0f * x - 6.0f)) / 6.0f;
+			if (x < 2.0f) return (2.0f - x) * (2.0f - x) * (2.0f - x) / 6.0f;
+			return 0.0f;
+		case Image::ResampleMitchell:
+		{
+			const float B = 1.0f / 3.0f;
+			const float C = 1.0f / 3.0f;
+			if (x < 1.0f) return ((12.0f - 9.0f * B - 6.0f * C) * x * x * x + (-18.0f + 12.0f * B + 6.0f * C) * x * x + (6.0f - 2.0f * B)) / 6.0f;
+			if (x < 2.0f) return ((-B - 6.0f * C) * x * x * x + (6.0f * B + 30.0f * C) * x * x + (-12.0f * B - 48.0f * C) * x + (8.0f * B + 24.0f * C)) / 6.0f;
+			return 0.0f;
+		}
+		case Image::ResampleLanczos3:
+		{
+			if (x < 1e-6f) return 1.0f;
+			if (x >= 3.0f) return 0.0f;
+			float px = utils::k_pi * x;
+			return 3.0f * sinf(px) * sinf(px / 3.0f) / (px * px);
+		}
+	}
+	return 0.0f;
+}
+
+typedef Image::ResampleWeights ResampleWeights;
+
+inline ResampleWeights MakeResampleWeights(int srcSize, int dstSize, Image::ResampleFilter filter)
+{
+	const float scale = (float)srcSize / dstSize;
+	// Downsampling stretches the filter to cover the source footprint of an output pixel
+	const float filterScale = std::max(scale, 1.0f);
+	const float support = ResampleSupport(filter) * filterScale;
+
+	std::vector<int> lo(dstSize);
+	std::vector<int> hi(dstSize);
+	// Weights of source pixels [a0, b0], out of range taps are clamped to the border
+	std::vector<float> dense;
+	std::vector<std::vector<float> > windows(dstSize);
+	int taps = 1;
+	for (int i = 0; i < dstSize; ++i)
+	{
+		float center = (i + 0.5f) * scale;
+		int begin = (int)floorf(center - support - 0.5f);
+		int end = (int)ceilf(center + support - 0.5f);
+		int a0 = std::min(std::max(begin, 0), srcSize - 1);
+		int b0 = std::min(std::max(end, 0), srcSize - 1);
+		dense.assign(b0 - a0 + 1, 0.0f);
+		float sum = 0.0f;
+		for (int k = begin; k <= end; ++k)
+		{
+			float w = ResampleKernel(filter, (k + 0.5f - center) / filterScale);
+			dense[std::min(std::max(k, 0), srcSize - 1) - a0] += w;
+			sum += w;
+		}
+		int a = a0;
+		int b = b0;
+		while (a < b && dense[a - a0] == 0.0f) ++a;
+		while (b > a && dense[b - a0] == 0.0f) --b;
+		if (sum == 0.0f)
+		{
+			// Can only happen with box filter when upsampling exactly on a pixel border
+			a = b = std::min(std::max((int)center, a0), b0);
+			dense[a - a0] = sum = 1.0f;
+		}
+		lo[i] = a;
+		hi[i] = b;
+		windows[i].assign(dense.begin() + (a - a0), dense.begin() + (b - a0) + 1);
+		for (float& w: windows[i])
+		{
+			w /= sum;
+		}
+		taps = std::max(taps, b - a + 1);
+	}
+
+	ResampleWeights r;
+	r.taps = taps;
+	r.first.resize(dstSize);
+	r.weights.assign((size_t)dstSize * taps, 0.0f);
+	for (int i = 0; i < dstSize; ++i)
+	{
+		// Shift the window left near the right border, so that all `taps` pixels exist
+		int first = std::min(lo[i], srcSize - taps);
+		r.first[i] = first;
+		std::copy(windows[i].begin(), windows[i].end(), r.weights.begin() + (size_t)i * taps + (lo[i] - first));
+	}
+	return r;
+}
+
+template<typename C>
+inline float ChannelMax()
+{
+	return std::is_integral<C>::value ? (float)std::numeric_limits<C>::max() : 1.0f;
+}
+
+// Loads a row converting color channels to linear light, alpha of 4-channel images is kept
+template<typename C>
+inline void DecodeRow(float* __restrict dst, const C* __restrict src, size_t pixels, int channels, float gamma, const std::vector<float>& lut)
+{
+	size_t n = pixels * channels;
+	if (gamma == 1.0f)
+	{
+		LoadRowF(dst, src, n);
+		return;
+	}
+	const float maxv = ChannelMax<C>();
+	const int colors = channels == 4 ? 3 : channels;
+	for (size_t i = 0; i < n; i += channels)
+	{
+		for (int c = 0; c < colors; ++c)
+		{
+			dst[i + c] = lut.empty() ? maxv * powf(std::max((float)src[i + c], 0.0f) / maxv, gamma) : lut[(size_t)src[i + c]];
+		}
+		if (colors != channels)
+		{
+			dst[i + 3] = (float)src[i + 3];
+		}
+	}
+}
+
+// Inverse of DecodeRow, integer types are rounded to nearest
+template<typename C>
+inline void EncodeRow(C* __restrict dst, float* __restrict src, size_t pixels, int channels, float gamma)
+{
+	size_t n = pixels * channels;
+	if (gamma != 1.0f)
+	{
+		const float maxv = ChannelMax<C>();
+		const float inv = 1.0f / gamma;
+		const int colors = channels == 4 ? 3 : channels;
+		for (size_t i = 0; i < n; i += channels)
+		{
+			for (int c = 0; c < colors; ++c)
+			{
+				src[i + c] = maxv * powf(std::max(src[i + c], 0.0f) / maxv, inv);
+			}
+		}
+	}
+	if (std::is_integral<C>::value)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			src[i] = floorf(src[i] + 0.5f);
+		}
+	}
+	StoreRowF(dst, src, n);
+}
+
+template<typename C>
+inline std::vector<float> MakeDecodeLUT(float gamma)
+{
+	std::vector<float> lut;
+	if (gamma != 1.0f && std::is_unsigned<C>::value && sizeof(C) <= 2)
+	{
+		const float maxv = ChannelMax<C>();
+		lut.resize((size_t)maxv + 1);
+		for (size_t v = 0; v < lut.size(); ++v)
+		{
+			lut[v] = maxv * powf(v / maxv, gamma);
+		}
+	}
+	return lut;
+}
+
+// Weights of output pixels [begin, begin + count) with source indices relative to `origin`
+inline ResampleWeights SliceResampleWeights(const ResampleWeights& w, int begin, int count, int origin)
+{
+	ResampleWeights r;
+	r.taps = w.taps;
+	r.first.resize(count);
+	for (int i = 0; i < count; ++i)
+	{
+		r.first[i] = w.first[begin + i] - origin;
+	}
+	r.weights.assign(w.weights.begin() + (size_t)begin * w.taps, w.weights.begin() + (size_t)(begin + count) * w.taps);
+	return r;
+}
+
+// Source pixels [lo, hi) read by output pixels [begin, begin + count)
+inline void GetResampleSourceRange(const ResampleWeights& w, int begin, int count, int& lo, int& hi)
+{
+	lo = std::numeric_limits<int>::max();
+	hi = std::numeric_limits<int>::min();
+	for (int i = begin; i < begin + count; ++i)
+	{
+		lo = std::min(lo, w.first[i]);
+		hi = std::max(hi, w.first[i] + w.taps);
+	}
+}
+
+// Horizontal pass into a float image of size (dst width, src height), then vertical pass into `dst`.
+// Gamma is decoded when loading source rows and encoded when storing the result, 1 disables either.
+template<typename Cin, typename Cout>
+inline void ResampleImpl(const Image& src, Image& dst, const ResampleWeights& wx, const ResampleWeights& wy, float decodeGamma, float encodeGamma)
+{
+	const int channels = src.GetChannelCount();
+	const glm::ivec2 srcSize = src.GetSize();
+	const glm::ivec2 dstSize = dst.GetSize();
+	const std::vector<float> lut = MakeDecodeLUT<Cin>(decodeGamma);
+	const simd::Kernels& k = simd::Get();
+
+	Image tmp = Image::Empty(glm::ivec2(dstSize.x, srcSize.y), (Image::DataType)(Image::RF + channels - 1));
+
+	PARALLEL_BEGIN(srcSize.y)
+	{
+		// One extra float, the row kernel may read past the last pixel
+		std::vector<float> row((size_t)srcSize.x * channels + 1);
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			DecodeRow(row.data(), src.GetRow<Cin>(j), srcSize.x, channels, decodeGamma, lut);
+			k.resample_row_f32(tmp.GetRow<float>(j), row.data(), wx.first.data(), wx.weights.data(), wx.taps, channels, dstSize.x);
+		}
+	}
+	PARALLEL_END();
+
+	const size_t n = (size_t)dstSize.x * channels;
+	// Whole pixels per strip, gamma is not applied to alpha
+	const size_t stripWidth = BlurStripWidth / channels * channels;
+	PARALLEL_BEGIN(dstSize.y)
+	{
+		float acc[BlurStripWidth];
+		for (size_t x = 0; x < n; x += stripWidth)
+		{
+			size_t m = std::min(stripWidth, n - x);
+			for (int j = p_begin; j < p_end; ++j)
+			{
+				memset(acc, 0, m * sizeof(float));
+				const float* w = wy.weights.data() + (size_t)j * wy.taps;
+				for (int t = 0; t < wy.taps; ++t)
+				{
+					if (w[t] != 0.0f)
+					{
+						k.axpy_f32(acc, tmp.GetRow<float>(wy.first[j] + t) + x, w[t], m);
+					}
+				}
+				EncodeRow(dst.GetRow<Cout>(j) + x, acc, m / channels, channels, encodeGamma);
+			}
+		}
+	}
+	PARALLEL_END();
+}
+
+template<typename Cin, typename Cout>
+inline void ResampleImpl(const Image& src, Image& dst, Image::ResampleFilter filter, float decodeGamma, float encodeGamma)
+{
+	const ResampleWeights wx = MakeResampleWeights(src.GetSize().x, dst.GetSize().x, filter);
+	const ResampleWeights wy = MakeResampleWeights(src.GetSize().y, dst.GetSize().y, filter);
+	ResampleImpl<Cin, Cout>(src, dst, wx, wy, decodeGamma, encodeGamma);
+}
+
+// Calls `emit` for every level of the chain, starting with `src` itself. Linear light levels live in one float buffer
+// with two regions used in turns: level k + 2 always fits where level k was. Encoded levels share one buffer as well,
+// so an emitted level is only valid until `emit` returns.
+template<typename C>
+inline void BuildMipChain(const Image& src, Image::ResampleFilter filter, float gamma, const std::function<void(const Image&)>& emit)
+{
+	emit(src);
+	glm::ivec2 size = src.GetSize();
+	if (size.x <= 1 && size.y <= 1)
+	{
+		return;
+	}
+	const int channels = src.GetChannelCount();
+	const glm::ivec2 size1 = glm::max(size / 2, glm::ivec2(1));
+	const glm::ivec2 size2 = glm::max(size1 / 2, glm::ivec2(1));
+	Image linear = Image::Empty(glm::ivec2(size1.x, size1.y + size2.y), (Image::DataType)(Image::RF + channels - 1));
+	Image encoded = Image::Empty(size1, src.GetType());
+
+	Image previous;
+	for (int level = 1; size.x > 1 || size.y > 1; ++level)
+	{
+		size = glm::max(size / 2, glm::ivec2(1));
+		Image next = linear.OpenView(glm::ivec2(0, level % 2 == 1 ? 0 : size1.y), size);
+		if (level == 1)
+		{
+			ResampleImpl<C, float>(src, next, filter, gamma, 1.0f);
+		}
+		else
+		{
+			ResampleImpl<float, float>(previous, next, filter, 1.0f, 1.0f);
+		}
+		previous = next;
+
+		Image out = encoded.OpenView(glm::ivec2(0), size);
+		PARALLEL_BEGIN(size.y)
+		{
+			std::vector<float> row((size_t)size.x * channels);
+			for (int j = p_begin; j < p_end; ++j)
+			{
+				memcpy(row.data(), next.GetRow<float>(j), row.size() * sizeof(float));
+				EncodeRow(out.GetRow<C>(j), row.data(), size.x, channels, gamma);
+			}
+		}
+		PARALLEL_END();
+		emit(out);
+	}
+}
+
+template<typename C>
+inline std::vector<Image> GenerateMipmapsImpl(const Image& src, Image::ResampleFilter filter, float gamma)
+{
+	std::vector<Image> levels;
+	BuildMipChain<C>(src, filter, gamma, [&levels](const Image& level)
+	{
+		levels.push_back(level.Copy());
+	});
+	return levels;
+}
+
+// PVR v3 header fields for an uncompressed image type
+inline void GetPVRFormat(Image::DataType type, uint64_t& pixelFormat, uint32_t& channelType)
+{
+	typedef Render::TextureFormat TF;
+	switch (type)
+	{
+		case Image::R8: pixelFormat = TF::R8; channelType = TF::UnsignedByteNormalized; return;
+		case Image::RGB8: pixelFormat = TF::RGB888; channelType = TF::UnsignedByteNormalized; return;
+		case Image::RGBA8: pixelFormat = TF::RGBA8888; channelType = TF::UnsignedByteNormalized; return;
+		case Image::R16: pixelFormat = TF::R16; channelType = TF::UnsignedShortNormalized; return;
+		case Image::RG16: pixelFormat = TF::RG1616; channelType = TF::SignedShortNormalized; return;
+		case Image::R32: pixelFormat = TF::R32; channelType = TF::UnsignedIntegerNormalized; return;
+		case Image::RF: pixelFormat = TF::R32; channelType = TF::Float; return;
+		case Image::RGF: pixelFormat = TF::RG3232; channelType = TF::Float; return;
+		case Image::RGBF: pixelFormat = TF::RGB323232; channelType = TF::Float; return;
+		case Image::RGBAF: pixelFormat = TF::RGBA32323232; channelType = TF::Float; return;
+		default: break;
+	}
+	throw utils::runtime_error("Image type %d can not be stored in PVR", (int)type);
+}
+
+template<typename C>
+inline void SaveMipmapsToPVRImpl(const Image& src, const char* filename, Image::ResampleFilter filter, float gamma)
+{
+	uint64_t pixelFormat = 0;
+	uint32_t channelType = 0;
+	GetPVRFormat(src.GetType(), pixelFormat, channelType);
+
+	const glm::ivec2 size = src.GetSize();
+	uint32_t mipCount = 1;
+	for (glm::ivec2 s = size; s.x > 1 || s.y > 1; s = glm::max(s / 2, glm::ivec2(1)))
+	{
+		++mipCount;
+	}
+
+	std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(filename, "wb"), &fclose);
+	if (!file)
+	{
+		throw utils::runtime_error("Can't open file %s for writing", filename);
+	}
+	// version, flags, pixel format, colour space, channel type, height, width, depth, surfaces, faces, mips, meta data size
+	const uint32_t magic = 0x03525650;
+	const uint32_t flags = 0;
+	const uint32_t colourSpace = gamma != 1.0f ? Render::TextureFormat::sRGB : Render::TextureFormat::lRGB;
+	const uint32_t dims[] = {(uint32_t)size.y, (uint32_t)size.x, 1, 1, 1, mipCount, 0};
+	bool ok = fwrite(&magic, 4, 1, file.get()) == 1
+		&& fwrite(&flags, 4, 1, file.get()) == 1
+		&& fwrite(&pixelFormat, 8, 1, file.get()) == 1
+		&& fwrite(&colourSpace, 4, 1, file.get()) == 1
+		&& fwrite(&channelType, 4, 1, file.get()) == 1
+		&& fwrite(dims, sizeof(dims), 1, file.get()) == 1;
+
+	BuildMipChain<C>(src, filter, gamma, [&](const Image& level)
+	{
+		for (int j = 0; j < level.GetSize().y && ok; ++j)
+		{
+			ok = fwrite(level.GetRow<uint8_t>(j), level.GetRowSize(), 1, file.get()) == 1;
+		}
+	});
+	if (!ok)
+	{
+		throw utils::runtime_error("Failed writing to %s", filename);
+	}
+}
+
+Image Image::Resample(glm::ivec2 size, ResampleFilter filter, float gamma) const
+{
+	Image out = Empty(size, dataType);
+	if (dataType == R8 || dataType == RGB8 || dataType == RGBA8)
+	{
+		ResampleImpl<byte, byte>(*this, out, filter, gamma, gamma);
+		return out;
+	}
+	else if (dataType == R16)
+	{
+		ResampleImpl<uint16_t, uint16_t>(*this, out, filter, gamma, gamma);
+		return out;
+	}
+	else if (dataType == R32)
+	{
+		ResampleImpl<uint32_t, uint32_t>(*this, out, filter, gamma, gamma);
+		return out;
+	}
+	else if (dataType == RG16)
+	{
+		ResampleImpl<int16_t, int16_t>(*this, out, filter, gamma, gamma);
+		return out;
+	}
+	else if (dataType & FLOAT_POINT)
+	{
+		ResampleImpl<float, float>(*this, out, filter, gamma, gamma);
+		return out;
+	}
+	assert(false);
+	return Image();
+}
+
+void Image::GetResampleRegion(glm::ivec2 srcSize, glm::ivec2 size, glm::ivec2 windowPos, glm::ivec2 windowSize, ResampleFilter filter,
+	glm::ivec2& regionPos, glm::ivec2& regionSize)
+{
+	GetResampleRegion(MakeResampleWeights(srcSize.x, size.x, filter), MakeResampleWeights(srcSize.y, size.y, filter), windowPos, windowSize,
+		regionPos, regionSize);
+}
+
+Image::ResampleWeights Image::ComputeResampleWeights(int srcSize, int dstSize, ResampleFilter filter)
+{
+	return MakeResampleWeights(srcSize, dstSize, filter);
+}
+
+void Image::GetResampleRegion(const ResampleWeights& wx, const ResampleWeights& wy, glm::ivec2 windowPos, glm::ivec2 windowSize,
+	glm::ivec2& regionPos, glm::ivec2& regionSize)
+{
+	glm::ivec2 hi;
+	GetResampleSourceRange(wx, windowPos.x, windowSize.x, regionPos.x, hi.x);
+	GetResampleSourceRange(wy, windowPos.y, windowSize.y, regionPos.y, hi.y);
+	regionSize = hi - regionPos;
+}
+
+Image Image::ResampleWindow(glm::ivec2 srcSize, glm::ivec2 cropPos, glm::ivec2 size, glm::ivec2 windowPos, glm::ivec2 windowSize,
+	ResampleFilter filter, float gamma) const
+{
+	return ResampleWindow(MakeResampleWeights(srcSize.x, size.x, filter), MakeResampleWeights(srcSize.y, size.y, filter), cropPos,
+		windowPos, windowSize, gamma);
+}
+
+Image Image::ResampleWindow(const ResampleWeights& fullX, const ResampleWeights& fullY, glm::ivec2 cropPos, glm::ivec2 windowPos,
+	glm::ivec2 windowSize, float gamma) const
+{
+	const ResampleWeights wx = SliceResampleWeights(fullX, windowPos.x, windowSize.x, cropPos.x);
+	const ResampleWeights wy = SliceResampleWeights(fullY, windowPos.y, windowSize.y, cropPos.y);
+	int lo, hi;
+	GetResampleSourceRange(wx, 0, windowSize.x, lo, hi);
+	bool covered = lo >= 0 && hi <= this->size.x;
+	GetResampleSourceRange(wy, 0, windowSize.y, lo, hi);
+	covered = covered && lo >= 0 && hi <= this->size.y;
+	if (!covered)
+	{
+		throw utils::runtime_error("Crop at %d, %d of size %dx%d does not cover the resample window", cropPos.x, cropPos.y, this->size.x, this->size.y);
+	}
+
+	Image out = Empty(windowSize, dataType);
+	if (dataType == R8 || dataType == RGB8 || dataType == RGBA8)
+	{
+		ResampleImpl<byte, byte>(*this, out, wx, wy, gamma, gamma);
+		return out;
+	}
+	else if (dataType == R16)
+	{
+		ResampleImpl<uint16_t, uint16_t>(*this, out, wx, wy, gamma, gamma);
+		return out;
+	}
+	else if (dataType == R32)
+	{
+		ResampleImpl<uint32_t, uint32_t>(*this, out, wx, wy, gamma, gamma);
+		return out;
+	}
+	else if (dataType == RG16)
+	{
+		ResampleImpl<int16_t, int16_t>(*this, out, wx, wy, gamma, gamma);
+		return out;
+	}
+	else if (dataType & FLOAT_POINT)
+	{
+		ResampleImpl<float, float>(*this, out, wx, wy, gamma, gamma);
+		return out;
+	}
+	assert(false);
+	return Image();
+}
+
+std::vector<Image> Image::GenerateMipmaps(ResampleFilter filter, float gamma) const
+{
+	if (dataType == R8 || dataType == RGB8 || dataType == RGBA8)
+	{
+		return GenerateMipmapsImpl<byte>(*this, filter, gamma);
+	}
+	else if (dataType == R16)
+	{
+		return GenerateMipmapsImpl<uint16_t>(*this, filter, gamma);
+	}
+	else if (dataType == R32)
+	{
+		return GenerateMipmapsImpl<uint32_t>(*this, filter, gamma);
+	}
+	else if (dataType == RG16)
+	{
+		return GenerateMipmapsImpl<int16_t>(*this, filter, gamma);
+	}
+	else if (dataType & FLOAT_POINT)
+	{
+		return GenerateMipmapsImpl<float>(*this, filter, gamma);
+	}
+	assert(false);
+	return std::vector<Image>();
+}
+
+void Image::SaveMipmapsToPVR(const char* filename, ResampleFilter filter, float gamma) const
+{
+	if (dataType == R8 || dataType == RGB8 || dataType == RGBA8)
+	{
+		SaveMipmapsToPVRImpl<byte>(*this, filename, filter, gamma);
+	}
+	else if (dataType == R16)
+	{
+		SaveMipmapsToPVRImpl<uint16_t>(*this, filename, filter, gamma);
+	}
+	else if (dataType == R32)
+	{
+		SaveMipmapsToPVRImpl<uint32_t>(*this, filename, filter, gamma);
+	}
+	else if (dataType == RG16)
+	{
+		SaveMipmapsToPVRImpl<int16_t>(*this, filename, filter, gamma);
+	}
+	else if (dataType & FLOAT_POINT)
+	{
+		SaveMipmapsToPVRImpl<float>(*this, filename, filter, gamma);
+	}
+	else
+	{
+		assert(false);
+	}
+}
+
+// Block-parallel 8-connected labeling. Rows are split into strips which are labeled independently with the
+// SAUF decision tree (same as LabelingWu), each strip with its own equivalence table and per-label stats.
+// The tables are then concatenated, labels touching across strip borders are united, and the final
+// relabeling runs per strip again. Roots are always the smallest label, and provisional labels grow in
+// raster order, so components are numbered the same way as by the serial labeler.
+namespace
+{
+	typedef uint32_t LabelT;
+
+	// Coordinate sums are kept in 64 bits, float would lose precision on large components
+	struct StatsAccum
+	{
+		int area = 0;
+		glm::ivec2 bbox_min = glm::ivec2(std::numeric_limits<int>::max());
+		glm::ivec2 bbox_max = glm::ivec2(std::numeric_limits<int>::min());
+		int64_t sum_x = 0;
+		int64_t sum_y = 0;
+
+		void Add(int i, int j)
+		{
+			area++;
+			bbox_min = glm::min(bbox_min, glm::ivec2(i, j));
+			bbox_max = glm::max(bbox_max, glm::ivec2(i, j));
+			sum_x += i;
+			sum_y += j;
+		}
+
+		void Merge(const StatsAccum& x)
+		{
+			area += x.area;
+			bbox_min = glm::min(bbox_min, x.bbox_min);
+			bbox_max = glm::max(bbox_max, x.bbox_max);
+			sum_x += x.sum_x;
+			sum_y += x.sum_y;
+		}
+	};
+
+	struct StripLabels
+	{
+		int begin = 0;
+		int end = 0;
+		LabelT base = 0;
+		std::vector<LabelT> P;
+		std::vector<StatsAccum> stats;
+	};
+
+	template<bool Stats>
+	inline LabelT NewLabel(StripLabels& strip)
+	{
+		LabelT l = (LabelT)strip.P.size();
+		strip.P.push_back(l);
+		if (Stats)
+		{
+			strip.stats.emplace_back();
+		}
+		return l;
+	}
+
+	template<bool Stats>
+	void LabelStrip(const Image& img, Image& labels, StripLabels& strip)
+	{
+		using cv::connectedcomponents::set_union;
+		const int w = img.GetSize().x;
+		strip.P.assign(1, 0);
+		strip.stats.assign(1, StatsAccum());
+
+		// The first row of a strip only looks to the left, borders with the strip above are merged later
+		{
+			const int r = strip.begin;
+			const uint8_t* img_row = img.GetRow<uint8_t>(r);
+			LabelT* labels_row = labels.GetRow<LabelT>(r);
+			for (int c = 0; c < w; ++c)
+			{
+				if (img_row[c] == 0)
+				{
+					labels_row[c] = 0;
+					continue;
+				}
+				LabelT l = c > 0 && img_row[c - 1] > 0 ? labels_row[c - 1] : NewLabel<Stats>(strip);
+				labels_row[c] = l;
+				if (Stats)
+				{
+					strip.stats[l].Add(c, r);
+				}
+			}
+		}
+
+		for (int r = strip.begin + 1; r < strip.end; ++r)
+		{
+			const uint8_t* img_row = img.GetRow<uint8_t>(r);
+			const uint8_t* img_row_prev = img.GetRow<uint8_t>(r - 1);
+			LabelT* labels_row = labels.GetRow<LabelT>(r);
+			const LabelT* labels_row_prev = labels.GetRow<LabelT>(r - 1);
+			LabelT* P = strip.P.data();
+
+			for (int c = 0; c < w; ++c)
+			{
+				if (img_row[c] == 0)
+				{
+					labels_row[c] = 0;
+					continue;
+				}
+				LabelT l;
+				if (img_row_prev[c] > 0)
+				{
+					l = labels_row_prev[c];
+				}
+				else if (c < w - 1 && img_row_prev[c + 1] > 0)
+				{
+					if (c > 0 && img_row_prev[c - 1] > 0)
+					{
+						l = set_union(P, labels_row_prev[c - 1], labels_row_prev[c + 1]);
+					}
+					else if (c > 0 && img_row[c - 1] > 0)
+					{
+						l = set_union(P, labels_row[c - 1], labels_row_prev[c + 1]);
+					}
+					else
+					{
+						l = labels_row_prev[c + 1];
+					}
+				}
+				else if (c > 0 && img_row_prev[c - 1] > 0)
+				{
+					l = labels_row_prev[c - 1];
+				}
+				else if (c > 0 && img_row[c - 1] > 0)
+				{
+					l = labels_row[c - 1];
+				}
+				else
+				{
+					l = NewLabel<Stats>(strip);
+					P = strip.P.data();
+				}
+				labels_row[c] = l;
+				if (Stats)
+				{
+					strip.stats[l].Add(c, r);
+				}
+			}
+		}
+	}
+}
+
+Image Image::ConnectedComponents(int* count, std::vector<ComponentStats>* stats) const
+{
+	using cv::connectedcomponents::set_union;
+	assert(dataType == Image::R8);
+
+	Image L = Image::Empty(GetSize(), R32);
+	const int w = GetSize().x;
+	const int h = GetSize().y;
+
+	// Strips are a few times more than threads, but not so thin that border merging dominates
+	int threads = utils::ThreadPool::Get().GetThreadCount();
+	int stripCount = std::max(1, std::min(threads * 4, h / 32));
+	std::vector<StripLabels> strips(stripCount);
+	for (int s = 0; s < stripCount; ++s)
+	{
+		strips[s].begin = (int)((int64_t)h * s / stripCount);
+		strips[s].end = (int)((int64_t)h * (s + 1) / stripCount);
+	}
+
+	PARALLEL_BEGIN(stripCount)
+	{
+		for (int s = p_begin; s < p_end; ++s)
+		{
+			if (stats != nullptr)
+			{
+				LabelStrip<true>(*this, L, strips[s]);
+			}
+			else
+			{
+				LabelStrip<false>(*this, L, strips[s]);
+			}
+		}
+	}
+	PARALLEL_END();
+
+	// Global equivalence table: local label l of strip s becomes base + l, label 0 stays background
+	std::vector<LabelT> P(1, 0);
+	for (auto& strip: strips)
+	{
+		strip.base = (LabelT)P.size() - 1;
+		for (size_t l = 1; l < strip.P.size(); ++l)
+		{
+			P.push_back(strip.base + strip.P[l]);
+		}
+	}
+
+	for (int s = 1; s < stripCount; ++s)
+	{
+		int r = strips[s].begin;
+		const uint8_t* img_row = GetRow<uint8_t>(r);
+		const uint8_t* img_row_prev = GetRow<uint8_t>(r - 1);
+		const LabelT* labels_row = L.GetRow<LabelT>(r);
+		const LabelT* labels_row_prev = L.GetRow<LabelT>(r - 1);
+		for (int c = 0; c < w; ++c)
+		{
+			if (img_row[c] == 0)
+			{
+				continue;
+			}
+			LabelT x = strips[s].base + labels_row[c];
+			for (int k = std::max(c - 1, 0); k <= std::min(c + 1, w - 1); ++k)
+			{
+				if (img_row_prev[k] > 0)
+				{
+					set_union(P.data(), x, strips[s - 1].base + labels_row_prev[k]);
+				}
+			}
+		}
+	}
+
+	LabelT nLabels = cv::connectedcomponents::flattenL(P.data(), (LabelT)P.size());
+
+	PARALLEL_BEGIN(stripCount)
+	{
+		for (int s = p_begin; s < p_end; ++s)
+		{
+			// Local lookup table keeps background at 0, so the loop below has no branches
+			std::vector<LabelT>& local = strips[s].P;
+			for (size_t l = 1; l < local.size(); ++l)
+			{
+				local[l] = P[strips[s].base + l];
+			}
+			for (int r = strips[s].begin; r < strips[s].end; ++r)
+			{
+				LabelT* labels_row = L.GetRow<LabelT>(r);
+				for (int c = 0; c < w; ++c)
+				{
+					labels_row[c] = local[labels_row[c]];
+				}
+			}
+		}
+	}
+	PARALLEL_END();
+
+	if (stats != nullptr)
+	{
+		std::vector<StatsAccum> accum(nLabels);
+		for (auto& strip: strips)
+		{
+			for (size_t l = 1; l < strip.stats.size(); ++l)
+			{
+				accum[P[strip.base + l]].Merge(strip.stats[l]);
+			}
+		}
+		stats->assign(nLabels, ComponentStats());
+		for (LabelT l = 1; l < nLabels; ++l)
+		{
+			ComponentStats& s = (*stats)[l];
+			s.area = accum[l].area;
+			s.bbox_min = accum[l].bbox_min;
+			s.bbox_max = accum[l].bbox_max;
+			s.centroid = glm::vec2(double(accum[l].sum_x) / s.area, double(accum[l].sum_y) / s.area);
+		}
+	}
+
+	if (count != nullptr)
+	{
+		*count = (int)nLabels;
+	}
+
+	return L;
+}
+
+// Seam carving works on a luma plane stored row-major with stride `w`, vertical seams only: horizontal seams are
+// traced on the transposed plane. Rows of the plane shrink by one pixel per removed seam.
+template<typename C>
+inline void LoadLuma(const Image& src, std::vector<float>& luma, bool transpose)
+{
+	const glm::ivec2 size = src.GetSize();
+	const int channels = src.GetChannelCount();
+	// Alpha does not contribute to energy
+	const int colors = channels == 4 ? 3 : channels;
+	const float inv = 1.0f / colors;
+	luma.resize((size_t)size.x * size.y);
+
+	PARALLEL_BEGIN(size.y)
+	{
+		std::vector<float> row((size_t)size.x * channels);
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			LoadRowF(row.data(), src.GetRow<C>(j), row.size());
+			for (int i = 0; i < size.x; ++i)
+			{
+				float s = 0.0f;
+				for (int c = 0; c < colors; ++c)
+				{
+					s += row[i * channels + c];
+				}
+				luma[transpose ? (size_t)i * size.y + j : (size_t)j * size.x + i] = s * inv;
+			}
+		}
+	}
+	PARALLEL_END();
+}
+
+inline void LoadSeamLuma(const Image& src, std::vector<float>& luma, bool transpose)
+{
+	Image::DataType t = src.GetType();
+	if (t == Image::R8 || t == Image::RGB8 || t == Image::RGBA8)
+	{
+		LoadLuma<uint8_t>(src, luma, transpose);
+	}
+	else if (t == Image::R16)
+	{
+		LoadLuma<uint16_t>(src, luma, transpose);
+	}
+	else if (t == Image::R32)
+	{
+		LoadLuma<uint32_t>(src, luma, transpose);
+	}
+	else if (t == Image::RG16)
+	{
+		LoadLuma<int16_t>(src, luma, transpose);
+	}
+	else if (t & Image::FLOAT_POINT)
+	{
+		LoadLuma<float>(src, luma, transpose);
+	}
+	else
+	{
+		assert(false);
+	}
+}
+
+// Sum of absolute central differences, one-sided at the borders. `width` is the current width of the rows.
+inline float SeamEnergyAt(const float* luma, int stride, int width, int height, int i, int j)
+{
+	const float* row = luma + (size_t)j * stride;
+	float dx = row[std::min(i + 1, width - 1)] - row[std::max(i - 1, 0)];
+	float dy = luma[(size_t)std::min(j + 1, height - 1) * stride + i] - luma[(size_t)std::max(j - 1, 0) * stride + i];
+	return fabsf(dx) + fabsf(dy);
+}
+
+inline void ComputeSeamEnergy(const std::vector<float>& luma, std::vector<float>& energy, int w, int h)
+{
+	energy.resize((size_t)w * h);
+	PARALLEL_BEGIN(h)
+	{
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			for (int i = 0; i < w; ++i)
+			{
+				energy[(size_t)j * w + i] = SeamEnergyAt(luma.data(), w, w, h, i, j);
+			}
+		}
+	}
+	PARALLEL_END();
+}
+
+// Traces `seams` minimal vertical seams one after another, removing each from the plane. order[j * w + i] receives
+// the index of the seam that went through pixel (i, j), pixels that are left get seams + their position in the row.
+// Cumulative cost rows are computed with SIMD, removal and energy update run in parallel over rows.
+inline void TraceSeams(std::vector<float> luma, int w, int h, int seams, std::vector<uint16_t>& order)
+{
+	seams = std::min(seams, w - 1);
+	std::vector<float> energy;
+	ComputeSeamEnergy(luma, energy, w, h);
+	std::vector<int> column((size_t)w * h);
+	for (size_t k = 0; k < column.size(); ++k)
+	{
+		column[k] = (int)(k % w);
+	}
+	order.resize((size_t)w * h);
+
+	// Cost rows are padded with one infinite value on both sides
+	const size_t costStride = w + 2;
+	std::vector<float> cost(costStride * h, std::numeric_limits<float>::infinity());
+	std::vector<int> path(h);
+	const simd::Kernels& k = simd::Get();
+
+	for (int s = 0, width = w; s < seams; ++s, --width)
+	{
+		memcpy(&cost[1], &energy[0], width * sizeof(float));
+		cost[width + 1] = std::numeric_limits<float>::infinity();
+		for (int j = 1; j < h; ++j)
+		{
+			float* dst = &cost[j * costStride + 1];
+			k.min3_add_f32(dst, dst - costStride, &energy[(size_t)j * w], width);
+			dst[width] = std::numeric_limits<float>::infinity();
+		}
+
+		const float* last = &cost[(h - 1) * costStride + 1];
+		path[h - 1] = (int)(std::min_element(last, last + width) - last);
+		for (int j = h - 1; j > 0; --j)
+		{
+			const float* prev = &cost[(j - 1) * costStride + 1];
+			int x = path[j];
+			int best = x;
+			if (prev[x - 1] < prev[best]) best = x - 1;
+			if (prev[x + 1] < prev[best]) best = x + 1;
+			path[j - 1] = best;
+		}
+
+		PARALLEL_BEGIN(h)
+		{
+			for (int j = p_begin; j < p_end; ++j)
+			{
+				size_t row = (size_t)j * w;
+				int x = path[j];
+				order[row + column[row + x]] = (uint16_t)s;
+				int tail = width - x - 1;
+				memmove(&luma[row + x], &luma[row + x + 1], tail * sizeof(float));
+				memmove(&energy[row + x], &energy[row + x + 1], tail * sizeof(float));
+				memmove(&column[row + x], &column[row + x + 1], tail * sizeof(int));
+			}
+		}
+		PARALLEL_END();
+
+		// Only pixels that became neighbours across the seam change their horizontal gradient
+		PARALLEL_BEGIN(h)
+		{
+			for (int j = p_begin; j < p_end; ++j)
+			{
+				for (int i = std::max(path[j] - 1, 0); i <= std::min(path[j], width - 2); ++i)
+				{
+					energy[(size_t)j * w + i] = SeamEnergyAt(luma.data(), w, width - 1, h, i, j);
+				}
+			}
+		}
+		PARALLEL_END();
+	}
+
+	const int left = w - seams;
+	PARALLEL_BEGIN(h)
+	{
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			size_t row = (size_t)j * w;
+			for (int i = 0; i < left; ++i)
+			{
+				order[row + column[row + i]] = (uint16_t)(seams + i);
+			}
+		}
+	}
+	PARALLEL_END();
+}
+
+// Coarse-to-fine: seams are traced on a plane box-downsampled 2^levels times, then every fine row is ordered by
+// the order of the coarse pixel above it, ties (pixels of the same coarse block) broken by fine energy.
+inline void TraceSeamsCoarseToFine(const std::vector<float>& luma, int w, int h, int seams, int levels, std::vector<uint16_t>& order)
+{
+	const int factor = 1 << levels;
+	const int cw = std::max(w / factor, 2);
+	const int ch = std::max(h / factor, 1);
+	std::vector<float> coarse((size_t)cw * ch, 0.0f);
+	PARALLEL_BEGIN(ch)
+	{
+		for (int cj = p_begin; cj < p_end; ++cj)
+		{
+			int j0 = cj * h / ch;
+			int j1 = (cj + 1) * h / ch;
+			for (int ci = 0; ci < cw; ++ci)
+			{
+				int i0 = ci * w / cw;
+				int i1 = (ci + 1) * w / cw;
+				float s = 0.0f;
+				for (int j = j0; j < j1; ++j)
+				{
+					for (int i = i0; i < i1; ++i)
+					{
+						s += luma[(size_t)j * w + i];
 					}
 				}
+				coarse[(size_t)cj * cw + ci] = s / std::max((j1 - j0) * (i1 - i0), 1);
+			}
+		}
+	}
+	PARALLEL_END();
+
+	std::vector<uint16_t> coarseOrder;
+	TraceSeams(coarse, cw, ch, (seams + factor - 1) / factor, coarseOrder);
+
+	std::vector<float> energy;
+	ComputeSeamEnergy(luma, energy, w, h);
+	order.resize((size_t)w * h);
+	PARALLEL_BEGIN(h)
+	{
+		std::vector<int> idx(w);
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			const uint16_t* c = &coarseOrder[(size_t)std::min(j * ch / h, ch - 1) * cw];
+			const float* e = &energy[(size_t)j * w];
+			for (int i = 0; i < w; ++i)
+			{
+				idx[i] = i;
+			}
+			std::sort(idx.begin(), idx.end(), [&](int a, int b)
+			{
+				uint16_t ca = c[std::min(a * cw / w, cw - 1)];
+				uint16_t cb = c[std::min(b * cw / w, cw - 1)];
+				return ca != cb ? ca < cb : (e[a] != e[b] ? e[a] < e[b] : a < b);
+			});
+			for (int i = 0; i < w; ++i)
+			{
+				order[(size_t)j * w + idx[i]] = (uint16_t)i;
+			}
+		}
+	}
+	PARALLEL_END();
+}
+
+Image Image::ComputeEnergy() const
+{
+	std::vector<float> luma;
+	std::vector<float> energy;
+	LoadSeamLuma(*this, luma, false);
+	ComputeSeamEnergy(luma, energy, size.x, size.y);
+	Image out = Empty(size, RF);
+	for (int j = 0; j < size.y; ++j)
+	{
+		memcpy(out.GetRow<float>(j), &energy[(size_t)j * size.x], size.x * sizeof(float));
+	}
+	return out;
+}
+
+Image Image::ComputeSeamMap(bool vertical, int seams, int levels) const
+{
+	const int w = vertical ? size.x : size.y;
+	const int h = vertical ? size.y : size.x;
+	if (w > std::numeric_limits<int16_t>::max())
+	{
+		throw utils::runtime_error("Seam map supports up to %d pixels across seams, got %d", (int)std::numeric_limits<int16_t>::max(), w);
+	}
+	std::vector<float> luma;
+	LoadSeamLuma(*this, luma, !vertical);
+
+	std::vector<uint16_t> order;
+	if (levels > 0 && (w >> levels) >= 2)
+	{
+		TraceSeamsCoarseToFine(luma, w, h, seams, levels, order);
+	}
+	else
+	{
+		TraceSeams(luma, w, h, seams, order);
+	}
+
+	Image out = Empty(size, R16);
+	PARALLEL_BEGIN(size.y)
+	{
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			uint16_t* dst = out.GetRow<uint16_t>(j);
+			for (int i = 0; i < size.x; ++i)
+			{
+				dst[i] = vertical ? order[(size_t)j * w + i] : order[(size_t)i * w + j];
 			}
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
-template<typename T>
-inline Image Image::ResizeY(Image seamMap, int reduction, bool fixCollisions) const
+// Seam maps resized together with the image may hold the same index several times. Counts the indices of a row
+// (or column) and returns the reduction that keeps the output filled, same sign as `reduction`.
+template<typename F>
+inline int FixSeamCollisions(int size, int reduction, std::vector<int>& counter, F index)
 {
-	byte* counter = new byte[GetSize().y];
+	std::fill(counter.begin(), counter.end(), 0);
+	for (int i = 0; i < size; ++i)
+	{
+		counter[index(i) % size]++;
+	}
+	int red = 0;
+	int abs_red = abs(reduction);
+	for (int i = 0; i < size; ++i)
+	{
+		red += counter[i];
+		if (red > abs_red)
+		{
+			return reduction < 0 ? -i + 1 : i - 1;
+		}
+	}
+	return reduction;
+}
 
-	Image out = Image::Empty(glm::ivec2(GetSize().x, GetSize().y - reduction), GetType());
+template<typename T>
+inline Image Image::ResizeX(Image seamMap, int reduction, bool fixCollisions) const
+{
+	Image out = Image::Empty(glm::ivec2(GetSize().x - reduction, GetSize().y), GetType());
 
-	if (reduction > 0)
+	int width = out.GetSize().x;
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		int height = out.GetSize().y;
-		for (int i = 0; i < GetSize().x; ++i)
+		std::vector<int> counter(fixCollisions ? GetSize().x : 0);
+		for (int j = p_begin; j < p_end; ++j)
 		{
+			const T* src = GetRow<T>(j);
+			const short* srcIndex = seamMap.GetRow<short>(j);
+			T* dst = out.GetRow<T>(j);
 			int reduction_corrected = reduction;
 
 			if (fixCollisions)
 			{
-				memset(counter, 0, GetSize().y);
+				reduction_corrected = FixSeamCollisions(GetSize().x, reduction, counter, [srcIndex](int i) { return srcIndex[i]; });
+			}
 
-				for (int j = 0; j < GetSize().y; ++j)
+			if (reduction_corrected > 0)
+			{
+				int ii = 0;
+				for (int i = 0; i < GetSize().x; ++i)
 				{
-					counter[seamMap.GetRow<short>(j)[i] % GetSize().y]++;
+					if (((srcIndex[i] >= reduction_corrected)) && ii < width)
+					{
+						dst[ii] = src[i];
+						++ii;
+					}
 				}
-				int red = 0;
-				int abs_red = abs(reduction);
-				for (int j = 0; j < GetSize().y; ++j)
+			}
+			else
+			{
+				int ii = 0;
+				for (int i = 0; i < GetSize().x; ++i)
 				{
-					red += counter[j];
-					if (red > abs_red)
+					if (ii < width)
 					{
-						if (reduction < 0)
-						{
-							reduction_corrected = -j + 1;
-						}
-						else
+						dst[ii] = src[i];
+						++ii;
+						if ((srcIndex[i] < -reduction_corrected) && ii < width)
 						{
-							reduction_corrected = j - 1;
+							dst[ii] = src[i];
+							++ii;
 						}
-						break;
 					}
 				}
 			}
+		}
+	}
+	PARALLEL_END();
+	return out;
+}
 
-			int jj = 0;
-			for (int j = 0; j < GetSize().y; ++j)
-			{
-				const T* src = GetRow<T>(j);
-				const short* srcIndex = seamMap.GetRow<short>(j);
-				T* dst = out.GetRow<T>(jj % height);
+template<typename T>
+inline Image Image::ResizeX(const std::vector<uint16_t>& col, int reduction) const
+{
+	Image out = Image::Empty(glm::ivec2(GetSize().x - reduction, GetSize().y), GetType());
+
+	int width = out.GetSize().x;
+	PARALLEL_BEGIN(GetSize().y)
+	{
+		for (int j = p_begin; j < p_end; ++j)
+		{
+			const T* src = GetRow<T>(j);
+			T* dst = out.GetRow<T>(j);
 
-				if (srcIndex[i] >= reduction_corrected && jj < height)
+			if (reduction > 0)
+			{
+				int ii = 0;
+				for (int i = 0; i < GetSize().x; ++i)
 				{
-					dst[i] = src[i];
-					++jj;
+					if (col[i] >= reduction && ii < width)
+					{
+						dst[ii] = src[i];
+						++ii;
+					}
+				}
+			}
+			else
+			{
+				int ii = 0;
+				for (int i = 0; i < GetSize().x; ++i)
+				{
+					if (ii < width)
+					{
+						dst[ii] = src[i];
+						++ii;
+						if (col[i] < -reduction && ii < width)
+						{
+							dst[ii] = src[i];
+							++ii;
+						}
+					}
 				}
 			}
 		}
 	}
-	else
+	PARALLEL_END();
+	return out;
+}
+
+// Columns are independent, so tiles of columns are processed in parallel
+template<typename T>
+inline Image Image::ResizeY(Image seamMap, int reduction, bool fixCollisions) const
+{
+	Image out = Image::Empty(glm::ivec2(GetSize().x, GetSize().y - reduction), GetType());
+
+	int height = out.GetSize().y;
+	PARALLEL_BEGIN(GetSize().x)
 	{
-		int height = out.GetSize().y;
-		for (int i = 0; i < GetSize().x; ++i)
+		std::vector<int> counter(fixCollisions ? GetSize().y : 0);
+		for (int i = p_begin; i < p_end; ++i)
 		{
 			int reduction_corrected = reduction;
 
 			if (fixCollisions)
 			{
-				memset(counter, 0, GetSize().y);
-
-				for (int j = 0; j < GetSize().y; ++j)
-				{
-					counter[seamMap.GetRow<short>(j)[i] % GetSize().y]++;
-				}
-				int red = 0;
-				int abs_red = abs(reduction);
-				for (int j = 0; j < GetSize().y; ++j)
-				{
-					red += counter[j];
-					if (red > abs_red)
-					{
-						if (reduction < 0)
-						{
-							reduction_corrected = -j + 1;
-						}
-						else
-						{
-							reduction_corrected = j - 1;
-						}
-						break;
-					}
-				}
+				reduction_corrected = FixSeamCollisions(GetSize().y, reduction, counter, [&seamMap, i](int j) { return seamMap.GetRow<short>(j)[i]; });
 			}
 
 			int jj = 0;
@@ -1658,7 +3380,15 @@ inline Image Image::ResizeY(Image seamMap, int reduction, bool fixCollisions) co
 				const short* srcIndex = seamMap.GetRow<short>(j);
 				T* dst = out.GetRow<T>(jj % height);
 
-				if (jj < height)
+				if (reduction > 0)
+				{
+					if (srcIndex[i] >= reduction_corrected && jj < height)
+					{
+						dst[i] = src[i];
+						++jj;
+					}
+				}
+				else if (jj < height)
 				{
 					dst[i] = src[i];
 					++jj;
@@ -1672,7 +3402,7 @@ inline Image Image::ResizeY(Image seamMap, int reduction, bool fixCollisions) co
 			}
 		}
 	}
-	delete[] counter;
+	PARALLEL_END();
 	return out;
 }
 
@@ -1681,10 +3411,10 @@ inline Image Image::ResizeY(const std::vector<uint16_t>& rows, int reduction) co
 {
 	Image out = Image::Empty(glm::ivec2(GetSize().x, GetSize().y - reduction), GetType());
 
-	if (reduction > 0)
+	int height = out.GetSize().y;
+	PARALLEL_BEGIN(GetSize().x)
 	{
-		int height = out.GetSize().y;
-		for (int i = 0; i < GetSize().x; ++i)
+		for (int i = p_begin; i < p_end; ++i)
 		{
 			int jj = 0;
 			for (int j = 0; j < GetSize().y; ++j)
@@ -1692,35 +3422,29 @@ inline Image Image::ResizeY(const std::vector<uint16_t>& rows, int reduction) co
 				const T* src = GetRow<T>(j);
 				T* dst = out.GetRow<T>(jj % height);
 
-				if (rows[j] >= reduction)
+				if (reduction > 0)
 				{
-					dst[i] = src[i];
-					++jj;
+					if (rows[j] >= reduction)
+					{
+						dst[i] = src[i];
+						++jj;
+					}
 				}
-			}
-		}
-	}
-	else
-	{
-		int height = out.GetSize().y;
-		for (int i = 0; i < GetSize().x; ++i)
-		{
-			int jj = 0;
-			for (int j = 0; j < GetSize().y; ++j)
-			{
-				const T* src = GetRow<T>(j);
-				T* dst = out.GetRow<T>(jj % height);
-				dst[i] = src[i];
-				++jj;
-				if (rows[j] < -reduction)
+				else
 				{
-					dst = out.GetRow<T>(jj % height);
 					dst[i] = src[i];
 					++jj;
+					if (rows[j] < -reduction)
+					{
+						dst = out.GetRow<T>(jj % height);
+						dst[i] = src[i];
+						++jj;
+					}
 				}
 			}
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
@@ -1843,13 +3567,15 @@ void Image::SaveToTGA(const char * filename)
 	buff[0xe] = height % 256;
 	buff[0xf] = height / 256;
 	buff[0x10] = 24;
+	// Top-left origin, rows are written in memory order and the file can be mapped back with MapTGA
+	buff[0x11] = 0x20;
 	fwrite(buff, headerSize, 1, file);
 
 	int channelCount = GetChannelCount();
 
 	uint8_t* row = new uint8_t[GetSize().x * 3];
 
-	for (int j = size.y - 1; j >= 0; --j)
+	for (int j = 0; j < size.y; ++j)
 	{
 		uint8_t* p = GetRow<uint8_t>(j);
 		for (int j = 0; j < GetSize().x; ++j)
@@ -1871,3 +3597,533 @@ void Image::SaveToTGA(const char * filename)
 	delete[] row;
 	fclose(file);
 }
+
+
+#include <doctest.h>
+
+TEST_CASE("[Image] Fused expressions match eager ops")
+{
+	glm::ivec2 size(1000, 7);
+	Image a = Image::Empty(size, Image::RGBAF);
+	Image b = Image::Empty(size, Image::RGBAF);
+	Image a8 = Image::Empty(size, Image::RGBA8);
+	Image b8 = Image::Empty(size, Image::RGBA8);
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x * 4; ++i)
+		{
+			a.GetRow<float>(j)[i] = (float)(i * 7 % 13) - 6.0f;
+			b.GetRow<float>(j)[i] = (float)(i * 5 % 11) + 1.0f;
+			a8.GetRow<uint8_t>(j)[i] = (uint8_t)(i * 37 + j);
+			b8.GetRow<uint8_t>(j)[i] = (uint8_t)(i * 91 + 3) | 1;
+		}
+	}
+
+	Image fused = a * 0.5f + b - a / b;
+	Image eager = a.Mul(0.5f).Add(b).Sub(a.Div(b));
+	CHECK(fused.GetType() == Image::RGBAF);
+	for (int j = 0; j < size.y; ++j)
+	{
+		CHECK(memcmp(fused.GetRow<float>(j), eager.GetRow<float>(j), fused.GetRowSize()) == 0);
+	}
+
+	Image fused8 = (a8 + b8) * 2 - 3 - a8 / b8;
+	Image eager8 = a8.Add(b8).Mul(2).Add(-3).Sub(a8.Div(b8));
+	for (int j = 0; j < size.y; ++j)
+	{
+		CHECK(memcmp(fused8.GetRow<uint8_t>(j), eager8.GetRow<uint8_t>(j), fused8.GetRowSize()) == 0);
+	}
+
+	// Operand as the destination
+	(a + b).EvalTo(a);
+	Image sum = eager.Sub(eager).Add(a);
+	CHECK(memcmp(sum.GetRow<float>(3), a.GetRow<float>(3), a.GetRowSize()) == 0);
+}
+
+TEST_CASE("[Image] GaussBlur")
+{
+	glm::ivec2 size(301, 67);
+	Image a = Image::Empty(size, Image::RGBF);
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x * 3; ++i)
+		{
+			a.GetRow<float>(j)[i] = (float)((i * 7 + j * 13) % 17);
+		}
+	}
+
+	// Separable reference computed directly
+	float r = 5.0f;
+	std::vector<float> kernel = misc::GaussKernel(r / 3.0f, 11);
+	std::vector<float> tmp(size.x * size.y * 3);
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x * 3; ++i)
+		{
+			float s = 0.0f;
+			for (int k = -5; k <= 5; ++k)
+			{
+				s += a.GetRow<float>(j)[MirrorIndex(i / 3 + k, size.x) * 3 + i % 3] * kernel[k + 5];
+			}
+			tmp[j * size.x * 3 + i] = s;
+		}
+	}
+	Image exact = a.GaussBlur(r, Image::GaussExact);
+	float maxError = 0.0f;
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x * 3; ++i)
+		{
+			float s = 0.0f;
+			for (int k = -5; k <= 5; ++k)
+			{
+				s += tmp[MirrorIndex(j + k, size.y) * size.x * 3 + i] * kernel[k + 5];
+			}
+			maxError = std::max(maxError, fabsf(s - exact.GetRow<float>(j)[i]));
+		}
+	}
+	CHECK(maxError < 1e-3f);
+
+	// The box cascade is an approximation, but close for smooth input
+	Image smooth = a.GaussBlur(30.0f, Image::GaussExact);
+	Image box = smooth.GaussBlur(30.0f, Image::GaussBoxCascade);
+	Image ref = smooth.GaussBlur(30.0f, Image::GaussExact);
+	maxError = 0.0f;
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x * 3; ++i)
+		{
+			maxError = std::max(maxError, fabsf(box.GetRow<float>(j)[i] - ref.GetRow<float>(j)[i]));
+		}
+	}
+	CHECK(maxError < 0.5f);
+
+	Image a8 = Image::Empty(size, Image::RGBA8);
+	memset(a8.GetRow<uint8_t>(0), 200, a8.GetRowSizeAligned() * size.y);
+	Image b8 = a8.GaussBlur(40.0f);
+	CHECK(b8.GetRow<uint8_t>(size.y / 2)[size.x * 2] >= 199);
+
+	// Saturated 32-bit pixels are clamped below 2^32, which doesn't fit
+	Image a32 = Image::Empty(size, Image::R32);
+	for (int j = 0; j < size.y; ++j)
+	{
+		std::fill(a32.GetRow<uint32_t>(j), a32.GetRow<uint32_t>(j) + size.x, std::numeric_limits<uint32_t>::max());
+	}
+	Image b32 = a32.GaussBlur(r);
+	CHECK(b32.GetRow<uint32_t>(size.y / 2)[size.x / 2] >= 4294967040u);
+}
+
+TEST_CASE("[Image] Exact distance field")
+{
+	glm::ivec2 size(97, 61);
+	Image a = Image::Empty(size, Image::RGB8);
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x; ++i)
+		{
+			bool inside = sqr(i - 40) + sqr(j - 30) < 400 || (i > 70 && i < 80 && j > 5 && j < 50);
+			a.GetRow<Image::pixelRGB8>(j)[i] = Image::pixelRGB8(inside ? 255 : 0);
+		}
+	}
+	Image df = a.ComputeDF(Image::ExactEuclidean);
+
+	std::vector<glm::ivec2> boundary;
+	auto value = [&](int i, int j) { return a.GetRow<Image::pixelRGB8>(j)[i].x; };
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x; ++i)
+		{
+			if ((i > 0 && value(i - 1, j) != value(i, j)) || (i < size.x - 1 && value(i + 1, j) != value(i, j)) ||
+				(j > 0 && value(i, j - 1) != value(i, j)) || (j < size.y - 1 && value(i, j + 1) != value(i, j)))
+			{
+				boundary.push_back(glm::ivec2(i, j));
+			}
+		}
+	}
+
+	float maxError = 0.0f;
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x; ++i)
+		{
+			float best = 1e8f;
+			for (auto b: boundary)
+			{
+				best = std::min(best, sqrtf(float(sqr(i - b.x) + sqr(j - b.y))));
+			}
+			float expected = value(i, j) ? best : -best;
+			maxError = std::max(maxError, fabsf(df.GetRow<float>(j)[i] - expected));
+		}
+	}
+	CHECK(maxError < 1e-4f);
+}
+
+TEST_CASE("[Image] Parallel connected components")
+{
+	glm::ivec2 size(203, 517);
+	Image a = Image::Empty(size, Image::R8);
+	unsigned seed = 7;
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x; ++i)
+		{
+			seed = seed * 1103515245u + 12345u;
+			bool ring = abs(sqr(i - 100) + sqr(j - 250) - 90 * 90) < 400;
+			a.GetRow<uint8_t>(j)[i] = ((seed >> 16) % 3 == 0 || ring) ? 255 : 0;
+		}
+	}
+
+	int count = 0;
+	std::vector<Image::ComponentStats> stats;
+	Image labels = a.ConnectedComponents(&count, &stats);
+
+	Image ref = Image::Empty(size, Image::R32);
+	int refCount = cv::connectedComponents(a, ref, 8);
+	CHECK_EQ(count, refCount);
+	CHECK_EQ((int)stats.size(), count);
+
+	std::vector<Image::ComponentStats> refStats(refCount);
+	std::vector<glm::dvec2> sums(refCount, glm::dvec2(0.0));
+	bool same = true;
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x; ++i)
+		{
+			uint32_t l = ref.GetRow<uint32_t>(j)[i];
+			same = same && l == labels.GetRow<uint32_t>(j)[i];
+			refStats[l].area++;
+			refStats[l].bbox_min = glm::min(refStats[l].bbox_min, glm::ivec2(i, j));
+			refStats[l].bbox_max = glm::max(refStats[l].bbox_max, glm::ivec2(i, j));
+			sums[l] += glm::dvec2(i, j);
+		}
+	}
+	CHECK(same);
+	for (int l = 1; l < refCount; ++l)
+	{
+		CHECK_EQ(stats[l].area, refStats[l].area);
+		CHECK(stats[l].bbox_min == refStats[l].bbox_min);
+		CHECK(stats[l].bbox_max == refStats[l].bbox_max);
+		CHECK(fabs(stats[l].centroid.x - sums[l].x / refStats[l].area) < 1e-3);
+		CHECK(fabs(stats[l].centroid.y - sums[l].y / refStats[l].area) < 1e-3);
+	}
+}
+
+TEST_CASE("[Image] External and mapped data")
+{
+	// Borrowed buffer stays alive while any view of the image exists
+	std::shared_ptr<std::vector<float> > buffer = std::make_shared<std::vector<float> >(10 * 5, 1.0f);
+	std::weak_ptr<std::vector<float> > weak = buffer;
+	{
+		Image im = Image::FromExternalData(buffer->data(), Image::RF, glm::ivec2(7, 5), 10 * sizeof(float), buffer);
+		buffer.reset();
+		CHECK(im.IsValid());
+		Image view = im.OpenView(glm::ivec2(2, 1), glm::ivec2(5, 4));
+		im = Image();
+		CHECK(!weak.expired());
+		Image sum = view + view;
+		CHECK(sum.GetRow<float>(3)[4] == 2.0f);
+	}
+	CHECK(weak.expired());
+
+	glm::ivec2 size(33, 9);
+	Image a = Image::Empty(size, Image::RGB8);
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x * 3; ++i)
+		{
+			a.GetRow<uint8_t>(j)[i] = (uint8_t)(i * 3 + j * 7);
+		}
+	}
+
+	const char* raw = "image_map_test.raw";
+	FILE* f = fopen(raw, "wb");
+	fwrite("head", 4, 1, f);
+	for (int j = 0; j < size.y; ++j)
+	{
+		fwrite(a.GetRow<uint8_t>(j), a.GetRowSize(), 1, f);
+	}
+	fclose(f);
+	{
+		Image m = Image::MapFile(raw, Image::RGB8, size, 4);
+		CHECK(m.IsValid());
+		for (int j = 0; j < size.y; ++j)
+		{
+			CHECK(memcmp(m.GetRow<uint8_t>(j), a.GetRow<uint8_t>(j), a.GetRowSize()) == 0);
+		}
+		CHECK_THROWS(Image::MapFile(raw, Image::RGB8, size + glm::ivec2(0, 1), 4));
+
+		// Pages are mapped read-only, in-place ops must not reach them
+		CHECK(m.IsReadOnly());
+		CHECK(m.OpenView(glm::ivec2(1), glm::ivec2(4)).IsReadOnly());
+		CHECK_THROWS(m.Assign(a));
+		CHECK(!m.Copy().IsReadOnly());
+	}
+	remove(raw);
+
+	const char* tga = "image_map_test.tga";
+	a.SaveToTGA(tga);
+	{
+		Image m = Image::MapTGA(tga);
+		CHECK(m.GetType() == Image::RGB8);
+		CHECK(m.GetSize() == size);
+		bool same = true;
+		for (int j = 0; j < size.y; ++j)
+		{
+			for (int i = 0; i < size.x; ++i)
+			{
+				const uint8_t* p = a.GetRow<uint8_t>(j) + i * 3;
+				const uint8_t* q = m.GetRow<uint8_t>(j) + i * 3;
+				same = same && p[0] == q[2] && p[1] == q[1] && p[2] == q[0];
+			}
+		}
+		CHECK(same);
+	}
+	remove(tga);
+}
+
+TEST_CASE("[Image] Resample filters")
+{
+	glm::ivec2 size(38, 22);
+	Image a = Image::Empty(size, Image::RGBAF);
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x * 4; ++i)
+		{
+			a.GetRow<float>(j)[i] = (float)((i * 7 + j * 13) % 17);
+		}
+	}
+
+	// Box filter halving is the 2x2 average
+	Image half = a.Resample(size / 2, Image::ResampleBox);
+	bool same = true;
+	for (int j = 0; j < size.y / 2; ++j)
+	{
+		for (int i = 0; i < size.x / 2 * 4; ++i)
+		{
+			int c = i % 4;
+			int x = i / 4 * 2;
+			float avg = (a.GetRow<float>(2 * j)[x * 4 + c] + a.GetRow<float>(2 * j)[x * 4 + 4 + c]
+				+ a.GetRow<float>(2 * j + 1)[x * 4 + c] + a.GetRow<float>(2 * j + 1)[x * 4 + 4 + c]) / 4.0f;
+			same = same && fabsf(half.GetRow<float>(j)[i] - avg) < 1e-4f;
+		}
+	}
+	CHECK(same);
+
+	// Weights are normalized, so flat images stay flat for any filter, scale and gamma
+	Image flat = Image::Empty(size, Image::RGB8) + 100;
+	Image::ResampleFilter filters[] = {Image::ResampleBox, Image::ResampleBSpline, Image::ResampleMitchell, Image::ResampleLanczos3};
+	for (Image::ResampleFilter f: filters)
+	{
+		glm::ivec2 sizes[] = {glm::ivec2(7, 5), glm::ivec2(53, 41), glm::ivec2(1, 1)};
+		for (glm::ivec2 s: sizes)
+		{
+			Image r = flat.Resample(s, f, 2.2f);
+			bool flatResult = true;
+			for (int j = 0; j < s.y; ++j)
+			{
+				for (int i = 0; i < s.x * 3; ++i)
+				{
+					flatResult = flatResult && r.GetRow<uint8_t>(j)[i] == 100;
+				}
+			}
+			CHECK(flatResult);
+		}
+	}
+
+	// Black and white average to mid gray in linear light
+	Image bw = Image::Empty(glm::ivec2(2, 1), Image::R8);
+	bw.GetRow<uint8_t>(0)[1] = 255;
+	CHECK(bw.Resample(glm::ivec2(1, 1), Image::ResampleBox).GetRow<uint8_t>(0)[0] == 128);
+	CHECK(bw.Resample(glm::ivec2(1, 1), Image::ResampleBox, 2.2f).GetRow<uint8_t>(0)[0] == 186);
+
+	std::vector<Image> mips = flat.GenerateMipmaps(Image::ResampleLanczos3);
+	CHECK(mips.size() == 6);
+	CHECK(mips[1].GetSize() == glm::ivec2(19, 11));
+	CHECK(mips[5].GetSize() == glm::ivec2(1, 1));
+	CHECK(mips[5].GetRow<uint8_t>(0)[2] == 100);
+}
+
+TEST_CASE("[Image] Mip chain to PVR")
+{
+	glm::ivec2 size(37, 20);
+	Image a = Image::Empty(size, Image::RGB8);
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x * 3; ++i)
+		{
+			a.GetRow<uint8_t>(j)[i] = (uint8_t)(i * 5 + j * 11);
+		}
+	}
+	std::vector<Image> mips = a.GenerateMipmaps(Image::ResampleMitchell);
+
+	const char* filename = "image_mips_test.pvr";
+	a.SaveMipmapsToPVR(filename, Image::ResampleMitchell);
+	FILE* f = fopen(filename, "rb");
+	REQUIRE(f != nullptr);
+	uint32_t header[13];
+	CHECK(fread(header, sizeof(header), 1, f) == 1);
+	CHECK(header[0] == 0x03525650);
+	CHECK(header[2] == (uint32_t)Render::TextureFormat::RGB888);
+	CHECK(header[3] == (uint32_t)(Render::TextureFormat::RGB888 >> 32u));
+	CHECK(header[4] == Render::TextureFormat::sRGB);
+	CHECK(header[6] == 20);
+	CHECK(header[7] == 37);
+	CHECK(header[11] == mips.size());
+	CHECK(header[12] == 0);
+
+	bool same = true;
+	for (const Image& level: mips)
+	{
+		std::vector<uint8_t> row(level.GetRowSize());
+		for (int j = 0; j < level.GetSize().y; ++j)
+		{
+			same = same && fread(row.data(), row.size(), 1, f) == 1;
+			same = same && memcmp(row.data(), level.GetRow<uint8_t>(j), row.size()) == 0;
+		}
+	}
+	CHECK(same);
+	CHECK(fgetc(f) == EOF);
+	fclose(f);
+	remove(filename);
+}
+
+TEST_CASE("[Image] Seam carving")
+{
+	// Noise with a flat vertical band, seams must go through the band
+	glm::ivec2 size(64, 40);
+	Image a = Image::Empty(size, Image::RGB8);
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x; ++i)
+		{
+			uint8_t v = i >= 20 && i < 30 ? 128 : (uint8_t)((i * 73 + j * 151 + i * j * 7) % 256);
+			for (int c = 0; c < 3; ++c)
+			{
+				a.GetRow<uint8_t>(j)[i * 3 + c] = v;
+			}
+		}
+	}
+
+	for (int levels = 0; levels <= 1; ++levels)
+	{
+		Image map = a.ComputeSeamMap(true, 5, levels);
+		CHECK(map.GetType() == Image::R16);
+		bool permutation = true;
+		bool inBand = true;
+		for (int j = 0; j < size.y; ++j)
+		{
+			std::vector<int> seen(size.x, 0);
+			for (int i = 0; i < size.x; ++i)
+			{
+				uint16_t k = map.GetRow<uint16_t>(j)[i];
+				permutation = permutation && k < size.x && seen[k]++ == 0;
+				inBand = inBand && (k >= 5 || (i >= 18 && i < 32));
+			}
+		}
+		CHECK(permutation);
+		CHECK(inBand);
+	}
+
+	Image mapY = a.ComputeSeamMap(true, 5);
+	Image mapX = a.ComputeSeamMap(false, 3);
+	bool columns = true;
+	for (int i = 0; i < size.x; ++i)
+	{
+		std::vector<int> seen(size.y, 0);
+		for (int j = 0; j < size.y; ++j)
+		{
+			uint16_t k = mapX.GetRow<uint16_t>(j)[i];
+			columns = columns && k < size.y && seen[k]++ == 0;
+		}
+	}
+	CHECK(columns);
+
+	Image narrow = a.ResizeSimple<Image::pixelRGB8>(mapX, mapY, size - glm::ivec2(5, 0));
+	CHECK(narrow.GetSize() == glm::ivec2(59, 40));
+	bool kept = true;
+	for (int j = 0; j < size.y; ++j)
+	{
+		kept = kept && memcmp(narrow.GetRow<uint8_t>(j), a.GetRow<uint8_t>(j), 18 * 3) == 0;
+		kept = kept && memcmp(narrow.GetRow<uint8_t>(j) + 27 * 3, a.GetRow<uint8_t>(j) + 32 * 3, 32 * 3) == 0;
+	}
+	CHECK(kept);
+}
+
+TEST_CASE("[Image] Transpose")
+{
+	const Image::DataType types[] = {Image::R8, Image::R16, Image::R32, Image::RG16, Image::RGB8, Image::RGBA8,
+		Image::RF, Image::RGF, Image::RGBF, Image::RGBAF};
+	for (Image::DataType type: types)
+	{
+		// View with an odd offset and a stride wider than the row
+		Image base = Image::Empty(glm::ivec2(150, 90), type);
+		size_t bpp = base.GetBPP();
+		for (int j = 0; j < 90; ++j)
+		{
+			for (size_t i = 0; i < 150 * bpp; ++i)
+			{
+				base.GetRow<uint8_t>(j)[i] = (uint8_t)(i * 31 + j * 17);
+			}
+		}
+		Image a = base.OpenView(glm::ivec2(3, 5), glm::ivec2(131, 70));
+		Image t = a.Transpose();
+		CHECK(t.GetSize() == glm::ivec2(70, 131));
+		bool same = true;
+		for (int j = 0; j < 70; ++j)
+		{
+			for (int i = 0; i < 131; ++i)
+			{
+				same = same && memcmp(a.GetRow<uint8_t>(j) + i * bpp, t.GetRow<uint8_t>(i) + j * bpp, bpp) == 0;
+			}
+		}
+		CHECK(same);
+	}
+}
+
+TEST_CASE("[Image] Format conversion")
+{
+	Image rgba = Image::Empty(glm::ivec2(300, 2), Image::RGBA8);
+	for (int i = 0; i < 300 * 4; ++i)
+	{
+		rgba.GetRow<uint8_t>(0)[i] = (uint8_t)i;
+		rgba.GetRow<uint8_t>(1)[i] = (uint8_t)(i * 7);
+	}
+
+	for (int srgb = 0; srgb < 2; ++srgb)
+	{
+		// Every code survives the round trip through float
+		Image f = rgba.Convert(Image::RGBAF, srgb != 0);
+		CHECK(f.GetType() == Image::RGBAF);
+		Image back = f.Convert(Image::RGBA8, srgb != 0);
+		CHECK(memcmp(back.GetRow<uint8_t>(0), rgba.GetRow<uint8_t>(0), 300 * 4) == 0);
+		CHECK(memcmp(back.GetRow<uint8_t>(1), rgba.GetRow<uint8_t>(1), 300 * 4) == 0);
+
+		LinearRowReader reader(rgba, srgb != 0);
+		CHECK(memcmp(reader.GetRow(1), f.GetRow<float>(1), 300 * 4 * sizeof(float)) == 0);
+	}
+	Image f = rgba.Convert(Image::RGBAF, true);
+	CHECK(f.GetRow<float>(0)[0] == 0.0f);
+	CHECK(fabsf(f.GetRow<float>(0)[128] - 0.2158605f) < 1e-6f);
+	// Alpha is linear
+	CHECK(fabsf(f.GetRow<float>(0)[131] - 131 / 255.0f) < 1e-6f);
+
+	Image rgb = rgba.Convert(Image::RGB8);
+	Image opaque = rgb.Convert(Image::RGBA8);
+	bool swizzled = true;
+	for (int i = 0; i < 300; ++i)
+	{
+		const uint8_t* a = rgba.GetRow<uint8_t>(1) + i * 4;
+		const uint8_t* b = opaque.GetRow<uint8_t>(1) + i * 4;
+		swizzled = swizzled && a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && b[3] == 255;
+	}
+	CHECK(swizzled);
+	CHECK(fabsf(rgb.Convert(Image::RGBF).Convert(Image::RF).GetRow<float>(0)[5] - 20 / 255.0f) < 1e-6f);
+
+	// Cast keeps values, float to 8-bit truncates
+	Image c = rgba.Cast<Image::pixelRF>();
+	CHECK(c.GetRow<float>(0)[2] == 8.0f);
+	Image cf = rgba.Convert(Image::RGBAF).Mul(255.0f).Add(0.25f);
+	Image c8 = Image::Empty(rgba.GetSize(), Image::RGBA8);
+	cf._Cast<Image::pixelRGBAF, Image::pixelRGBA8>(c8);
+	CHECK(memcmp(c8.GetRow<uint8_t>(1), rgba.GetRow<uint8_t>(1), 300 * 4) == 0);
+}
@@ -1,8 +1,10 @@
 #pragma once
 #include "utils/align.h"
 #include "utils/common.h"
+#include "parallelisation.h"
 #include <glm/glm.hpp>
 
+#include <limits>
 #include <memory>
 #include <vector>
 
@@ -31,7 +33,31 @@ public:
 	{
 		Chamfer3x3,
 		DeadReckoning3x3,
-		DeadReckoning5x5
+		DeadReckoning5x5,
+		// Exact euclidean distance, computed separably with the thread pool
+		ExactEuclidean
+	};
+
+	enum BlurType
+	{
+		// Direct convolution, cost grows linearly with the radius
+		GaussExact,
+		// Three box filters with running sums, constant cost per pixel
+		GaussBoxCascade,
+		// Exact for small radii, box cascade for large ones
+		GaussAuto
+	};
+
+	enum ResampleFilter
+	{
+		// Area average when downsampling, nearest neighbour when upsampling
+		ResampleBox,
+		// Cubic B-spline, smooth and without ringing
+		ResampleBSpline,
+		// Mitchell-Netravali cubic with B = C = 1/3
+		ResampleMitchell,
+		// Windowed sinc with 3 lobes, sharpest
+		ResampleLanczos3
 	};
 
 	enum
@@ -39,6 +65,24 @@ public:
 		Alignment = 16
 	};
 
+	struct ComponentStats
+	{
+		int area = 0;
+		// Inclusive bounding box
+		glm::ivec2 bbox_min = glm::ivec2(std::numeric_limits<int>::max());
+		glm::ivec2 bbox_max = glm::ivec2(std::numeric_limits<int>::min());
+		glm::vec2 centroid = glm::vec2(0.0f);
+	};
+
+	// Per-axis weights of Resample, output pixel i takes `taps` source pixels starting from first[i]. Source pixels past
+	// the border are clamped to the edge, their weights are added to the edge pixel, so every window stays inside the source.
+	struct ResampleWeights
+	{
+		int taps = 0;
+		std::vector<int> first;
+		std::vector<float> weights;
+	};
+
 	typedef uint8_t byte;
 	typedef glm::vec<3, uint8_t> pixelRGB8;
 	typedef glm::vec<4, uint8_t> pixelRGBA8;
@@ -66,8 +110,22 @@ public:
 	// IO
 	static Image FromRawData(const void* data, DataType d, glm::ivec2 size);
 
+	// Wraps external pixels without copying. `owner` is kept alive while the image or any view of it exists,
+	// pass nullptr if the caller guarantees the lifetime. Rows don't have to be aligned. With `readOnly` set in-place
+	// operations throw.
+	static Image FromExternalData(void* data, DataType d, glm::ivec2 size, size_t rowStride, std::shared_ptr<void> owner,
+		bool readOnly = false);
+
+	// Maps raw pixels of a file starting at `offset`, rows are tightly packed. Pages are loaded on first access.
+	// Writes go to the file if `writable` is set, otherwise the image is read-only.
+	static Image MapFile(const char* filename, DataType d, glm::ivec2 size, size_t offset = 0, bool writable = false);
+
+	// Maps an uncompressed 8, 24 or 32-bit TGA stored with top-left origin. Channels are kept as stored (BGR/BGRA).
+	static Image MapTGA(const char* filename, bool writable = false);
+
 	void* ToRawData();
 
+	// Throws if the image is read-only
 	void Assign(const Image& x);
 	
 	// Basic operation
@@ -77,6 +135,38 @@ public:
 
 	Image Resample(glm::ivec2 size, bool fast=false) const;
 
+	// Separable resampling with the given filter. If gamma is not 1, color channels are filtered in linear light,
+	// value / max is raised to `gamma` before filtering and back after. Alpha is filtered as is.
+	Image Resample(glm::ivec2 size, ResampleFilter filter, float gamma = 1.0f) const;
+
+	// Part of Resample(size, filter, gamma) of a larger source, for images processed in pieces. This image is the crop at
+	// `cropPos` of a source of `srcSize` and has to cover GetResampleRegion of the window. Throws if it does not.
+	Image ResampleWindow(glm::ivec2 srcSize, glm::ivec2 cropPos, glm::ivec2 size, glm::ivec2 windowPos, glm::ivec2 windowSize,
+		ResampleFilter filter, float gamma = 1.0f) const;
+
+	// Source pixels read when resampling from `srcSize` to `size` to produce the given window
+	static void GetResampleRegion(glm::ivec2 srcSize, glm::ivec2 size, glm::ivec2 windowPos, glm::ivec2 windowSize, ResampleFilter filter,
+		glm::ivec2& regionPos, glm::ivec2& regionSize);
+
+	// Weights of one axis for resampling from `srcSize` to `dstSize`. Windows of one resample should share them, computing
+	// them takes time linear in `dstSize`.
+	static ResampleWeights ComputeResampleWeights(int srcSize, int dstSize, ResampleFilter filter);
+
+	// Same as above with weights of the whole resample for each axis
+	static void GetResampleRegion(const ResampleWeights& wx, const ResampleWeights& wy, glm::ivec2 windowPos, glm::ivec2 windowSize,
+		glm::ivec2& regionPos, glm::ivec2& regionSize);
+
+	Image ResampleWindow(const ResampleWeights& wx, const ResampleWeights& wy, glm::ivec2 cropPos, glm::ivec2 windowPos,
+		glm::ivec2 windowSize, float gamma = 1.0f) const;
+
+	// Mip chain down to 1x1 starting with this image. Each level halves the previous one (rounding down, at least 1),
+	// levels are filtered from the linear light float chain, so quantization does not accumulate.
+	std::vector<Image> GenerateMipmaps(ResampleFilter filter = ResampleBSpline, float gamma = 2.2f) const;
+
+	// Streams the mip chain into a PVR v3 file level by level, only one level is held in memory at a time.
+	// Colour space is sRGB if gamma is not 1. Throws utils::runtime_error on IO errors.
+	void SaveMipmapsToPVR(const char* filename, ResampleFilter filter = ResampleBSpline, float gamma = 2.2f) const;
+
 	// Attributes
 	DataType GetType() const;
 
@@ -86,6 +176,9 @@ public:
 
 	bool IsValid() const;
 
+	// Pixels are not writable, set for read-only mappings and external data
+	bool IsReadOnly() const;
+
 	static size_t GetBPP(DataType d);
 
 	size_t GetBPP() const;
@@ -112,8 +205,18 @@ public:
 	T* ptr(int j);
 
 	// Carving
+	// Energy for seam carving: absolute luma differences between horizontal and vertical neighbours, RF
+	Image ComputeEnergy() const;
+
+	// Seam removal order for ResizeX (vertical seams) or ResizeY (horizontal seams). R16 map where every row (column for
+	// horizontal seams) is a permutation, pixels of the k-th removed seam hold k for k < seams, the rest follow in order.
+	// With levels > 0 seams are planned on the image downsampled 2^levels times and projected back, which is much
+	// faster for large images, pixels within one coarse seam are then removed in the order of their energy.
+	Image ComputeSeamMap(bool vertical, int seams, int levels = 0) const;
+
 	Image CarveVertical(const std::vector<short>& seam) const;
 
+	// Throws if the image is read-only
 	void CarveVerticalInplace(const std::vector<short>& seam);
 
 	template<typename T>
@@ -126,9 +229,15 @@ public:
 	Image ResizeCollisionFix(Image seamMapX, Image seamMapY, glm::ivec2 newSize) const;
 
 	// Casting
+	// Values are kept as is, float to integer truncates
 	template<typename T>
 	Image Cast() const;
 
+	// Conversion between R8, RGB8, RGBA8 and float types. 8-bit channels map to [0, 1] floats and back with rounding,
+	// dropped channels are discarded, added color channels are zero and added alpha is opaque.
+	// With srgb set 8-bit color channels are sRGB encoded, alpha is always linear.
+	Image Convert(DataType d, bool srgb = false) const;
+
 	// Scalar ops
 	Image Mul(float x) const;
 
@@ -144,6 +253,9 @@ public:
 
 	Image Step(int x) const;
 
+	// x * scale + bias in one pass. Float types use FMA where available, 8-bit types saturate.
+	Image ScaleBias(float scale, float bias) const;
+
 	//Elementwise ops
 	Image Add(const Image& x) const;
 
@@ -156,11 +268,16 @@ public:
 	// Misc
 	Image ComputeDF(DFType type = DeadReckoning3x3) const;
 
-	Image ConnectedComponents(int* count = nullptr) const;
+	// Labels 8-connected components of non-zero pixels into an R32 image, 0 is the background. `count` receives
+	// the number of labels including the background. If `stats` is given, it is filled per label in the same pass.
+	Image ConnectedComponents(int* count = nullptr, std::vector<ComponentStats>* stats = nullptr) const;
 
-	Image GaussBlur(float r) const;
+	Image GaussBlur(float r, BlurType type = GaussAuto) const;
 
-	Image GaussBlurX(float r) const;
+	// Distance in pixels within which source pixels affect a pixel of GaussBlur
+	static int GetGaussBlurSupport(float r, BlurType type = GaussAuto);
+
+	Image GaussBlurX(float r, BlurType type = GaussAuto) const;
 
 	template<typename T>
 	Image ResizeX(Image seamMap, int reduction, bool fixCollisions = false) const;
@@ -171,9 +288,6 @@ public:
 	template<typename T>
 	Image ResizeY(const std::vector<uint16_t>& col, int reduction) const;
 
-	template<typename T, typename I>
-	Image _GaussBlurX(float x) const;
-
 	template<typename V, typename D>
 	Image _Mul(V x) const;
 
@@ -210,6 +324,8 @@ public:
 	void SaveToTGA(const char* filename);
 
 private:
+	void CheckWritable() const;
+
 	std::shared_ptr<byte> _ptr;
 	glm::ivec2 size = glm::ivec2(0);
 	size_t data_size = 0;
@@ -217,79 +333,30 @@ private:
 	size_t row_size = 0;
 	size_t row_stride = 0;
 	DataType dataType = R8;
+	bool readOnly = false;
 };
 
-inline Image operator - (const Image& a)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Mul(-1.0f);
-	}
-	else
-	{
-		return a.Mul(-1);
-	}
-}
-
-inline Image operator + (const Image& a)
+// Reads rows of an image as floats without converting the whole image: 8 and 16-bit channels are normalized to [0, 1],
+// float rows are returned in place. 8-bit color channels are decoded from sRGB when srgb is set.
+// A row is valid until the next call, so every thread needs its own reader.
+class LinearRowReader
 {
-	return a;
-}
-
-inline Image operator + (const Image& a, const Image& x)
-{
-	return a.Add(x);
-}
-
-inline Image operator - (const Image& a, const Image& x)
-{
-	return a.Sub(x);
-}
-
-inline Image operator * (const Image& a, const Image& x)
-{
-	return a.Mul(x);
-}
+public:
+	explicit LinearRowReader(const Image& image, bool srgb = false);
 
-inline Image operator / (const Image& a, const Image& x)
-{
-	return a.Div(x);
-}
+	const float* GetRow(int j);
 
-inline Image operator * (const Image& a, float x)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Mul(x);
-	}
-	else
-	{
-		return a.Mul((int)x);
-	}
-}
+private:
+	const Image& m_image;
+	bool m_srgb;
+	std::vector<float> m_row;
+};
 
-inline Image operator * (const Image& a, double x)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Mul((float)x);
-	}
-	else
-	{
-		return a.Mul((int)x);
-	}
-}
+#include "ImageExpr.h"
 
-inline Image operator * (const Image& a, int x)
+inline Image operator + (const Image& a)
 {
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Mul((float)x);
-	}
-	else
-	{
-		return a.Mul((int)x);
-	}
+	return a;
 }
 
 template<typename T, int d>
@@ -304,99 +371,12 @@ inline Image operator * (glm::vec<d, T> x, const Image& a)
 	return a * x;
 }
 
-inline Image operator * (float x, const Image& a)
-{
-	return a * x;
-}
-
-inline Image operator * (double x, const Image& a)
-{
-	return a * x;
-}
-
-inline Image operator / (const Image& a, float x)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Mul(1.0f / (float)x);
-	}
-	else
-	{
-		return a.Div((int)x);
-	}
-}
-
-inline Image operator / (const Image& a, double x)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Mul(1.0f / (float)x);
-	}
-	else
-	{
-		return a.Div((int)x);
-	}
-}
-
 template<typename T, int d>
 inline Image operator / (const Image& a, glm::vec<d, T> x)
 {
 	return a._Div<glm::vec<d, T>, glm::vec<d, T> >(x);
 }
 
-inline Image operator * (int x, const Image& a)
-{
-	return a * x;
-}
-
-inline Image operator / (const Image& a, int x)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Mul(1.0f / (float)x);
-	}
-	else
-	{
-		return a.Div((int)x);
-	}
-}
-
-inline Image operator + (const Image& a, int x)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Add((float)x);
-	}
-	else
-	{
-		return a.Add((int)x);
-	}
-}
-
-inline Image operator + (const Image& a, float x)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Add((float)x);
-	}
-	else
-	{
-		return a.Add((int)x);
-	}
-}
-
-inline Image operator + (const Image& a, double x)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Add((float)x);
-	}
-	else
-	{
-		return a.Add((int)x);
-	}
-}
-
 template<typename T, int d>
 inline Image operator + (const Image& a, glm::vec<d, T> x)
 {
@@ -409,57 +389,6 @@ inline Image operator + (glm::vec<d, T> x, const Image& a)
 	return a + x;
 }
 
-inline Image operator + (int x, const Image& a)
-{
-	return a + x;
-}
-
-inline Image operator + (float x, const Image& a)
-{
-	return a + x;
-}
-
-inline Image operator + (double x, const Image& a)
-{
-	return a + x;
-}
-
-inline Image operator - (const Image& a, int x)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Add(-(float)x);
-	}
-	else
-	{
-		return a.Add(-(int)x);
-	}
-}
-
-inline Image operator - (const Image& a, float x)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Add(-(float)x);
-	}
-	else
-	{
-		return a.Add(-(int)x);
-	}
-}
-
-inline Image operator - (const Image& a, double x)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return a.Add(-(float)x);
-	}
-	else
-	{
-		return a.Add(-(int)x);
-	}
-}
-
 template<typename T, int d>
 inline Image operator - (const Image& a, glm::vec<d, T> x)
 {
@@ -472,42 +401,6 @@ inline Image operator - (glm::vec<d, T> x, const Image& a)
 	return -a + x;
 }
 
-inline Image operator - (int x, const Image& a)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return (a * -1.0f).Add((float)x);
-	}
-	else
-	{
-		return (a * -1).Add((int)x);
-	}
-}
-
-inline Image operator - (float x, const Image& a)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return (a * -1.0f).Add((float)x);
-	}
-	else
-	{
-		return (a * -1).Add((int)x);
-	}
-}
-
-inline Image operator - (double x, const Image& a)
-{
-	if (a.GetType() & Image::FLOAT_POINT)
-	{
-		return (a * -1.0f).Add((float)x);
-	}
-	else
-	{
-		return (a * -1).Add((int)x);
-	}
-}
-
 inline glm::ivec2 Image::GetSize() const
 {
 	return size;
@@ -523,6 +416,11 @@ inline size_t Image::GetRowSizeAligned() const
 	return row_stride;
 }
 
+inline bool Image::IsReadOnly() const
+{
+	return readOnly;
+}
+
 inline size_t Image::GetRowSize() const
 {
 	return size.x * GetBPP();
@@ -672,18 +570,34 @@ inline Image::byte CastPixel<Image::pixelRGBAF, Image::byte>(Image::pixelRGBAF x
 	return static_cast<Image::byte>(x.x);
 }
 
+template<typename T1, typename T2>
+inline void CastRow(T2* dst, const T1* src, int n)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		dst[i] = CastPixel<T1, T2>(src[i]);
+	}
+}
+
+// 8-bit and float pixels with the same channels go through SIMD kernels
+void CastRow(Image::pixelRF* dst, const Image::pixelR8* src, int n);
+void CastRow(Image::pixelRGBF* dst, const Image::pixelRGB8* src, int n);
+void CastRow(Image::pixelRGBAF* dst, const Image::pixelRGBA8* src, int n);
+void CastRow(Image::pixelR8* dst, const Image::pixelRF* src, int n);
+void CastRow(Image::pixelRGB8* dst, const Image::pixelRGBF* src, int n);
+void CastRow(Image::pixelRGBA8* dst, const Image::pixelRGBAF* src, int n);
+
 template<typename T1, typename T2>
 Image Image::_Cast(Image& out) const
 {
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		const T1* src = GetRow<T1>(j);
-		T2* dst = out.GetRow<T2>(j);
-		for (int i = 0; i < GetSize().x; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			dst[i] = CastPixel<T1, T2>(src[i]);
+			CastRow(out.GetRow<T2>(j), GetRow<T1>(j), GetSize().x);
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
@@ -737,15 +651,19 @@ template<typename V, typename D>
 inline Image Image::_Mul(V x) const
 {
 	Image out = Image::Empty(*this);
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		const D* src = GetRow<D>(j);
-		D* dst = out.GetRow<D>(j);
-		for (int i = 0; i < GetSize().x; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			dst[i] = src[i] * x;
+			const D* src = GetRow<D>(j);
+			D* dst = out.GetRow<D>(j);
+			for (int i = 0; i < GetSize().x; ++i)
+			{
+				dst[i] = src[i] * x;
+			}
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
@@ -753,15 +671,19 @@ template<typename V, typename D>
 inline Image Image::_Add(V x) const
 {
 	Image out = Image::Empty(*this);
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		const D* src = GetRow<D>(j);
-		D* dst = out.GetRow<D>(j);
-		for (int i = 0; i < GetSize().x; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			dst[i] = src[i] + x;
+			const D* src = GetRow<D>(j);
+			D* dst = out.GetRow<D>(j);
+			for (int i = 0; i < GetSize().x; ++i)
+			{
+				dst[i] = src[i] + x;
+			}
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
@@ -769,15 +691,19 @@ template<typename V, typename D>
 inline Image Image::_Sub(V x) const
 {
 	Image out = Image::Empty(*this);
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		const D* src = GetRow<D>(j);
-		D* dst = out.GetRow<D>(j);
-		for (int i = 0; i < GetSize().x; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			dst[i] = src[i] - x;
+			const D* src = GetRow<D>(j);
+			D* dst = out.GetRow<D>(j);
+			for (int i = 0; i < GetSize().x; ++i)
+			{
+				dst[i] = src[i] - x;
+			}
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
@@ -785,15 +711,19 @@ template<typename V, typename D>
 inline Image Image::_Div(V x) const
 {
 	Image out = Image::Empty(*this);
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		const D* src = GetRow<D>(j);
-		D* dst = out.GetRow<D>(j);
-		for (int i = 0; i < GetSize().x; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			dst[i] = src[i] / x;
+			const D* src = GetRow<D>(j);
+			D* dst = out.GetRow<D>(j);
+			for (int i = 0; i < GetSize().x; ++i)
+			{
+				dst[i] = src[i] / x;
+			}
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
@@ -801,15 +731,19 @@ template<typename V, typename D>
 inline Image Image::_Step(V x) const
 {
 	Image out = Image::Empty(GetSize(), R8);
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		const D* src = GetRow<D>(j);
-		byte* dst = out.GetRow<byte>(j);
-		for (int i = 0; i < GetSize().x; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			dst[i] = (src[i] > D(x)) * 255;
+			const D* src = GetRow<D>(j);
+			byte* dst = out.GetRow<byte>(j);
+			for (int i = 0; i < GetSize().x; ++i)
+			{
+				dst[i] = (src[i] > D(x)) * 255;
+			}
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
@@ -818,15 +752,19 @@ inline Image Image::_StepV(V x) const
 {
 	Image out = Image::Empty(GetSize(), R8);
 	byte ar[2] = { (byte)0, (byte)255 };
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		const D* src = GetRow<D>(j);
-		byte* dst = out.GetRow<byte>(j);
-		for (int i = 0; i < GetSize().x; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			dst[i] = ar[glm::all(glm::greaterThan(src[i], D(x)))];
+			const D* src = GetRow<D>(j);
+			byte* dst = out.GetRow<byte>(j);
+			for (int i = 0; i < GetSize().x; ++i)
+			{
+				dst[i] = ar[glm::all(glm::greaterThan(src[i], D(x)))];
+			}
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
@@ -834,16 +772,20 @@ template<typename T>
 inline Image Image::_Add(Image x) const
 {
 	Image out = Image::Empty(*this);
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		const T* srcA = GetRow<T>(j);
-		const T* srcB = x.GetRow<T>(j);
-		T* dst = out.GetRow<T>(j);
-		for (int i = 0; i < GetSize().x; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			dst[i] = srcA[i] + srcB[i];
+			const T* srcA = GetRow<T>(j);
+			const T* srcB = x.GetRow<T>(j);
+			T* dst = out.GetRow<T>(j);
+			for (int i = 0; i < GetSize().x; ++i)
+			{
+				dst[i] = srcA[i] + srcB[i];
+			}
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
@@ -851,16 +793,20 @@ template<typename T>
 inline Image Image::_Sub(Image x) const
 {
 	Image out = Image::Empty(*this);
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		const T* srcA = GetRow<T>(j);
-		const T* srcB = x.GetRow<T>(j);
-		T* dst = out.GetRow<T>(j);
-		for (int i = 0; i < GetSize().x; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			dst[i] = srcA[i] - srcB[i];
+			const T* srcA = GetRow<T>(j);
+			const T* srcB = x.GetRow<T>(j);
+			T* dst = out.GetRow<T>(j);
+			for (int i = 0; i < GetSize().x; ++i)
+			{
+				dst[i] = srcA[i] - srcB[i];
+			}
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
@@ -868,16 +814,20 @@ template<typename T>
 inline Image Image::_Mul(Image x) const
 {
 	Image out = Image::Empty(*this);
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		const T* srcA = GetRow<T>(j);
-		const T* srcB = x.GetRow<T>(j);
-		T* dst = out.GetRow<T>(j);
-		for (int i = 0; i < GetSize().x; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			dst[i] = srcA[i] * srcB[i];
+			const T* srcA = GetRow<T>(j);
+			const T* srcB = x.GetRow<T>(j);
+			T* dst = out.GetRow<T>(j);
+			for (int i = 0; i < GetSize().x; ++i)
+			{
+				dst[i] = srcA[i] * srcB[i];
+			}
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
@@ -885,16 +835,20 @@ template<typename T>
 inline Image Image::_Div(Image x) const
 {
 	Image out = Image::Empty(*this);
-	for (int j = 0; j < GetSize().y; ++j)
+	PARALLEL_BEGIN(GetSize().y)
 	{
-		const T* srcA = GetRow<T>(j);
-		const T* srcB = x.GetRow<T>(j);
-		T* dst = out.GetRow<T>(j);
-		for (int i = 0; i < GetSize().x; ++i)
+		for (int j = p_begin; j < p_end; ++j)
 		{
-			dst[i] = srcA[i] / srcB[i];
+			const T* srcA = GetRow<T>(j);
+			const T* srcB = x.GetRow<T>(j);
+			T* dst = out.GetRow<T>(j);
+			for (int i = 0; i < GetSize().x; ++i)
+			{
+				dst[i] = srcA[i] / srcB[i];
+			}
 		}
 	}
+	PARALLEL_END();
 	return out;
 }
 
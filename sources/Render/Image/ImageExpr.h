@@ -0,0 +1,402 @@
+#pragma once
+#include "simd_kernels.h"
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+#include <type_traits>
+
+// Lazy arithmetic over images. Free operators build an expression tree instead of a temporary Image per
+// operation, and the tree is evaluated in a single pass when converted to Image, Copy()'d or EvalTo()'d.
+// Every row is processed in blocks small enough to keep all intermediate values in L1, so a chain like
+// `a * 0.5f + b - c` reads each source once and writes the destination once.
+//
+// Float and 8-bit images are fused, using the same row kernels as the eager methods, so results are
+// identical to calling Mul/Add/... step by step. Other data types fall back to the eager methods.
+namespace image_expr
+{
+	enum Op
+	{
+		OpAdd,
+		OpSub,
+		OpMul,
+		OpDiv
+	};
+
+	enum
+	{
+		BlockBytes = 2048
+	};
+
+	template<typename T>
+	struct RowOps;
+
+	template<>
+	struct RowOps<float>
+	{
+		static void Binary(Op op, float* dst, const float* a, const float* b, size_t n)
+		{
+			const simd::Kernels& k = simd::Get();
+			switch (op)
+			{
+				case OpAdd: k.add_f32(dst, a, b, n); break;
+				case OpSub: k.sub_f32(dst, a, b, n); break;
+				case OpMul: k.mul_f32(dst, a, b, n); break;
+				case OpDiv: k.div_f32(dst, a, b, n); break;
+			}
+		}
+
+		static void Scalar(Op op, float* dst, const float* a, float f, int, size_t n)
+		{
+			const simd::Kernels& k = simd::Get();
+			switch (op)
+			{
+				case OpAdd: k.add_scalar_f32(dst, a, f, n); break;
+				case OpMul: k.mul_scalar_f32(dst, a, f, n); break;
+				default: assert(false);
+			}
+		}
+	};
+
+	template<>
+	struct RowOps<uint8_t>
+	{
+		static void Binary(Op op, uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t n)
+		{
+			const simd::Kernels& k = simd::Get();
+			switch (op)
+			{
+				case OpAdd: k.add_u8(dst, a, b, n); break;
+				case OpSub: k.sub_u8(dst, a, b, n); break;
+				case OpMul: k.mul_u8(dst, a, b, n); break;
+				case OpDiv:
+					for (size_t i = 0; i < n; ++i)
+					{
+						dst[i] = a[i] / b[i];
+					}
+					break;
+			}
+		}
+
+		static void Scalar(Op op, uint8_t* dst, const uint8_t* a, float, int x, size_t n)
+		{
+			const simd::Kernels& k = simd::Get();
+			switch (op)
+			{
+				case OpAdd: k.add_scalar_u8(dst, a, x, n); break;
+				case OpMul: k.mul_scalar_u8(dst, a, x, n); break;
+				case OpDiv:
+					for (size_t i = 0; i < n; ++i)
+					{
+						dst[i] = a[i] / (uint8_t)x;
+					}
+					break;
+				default: assert(false);
+			}
+		}
+	};
+
+	// Node interface:
+	//   GetSize(), GetType()  - shape of the result
+	//   EvalRow<T>(j, i, n, scratch) - computes elements [i, i + n) of row j. Returns either `scratch`
+	//                          or a pointer straight into a source image, so leaves are never copied.
+	//   Eager()              - evaluates the node with the non-fused Image methods
+
+	template<typename Derived>
+	class Expr
+	{
+	public:
+		const Derived& Self() const { return static_cast<const Derived&>(*this); }
+
+		glm::ivec2 GetSize() const { return Self().GetSize(); }
+
+		Image::DataType GetType() const { return Self().GetType(); }
+
+		// Writes the result into an existing image of the same size and type, e.g. a view or one of the operands
+		void EvalTo(Image& out) const
+		{
+			assert(out.GetSize() == GetSize() && out.GetType() == GetType());
+			Image::DataType type = GetType();
+			if (type & Image::FLOAT_POINT)
+			{
+				Run<float>(out);
+			}
+			else if (type == Image::R8 || type == Image::RGB8 || type == Image::RGBA8)
+			{
+				Run<uint8_t>(out);
+			}
+			else
+			{
+				out.Assign(Self().Eager());
+			}
+		}
+
+		Image Copy() const
+		{
+			Image out = Image::Empty(GetSize(), GetType());
+			EvalTo(out);
+			return out;
+		}
+
+		operator Image() const
+		{
+			return Copy();
+		}
+
+	private:
+		template<typename T>
+		void Run(Image& out) const
+		{
+			const Derived& e = Self();
+			size_t n = out.GetRowSize() / sizeof(T);
+			const size_t block = BlockBytes / sizeof(T);
+			PARALLEL_BEGIN(out.GetSize().y)
+			{
+				for (int j = p_begin; j < p_end; ++j)
+				{
+					// The block is computed aside and then stored, so `out` may be one of the operands
+					alignas(32) T scratch[BlockBytes / sizeof(T)];
+					T* dst = out.GetRow<T>(j);
+					for (size_t i = 0; i < n; i += block)
+					{
+						size_t m = std::min(block, n - i);
+						const T* r = e.template EvalRow<T>(j, i, m, scratch);
+						memcpy(dst + i, r, m * sizeof(T));
+					}
+				}
+			}
+			PARALLEL_END();
+		}
+	};
+
+	class Leaf: public Expr<Leaf>
+	{
+	public:
+		explicit Leaf(const Image& im): m_im(im) {}
+
+		glm::ivec2 GetSize() const { return m_im.GetSize(); }
+
+		Image::DataType GetType() const { return m_im.GetType(); }
+
+		template<typename T>
+		const T* EvalRow(int j, size_t i, size_t, T*) const
+		{
+			return m_im.GetRow<T>(j) + i;
+		}
+
+		Image Eager() const { return m_im; }
+
+	private:
+		Image m_im;
+	};
+
+	template<Op op, typename L, typename R>
+	class Binary: public Expr<Binary<op, L, R> >
+	{
+	public:
+		Binary(const L& l, const R& r): m_l(l), m_r(r)
+		{
+			assert(l.GetSize() == r.GetSize() && l.GetType() == r.GetType());
+		}
+
+		glm::ivec2 GetSize() const { return m_l.GetSize(); }
+
+		Image::DataType GetType() const { return m_l.GetType(); }
+
+		template<typename T>
+		const T* EvalRow(int j, size_t i, size_t n, T* scratch) const
+		{
+			alignas(32) T tmp[BlockBytes / sizeof(T)];
+			const T* a = m_l.template EvalRow<T>(j, i, n, scratch);
+			const T* b = m_r.template EvalRow<T>(j, i, n, tmp);
+			RowOps<T>::Binary(op, scratch, a, b, n);
+			return scratch;
+		}
+
+		Image Eager() const
+		{
+			Image a = m_l.Eager();
+			Image b = m_r.Eager();
+			switch (op)
+			{
+				case OpAdd: return a.Add(b);
+				case OpSub: return a.Sub(b);
+				case OpMul: return a.Mul(b);
+				case OpDiv: return a.Div(b);
+			}
+			return Image();
+		}
+
+	private:
+		L m_l;
+		R m_r;
+	};
+
+	// Operation with a constant. Float images use `f`, integer images use `i`, the same way the eager
+	// operators pick between Mul(float) and Mul(int). Only OpAdd, OpMul and integer OpDiv are valid here.
+	template<typename L>
+	class Scalar: public Expr<Scalar<L> >
+	{
+	public:
+		Scalar(const L& l, Op op, float f, int i): m_l(l), m_op(op), m_f(f), m_i(i) {}
+
+		glm::ivec2 GetSize() const { return m_l.GetSize(); }
+
+		Image::DataType GetType() const { return m_l.GetType(); }
+
+		template<typename T>
+		const T* EvalRow(int j, size_t i, size_t n, T* scratch) const
+		{
+			const T* a = m_l.template EvalRow<T>(j, i, n, scratch);
+			RowOps<T>::Scalar(m_op, scratch, a, m_f, m_i, n);
+			return scratch;
+		}
+
+		Image Eager() const
+		{
+			Image a = m_l.Eager();
+			bool fp = (a.GetType() & Image::FLOAT_POINT) != 0;
+			switch (m_op)
+			{
+				case OpAdd: return fp ? a.Add(m_f) : a.Add(m_i);
+				case OpMul: return fp ? a.Mul(m_f) : a.Mul(m_i);
+				case OpDiv: return a.Div(m_i);
+				default: assert(false);
+			}
+			return Image();
+		}
+
+	private:
+		L m_l;
+		Op m_op;
+		float m_f;
+		int m_i;
+	};
+
+	// Maps an operand of the free operators to its node type: Image becomes a Leaf, nodes stay as they are.
+	template<typename T, typename Enable = void>
+	struct Operand
+	{
+		enum { value = false };
+	};
+
+	template<>
+	struct Operand<Image>
+	{
+		enum { value = true };
+		typedef Leaf type;
+		static Leaf Make(const Image& x) { return Leaf(x); }
+	};
+
+	template<typename T>
+	struct Operand<T, typename std::enable_if<std::is_base_of<Expr<T>, T>::value>::type>
+	{
+		enum { value = true };
+		typedef T type;
+		static const T& Make(const T& x) { return x; }
+	};
+
+	template<typename A, typename B, typename R>
+	using EnableIfOperands = typename std::enable_if<Operand<A>::value && Operand<B>::value, R>::type;
+
+	template<typename A, typename S, typename R>
+	using EnableIfScalar = typename std::enable_if<Operand<A>::value && std::is_arithmetic<S>::value, R>::type;
+
+	template<typename A>
+	using ScalarOf = Scalar<typename Operand<A>::type>;
+
+	template<typename A>
+	inline bool IsFloat(const A& a)
+	{
+		return (a.GetType() & Image::FLOAT_POINT) != 0;
+	}
+}
+
+
+template<typename A, typename B>
+inline image_expr::EnableIfOperands<A, B, image_expr::Binary<image_expr::OpAdd, typename image_expr::Operand<A>::type, typename image_expr::Operand<B>::type> >
+operator + (const A& a, const B& b)
+{
+	return {image_expr::Operand<A>::Make(a), image_expr::Operand<B>::Make(b)};
+}
+
+template<typename A, typename B>
+inline image_expr::EnableIfOperands<A, B, image_expr::Binary<image_expr::OpSub, typename image_expr::Operand<A>::type, typename image_expr::Operand<B>::type> >
+operator - (const A& a, const B& b)
+{
+	return {image_expr::Operand<A>::Make(a), image_expr::Operand<B>::Make(b)};
+}
+
+template<typename A, typename B>
+inline image_expr::EnableIfOperands<A, B, image_expr::Binary<image_expr::OpMul, typename image_expr::Operand<A>::type, typename image_expr::Operand<B>::type> >
+operator * (const A& a, const B& b)
+{
+	return {image_expr::Operand<A>::Make(a), image_expr::Operand<B>::Make(b)};
+}
+
+template<typename A, typename B>
+inline image_expr::EnableIfOperands<A, B, image_expr::Binary<image_expr::OpDiv, typename image_expr::Operand<A>::type, typename image_expr::Operand<B>::type> >
+operator / (const A& a, const B& b)
+{
+	return {image_expr::Operand<A>::Make(a), image_expr::Operand<B>::Make(b)};
+}
+
+template<typename A>
+inline image_expr::EnableIfScalar<A, int, image_expr::ScalarOf<A> >
+operator - (const A& a)
+{
+	return {image_expr::Operand<A>::Make(a), image_expr::OpMul, -1.0f, -1};
+}
+
+template<typename A, typename S>
+inline image_expr::EnableIfScalar<A, S, image_expr::ScalarOf<A> >
+operator * (const A& a, S x)
+{
+	return {image_expr::Operand<A>::Make(a), image_expr::OpMul, (float)x, (int)x};
+}
+
+template<typename A, typename S>
+inline image_expr::EnableIfScalar<A, S, image_expr::ScalarOf<A> >
+operator * (S x, const A& a)
+{
+	return a * x;
+}
+
+template<typename A, typename S>
+inline image_expr::EnableIfScalar<A, S, image_expr::ScalarOf<A> >
+operator + (const A& a, S x)
+{
+	return {image_expr::Operand<A>::Make(a), image_expr::OpAdd, (float)x, (int)x};
+}
+
+template<typename A, typename S>
+inline image_expr::EnableIfScalar<A, S, image_expr::ScalarOf<A> >
+operator + (S x, const A& a)
+{
+	return a + x;
+}
+
+template<typename A, typename S>
+inline image_expr::EnableIfScalar<A, S, image_expr::ScalarOf<A> >
+operator - (const A& a, S x)
+{
+	return {image_expr::Operand<A>::Make(a), image_expr::OpAdd, -(float)x, -(int)x};
+}
+
+template<typename A, typename S>
+inline image_expr::EnableIfScalar<A, S, image_expr::Scalar<image_expr::ScalarOf<A> > >
+operator - (S x, const A& a)
+{
+	return {-a, image_expr::OpAdd, (float)x, (int)x};
+}
+
+// Float images are multiplied by the reciprocal, integer images use integer division
+template<typename A, typename S>
+inline image_expr::EnableIfScalar<A, S, image_expr::ScalarOf<A> >
+operator / (const A& a, S x)
+{
+	if (image_expr::IsFloat(a))
+	{
+		return {image_expr::Operand<A>::Make(a), image_expr::OpMul, 1.0f / (float)x, 0};
+	}
+	return {image_expr::Operand<A>::Make(a), image_expr::OpDiv, 0.0f, (int)x};
+}
@@ -0,0 +1,247 @@
+#include "ImagePool.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+namespace
+{
+	enum
+	{
+		ShardCount = 8,
+		MinSizeClass = 4096
+	};
+
+	struct Shard
+	{
+		std::mutex mutex;
+		// size class -> free buffers
+		std::unordered_map<size_t, std::vector<uint8_t*> > free;
+	};
+
+	void UpdatePeak(std::atomic<size_t>& peak, size_t value)
+	{
+		size_t p = peak.load(std::memory_order_relaxed);
+		while (value > p && !peak.compare_exchange_weak(p, value, std::memory_order_relaxed));
+	}
+
+	int GetShardIndex()
+	{
+		static std::atomic<int> next(0);
+		thread_local int index = next.fetch_add(1, std::memory_order_relaxed) % ShardCount;
+		return index;
+	}
+}
+
+struct ImagePool::Impl
+{
+	Shard shards[ShardCount];
+	std::atomic<uint64_t> requests{0};
+	std::atomic<uint64_t> hits{0};
+	std::atomic<size_t> in_use{0};
+	std::atomic<size_t> peak_in_use{0};
+	std::atomic<size_t> retained{0};
+	std::atomic<size_t> peak_retained{0};
+	std::atomic<size_t> retain_limit{(size_t)256 << 20};
+	std::atomic<bool> enabled{true};
+};
+
+ImagePool::ImagePool(): m_impl(new Impl)
+{}
+
+ImagePool::~ImagePool()
+{
+	Trim(0);
+}
+
+ImagePool& ImagePool::Get()
+{
+	// Never destroyed, images held by static objects may be released after static destructors ran.
+	static ImagePool* pool = new ImagePool();
+	return *pool;
+}
+
+size_t ImagePool::GetSizeClass(size_t size)
+{
+	if (size <= MinSizeClass)
+	{
+		return MinSizeClass;
+	}
+	size_t base = MinSizeClass;
+	while (base * 2 <= size)
+	{
+		base *= 2;
+	}
+	size_t step = base / 4;
+	return (size + step - 1) / step * step;
+}
+
+std::shared_ptr<uint8_t> ImagePool::Allocate(size_t size)
+{
+	Impl& impl = *m_impl;
+	size_t capacity = GetSizeClass(size);
+	impl.requests.fetch_add(1, std::memory_order_relaxed);
+
+	uint8_t* p = nullptr;
+	if (impl.enabled.load(std::memory_order_relaxed))
+	{
+		int first = GetShardIndex();
+		for (int k = 0; k < ShardCount && p == nullptr; ++k)
+		{
+			Shard& shard = impl.shards[(first + k) % ShardCount];
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto it = shard.free.find(capacity);
+			if (it != shard.free.end() && !it->second.empty())
+			{
+				p = it->second.back();
+				it->second.pop_back();
+			}
+		}
+	}
+
+	if (p != nullptr)
+	{
+		impl.hits.fetch_add(1, std::memory_order_relaxed);
+		impl.retained.fetch_sub(capacity, std::memory_order_relaxed);
+	}
+	else
+	{
+		p = new uint8_t[capacity];
+	}
+	UpdatePeak(impl.peak_in_use, impl.in_use.fetch_add(capacity, std::memory_order_relaxed) + capacity);
+
+	return std::shared_ptr<uint8_t>(p, [this, capacity](uint8_t* p) { Release(p, capacity); });
+}
+
+void ImagePool::Release(uint8_t* p, size_t capacity)
+{
+	Impl& impl = *m_impl;
+	impl.in_use.fetch_sub(capacity, std::memory_order_relaxed);
+
+	if (impl.enabled.load(std::memory_order_relaxed))
+	{
+		size_t retained = impl.retained.fetch_add(capacity, std::memory_order_relaxed) + capacity;
+		if (retained <= impl.retain_limit.load(std::memory_order_relaxed))
+		{
+			UpdatePeak(impl.peak_retained, retained);
+			Shard& shard = impl.shards[GetShardIndex()];
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.free[capacity].push_back(p);
+			return;
+		}
+		impl.retained.fetch_sub(capacity, std::memory_order_relaxed);
+	}
+	delete[] p;
+}
+
+void ImagePool::SetRetainLimit(size_t bytes)
+{
+	m_impl->retain_limit = bytes;
+	Trim(bytes);
+}
+
+size_t ImagePool::GetRetainLimit() const
+{
+	return m_impl->retain_limit;
+}
+
+void ImagePool::SetEnabled(bool enabled)
+{
+	m_impl->enabled = enabled;
+	if (!enabled)
+	{
+		Trim(0);
+	}
+}
+
+bool ImagePool::IsEnabled() const
+{
+	return m_impl->enabled;
+}
+
+void ImagePool::Trim(size_t bytes)
+{
+	Impl& impl = *m_impl;
+	for (int k = 0; k < ShardCount && impl.retained > bytes; ++k)
+	{
+		Shard& shard = impl.shards[k];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		for (auto& bucket: shard.free)
+		{
+			while (!bucket.second.empty() && impl.retained > bytes)
+			{
+				delete[] bucket.second.back();
+				bucket.second.pop_back();
+				impl.retained -= bucket.first;
+			}
+		}
+	}
+}
+
+ImagePool::Stats ImagePool::GetStats() const
+{
+	const Impl& impl = *m_impl;
+	Stats s;
+	s.requests = impl.requests;
+	s.hits = impl.hits;
+	s.bytes_in_use = impl.in_use;
+	s.peak_bytes_in_use = impl.peak_in_use;
+	s.bytes_retained = impl.retained;
+	s.peak_bytes_retained = impl.peak_retained;
+	return s;
+}
+
+void ImagePool::ResetStats()
+{
+	Impl& impl = *m_impl;
+	impl.requests = 0;
+	impl.hits = 0;
+	impl.peak_in_use = impl.in_use.load();
+	impl.peak_retained = impl.retained.load();
+}
+
+
+#include <doctest.h>
+#include "Image.h"
+
+TEST_CASE("[Image] ImagePool")
+{
+	CHECK(ImagePool::GetSizeClass(1) == 4096);
+	CHECK(ImagePool::GetSizeClass(5000) == 5120);
+	CHECK(ImagePool::GetSizeClass(8192) == 8192);
+	CHECK(ImagePool::GetSizeClass(8193) == 10240);
+
+	ImagePool& pool = ImagePool::Get();
+	size_t limit = pool.GetRetainLimit();
+	pool.SetRetainLimit(64 << 20);
+	pool.Trim();
+	pool.ResetStats();
+
+	glm::ivec2 size(300, 200);
+	size_t capacity = ImagePool::GetSizeClass(Image::Empty(size, Image::RGBA8).GetRowSizeAligned() * size.y);
+	{
+		Image a = Image::Empty(size, Image::RGBA8);
+		a.GetRow<uint8_t>(5)[7] = 255;
+		CHECK(pool.GetStats().bytes_in_use == capacity);
+	}
+	{
+		// Recycled buffer is cleared by Empty
+		Image b = Image::Empty(size, Image::RGBA8);
+		CHECK(b.GetRow<uint8_t>(5)[7] == 0);
+	}
+	ImagePool::Stats stats = pool.GetStats();
+	CHECK(stats.requests == 3);
+	CHECK(stats.hits == 2);
+	CHECK(stats.bytes_in_use == 0);
+	CHECK(stats.bytes_retained == capacity);
+	CHECK(stats.peak_bytes_in_use == capacity);
+
+	pool.SetRetainLimit(0);
+	CHECK(pool.GetStats().bytes_retained == 0);
+	{
+		Image c = Image::Empty(size, Image::RGBA8);
+	}
+	CHECK(pool.GetStats().bytes_retained == 0);
+	pool.SetRetainLimit(limit);
+}
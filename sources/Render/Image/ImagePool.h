@@ -0,0 +1,63 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+
+
+// Recycles pixel buffers of Image. Requests are rounded up to size classes (four per power of two) and
+// released buffers are kept for reuse instead of going back to the heap. Free lists are split into shards
+// picked by the calling thread, so threads that allocate concurrently rarely contend on the same lock.
+// Retained memory is bounded by a limit, buffers released above it are freed immediately.
+class ImagePool
+{
+public:
+	struct Stats
+	{
+		uint64_t requests = 0;
+		uint64_t hits = 0;
+		size_t bytes_in_use = 0;
+		size_t peak_bytes_in_use = 0;
+		size_t bytes_retained = 0;
+		size_t peak_bytes_retained = 0;
+
+		double HitRate() const { return requests != 0 ? (double)hits / requests : 0.0; }
+	};
+
+	static ImagePool& Get();
+
+	ImagePool(const ImagePool&) = delete;
+	ImagePool& operator=(const ImagePool&) = delete;
+
+	// Buffer of at least `size` bytes, returned to the pool when the last reference is dropped.
+	// Contents are undefined.
+	std::shared_ptr<uint8_t> Allocate(size_t size);
+
+	// Maximum number of bytes kept in free lists. Lowering the limit trims the pool right away.
+	void SetRetainLimit(size_t bytes);
+
+	size_t GetRetainLimit() const;
+
+	// Disabled pool allocates and frees every buffer directly. Retained buffers are released.
+	void SetEnabled(bool enabled);
+
+	bool IsEnabled() const;
+
+	// Frees retained buffers until at most `bytes` are kept.
+	void Trim(size_t bytes = 0);
+
+	Stats GetStats() const;
+
+	// Resets counters and peaks, current usage is kept.
+	void ResetStats();
+
+	static size_t GetSizeClass(size_t size);
+
+private:
+	ImagePool();
+	~ImagePool();
+
+	void Release(uint8_t* p, size_t capacity);
+
+	struct Impl;
+	std::unique_ptr<Impl> m_impl;
+};
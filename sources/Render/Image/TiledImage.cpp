@@ -0,0 +1,516 @@
+#include "TiledImage.h"
+#include "parallelisation.h"
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+
+namespace
+{
+	int SeekFile(FILE* file, size_t offset)
+	{
+#ifdef _WIN32
+		return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+		return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+	}
+
+	// Copies `size` pixels from `src` at `srcPos` to `dst` at `dstPos`
+	void CopyRect(Image& dst, glm::ivec2 dstPos, const Image& src, glm::ivec2 srcPos, glm::ivec2 size)
+	{
+		size_t bpp = src.GetBPP();
+		for (int j = 0; j < size.y; ++j)
+		{
+			memcpy(dst.GetRow<uint8_t>(dstPos.y + j) + dstPos.x * bpp, src.GetRow<uint8_t>(srcPos.y + j) + srcPos.x * bpp, size.x * bpp);
+		}
+	}
+}
+
+TiledImage::TiledImage(glm::ivec2 size, Image::DataType d, int tileSize, size_t residentLimit)
+	: m_size(size)
+	, m_type(d)
+	, m_tileSize(tileSize)
+	, m_tileCount((size + tileSize - 1) / tileSize)
+	, m_residentLimit(residentLimit)
+	, m_tiles(m_tileCount.x * m_tileCount.y)
+{}
+
+TiledImage::Ptr TiledImage::Create(glm::ivec2 size, Image::DataType d, int tileSize, size_t residentLimit, const char* spillFile)
+{
+	if (tileSize <= 0 || size.x <= 0 || size.y <= 0)
+	{
+		throw utils::runtime_error("Invalid tiled image of size %dx%d with tile size %d", size.x, size.y, tileSize);
+	}
+	Ptr image(new TiledImage(size, d, tileSize, residentLimit));
+	if (spillFile != nullptr)
+	{
+		image->m_file = fopen(spillFile, "w+b");
+		image->m_filename = spillFile;
+	}
+	else
+	{
+		image->m_file = tmpfile();
+	}
+	if (image->m_file == nullptr)
+	{
+		throw utils::runtime_error("Can't create spill file %s", spillFile != nullptr ? spillFile : "(temporary)");
+	}
+	return image;
+}
+
+TiledImage::Ptr TiledImage::FromImage(const Image& image, int tileSize, size_t residentLimit)
+{
+	Ptr tiled = Create(image.GetSize(), image.GetType(), tileSize, residentLimit);
+	tiled->Write(glm::ivec2(0), image);
+	return tiled;
+}
+
+TiledImage::~TiledImage()
+{
+	if (m_file != nullptr)
+	{
+		fclose(m_file);
+	}
+	if (!m_filename.empty())
+	{
+		remove(m_filename.c_str());
+	}
+}
+
+glm::ivec2 TiledImage::GetTileExtent(glm::ivec2 t) const
+{
+	return glm::min(GetTilePos(t) + m_tileSize, m_size) - GetTilePos(t);
+}
+
+size_t TiledImage::GetResidentBytes() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_residentBytes;
+}
+
+size_t TiledImage::GetPeakResidentBytes() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_peakResidentBytes;
+}
+
+void TiledImage::LoadTile(int index) const
+{
+	Tile& tile = m_tiles[index];
+	Image pixels = Image::Empty(GetTileExtent(GetTile(index)), m_type);
+	if (tile.on_disk)
+	{
+		// Every tile has a slot of the full tile size, rows are stored tightly packed
+		size_t slot = (size_t)m_tileSize * m_tileSize * Image::GetBPP(m_type);
+		if (SeekFile(m_file, slot * index) != 0)
+		{
+			throw utils::runtime_error("Can't seek in spill file");
+		}
+		for (int j = 0; j < pixels.GetSize().y; ++j)
+		{
+			if (fread(pixels.GetRow<uint8_t>(j), pixels.GetRowSize(), 1, m_file) != 1)
+			{
+				throw utils::runtime_error("Can't read tile from spill file");
+			}
+		}
+	}
+	tile.pixels = pixels;
+	m_residentBytes += pixels.GetRowSizeAligned() * pixels.GetSize().y;
+	m_peakResidentBytes = std::max(m_peakResidentBytes, m_residentBytes);
+}
+
+void TiledImage::StoreTile(int index) const
+{
+	Tile& tile = m_tiles[index];
+	if (tile.dirty)
+	{
+		size_t slot = (size_t)m_tileSize * m_tileSize * Image::GetBPP(m_type);
+		if (SeekFile(m_file, slot * index) != 0)
+		{
+			throw utils::runtime_error("Can't seek in spill file");
+		}
+		for (int j = 0; j < tile.pixels.GetSize().y; ++j)
+		{
+			if (fwrite(tile.pixels.GetRow<uint8_t>(j), tile.pixels.GetRowSize(), 1, m_file) != 1)
+			{
+				throw utils::runtime_error("Can't write tile to spill file");
+			}
+		}
+		tile.dirty = false;
+		tile.on_disk = true;
+	}
+	m_residentBytes -= tile.pixels.GetRowSizeAligned() * tile.pixels.GetSize().y;
+	tile.pixels = Image();
+}
+
+void TiledImage::Evict() const
+{
+	while (m_residentBytes > m_residentLimit && !m_lru.empty())
+	{
+		int index = m_lru.front();
+		Tile& tile = m_tiles[index];
+		try
+		{
+			StoreTile(index);
+		}
+		catch (const std::exception& e)
+		{
+			// The tile is still resident and dirty, it is stored again by a later eviction
+			m_error = e.what();
+			return;
+		}
+		m_lru.pop_front();
+		tile.in_lru = false;
+	}
+}
+
+void TiledImage::ThrowPendingError() const
+{
+	if (!m_error.empty())
+	{
+		std::string error;
+		error.swap(m_error);
+		throw utils::runtime_error("%s", error.c_str());
+	}
+}
+
+Image TiledImage::LockTile(glm::ivec2 t, bool write) const
+{
+	assert(glm::all(glm::greaterThanEqual(t, glm::ivec2(0))) && glm::all(glm::lessThan(t, m_tileCount)));
+	int index = GetTileIndex(t);
+	Image pixels;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		ThrowPendingError();
+		Tile& tile = m_tiles[index];
+		if (!tile.pixels.IsValid())
+		{
+			LoadTile(index);
+		}
+		else if (tile.in_lru)
+		{
+			m_lru.erase(tile.lru);
+			tile.in_lru = false;
+		}
+		tile.pins += 1;
+		tile.dirty = tile.dirty || write;
+		pixels = tile.pixels;
+		Evict();
+	}
+
+	std::shared_ptr<const TiledImage> self = shared_from_this();
+	std::shared_ptr<void> owner((void*)this, [self, index](void*) { self->Unpin(index); });
+	return Image::FromExternalData(pixels.GetRow<uint8_t>(0), m_type, pixels.GetSize(), pixels.GetRowSizeAligned(), owner);
+}
+
+void TiledImage::Unpin(int index) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Tile& tile = m_tiles[index];
+	if (--tile.pins == 0)
+	{
+		tile.lru = m_lru.insert(m_lru.end(), index);
+		tile.in_lru = true;
+		Evict();
+	}
+}
+
+Image TiledImage::Read(glm::ivec2 pos, glm::ivec2 size) const
+{
+	assert(glm::all(glm::greaterThanEqual(pos, glm::ivec2(0))) && glm::all(glm::lessThanEqual(pos + size, m_size)));
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		ThrowPendingError();
+	}
+	Image out = Image::Empty(size, m_type);
+	glm::ivec2 t0 = pos / m_tileSize;
+	glm::ivec2 t1 = (pos + size - 1) / m_tileSize + 1;
+	int columns = t1.x - t0.x;
+	PARALLEL_BEGIN(columns * (t1.y - t0.y))
+	{
+		for (int k = p_begin; k < p_end; ++k)
+		{
+			glm::ivec2 t = t0 + glm::ivec2(k % columns, k / columns);
+			glm::ivec2 a = glm::max(pos, GetTilePos(t));
+			glm::ivec2 b = glm::min(pos + size, GetTilePos(t) + GetTileExtent(t));
+			Image tile = LockTile(t, false);
+			CopyRect(out, a - pos, tile, a - GetTilePos(t), b - a);
+		}
+	}
+	PARALLEL_END();
+	return out;
+}
+
+void TiledImage::Write(glm::ivec2 pos, const Image& image)
+{
+	assert(image.GetType() == m_type);
+	glm::ivec2 size = image.GetSize();
+	assert(glm::all(glm::greaterThanEqual(pos, glm::ivec2(0))) && glm::all(glm::lessThanEqual(pos + size, m_size)));
+	glm::ivec2 t0 = pos / m_tileSize;
+	glm::ivec2 t1 = (pos + size - 1) / m_tileSize + 1;
+	int columns = t1.x - t0.x;
+	PARALLEL_BEGIN(columns * (t1.y - t0.y))
+	{
+		for (int k = p_begin; k < p_end; ++k)
+		{
+			glm::ivec2 t = t0 + glm::ivec2(k % columns, k / columns);
+			glm::ivec2 a = glm::max(pos, GetTilePos(t));
+			glm::ivec2 b = glm::min(pos + size, GetTilePos(t) + GetTileExtent(t));
+			Image tile = LockTile(t, true);
+			CopyRect(tile, a - GetTilePos(t), image, a - pos, b - a);
+		}
+	}
+	PARALLEL_END();
+}
+
+Image TiledImage::ToImage() const
+{
+	return Read(glm::ivec2(0), m_size);
+}
+
+TiledImage::Ptr TiledImage::CreateSameTiling(glm::ivec2 size, Image::DataType d) const
+{
+	return Create(size, d, m_tileSize, m_residentLimit);
+}
+
+TiledImage::Ptr TiledImage::Map(Image::DataType d, const std::function<Image(const Image& tile)>& f) const
+{
+	Ptr out = CreateSameTiling(m_size, d);
+	PARALLEL_BEGIN(m_tileCount.x * m_tileCount.y)
+	{
+		for (int k = p_begin; k < p_end; ++k)
+		{
+			Image result = f(LockTile(GetTile(k), false));
+			out->LockTile(GetTile(k), true).Assign(result);
+		}
+	}
+	PARALLEL_END();
+	return out;
+}
+
+TiledImage::Ptr TiledImage::MapWithHalo(Image::DataType d, int halo, const std::function<Image(const Image& region)>& f) const
+{
+	Ptr out = CreateSameTiling(m_size, d);
+	PARALLEL_BEGIN(m_tileCount.x * m_tileCount.y)
+	{
+		for (int k = p_begin; k < p_end; ++k)
+		{
+			glm::ivec2 t = GetTile(k);
+			glm::ivec2 a = glm::max(GetTilePos(t) - halo, glm::ivec2(0));
+			glm::ivec2 b = glm::min(GetTilePos(t) + GetTileExtent(t) + halo, m_size);
+			Image result = f(Read(a, b - a));
+			Image tile = out->LockTile(t, true);
+			CopyRect(tile, glm::ivec2(0), result, GetTilePos(t) - a, tile.GetSize());
+		}
+	}
+	PARALLEL_END();
+	return out;
+}
+
+TiledImage::Ptr TiledImage::Elementwise(const TiledImage& x, Image (Image::*op)(const Image&) const) const
+{
+	if (x.GetSize() != m_size || x.GetType() != m_type)
+	{
+		throw utils::runtime_error("Tiled images of size %dx%d and %dx%d or types don't match", m_size.x, m_size.y, x.GetSize().x, x.GetSize().y);
+	}
+	Ptr out = CreateSameTiling(m_size, m_type);
+	PARALLEL_BEGIN(m_tileCount.x * m_tileCount.y)
+	{
+		for (int k = p_begin; k < p_end; ++k)
+		{
+			glm::ivec2 t = GetTile(k);
+			Image b = x.GetTileSize() == m_tileSize ? x.LockTile(t, false) : x.Read(GetTilePos(t), GetTileExtent(t));
+			out->LockTile(t, true).Assign((LockTile(t, false).*op)(b));
+		}
+	}
+	PARALLEL_END();
+	return out;
+}
+
+TiledImage::Ptr TiledImage::Add(const TiledImage& x) const
+{
+	return Elementwise(x, &Image::Add);
+}
+
+TiledImage::Ptr TiledImage::Sub(const TiledImage& x) const
+{
+	return Elementwise(x, &Image::Sub);
+}
+
+TiledImage::Ptr TiledImage::Mul(const TiledImage& x) const
+{
+	return Elementwise(x, &Image::Mul);
+}
+
+TiledImage::Ptr TiledImage::Div(const TiledImage& x) const
+{
+	return Elementwise(x, &Image::Div);
+}
+
+TiledImage::Ptr TiledImage::Mul(float x) const
+{
+	return Map(m_type, [x](const Image& tile) { return tile.Mul(x); });
+}
+
+TiledImage::Ptr TiledImage::Add(float x) const
+{
+	return Map(m_type, [x](const Image& tile) { return tile.Add(x); });
+}
+
+TiledImage::Ptr TiledImage::GaussBlur(float r, Image::BlurType type) const
+{
+	// Blur mirrors at the border of the region, which only affects pixels within the support of it
+	return MapWithHalo(m_type, Image::GetGaussBlurSupport(r, type), [r, type](const Image& region)
+	{
+		return region.GaussBlur(r, type);
+	});
+}
+
+TiledImage::Ptr TiledImage::Resample(glm::ivec2 size, Image::ResampleFilter filter, float gamma) const
+{
+	Ptr out = CreateSameTiling(size, m_type);
+	// Output tiles are produced in windows that read about a tile worth of source pixels when downsampling
+	glm::ivec2 window = glm::clamp(m_tileSize * size / m_size, glm::ivec2(1), glm::ivec2(m_tileSize));
+	glm::ivec2 tileCount = out->GetTileCount();
+	// Weights of the whole resample, windows read their slices
+	const Image::ResampleWeights wx = Image::ComputeResampleWeights(m_size.x, size.x, filter);
+	const Image::ResampleWeights wy = Image::ComputeResampleWeights(m_size.y, size.y, filter);
+	PARALLEL_BEGIN(tileCount.x * tileCount.y)
+	{
+		for (int k = p_begin; k < p_end; ++k)
+		{
+			glm::ivec2 t(k % tileCount.x, k / tileCount.x);
+			Image tile = out->LockTile(t, true);
+			for (int y = 0; y < tile.GetSize().y; y += window.y)
+			{
+				for (int x = 0; x < tile.GetSize().x; x += window.x)
+				{
+					glm::ivec2 windowPos = out->GetTilePos(t) + glm::ivec2(x, y);
+					glm::ivec2 windowSize = glm::min(window, tile.GetSize() - glm::ivec2(x, y));
+					glm::ivec2 regionPos, regionSize;
+					Image::GetResampleRegion(wx, wy, windowPos, windowSize, regionPos, regionSize);
+					Image result = Read(regionPos, regionSize).ResampleWindow(wx, wy, regionPos, windowPos, windowSize, gamma);
+					CopyRect(tile, glm::ivec2(x, y), result, glm::ivec2(0), windowSize);
+				}
+			}
+		}
+	}
+	PARALLEL_END();
+	return out;
+}
+
+TiledImage::Ptr TiledImage::ComputeDF(Image::DFType type, float maxDistance) const
+{
+	// Nearest boundary within maxDistance is inside the halo, one more pixel is needed to detect boundary pixels
+	int halo = (int)ceilf(maxDistance) + 2;
+	return MapWithHalo(Image::RF, halo, [type, maxDistance](const Image& region)
+	{
+		Image d = region.ComputeDF(type);
+		for (int j = 0; j < d.GetSize().y; ++j)
+		{
+			float* ptr = d.GetRow<float>(j);
+			for (int i = 0; i < d.GetSize().x; ++i)
+			{
+				ptr[i] = std::min(std::max(ptr[i], -maxDistance), maxDistance);
+			}
+		}
+		return d;
+	});
+}
+
+
+#include <doctest.h>
+#include "utils/thread_pool.h"
+
+TEST_CASE("[Image] Tiled image")
+{
+	glm::ivec2 size(300, 200);
+	Image a = Image::Empty(size, Image::RGB8);
+	Image b = Image::Empty(size, Image::RGB8);
+	for (int j = 0; j < size.y; ++j)
+	{
+		uint8_t* pa = a.GetRow<uint8_t>(j);
+		uint8_t* pb = b.GetRow<uint8_t>(j);
+		for (int i = 0; i < size.x * 3; ++i)
+		{
+			pa[i] = (uint8_t)((i * 7 + j * 13 + (i * j) % 31) & 0x7f);
+			pb[i] = (uint8_t)((i * 5 + j * 3) & 0x7f);
+		}
+	}
+	// A few blobs for the distance field
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x; ++i)
+		{
+			bool inside = (i - 70) * (i - 70) + (j - 60) * (j - 60) < 400 || (i > 200 && i < 230 && j > 120 && j < 190);
+			a.GetRow<Image::pixelRGB8>(j)[i] = inside ? Image::pixelRGB8(255) : Image::pixelRGB8(0);
+		}
+	}
+
+	auto maxDiff = [](const Image& x, const Image& y)
+	{
+		REQUIRE(x.GetSize() == y.GetSize());
+		REQUIRE(x.GetType() == y.GetType());
+		float diff = 0.0f;
+		int n = x.GetSize().x * x.GetChannelCount();
+		for (int j = 0; j < x.GetSize().y; ++j)
+		{
+			for (int i = 0; i < n; ++i)
+			{
+				if (x.GetType() & Image::FLOAT_POINT)
+				{
+					diff = std::max(diff, fabsf(x.GetRow<float>(j)[i] - y.GetRow<float>(j)[i]));
+				}
+				else
+				{
+					diff = std::max(diff, fabsf((float)x.GetRow<uint8_t>(j)[i] - y.GetRow<uint8_t>(j)[i]));
+				}
+			}
+		}
+		return diff;
+	};
+
+	// Limit holds only a few tiles, so most of them go through the spill file
+	const int tileSize = 64;
+	const size_t tileBytes = Image::Empty(glm::ivec2(tileSize), Image::RGB8).GetRowSizeAligned() * tileSize;
+	const size_t limit = tileBytes * 3;
+	TiledImage::Ptr ta = TiledImage::FromImage(a, tileSize, limit);
+	TiledImage::Ptr tb = TiledImage::FromImage(b, tileSize, limit);
+
+	CHECK(maxDiff(ta->ToImage(), a) == 0.0f);
+	CHECK(maxDiff(ta->Read(glm::ivec2(50, 30), glm::ivec2(130, 100)), a.OpenView(glm::ivec2(50, 30), glm::ivec2(130, 100))) == 0.0f);
+	CHECK(maxDiff(ta->Add(*tb)->ToImage(), a.Add(b)) == 0.0f);
+	Image fb = b.Convert(Image::RGBF);
+	CHECK(maxDiff(TiledImage::FromImage(fb, tileSize, limit)->Mul(0.5f)->ToImage(), fb.Mul(0.5f)) == 0.0f);
+
+	CHECK(maxDiff(tb->GaussBlur(5.0f, Image::GaussExact)->ToImage(), b.GaussBlur(5.0f, Image::GaussExact)) <= 1.0f);
+	CHECK(maxDiff(tb->GaussBlur(20.0f, Image::GaussBoxCascade)->ToImage(), b.GaussBlur(20.0f, Image::GaussBoxCascade)) <= 1.0f);
+
+	CHECK(maxDiff(tb->Resample(glm::ivec2(113, 71), Image::ResampleLanczos3)->ToImage(), b.Resample(glm::ivec2(113, 71), Image::ResampleLanczos3)) <= 1.0f);
+	CHECK(maxDiff(tb->Resample(glm::ivec2(517, 333), Image::ResampleMitchell, 2.2f)->ToImage(), b.Resample(glm::ivec2(517, 333), Image::ResampleMitchell, 2.2f)) <= 1.0f);
+
+	const float maxDistance = 12.0f;
+	Image df = a.ComputeDF(Image::ExactEuclidean);
+	for (int j = 0; j < size.y; ++j)
+	{
+		for (int i = 0; i < size.x; ++i)
+		{
+			df.GetRow<float>(j)[i] = std::min(std::max(df.GetRow<float>(j)[i], -maxDistance), maxDistance);
+		}
+	}
+	CHECK(maxDiff(ta->ComputeDF(Image::ExactEuclidean, maxDistance)->ToImage(), df) < 1e-4f);
+
+	// Only tiles locked by the workers may exceed the limit
+	int threads = utils::ThreadPool::Get().GetThreadCount();
+	CHECK(ta->GetPeakResidentBytes() <= limit + threads * tileBytes);
+	CHECK(ta->GetResidentBytes() <= limit);
+
+	{
+		Image tile = ta->LockTile(glm::ivec2(4, 3), true);
+		CHECK(tile.GetSize() == glm::ivec2(300 - 4 * tileSize, 200 - 3 * tileSize));
+		tile.GetRow<uint8_t>(0)[0] = 77;
+	}
+	CHECK(ta->Read(glm::ivec2(4 * tileSize, 3 * tileSize), glm::ivec2(1)).GetRow<uint8_t>(0)[0] == 77);
+}
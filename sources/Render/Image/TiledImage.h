@@ -0,0 +1,155 @@
+#pragma once
+#include "Image.h"
+#include <stdio.h>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// Image split into square tiles of a fixed size, for canvases that don't fit in memory. Only recently used tiles are
+// kept resident, the least recently used ones are written to a spill file and dropped once resident tiles exceed the
+// limit. Tiles locked by LockTile stay resident, so the limit can be exceeded by the tiles in use.
+// Ops process output tiles in parallel and return a new tiled image, inputs are read with the halo the op needs.
+class TiledImage: public std::enable_shared_from_this<TiledImage>
+{
+public:
+	enum
+	{
+		DefaultTileSize = 512
+	};
+
+	static const size_t DefaultResidentLimit = (size_t)256 << 20;
+
+	typedef std::shared_ptr<TiledImage> Ptr;
+
+	// Tiles are zero until written. Without `spillFile` an anonymous temporary file is used, a named one
+	// is removed when the image is destroyed. Throws utils::runtime_error if the file can't be created.
+	static Ptr Create(glm::ivec2 size, Image::DataType d, int tileSize = DefaultTileSize,
+		size_t residentLimit = DefaultResidentLimit, const char* spillFile = nullptr);
+
+	static Ptr FromImage(const Image& image, int tileSize = DefaultTileSize, size_t residentLimit = DefaultResidentLimit);
+
+	TiledImage(const TiledImage&) = delete;
+	TiledImage& operator=(const TiledImage&) = delete;
+
+	~TiledImage();
+
+	// Whole image in memory
+	Image ToImage() const;
+
+	// Copy of the region, which has to be inside the image
+	Image Read(glm::ivec2 pos, glm::ivec2 size) const;
+
+	void Write(glm::ivec2 pos, const Image& image);
+
+	// Pixels of tile `t`, loaded if needed. The tile stays resident while the returned image or its views exist.
+	// Set `write` if the pixels are modified, so the tile is written back before it is dropped.
+	// Spill file errors of earlier evictions are thrown here and by Read, the tiles that failed to spill stay resident.
+	Image LockTile(glm::ivec2 t, bool write) const;
+
+	// Attributes
+	glm::ivec2 GetSize() const { return m_size; }
+
+	Image::DataType GetType() const { return m_type; }
+
+	int GetTileSize() const { return m_tileSize; }
+
+	glm::ivec2 GetTileCount() const { return m_tileCount; }
+
+	// Position and size of tile `t` in pixels, tiles at the right and bottom edges can be smaller
+	glm::ivec2 GetTilePos(glm::ivec2 t) const { return t * m_tileSize; }
+
+	glm::ivec2 GetTileExtent(glm::ivec2 t) const;
+
+	size_t GetResidentLimit() const { return m_residentLimit; }
+
+	size_t GetResidentBytes() const;
+
+	size_t GetPeakResidentBytes() const;
+
+	// Ops
+	// Calls `f` for every tile and stores the results, which must have the size of the tile and type `d`
+	Ptr Map(Image::DataType d, const std::function<Image(const Image& tile)>& f) const;
+
+	// Same as Map, but `f` gets the tile extended by `halo` pixels on each side (less at the image border)
+	// and returns an image of that size, from which the tile is cropped.
+	Ptr MapWithHalo(Image::DataType d, int halo, const std::function<Image(const Image& region)>& f) const;
+
+	// Elementwise ops with an image of the same size and type, tile sizes may differ
+	Ptr Add(const TiledImage& x) const;
+
+	Ptr Sub(const TiledImage& x) const;
+
+	Ptr Mul(const TiledImage& x) const;
+
+	Ptr Div(const TiledImage& x) const;
+
+	Ptr Mul(float x) const;
+
+	Ptr Add(float x) const;
+
+	// Same result as Image::GaussBlur of the whole image
+	Ptr GaussBlur(float r, Image::BlurType type = Image::GaussAuto) const;
+
+	// Same result as Image::Resample of the whole image, output tiles read only the source pixels they need
+	Ptr Resample(glm::ivec2 size, Image::ResampleFilter filter, float gamma = 1.0f) const;
+
+	// Image::ComputeDF clamped to [-maxDistance, maxDistance], which bounds the halo. Exact for ExactEuclidean, the raster
+	// modes propagate distances only within the halo, so they can differ from the whole image result slightly.
+	Ptr ComputeDF(Image::DFType type, float maxDistance) const;
+
+private:
+	struct Tile
+	{
+		Image pixels;
+		int pins = 0;
+		bool dirty = false;
+		bool on_disk = false;
+		bool in_lru = false;
+		std::list<int>::iterator lru;
+	};
+
+	TiledImage(glm::ivec2 size, Image::DataType d, int tileSize, size_t residentLimit);
+
+	Ptr Elementwise(const TiledImage& x, Image (Image::*op)(const Image&) const) const;
+
+	Ptr CreateSameTiling(glm::ivec2 size, Image::DataType d) const;
+
+	int GetTileIndex(glm::ivec2 t) const { return t.y * m_tileCount.x + t.x; }
+
+	glm::ivec2 GetTile(int index) const { return glm::ivec2(index % m_tileCount.x, index / m_tileCount.x); }
+
+	void Unpin(int index) const;
+
+	// Expects the mutex to be locked
+	void LoadTile(int index) const;
+
+	void StoreTile(int index) const;
+
+	// Doesn't throw, it runs when tiles are unlocked. A failed store is recorded in m_error and stops the eviction.
+	void Evict() const;
+
+	// Throws the recorded spill file error, if any
+	void ThrowPendingError() const;
+
+	glm::ivec2 m_size;
+	Image::DataType m_type;
+	int m_tileSize;
+	glm::ivec2 m_tileCount;
+	size_t m_residentLimit;
+
+	FILE* m_file = nullptr;
+	std::string m_filename;
+
+	// Guards tiles, LRU list and the spill file
+	mutable std::mutex m_mutex;
+	mutable std::vector<Tile> m_tiles;
+	// Resident tiles that are not locked, least recently used first
+	mutable std::list<int> m_lru;
+	mutable size_t m_residentBytes = 0;
+	mutable size_t m_peakResidentBytes = 0;
+	mutable std::string m_error;
+};
@@ -1,26 +1,24 @@
 #pragma once
+#include "utils/thread_pool.h"
 
-#define DO_NOT_PARALLELIZE
+// Runs the body for row tiles [p_begin, p_end) of [0, TOTAL) on the shared thread pool.
+// Define DO_NOT_PARALLELIZE to get the plain serial loop.
+//
+//	PARALLEL_BEGIN(rows)
+//	{
+//		for (int j = p_begin; j < p_end; ++j) ...
+//	}
+//	PARALLEL_END();
 
 #ifndef DO_NOT_PARALLELIZE
 
 #define PARALLEL_BEGIN(TOTAL) \
-	int total = TOTAL;\
-	std::thread* workers[4];\
-	int batch = total / 4 + (total % 4 != 0); \
-	for (int k = 0; k < 4; ++k){\
-	int p_begin = batch * k;\
-	int p_end = std::min(batch * (k + 1), total); \
-	workers[k] = new std::thread([&]
+	utils::ThreadPool::Get().ParallelFor(0, (TOTAL), [&](int p_begin, int p_end)
 #define PARALLEL_END() \
-	);}\
-	for (int k = 0; k < 4; ++k){\
-		workers[k]->join();\
-		delete workers[k];\
-	}
+	)
 #else
 #define PARALLEL_BEGIN(TOTAL) \
-	int p_begin = 0;\
-	int p_end = TOTAL;
-#define PARALLEL_END()
+	{ int p_begin = 0;\
+	int p_end = (TOTAL);
+#define PARALLEL_END() }
 #endif
@@ -0,0 +1,1269 @@
+#include "simd_kernels.h"
+#include "utils/system_info.h"
+
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Kernels are compiled with per-function target attributes, so the rest of the build does not need -mavx2.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define SIMD_TARGET_SSE41
+#define SIMD_TARGET_AVX2
+#else
+#define SIMD_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+
+namespace
+{
+	inline uint8_t saturate_u8(int x)
+	{
+		return (uint8_t)std::min(std::max(x, 0), 255);
+	}
+
+	/////////////////////////////////////////////////////////////////////
+	// Scalar
+	/////////////////////////////////////////////////////////////////////
+#define BINARY_KERNEL_SCALAR(NAME, T, EXPR) \
+	void NAME##_scalar(T* dst, const T* a, const T* b, size_t n) \
+	{ \
+		for (size_t i = 0; i < n; ++i) \
+		{ \
+			dst[i] = (T)(EXPR); \
+		} \
+	}
+
+	BINARY_KERNEL_SCALAR(add_u8, uint8_t, saturate_u8(a[i] + b[i]))
+	BINARY_KERNEL_SCALAR(sub_u8, uint8_t, saturate_u8(a[i] - b[i]))
+	BINARY_KERNEL_SCALAR(mul_u8, uint8_t, saturate_u8(a[i] * b[i]))
+	BINARY_KERNEL_SCALAR(add_u16, uint16_t, a[i] + b[i])
+	BINARY_KERNEL_SCALAR(sub_u16, uint16_t, a[i] - b[i])
+	BINARY_KERNEL_SCALAR(mul_u16, uint16_t, uint32_t(a[i]) * b[i])
+	BINARY_KERNEL_SCALAR(add_u32, uint32_t, a[i] + b[i])
+	BINARY_KERNEL_SCALAR(sub_u32, uint32_t, a[i] - b[i])
+	BINARY_KERNEL_SCALAR(mul_u32, uint32_t, a[i] * b[i])
+	BINARY_KERNEL_SCALAR(add_f32, float, a[i] + b[i])
+	BINARY_KERNEL_SCALAR(sub_f32, float, a[i] - b[i])
+	BINARY_KERNEL_SCALAR(mul_f32, float, a[i] * b[i])
+	BINARY_KERNEL_SCALAR(div_f32, float, a[i] / b[i])
+
+	void add_scalar_u8_scalar(uint8_t* dst, const uint8_t* a, int x, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			dst[i] = saturate_u8(a[i] + x);
+		}
+	}
+
+	void mul_scalar_u8_scalar(uint8_t* dst, const uint8_t* a, int x, size_t n)
+	{
+		x = std::min(std::max(x, 0), 256);
+		for (size_t i = 0; i < n; ++i)
+		{
+			dst[i] = saturate_u8(a[i] * x);
+		}
+	}
+
+	void scale_bias_u8_scalar(uint8_t* dst, const uint8_t* a, float scale, float bias, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			float v = std::min(std::max(a[i] * scale + bias, -1.0f), 256.0f);
+			dst[i] = saturate_u8((int)lrintf(v));
+		}
+	}
+
+	void step_u8_scalar(uint8_t* dst, const uint8_t* a, uint8_t threshold, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			dst[i] = (a[i] > threshold) * 255;
+		}
+	}
+
+	void add_scalar_f32_scalar(float* dst, const float* a, float x, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			dst[i] = a[i] + x;
+		}
+	}
+
+	void mul_scalar_f32_scalar(float* dst, const float* a, float x, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			dst[i] = a[i] * x;
+		}
+	}
+
+	void scale_bias_f32_scalar(float* dst, const float* a, float scale, float bias, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			dst[i] = a[i] * scale + bias;
+		}
+	}
+
+	void step_f32_scalar(uint8_t* dst, const float* a, float threshold, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			dst[i] = (a[i] > threshold) * 255;
+		}
+	}
+
+	void axpy_f32_scalar(float* acc, const float* a, float w, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			acc[i] += a[i] * w;
+		}
+	}
+
+	void convolve_f32_scalar(float* dst, const float* src, const float* weights, int taps, size_t stride, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			float s = 0.0f;
+			for (int t = 0; t < taps; ++t)
+			{
+				s += src[i + t * stride] * weights[t];
+			}
+			dst[i] = s;
+		}
+	}
+
+	void resample_row_f32_scalar(float* dst, const float* src, const int* first, const float* weights, int taps, int channels, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			const float* p = src + first[i] * channels;
+			const float* w = weights + i * taps;
+			for (int c = 0; c < channels; ++c)
+			{
+				float s = 0.0f;
+				for (int t = 0; t < taps; ++t)
+				{
+					s += p[t * channels + c] * w[t];
+				}
+				dst[i * channels + c] = s;
+			}
+		}
+	}
+
+	void min3_add_f32_scalar(float* dst, const float* prev, const float* e, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			dst[i] = e[i] + std::min(std::min(prev[i - 1], prev[i]), prev[i + 1]);
+		}
+	}
+
+	template<typename T>
+	void transpose_scalar(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h)
+	{
+		for (size_t j = 0; j < h; ++j)
+		{
+			const uint8_t* s = src + j * srcStride;
+			uint8_t* d = dst + j * sizeof(T);
+			for (size_t i = 0; i < w; ++i, s += sizeof(T), d += dstStride)
+			{
+				memcpy(d, s, sizeof(T));
+			}
+		}
+	}
+
+	void transpose_8_scalar(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h)
+	{
+		transpose_scalar<uint8_t>(dst, dstStride, src, srcStride, w, h);
+	}
+
+	void transpose_16_scalar(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h)
+	{
+		transpose_scalar<uint16_t>(dst, dstStride, src, srcStride, w, h);
+	}
+
+	void transpose_32_scalar(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h)
+	{
+		transpose_scalar<uint32_t>(dst, dstStride, src, srcStride, w, h);
+	}
+
+	// Parts of a block that are not covered by whole register tiles of size `tile`
+	template<typename T>
+	void transpose_edges(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h, size_t tile)
+	{
+		size_t w0 = w / tile * tile;
+		size_t h0 = h / tile * tile;
+		transpose_scalar<T>(dst + w0 * dstStride, dstStride, src + w0 * sizeof(T), srcStride, w - w0, h);
+		transpose_scalar<T>(dst + h0 * sizeof(T), dstStride, src + h0 * srcStride, srcStride, w0, h - h0);
+	}
+
+	void u8_to_f32_scalar(float* dst, const uint8_t* src, float scale, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			dst[i] = src[i] * scale;
+		}
+	}
+
+	void f32_to_u8_scalar(uint8_t* dst, const float* src, float scale, float bias, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			float v = src[i] * scale + bias;
+			dst[i] = v > 0.0f ? (v < 255.0f ? (uint8_t)v : 255) : 0;
+		}
+	}
+
+	void rgb8_to_rgba8_scalar(uint8_t* dst, const uint8_t* src, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i, dst += 4, src += 3)
+		{
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+			dst[3] = 255;
+		}
+	}
+
+	void rgba8_to_rgb8_scalar(uint8_t* dst, const uint8_t* src, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i, dst += 3, src += 4)
+		{
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+		}
+	}
+
+#ifdef SIMD_X86
+	/////////////////////////////////////////////////////////////////////
+	// SSE4.1
+	/////////////////////////////////////////////////////////////////////
+#define BINARY_KERNEL_SSE_I(NAME, T, OP) \
+	SIMD_TARGET_SSE41 void NAME##_sse41(T* dst, const T* a, const T* b, size_t n) \
+	{ \
+		const size_t step = 16 / sizeof(T); \
+		size_t i = 0; \
+		for (; i + step <= n; i += step) \
+		{ \
+			__m128i va = _mm_loadu_si128((const __m128i*)(a + i)); \
+			__m128i vb = _mm_loadu_si128((const __m128i*)(b + i)); \
+			_mm_storeu_si128((__m128i*)(dst + i), OP(va, vb)); \
+		} \
+		NAME##_scalar(dst + i, a + i, b + i, n - i); \
+	}
+
+#define BINARY_KERNEL_SSE_F(NAME, OP) \
+	SIMD_TARGET_SSE41 void NAME##_sse41(float* dst, const float* a, const float* b, size_t n) \
+	{ \
+		size_t i = 0; \
+		for (; i + 8 <= n; i += 8) \
+		{ \
+			__m128 a0 = _mm_loadu_ps(a + i); \
+			__m128 a1 = _mm_loadu_ps(a + i + 4); \
+			__m128 b0 = _mm_loadu_ps(b + i); \
+			__m128 b1 = _mm_loadu_ps(b + i + 4); \
+			_mm_storeu_ps(dst + i, OP(a0, b0)); \
+			_mm_storeu_ps(dst + i + 4, OP(a1, b1)); \
+		} \
+		NAME##_scalar(dst + i, a + i, b + i, n - i); \
+	}
+
+	SIMD_TARGET_SSE41 inline __m128i mul_sat_u8_sse41(__m128i a, __m128i b)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i max = _mm_set1_epi16(255);
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+		return _mm_packus_epi16(_mm_min_epu16(lo, max), _mm_min_epu16(hi, max));
+	}
+
+	BINARY_KERNEL_SSE_I(add_u8, uint8_t, _mm_adds_epu8)
+	BINARY_KERNEL_SSE_I(sub_u8, uint8_t, _mm_subs_epu8)
+	BINARY_KERNEL_SSE_I(mul_u8, uint8_t, mul_sat_u8_sse41)
+	BINARY_KERNEL_SSE_I(add_u16, uint16_t, _mm_add_epi16)
+	BINARY_KERNEL_SSE_I(sub_u16, uint16_t, _mm_sub_epi16)
+	BINARY_KERNEL_SSE_I(mul_u16, uint16_t, _mm_mullo_epi16)
+	BINARY_KERNEL_SSE_I(add_u32, uint32_t, _mm_add_epi32)
+	BINARY_KERNEL_SSE_I(sub_u32, uint32_t, _mm_sub_epi32)
+	BINARY_KERNEL_SSE_I(mul_u32, uint32_t, _mm_mullo_epi32)
+	BINARY_KERNEL_SSE_F(add_f32, _mm_add_ps)
+	BINARY_KERNEL_SSE_F(sub_f32, _mm_sub_ps)
+	BINARY_KERNEL_SSE_F(mul_f32, _mm_mul_ps)
+	BINARY_KERNEL_SSE_F(div_f32, _mm_div_ps)
+
+	SIMD_TARGET_SSE41 void add_scalar_u8_sse41(uint8_t* dst, const uint8_t* a, int x, size_t n)
+	{
+		__m128i vx = _mm_set1_epi8((char)std::min(std::abs(x), 255));
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+			_mm_storeu_si128((__m128i*)(dst + i), x >= 0 ? _mm_adds_epu8(va, vx) : _mm_subs_epu8(va, vx));
+		}
+		add_scalar_u8_scalar(dst + i, a + i, x, n - i);
+	}
+
+	SIMD_TARGET_SSE41 void mul_scalar_u8_sse41(uint8_t* dst, const uint8_t* a, int x, size_t n)
+	{
+		__m128i vx = _mm_set1_epi8((char)std::min(std::max(x, 0), 255));
+		size_t i = 0;
+		if (x <= 255)
+		{
+			for (; i + 16 <= n; i += 16)
+			{
+				__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+				_mm_storeu_si128((__m128i*)(dst + i), mul_sat_u8_sse41(va, vx));
+			}
+		}
+		mul_scalar_u8_scalar(dst + i, a + i, x, n - i);
+	}
+
+	// Result is clamped before conversion, out of range floats would turn into INT_MIN otherwise.
+	SIMD_TARGET_SSE41 inline __m128i scale_bias_u8x4_sse41(__m128i v, __m128 scale, __m128 bias)
+	{
+		__m128 f = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(v));
+		f = _mm_add_ps(_mm_mul_ps(f, scale), bias);
+		return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(f, _mm_set1_ps(-1.0f)), _mm_set1_ps(256.0f)));
+	}
+
+	SIMD_TARGET_SSE41 void scale_bias_u8_sse41(uint8_t* dst, const uint8_t* a, float scale, float bias, size_t n)
+	{
+		__m128 vs = _mm_set1_ps(scale);
+		__m128 vb = _mm_set1_ps(bias);
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+			__m128i q0 = scale_bias_u8x4_sse41(va, vs, vb);
+			__m128i q1 = scale_bias_u8x4_sse41(_mm_srli_si128(va, 4), vs, vb);
+			__m128i q2 = scale_bias_u8x4_sse41(_mm_srli_si128(va, 8), vs, vb);
+			__m128i q3 = scale_bias_u8x4_sse41(_mm_srli_si128(va, 12), vs, vb);
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(_mm_packs_epi32(q0, q1), _mm_packs_epi32(q2, q3)));
+		}
+		scale_bias_u8_scalar(dst + i, a + i, scale, bias, n - i);
+	}
+
+	SIMD_TARGET_SSE41 void step_u8_sse41(uint8_t* dst, const uint8_t* a, uint8_t threshold, size_t n)
+	{
+		const __m128i sign = _mm_set1_epi8((char)0x80);
+		__m128i vt = _mm_xor_si128(_mm_set1_epi8((char)threshold), sign);
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			__m128i va = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i)), sign);
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_cmpgt_epi8(va, vt));
+		}
+		step_u8_scalar(dst + i, a + i, threshold, n - i);
+	}
+
+	SIMD_TARGET_SSE41 void add_scalar_f32_sse41(float* dst, const float* a, float x, size_t n)
+	{
+		__m128 vx = _mm_set1_ps(x);
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(a + i), vx));
+		}
+		add_scalar_f32_scalar(dst + i, a + i, x, n - i);
+	}
+
+	SIMD_TARGET_SSE41 void mul_scalar_f32_sse41(float* dst, const float* a, float x, size_t n)
+	{
+		__m128 vx = _mm_set1_ps(x);
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), vx));
+		}
+		mul_scalar_f32_scalar(dst + i, a + i, x, n - i);
+	}
+
+	SIMD_TARGET_SSE41 void scale_bias_f32_sse41(float* dst, const float* a, float scale, float bias, size_t n)
+	{
+		__m128 vs = _mm_set1_ps(scale);
+		__m128 vb = _mm_set1_ps(bias);
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			_mm_storeu_ps(dst + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), vs), vb));
+		}
+		scale_bias_f32_scalar(dst + i, a + i, scale, bias, n - i);
+	}
+
+	SIMD_TARGET_SSE41 void step_f32_sse41(uint8_t* dst, const float* a, float threshold, size_t n)
+	{
+		__m128 vt = _mm_set1_ps(threshold);
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			__m128i m0 = _mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(a + i), vt));
+			__m128i m1 = _mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(a + i + 4), vt));
+			__m128i m2 = _mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(a + i + 8), vt));
+			__m128i m3 = _mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(a + i + 12), vt));
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi16(_mm_packs_epi32(m0, m1), _mm_packs_epi32(m2, m3)));
+		}
+		step_f32_scalar(dst + i, a + i, threshold, n - i);
+	}
+
+	SIMD_TARGET_SSE41 void axpy_f32_sse41(float* acc, const float* a, float w, size_t n)
+	{
+		__m128 vw = _mm_set1_ps(w);
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			_mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(_mm_loadu_ps(a + i), vw)));
+		}
+		axpy_f32_scalar(acc + i, a + i, w, n - i);
+	}
+
+	SIMD_TARGET_SSE41 void convolve_f32_sse41(float* dst, const float* src, const float* weights, int taps, size_t stride, size_t n)
+	{
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			__m128 s0 = _mm_setzero_ps();
+			__m128 s1 = _mm_setzero_ps();
+			const float* p = src + i;
+			for (int t = 0; t < taps; ++t, p += stride)
+			{
+				__m128 w = _mm_set1_ps(weights[t]);
+				s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(p), w));
+				s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(p + 4), w));
+			}
+			_mm_storeu_ps(dst + i, s0);
+			_mm_storeu_ps(dst + i + 4, s1);
+		}
+		convolve_f32_scalar(dst + i, src + i, weights, taps, stride, n - i);
+	}
+
+	// One pixel per register for 2 to 4 channels, lanes past the last channel are discarded.
+	// Single channel rows are dot products of 4 taps at a time.
+	SIMD_TARGET_SSE41 void resample_row_f32_sse41(float* dst, const float* src, const int* first, const float* weights, int taps, int channels, size_t n)
+	{
+		if (channels == 1)
+		{
+			for (size_t i = 0; i < n; ++i)
+			{
+				const float* p = src + first[i];
+				const float* w = weights + i * taps;
+				__m128 s = _mm_setzero_ps();
+				int t = 0;
+				for (; t + 4 <= taps; t += 4)
+				{
+					s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(p + t), _mm_loadu_ps(w + t)));
+				}
+				s = _mm_hadd_ps(s, s);
+				s = _mm_hadd_ps(s, s);
+				float r = _mm_cvtss_f32(s);
+				for (; t < taps; ++t)
+				{
+					r += p[t] * w[t];
+				}
+				dst[i] = r;
+			}
+			return;
+		}
+		for (size_t i = 0; i < n; ++i)
+		{
+			const float* p = src + first[i] * channels;
+			const float* w = weights + i * taps;
+			__m128 s = _mm_setzero_ps();
+			for (int t = 0; t < taps; ++t, p += channels)
+			{
+				__m128 v = channels == 2 ? _mm_castpd_ps(_mm_load_sd((const double*)p)) : _mm_loadu_ps(p);
+				s = _mm_add_ps(s, _mm_mul_ps(v, _mm_set1_ps(w[t])));
+			}
+			if (channels == 4 || (channels == 3 && i + 1 < n))
+			{
+				// For 3 channels the extra lane is overwritten by the next pixel
+				_mm_storeu_ps(dst + i * channels, s);
+			}
+			else
+			{
+				float r[4];
+				_mm_storeu_ps(r, s);
+				memcpy(dst + i * channels, r, channels * sizeof(float));
+			}
+		}
+	}
+
+	SIMD_TARGET_SSE41 void min3_add_f32_sse41(float* dst, const float* prev, const float* e, size_t n)
+	{
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			__m128 m = _mm_min_ps(_mm_min_ps(_mm_loadu_ps(prev + i - 1), _mm_loadu_ps(prev + i)), _mm_loadu_ps(prev + i + 1));
+			_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(e + i), m));
+		}
+		min3_add_f32_scalar(dst + i, prev + i, e + i, n - i);
+	}
+
+	// Interleaving rows k and k + N/2 log2(N) times transposes an NxN tile of bytes (words)
+	SIMD_TARGET_SSE41 void transpose_8_sse41(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h)
+	{
+		for (size_t j = 0; j + 16 <= h; j += 16)
+		{
+			for (size_t i = 0; i + 16 <= w; i += 16)
+			{
+				__m128i a[16], b[16];
+				for (int k = 0; k < 16; ++k)
+				{
+					a[k] = _mm_loadu_si128((const __m128i*)(src + (j + k) * srcStride + i));
+				}
+				for (int round = 0; round < 4; ++round)
+				{
+					for (int k = 0; k < 8; ++k)
+					{
+						b[2 * k] = _mm_unpacklo_epi8(a[k], a[k + 8]);
+						b[2 * k + 1] = _mm_unpackhi_epi8(a[k], a[k + 8]);
+					}
+					memcpy(a, b, sizeof(a));
+				}
+				for (int k = 0; k < 16; ++k)
+				{
+					_mm_storeu_si128((__m128i*)(dst + (i + k) * dstStride + j), a[k]);
+				}
+			}
+		}
+		transpose_edges<uint8_t>(dst, dstStride, src, srcStride, w, h, 16);
+	}
+
+	SIMD_TARGET_SSE41 void transpose_16_sse41(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h)
+	{
+		for (size_t j = 0; j + 8 <= h; j += 8)
+		{
+			for (size_t i = 0; i + 8 <= w; i += 8)
+			{
+				__m128i a[8], b[8];
+				for (int k = 0; k < 8; ++k)
+				{
+					a[k] = _mm_loadu_si128((const __m128i*)(src + (j + k) * srcStride + i * 2));
+				}
+				for (int round = 0; round < 3; ++round)
+				{
+					for (int k = 0; k < 4; ++k)
+					{
+						b[2 * k] = _mm_unpacklo_epi16(a[k], a[k + 4]);
+						b[2 * k + 1] = _mm_unpackhi_epi16(a[k], a[k + 4]);
+					}
+					memcpy(a, b, sizeof(a));
+				}
+				for (int k = 0; k < 8; ++k)
+				{
+					_mm_storeu_si128((__m128i*)(dst + (i + k) * dstStride + j * 2), a[k]);
+				}
+			}
+		}
+		transpose_edges<uint16_t>(dst, dstStride, src, srcStride, w, h, 8);
+	}
+
+	SIMD_TARGET_SSE41 void transpose_32_sse41(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h)
+	{
+		for (size_t j = 0; j + 4 <= h; j += 4)
+		{
+			for (size_t i = 0; i + 4 <= w; i += 4)
+			{
+				const uint8_t* s = src + j * srcStride + i * 4;
+				__m128 r0 = _mm_loadu_ps((const float*)s);
+				__m128 r1 = _mm_loadu_ps((const float*)(s + srcStride));
+				__m128 r2 = _mm_loadu_ps((const float*)(s + srcStride * 2));
+				__m128 r3 = _mm_loadu_ps((const float*)(s + srcStride * 3));
+				_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+				uint8_t* d = dst + i * dstStride + j * 4;
+				_mm_storeu_ps((float*)d, r0);
+				_mm_storeu_ps((float*)(d + dstStride), r1);
+				_mm_storeu_ps((float*)(d + dstStride * 2), r2);
+				_mm_storeu_ps((float*)(d + dstStride * 3), r3);
+			}
+		}
+		transpose_edges<uint32_t>(dst, dstStride, src, srcStride, w, h, 4);
+	}
+
+	SIMD_TARGET_SSE41 void u8_to_f32_sse41(float* dst, const uint8_t* src, float scale, size_t n)
+	{
+		__m128 vs = _mm_set1_ps(scale);
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+			for (int k = 0; k < 4; ++k, v = _mm_srli_si128(v, 4))
+			{
+				_mm_storeu_ps(dst + i + k * 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(v)), vs));
+			}
+		}
+		u8_to_f32_scalar(dst + i, src + i, scale, n - i);
+	}
+
+	SIMD_TARGET_SSE41 inline __m128i f32_to_i32x4_sse41(const float* src, __m128 scale, __m128 bias)
+	{
+		// max returns zero for NaN
+		__m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src), scale), bias);
+		v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+		return _mm_cvttps_epi32(v);
+	}
+
+	SIMD_TARGET_SSE41 void f32_to_u8_sse41(uint8_t* dst, const float* src, float scale, float bias, size_t n)
+	{
+		__m128 vs = _mm_set1_ps(scale);
+		__m128 vb = _mm_set1_ps(bias);
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			__m128i a = _mm_packs_epi32(f32_to_i32x4_sse41(src + i, vs, vb), f32_to_i32x4_sse41(src + i + 4, vs, vb));
+			__m128i b = _mm_packs_epi32(f32_to_i32x4_sse41(src + i + 8, vs, vb), f32_to_i32x4_sse41(src + i + 12, vs, vb));
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+		}
+		f32_to_u8_scalar(dst + i, src + i, scale, bias, n - i);
+	}
+
+	// Four pixels per step, loads and stores stay within the row while six pixels are left
+	SIMD_TARGET_SSE41 void rgb8_to_rgba8_sse41(uint8_t* dst, const uint8_t* src, size_t n)
+	{
+		const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+		size_t i = 0;
+		for (; i + 6 <= n; i += 4)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i * 3));
+			_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+		}
+		rgb8_to_rgba8_scalar(dst + i * 4, src + i * 3, n - i);
+	}
+
+	SIMD_TARGET_SSE41 void rgba8_to_rgb8_sse41(uint8_t* dst, const uint8_t* src, size_t n)
+	{
+		const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+		size_t i = 0;
+		for (; i + 6 <= n; i += 4)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i * 4));
+			_mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(v, shuffle));
+		}
+		rgba8_to_rgb8_scalar(dst + i * 3, src + i * 4, n - i);
+	}
+
+	/////////////////////////////////////////////////////////////////////
+	// AVX2 + FMA
+	/////////////////////////////////////////////////////////////////////
+#define BINARY_KERNEL_AVX2_I(NAME, T, OP) \
+	SIMD_TARGET_AVX2 void NAME##_avx2(T* dst, const T* a, const T* b, size_t n) \
+	{ \
+		const size_t step = 32 / sizeof(T); \
+		size_t i = 0; \
+		for (; i + step <= n; i += step) \
+		{ \
+			__m256i va = _mm256_loadu_si256((const __m256i*)(a + i)); \
+			__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i)); \
+			_mm256_storeu_si256((__m256i*)(dst + i), OP(va, vb)); \
+		} \
+		NAME##_scalar(dst + i, a + i, b + i, n - i); \
+	}
+
+#define BINARY_KERNEL_AVX2_F(NAME, OP) \
+	SIMD_TARGET_AVX2 void NAME##_avx2(float* dst, const float* a, const float* b, size_t n) \
+	{ \
+		size_t i = 0; \
+		for (; i + 16 <= n; i += 16) \
+		{ \
+			__m256 a0 = _mm256_loadu_ps(a + i); \
+			__m256 a1 = _mm256_loadu_ps(a + i + 8); \
+			__m256 b0 = _mm256_loadu_ps(b + i); \
+			__m256 b1 = _mm256_loadu_ps(b + i + 8); \
+			_mm256_storeu_ps(dst + i, OP(a0, b0)); \
+			_mm256_storeu_ps(dst + i + 8, OP(a1, b1)); \
+		} \
+		NAME##_scalar(dst + i, a + i, b + i, n - i); \
+	}
+
+	// Packs of 256-bit registers work per 128-bit lane, this puts 32-bit groups back in memory order.
+	SIMD_TARGET_AVX2 inline __m256i fix_pack_order_avx2(__m256i v)
+	{
+		return _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+	}
+
+	SIMD_TARGET_AVX2 inline __m256i mul_sat_u8_avx2(__m256i a, __m256i b)
+	{
+		const __m256i max = _mm256_set1_epi16(255);
+		__m256i lo = _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(a)), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b)));
+		__m256i hi = _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1)), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b, 1)));
+		__m256i r = _mm256_packus_epi16(_mm256_min_epu16(lo, max), _mm256_min_epu16(hi, max));
+		return _mm256_permute4x64_epi64(r, 0xD8);
+	}
+
+	BINARY_KERNEL_AVX2_I(add_u8, uint8_t, _mm256_adds_epu8)
+	BINARY_KERNEL_AVX2_I(sub_u8, uint8_t, _mm256_subs_epu8)
+	BINARY_KERNEL_AVX2_I(mul_u8, uint8_t, mul_sat_u8_avx2)
+	BINARY_KERNEL_AVX2_I(add_u16, uint16_t, _mm256_add_epi16)
+	BINARY_KERNEL_AVX2_I(sub_u16, uint16_t, _mm256_sub_epi16)
+	BINARY_KERNEL_AVX2_I(mul_u16, uint16_t, _mm256_mullo_epi16)
+	BINARY_KERNEL_AVX2_I(add_u32, uint32_t, _mm256_add_epi32)
+	BINARY_KERNEL_AVX2_I(sub_u32, uint32_t, _mm256_sub_epi32)
+	BINARY_KERNEL_AVX2_I(mul_u32, uint32_t, _mm256_mullo_epi32)
+	BINARY_KERNEL_AVX2_F(add_f32, _mm256_add_ps)
+	BINARY_KERNEL_AVX2_F(sub_f32, _mm256_sub_ps)
+	BINARY_KERNEL_AVX2_F(mul_f32, _mm256_mul_ps)
+	BINARY_KERNEL_AVX2_F(div_f32, _mm256_div_ps)
+
+	SIMD_TARGET_AVX2 void add_scalar_u8_avx2(uint8_t* dst, const uint8_t* a, int x, size_t n)
+	{
+		__m256i vx = _mm256_set1_epi8((char)std::min(std::abs(x), 255));
+		size_t i = 0;
+		for (; i + 32 <= n; i += 32)
+		{
+			__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+			_mm256_storeu_si256((__m256i*)(dst + i), x >= 0 ? _mm256_adds_epu8(va, vx) : _mm256_subs_epu8(va, vx));
+		}
+		add_scalar_u8_scalar(dst + i, a + i, x, n - i);
+	}
+
+	SIMD_TARGET_AVX2 void mul_scalar_u8_avx2(uint8_t* dst, const uint8_t* a, int x, size_t n)
+	{
+		__m256i vx = _mm256_set1_epi8((char)std::min(std::max(x, 0), 255));
+		size_t i = 0;
+		if (x <= 255)
+		{
+			for (; i + 32 <= n; i += 32)
+			{
+				__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+				_mm256_storeu_si256((__m256i*)(dst + i), mul_sat_u8_avx2(va, vx));
+			}
+		}
+		mul_scalar_u8_scalar(dst + i, a + i, x, n - i);
+	}
+
+	SIMD_TARGET_AVX2 inline __m256i scale_bias_u8x8_avx2(__m128i v, __m256 scale, __m256 bias)
+	{
+		__m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+		f = _mm256_fmadd_ps(f, scale, bias);
+		return _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(f, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(256.0f)));
+	}
+
+	SIMD_TARGET_AVX2 void scale_bias_u8_avx2(uint8_t* dst, const uint8_t* a, float scale, float bias, size_t n)
+	{
+		__m256 vs = _mm256_set1_ps(scale);
+		__m256 vb = _mm256_set1_ps(bias);
+		size_t i = 0;
+		for (; i + 32 <= n; i += 32)
+		{
+			__m128i lo = _mm_loadu_si128((const __m128i*)(a + i));
+			__m128i hi = _mm_loadu_si128((const __m128i*)(a + i + 16));
+			__m256i q0 = scale_bias_u8x8_avx2(lo, vs, vb);
+			__m256i q1 = scale_bias_u8x8_avx2(_mm_srli_si128(lo, 8), vs, vb);
+			__m256i q2 = scale_bias_u8x8_avx2(hi, vs, vb);
+			__m256i q3 = scale_bias_u8x8_avx2(_mm_srli_si128(hi, 8), vs, vb);
+			__m256i r = _mm256_packus_epi16(_mm256_packs_epi32(q0, q1), _mm256_packs_epi32(q2, q3));
+			_mm256_storeu_si256((__m256i*)(dst + i), fix_pack_order_avx2(r));
+		}
+		scale_bias_u8_scalar(dst + i, a + i, scale, bias, n - i);
+	}
+
+	SIMD_TARGET_AVX2 void step_u8_avx2(uint8_t* dst, const uint8_t* a, uint8_t threshold, size_t n)
+	{
+		const __m256i sign = _mm256_set1_epi8((char)0x80);
+		__m256i vt = _mm256_xor_si256(_mm256_set1_epi8((char)threshold), sign);
+		size_t i = 0;
+		for (; i + 32 <= n; i += 32)
+		{
+			__m256i va = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i)), sign);
+			_mm256_storeu_si256((__m256i*)(dst + i), _mm256_cmpgt_epi8(va, vt));
+		}
+		step_u8_scalar(dst + i, a + i, threshold, n - i);
+	}
+
+	SIMD_TARGET_AVX2 void add_scalar_f32_avx2(float* dst, const float* a, float x, size_t n)
+	{
+		__m256 vx = _mm256_set1_ps(x);
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			_mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(a + i), vx));
+		}
+		add_scalar_f32_scalar(dst + i, a + i, x, n - i);
+	}
+
+	SIMD_TARGET_AVX2 void mul_scalar_f32_avx2(float* dst, const float* a, float x, size_t n)
+	{
+		__m256 vx = _mm256_set1_ps(x);
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(a + i), vx));
+		}
+		mul_scalar_f32_scalar(dst + i, a + i, x, n - i);
+	}
+
+	SIMD_TARGET_AVX2 void scale_bias_f32_avx2(float* dst, const float* a, float scale, float bias, size_t n)
+	{
+		__m256 vs = _mm256_set1_ps(scale);
+		__m256 vb = _mm256_set1_ps(bias);
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			_mm256_storeu_ps(dst + i, _mm256_fmadd_ps(_mm256_loadu_ps(a + i), vs, vb));
+		}
+		scale_bias_f32_scalar(dst + i, a + i, scale, bias, n - i);
+	}
+
+	SIMD_TARGET_AVX2 void step_f32_avx2(uint8_t* dst, const float* a, float threshold, size_t n)
+	{
+		__m256 vt = _mm256_set1_ps(threshold);
+		size_t i = 0;
+		for (; i + 32 <= n; i += 32)
+		{
+			__m256i m0 = _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(a + i), vt, _CMP_GT_OQ));
+			__m256i m1 = _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(a + i + 8), vt, _CMP_GT_OQ));
+			__m256i m2 = _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(a + i + 16), vt, _CMP_GT_OQ));
+			__m256i m3 = _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(a + i + 24), vt, _CMP_GT_OQ));
+			__m256i r = _mm256_packs_epi16(_mm256_packs_epi32(m0, m1), _mm256_packs_epi32(m2, m3));
+			_mm256_storeu_si256((__m256i*)(dst + i), fix_pack_order_avx2(r));
+		}
+		step_f32_scalar(dst + i, a + i, threshold, n - i);
+	}
+	SIMD_TARGET_AVX2 void axpy_f32_avx2(float* acc, const float* a, float w, size_t n)
+	{
+		__m256 vw = _mm256_set1_ps(w);
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			_mm256_storeu_ps(acc + i, _mm256_fmadd_ps(_mm256_loadu_ps(a + i), vw, _mm256_loadu_ps(acc + i)));
+		}
+		axpy_f32_scalar(acc + i, a + i, w, n - i);
+	}
+
+	// Four independent accumulators hide the FMA latency
+	SIMD_TARGET_AVX2 void convolve_f32_avx2(float* dst, const float* src, const float* weights, int taps, size_t stride, size_t n)
+	{
+		size_t i = 0;
+		for (; i + 32 <= n; i += 32)
+		{
+			__m256 s0 = _mm256_setzero_ps();
+			__m256 s1 = _mm256_setzero_ps();
+			__m256 s2 = _mm256_setzero_ps();
+			__m256 s3 = _mm256_setzero_ps();
+			const float* p = src + i;
+			for (int t = 0; t < taps; ++t, p += stride)
+			{
+				__m256 w = _mm256_set1_ps(weights[t]);
+				s0 = _mm256_fmadd_ps(_mm256_loadu_ps(p), w, s0);
+				s1 = _mm256_fmadd_ps(_mm256_loadu_ps(p + 8), w, s1);
+				s2 = _mm256_fmadd_ps(_mm256_loadu_ps(p + 16), w, s2);
+				s3 = _mm256_fmadd_ps(_mm256_loadu_ps(p + 24), w, s3);
+			}
+			_mm256_storeu_ps(dst + i, s0);
+			_mm256_storeu_ps(dst + i + 8, s1);
+			_mm256_storeu_ps(dst + i + 16, s2);
+			_mm256_storeu_ps(dst + i + 24, s3);
+		}
+		for (; i + 8 <= n; i += 8)
+		{
+			__m256 s0 = _mm256_setzero_ps();
+			const float* p = src + i;
+			for (int t = 0; t < taps; ++t, p += stride)
+			{
+				s0 = _mm256_fmadd_ps(_mm256_loadu_ps(p), _mm256_set1_ps(weights[t]), s0);
+			}
+			_mm256_storeu_ps(dst + i, s0);
+		}
+		convolve_f32_scalar(dst + i, src + i, weights, taps, stride, n - i);
+	}
+
+	// Two output pixels per register for 4 channels, 8 taps at a time for a single channel
+	SIMD_TARGET_AVX2 void resample_row_f32_avx2(float* dst, const float* src, const int* first, const float* weights, int taps, int channels, size_t n)
+	{
+		if (channels == 4)
+		{
+			size_t i = 0;
+			for (; i + 2 <= n; i += 2)
+			{
+				const float* p0 = src + first[i] * 4;
+				const float* p1 = src + first[i + 1] * 4;
+				const float* w0 = weights + i * taps;
+				const float* w1 = w0 + taps;
+				__m256 s = _mm256_setzero_ps();
+				for (int t = 0; t < taps; ++t)
+				{
+					__m256 v = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p0 + t * 4)), _mm_loadu_ps(p1 + t * 4), 1);
+					__m256 w = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(w0[t])), _mm_set1_ps(w1[t]), 1);
+					s = _mm256_fmadd_ps(v, w, s);
+				}
+				_mm256_storeu_ps(dst + i * 4, s);
+			}
+			resample_row_f32_sse41(dst + i * 4, src, first + i, weights + i * taps, taps, channels, n - i);
+			return;
+		}
+		if (channels == 1)
+		{
+			for (size_t i = 0; i < n; ++i)
+			{
+				const float* p = src + first[i];
+				const float* w = weights + i * taps;
+				__m256 s = _mm256_setzero_ps();
+				int t = 0;
+				for (; t + 8 <= taps; t += 8)
+				{
+					s = _mm256_fmadd_ps(_mm256_loadu_ps(p + t), _mm256_loadu_ps(w + t), s);
+				}
+				__m128 h = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+				h = _mm_hadd_ps(h, h);
+				h = _mm_hadd_ps(h, h);
+				float r = _mm_cvtss_f32(h);
+				for (; t < taps; ++t)
+				{
+					r += p[t] * w[t];
+				}
+				dst[i] = r;
+			}
+			return;
+		}
+		resample_row_f32_sse41(dst, src, first, weights, taps, channels, n);
+	}
+
+	SIMD_TARGET_AVX2 void min3_add_f32_avx2(float* dst, const float* prev, const float* e, size_t n)
+	{
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			__m256 m = _mm256_min_ps(_mm256_min_ps(_mm256_loadu_ps(prev + i - 1), _mm256_loadu_ps(prev + i)), _mm256_loadu_ps(prev + i + 1));
+			_mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(e + i), m));
+		}
+		min3_add_f32_scalar(dst + i, prev + i, e + i, n - i);
+	}
+
+	SIMD_TARGET_AVX2 void transpose_8_avx2(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h)
+	{
+		transpose_8_sse41(dst, dstStride, src, srcStride, w, h);
+	}
+
+	SIMD_TARGET_AVX2 void transpose_16_avx2(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h)
+	{
+		transpose_16_sse41(dst, dstStride, src, srcStride, w, h);
+	}
+
+	SIMD_TARGET_AVX2 void transpose_32_avx2(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h)
+	{
+		for (size_t j = 0; j + 8 <= h; j += 8)
+		{
+			for (size_t i = 0; i + 8 <= w; i += 8)
+			{
+				const uint8_t* s = src + j * srcStride + i * 4;
+				__m256 r[8], t[8];
+				for (int k = 0; k < 8; ++k)
+				{
+					r[k] = _mm256_loadu_ps((const float*)(s + k * srcStride));
+				}
+				for (int k = 0; k < 8; k += 2)
+				{
+					t[k] = _mm256_unpacklo_ps(r[k], r[k + 1]);
+					t[k + 1] = _mm256_unpackhi_ps(r[k], r[k + 1]);
+				}
+				for (int k = 0; k < 8; k += 4)
+				{
+					r[k] = _mm256_shuffle_ps(t[k], t[k + 2], _MM_SHUFFLE(1, 0, 1, 0));
+					r[k + 1] = _mm256_shuffle_ps(t[k], t[k + 2], _MM_SHUFFLE(3, 2, 3, 2));
+					r[k + 2] = _mm256_shuffle_ps(t[k + 1], t[k + 3], _MM_SHUFFLE(1, 0, 1, 0));
+					r[k + 3] = _mm256_shuffle_ps(t[k + 1], t[k + 3], _MM_SHUFFLE(3, 2, 3, 2));
+				}
+				uint8_t* d = dst + i * dstStride + j * 4;
+				for (int k = 0; k < 4; ++k)
+				{
+					_mm256_storeu_ps((float*)(d + k * dstStride), _mm256_permute2f128_ps(r[k], r[k + 4], 0x20));
+					_mm256_storeu_ps((float*)(d + (k + 4) * dstStride), _mm256_permute2f128_ps(r[k], r[k + 4], 0x31));
+				}
+			}
+		}
+		transpose_edges<uint32_t>(dst, dstStride, src, srcStride, w, h, 8);
+	}
+
+	SIMD_TARGET_AVX2 void u8_to_f32_avx2(float* dst, const uint8_t* src, float scale, size_t n)
+	{
+		__m256 vs = _mm256_set1_ps(scale);
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+			_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)), vs));
+			_mm256_storeu_ps(dst + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(v, 8))), vs));
+		}
+		u8_to_f32_scalar(dst + i, src + i, scale, n - i);
+	}
+
+	SIMD_TARGET_AVX2 inline __m256i f32_to_i32x8_avx2(const float* src, __m256 scale, __m256 bias)
+	{
+		__m256 v = _mm256_fmadd_ps(_mm256_loadu_ps(src), scale, bias);
+		v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+		return _mm256_cvttps_epi32(v);
+	}
+
+	SIMD_TARGET_AVX2 void f32_to_u8_avx2(uint8_t* dst, const float* src, float scale, float bias, size_t n)
+	{
+		__m256 vs = _mm256_set1_ps(scale);
+		__m256 vb = _mm256_set1_ps(bias);
+		size_t i = 0;
+		for (; i + 32 <= n; i += 32)
+		{
+			__m256i a = _mm256_packs_epi32(f32_to_i32x8_avx2(src + i, vs, vb), f32_to_i32x8_avx2(src + i + 8, vs, vb));
+			__m256i b = _mm256_packs_epi32(f32_to_i32x8_avx2(src + i + 16, vs, vb), f32_to_i32x8_avx2(src + i + 24, vs, vb));
+			_mm256_storeu_si256((__m256i*)(dst + i), fix_pack_order_avx2(_mm256_packus_epi16(a, b)));
+		}
+		f32_to_u8_sse41(dst + i, src + i, scale, bias, n - i);
+	}
+
+	SIMD_TARGET_AVX2 void rgb8_to_rgba8_avx2(uint8_t* dst, const uint8_t* src, size_t n)
+	{
+		rgb8_to_rgba8_sse41(dst, src, n);
+	}
+
+	SIMD_TARGET_AVX2 void rgba8_to_rgb8_avx2(uint8_t* dst, const uint8_t* src, size_t n)
+	{
+		rgba8_to_rgb8_sse41(dst, src, n);
+	}
+#endif
+
+#define FILL_KERNELS(K, SUFFIX) \
+	K.add_u8 = add_u8_##SUFFIX; \
+	K.sub_u8 = sub_u8_##SUFFIX; \
+	K.mul_u8 = mul_u8_##SUFFIX; \
+	K.add_scalar_u8 = add_scalar_u8_##SUFFIX; \
+	K.mul_scalar_u8 = mul_scalar_u8_##SUFFIX; \
+	K.scale_bias_u8 = scale_bias_u8_##SUFFIX; \
+	K.step_u8 = step_u8_##SUFFIX; \
+	K.add_u16 = add_u16_##SUFFIX; \
+	K.sub_u16 = sub_u16_##SUFFIX; \
+	K.mul_u16 = mul_u16_##SUFFIX; \
+	K.add_u32 = add_u32_##SUFFIX; \
+	K.sub_u32 = sub_u32_##SUFFIX; \
+	K.mul_u32 = mul_u32_##SUFFIX; \
+	K.add_f32 = add_f32_##SUFFIX; \
+	K.sub_f32 = sub_f32_##SUFFIX; \
+	K.mul_f32 = mul_f32_##SUFFIX; \
+	K.div_f32 = div_f32_##SUFFIX; \
+	K.add_scalar_f32 = add_scalar_f32_##SUFFIX; \
+	K.mul_scalar_f32 = mul_scalar_f32_##SUFFIX; \
+	K.scale_bias_f32 = scale_bias_f32_##SUFFIX; \
+	K.step_f32 = step_f32_##SUFFIX; \
+	K.axpy_f32 = axpy_f32_##SUFFIX; \
+	K.convolve_f32 = convolve_f32_##SUFFIX; \
+	K.resample_row_f32 = resample_row_f32_##SUFFIX; \
+	K.min3_add_f32 = min3_add_f32_##SUFFIX; \
+	K.transpose_8 = transpose_8_##SUFFIX; \
+	K.transpose_16 = transpose_16_##SUFFIX; \
+	K.transpose_32 = transpose_32_##SUFFIX; \
+	K.u8_to_f32 = u8_to_f32_##SUFFIX; \
+	K.f32_to_u8 = f32_to_u8_##SUFFIX; \
+	K.rgb8_to_rgba8 = rgb8_to_rgba8_##SUFFIX; \
+	K.rgba8_to_rgb8 = rgba8_to_rgb8_##SUFFIX;
+
+	simd::Kernels MakeKernels(simd::ISA isa)
+	{
+		simd::Kernels k;
+		switch (isa)
+		{
+#ifdef SIMD_X86
+			case simd::ISA_AVX2:
+				FILL_KERNELS(k, avx2)
+				break;
+			case simd::ISA_SSE41:
+				FILL_KERNELS(k, sse41)
+				break;
+#endif
+			default:
+				FILL_KERNELS(k, scalar)
+		}
+		return k;
+	}
+
+	simd::ISA DetectISA()
+	{
+#ifdef SIMD_X86
+		auto features = utils::GetCPUFeatures();
+		if (features.avx2 && features.fma)
+		{
+			return simd::ISA_AVX2;
+		}
+		if (features.sse41)
+		{
+			return simd::ISA_SSE41;
+		}
+#endif
+		return simd::ISA_Scalar;
+	}
+
+	struct Dispatch
+	{
+		simd::ISA best;
+		simd::ISA current;
+		simd::Kernels kernels;
+
+		Dispatch(): best(DetectISA()), current(best), kernels(MakeKernels(best)) {}
+	};
+
+	Dispatch& GetDispatch()
+	{
+		static Dispatch dispatch;
+		return dispatch;
+	}
+}
+
+
+const simd::Kernels& simd::Get()
+{
+	return GetDispatch().kernels;
+}
+
+simd::ISA simd::GetISA()
+{
+	return GetDispatch().current;
+}
+
+simd::ISA simd::GetBestISA()
+{
+	return GetDispatch().best;
+}
+
+void simd::SetISA(ISA isa)
+{
+	auto& dispatch = GetDispatch();
+	dispatch.current = std::min(isa, dispatch.best);
+	dispatch.kernels = MakeKernels(dispatch.current);
+}
+
+const char* simd::GetISAName(ISA isa)
+{
+	switch (isa)
+	{
+		case ISA_Scalar: return "scalar";
+		case ISA_SSE41: return "sse4.1";
+		case ISA_AVX2: return "avx2";
+	}
+	return "unknown";
+}
+
+
+#include <doctest.h>
+
+TEST_CASE("[Image] SIMD kernels match scalar")
+{
+	const size_t n = 77;
+	uint8_t a[n], b[n], r_ref[n], r[n];
+	float fa[n], fb[n], f_ref[n], f[n];
+	for (size_t i = 0; i < n; ++i)
+	{
+		a[i] = (uint8_t)(i * 37 + 11);
+		b[i] = (uint8_t)(i * 91 + 3);
+		fa[i] = (float)i * 0.37f - 9.0f;
+		fb[i] = (float)i * 0.11f + 1.0f;
+	}
+
+	for (int isa = simd::ISA_SSE41; isa <= simd::GetBestISA(); ++isa)
+	{
+		simd::SetISA(simd::ISA_Scalar);
+		auto ref = simd::Get();
+		simd::SetISA((simd::ISA)isa);
+		auto k = simd::Get();
+
+		ref.add_u8(r_ref, a, b, n); k.add_u8(r, a, b, n);
+		CHECK(memcmp(r_ref, r, n) == 0);
+		ref.sub_u8(r_ref, a, b, n); k.sub_u8(r, a, b, n);
+		CHECK(memcmp(r_ref, r, n) == 0);
+		ref.mul_u8(r_ref, a, b, n); k.mul_u8(r, a, b, n);
+		CHECK(memcmp(r_ref, r, n) == 0);
+		{
+			// Products past 16 bits wrap
+			uint16_t wa[n], wb[n], w_ref[n], w[n];
+			for (size_t i = 0; i < n; ++i)
+			{
+				wa[i] = (uint16_t)(65535 - i * 13);
+				wb[i] = (uint16_t)(65535 - i * 7);
+			}
+			ref.mul_u16(w_ref, wa, wb, n); k.mul_u16(w, wa, wb, n);
+			CHECK(memcmp(w_ref, w, sizeof(w)) == 0);
+			CHECK(w_ref[0] == 1);
+		}
+		ref.add_scalar_u8(r_ref, a, -40, n); k.add_scalar_u8(r, a, -40, n);
+		CHECK(memcmp(r_ref, r, n) == 0);
+		ref.mul_scalar_u8(r_ref, a, 3, n); k.mul_scalar_u8(r, a, 3, n);
+		CHECK(memcmp(r_ref, r, n) == 0);
+		ref.scale_bias_u8(r_ref, a, 0.75f, 20.0f, n); k.scale_bias_u8(r, a, 0.75f, 20.0f, n);
+		CHECK(memcmp(r_ref, r, n) == 0);
+		ref.step_u8(r_ref, a, 127, n); k.step_u8(r, a, 127, n);
+		CHECK(memcmp(r_ref, r, n) == 0);
+		ref.step_f32(r_ref, fa, 2.0f, n); k.step_f32(r, fa, 2.0f, n);
+		CHECK(memcmp(r_ref, r, n) == 0);
+		ref.div_f32(f_ref, fa, fb, n); k.div_f32(f, fa, fb, n);
+		CHECK(memcmp(f_ref, f, n * sizeof(float)) == 0);
+		ref.scale_bias_f32(f_ref, fa, 0.5f, 0.25f, n); k.scale_bias_f32(f, fa, 0.5f, 0.25f, n);
+		for (size_t i = 0; i < n; ++i)
+		{
+			CHECK(fabsf(f_ref[i] - f[i]) < 1e-5f);
+		}
+		const float weights[5] = {0.1f, 0.2f, 0.4f, 0.2f, 0.1f};
+		ref.convolve_f32(f_ref, fa, weights, 5, 3, n - 12); k.convolve_f32(f, fa, weights, 5, 3, n - 12);
+		for (size_t i = 0; i < n - 12; ++i)
+		{
+			CHECK(fabsf(f_ref[i] - f[i]) < 1e-5f);
+		}
+		ref.min3_add_f32(f_ref, fa + 1, fb, n - 2); k.min3_add_f32(f, fa + 1, fb, n - 2);
+		CHECK(memcmp(f_ref, f, (n - 2) * sizeof(float)) == 0);
+		{
+			// 37x29 block of a 40 element wide source, covers whole register tiles and edges for every element size
+			static uint8_t block[29 * 160], t_ref[37 * 120], t[37 * 120];
+			for (size_t i = 0; i < sizeof(block); ++i)
+			{
+				block[i] = (uint8_t)(i * 53 + 7);
+			}
+			auto check = [&](decltype(ref.transpose_8) f_ref, decltype(ref.transpose_8) f, size_t bpp)
+			{
+				memset(t_ref, 0, sizeof(t_ref));
+				memset(t, 0, sizeof(t));
+				f_ref(t_ref, 29 * bpp + 4, block, 40 * bpp, 37, 29);
+				f(t, 29 * bpp + 4, block, 40 * bpp, 37, 29);
+				CHECK(memcmp(t_ref, t, sizeof(t)) == 0);
+			};
+			check(ref.transpose_8, k.transpose_8, 1);
+			check(ref.transpose_16, k.transpose_16, 2);
+			check(ref.transpose_32, k.transpose_32, 4);
+		}
+		{
+			float g_ref[n], g[n];
+			ref.u8_to_f32(g_ref, a, 1.0f / 255.0f, n); k.u8_to_f32(g, a, 1.0f / 255.0f, n);
+			CHECK(memcmp(g_ref, g, sizeof(g)) == 0);
+			memcpy(g, fa, sizeof(g));
+			g[5] = NAN;
+			g[6] = 1e20f;
+			ref.f32_to_u8(r_ref, g, 40.0f, 0.5f, n); k.f32_to_u8(r, g, 40.0f, 0.5f, n);
+			CHECK(memcmp(r_ref, r, n) == 0);
+			uint8_t rgba_ref[n * 4], rgba[n * 4];
+			ref.rgb8_to_rgba8(rgba_ref, a, n / 3); k.rgb8_to_rgba8(rgba, a, n / 3);
+			CHECK(memcmp(rgba_ref, rgba, n / 3 * 4) == 0);
+			ref.rgba8_to_rgb8(r_ref, a, n / 4); k.rgba8_to_rgb8(r, a, n / 4);
+			CHECK(memcmp(r_ref, r, n / 4 * 3) == 0);
+		}
+		for (int channels = 1; channels <= 4; ++channels)
+		{
+			const int pixels = 7;
+			const int first[pixels] = {0, 1, 3, 4, 6, 8, 10};
+			float resample_weights[pixels * 5];
+			for (int i = 0; i < pixels * 5; ++i)
+			{
+				resample_weights[i] = weights[i % 5] * (1.0f + 0.1f * (i / 5));
+			}
+			ref.resample_row_f32(f_ref, fa, first, resample_weights, 5, channels, pixels);
+			k.resample_row_f32(f, fa, first, resample_weights, 5, channels, pixels);
+			for (int i = 0; i < pixels * channels; ++i)
+			{
+				CHECK(fabsf(f_ref[i] - f[i]) < 1e-5f);
+			}
+		}
+	}
+	simd::SetISA(simd::GetBestISA());
+}
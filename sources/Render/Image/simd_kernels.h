@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+
+// Row kernels for Image arithmetic. Every kernel processes `n` scalar elements (bytes for 8-bit types,
+// channels for the rest), so multichannel pixels are handled as flat arrays.
+// Implementations for each instruction set are picked at runtime from the CPU features.
+namespace simd
+{
+	enum ISA
+	{
+		ISA_Scalar = 0,
+		ISA_SSE41,
+		ISA_AVX2,
+	};
+
+	struct Kernels
+	{
+		// 8-bit channels, saturating
+		void (*add_u8)(uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t n);
+		void (*sub_u8)(uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t n);
+		void (*mul_u8)(uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t n);
+		void (*add_scalar_u8)(uint8_t* dst, const uint8_t* a, int x, size_t n);
+		void (*mul_scalar_u8)(uint8_t* dst, const uint8_t* a, int x, size_t n);
+		void (*scale_bias_u8)(uint8_t* dst, const uint8_t* a, float scale, float bias, size_t n);
+		void (*step_u8)(uint8_t* dst, const uint8_t* a, uint8_t threshold, size_t n);
+
+		// 16 and 32-bit integer channels, wrapping
+		void (*add_u16)(uint16_t* dst, const uint16_t* a, const uint16_t* b, size_t n);
+		void (*sub_u16)(uint16_t* dst, const uint16_t* a, const uint16_t* b, size_t n);
+		void (*mul_u16)(uint16_t* dst, const uint16_t* a, const uint16_t* b, size_t n);
+		void (*add_u32)(uint32_t* dst, const uint32_t* a, const uint32_t* b, size_t n);
+		void (*sub_u32)(uint32_t* dst, const uint32_t* a, const uint32_t* b, size_t n);
+		void (*mul_u32)(uint32_t* dst, const uint32_t* a, const uint32_t* b, size_t n);
+
+		// float channels
+		void (*add_f32)(float* dst, const float* a, const float* b, size_t n);
+		void (*sub_f32)(float* dst, const float* a, const float* b, size_t n);
+		void (*mul_f32)(float* dst, const float* a, const float* b, size_t n);
+		void (*div_f32)(float* dst, const float* a, const float* b, size_t n);
+		void (*add_scalar_f32)(float* dst, const float* a, float x, size_t n);
+		void (*mul_scalar_f32)(float* dst, const float* a, float x, size_t n);
+		void (*scale_bias_f32)(float* dst, const float* a, float scale, float bias, size_t n);
+		void (*step_f32)(uint8_t* dst, const float* a, float threshold, size_t n);
+
+		// acc[i] += a[i] * w
+		void (*axpy_f32)(float* acc, const float* a, float w, size_t n);
+		// dst[i] = sum(src[i + t * stride] * weights[t]) over t in [0, taps). `src` must hold n + (taps - 1) * stride elements.
+		void (*convolve_f32)(float* dst, const float* src, const float* weights, int taps, size_t stride, size_t n);
+		// Resampling of `n` pixels with `channels` interleaved floats. Pixel i is the sum of src pixels [first[i], first[i] + taps)
+		// weighted by weights[i * taps + t]. `src` is read up to one float past its last pixel.
+		void (*resample_row_f32)(float* dst, const float* src, const int* first, const float* weights, int taps, int channels, size_t n);
+		// Seam carving cumulative cost: dst[i] = e[i] + min(prev[i - 1], prev[i], prev[i + 1]), `prev` is read at -1 and n
+		void (*min3_add_f32)(float* dst, const float* prev, const float* e, size_t n);
+
+		// Transpose of a block of w x h elements of 1, 2 or 4 bytes: element i of src row j goes to element j of dst row i.
+		// Strides are in bytes, the block is done in 16x16, 8x8 and 4x4 (8x8 with AVX2) register tiles.
+		void (*transpose_8)(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h);
+		void (*transpose_16)(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h);
+		void (*transpose_32)(uint8_t* dst, size_t dstStride, const uint8_t* src, size_t srcStride, size_t w, size_t h);
+
+		// Format conversion: dst[i] = src[i] * scale, and back with dst[i] = trunc(clamp(src[i] * scale + bias, 0, 255)), NaN gives 0
+		void (*u8_to_f32)(float* dst, const uint8_t* src, float scale, size_t n);
+		void (*f32_to_u8)(uint8_t* dst, const float* src, float scale, float bias, size_t n);
+		// RGB8 <-> RGBA8 for `n` pixels, added alpha is 255
+		void (*rgb8_to_rgba8)(uint8_t* dst, const uint8_t* src, size_t n);
+		void (*rgba8_to_rgb8)(uint8_t* dst, const uint8_t* src, size_t n);
+	};
+
+	const Kernels& Get();
+
+	ISA GetISA();
+
+	// Best instruction set supported by the CPU and the build.
+	ISA GetBestISA();
+
+	// Forces kernels of the given instruction set, clamped to GetBestISA(). Used by benchmarks and tests.
+	void SetISA(ISA isa);
+
+	const char* GetISAName(ISA isa);
+}
@@ -0,0 +1,138 @@
+#include "StreamBuffer.h"
+#include <assert.h>
+
+using namespace Render;
+
+
+StreamBuffer::StreamBuffer():
+		m_handle(-1),
+		m_segmentSize(0),
+		m_segment(0),
+		m_offset(0),
+		m_persistent(nullptr),
+		m_mapped(nullptr),
+		m_mappedSize(0)
+{
+	for (int i = 0; i < Segments; ++i)
+	{
+		m_fences[i] = nullptr;
+	}
+}
+
+StreamBuffer::~StreamBuffer()
+{
+	if (m_handle == (uint32_t)-1)
+	{
+		return;
+	}
+	for (int i = 0; i < Segments; ++i)
+	{
+		if (m_fences[i] != nullptr)
+		{
+			glDeleteSync(m_fences[i]);
+		}
+	}
+	if (m_persistent != nullptr || m_mapped != nullptr)
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, m_handle);
+		glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
+	glDeleteBuffers(1, &m_handle);
+}
+
+void StreamBuffer::Init(size_t segmentSize)
+{
+	assert(m_handle == (uint32_t)-1);
+	m_segmentSize = (segmentSize + Alignment - 1) / Alignment * Alignment;
+	size_t size = m_segmentSize * Segments;
+
+	// The copy target keeps the bindings of the vertex array object untouched
+	glGenBuffers(1, &m_handle);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_handle);
+	if (glBufferStorage != nullptr && glFenceSync != nullptr)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, flags);
+		m_persistent = (uint8_t*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags);
+	}
+	if (m_persistent == nullptr)
+	{
+		glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+uint8_t* StreamBuffer::Map(size_t size)
+{
+	assert(m_mapped == nullptr && size <= m_segmentSize);
+	size_t end = (m_segment + 1) * m_segmentSize;
+	bool orphan = false;
+	if (m_offset + size > end)
+	{
+		NextSegment();
+		end = (m_segment + 1) * m_segmentSize;
+		// Without fences the storage is replaced when the buffer wraps around
+		orphan = m_segment == 0 && glFenceSync == nullptr;
+	}
+
+	m_mappedSize = end - m_offset;
+	if (m_persistent != nullptr)
+	{
+		m_mapped = m_persistent + m_offset;
+	}
+	else
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT
+				| (orphan ? GL_MAP_INVALIDATE_BUFFER_BIT : GL_MAP_INVALIDATE_RANGE_BIT);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, m_handle);
+		m_mapped = (uint8_t*)glMapBufferRange(GL_COPY_WRITE_BUFFER, m_offset, m_mappedSize, flags);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
+	return m_mapped;
+}
+
+size_t StreamBuffer::Commit(size_t size)
+{
+	assert(m_mapped != nullptr && size <= m_mappedSize);
+	if (m_persistent == nullptr)
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, m_handle);
+		glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
+	m_mapped = nullptr;
+	m_mappedSize = 0;
+
+	size_t offset = m_offset;
+	m_offset = (m_offset + size + Alignment - 1) / Alignment * Alignment;
+	return offset;
+}
+
+void StreamBuffer::NextSegment()
+{
+	if (glFenceSync != nullptr)
+	{
+		// Draws reading the segment are issued by now
+		if (m_fences[m_segment] != nullptr)
+		{
+			glDeleteSync(m_fences[m_segment]);
+		}
+		m_fences[m_segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	m_segment = (m_segment + 1) % Segments;
+	m_offset = m_segment * m_segmentSize;
+
+	GLsync fence = m_fences[m_segment];
+	if (fence != nullptr)
+	{
+		GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+		while (glClientWaitSync(fence, flags, 1000000) == GL_TIMEOUT_EXPIRED)
+		{
+			flags = 0;
+		}
+		glDeleteSync(fence);
+		m_fences[m_segment] = nullptr;
+	}
+}
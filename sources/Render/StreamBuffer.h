@@ -0,0 +1,56 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <GL/gl3w.h>
+
+namespace Render
+{
+	// Buffer for geometry rewritten every frame. Storage is split into segments used in turn, a segment is written
+	// again once the GPU has passed the fence put after the draws reading it. With GL 4.4 the buffer stays mapped
+	// (persistent and coherent), otherwise ranges are mapped unsynchronized and unmapped before drawing.
+	class StreamBuffer
+	{
+		StreamBuffer(const StreamBuffer&) = delete; // non construction-copyable
+		StreamBuffer& operator=(const StreamBuffer&) = delete; // non copyable
+	public:
+		enum
+		{
+			Segments = 3,
+			Alignment = 64
+		};
+
+		StreamBuffer();
+		~StreamBuffer();
+
+		void Init(size_t segmentSize);
+
+		// Maps at least `size` bytes for writing, moving to the next segment if the current one has less left.
+		// The size actually mapped is returned by GetMappedSize.
+		uint8_t* Map(size_t size);
+
+		// Ends writing, the first `size` bytes of the mapped range can be drawn from. Returns their offset in the buffer.
+		size_t Commit(size_t size);
+
+		size_t GetMappedSize() const { return m_mappedSize; }
+
+		bool IsMapped() const { return m_mapped != nullptr; }
+
+		bool IsPersistent() const { return m_persistent != nullptr; }
+
+		uint32_t GetHandle() const { return m_handle; }
+
+	private:
+		void NextSegment();
+
+		uint32_t m_handle;
+		size_t m_segmentSize;
+		int m_segment;
+		// Offset of the first free byte
+		size_t m_offset;
+		// Whole buffer if mapped persistently
+		uint8_t* m_persistent;
+		uint8_t* m_mapped;
+		size_t m_mappedSize;
+		GLsync m_fences[Segments];
+	};
+}
@@ -119,11 +119,6 @@ PVRReader::PVRReader(fsal::File file): file(file), version(-1), flags(0), channe
 	}
 }
 
-static int sizeof_4_ary_tree(int h)
-{
-	return ((1u << uint32_t(2 * (h + 1))) - 1) / (4 - 1);
-}
-
 template<typename T, int D>
 inline T prod(const glm::vec<D, T>& x)
 {
@@ -141,19 +136,11 @@ PVRReader::Blob PVRReader::Read(int mipmap, int face)
 
 	int offset = HeaderSize + metaDataSize;
 
-	if (glm::all(glm::equal(GetBlockSize(), glm::ivec3(1))))
+	// Levels are stored one after another, each with all faces. Sizes are summed level by level, so that
+	// non-square and non power of two chains, where levels are not exactly a quarter of the previous one, work too.
+	for (int i = 0; i < mipmap; ++i)
 	{
-		int offset_smallest_mipmap = sizeof_4_ary_tree(MIPMapCount - 1) - sizeof_4_ary_tree(MIPMapCount - 1 - mipmap);
-		auto smallest_mipmap_size = GetSize(MIPMapCount - 1);
-		offset += (offset_smallest_mipmap * prod(smallest_mipmap_size) * GetBitsPerPixel()) / 8 * GetFaceCount();
-	}
-	else
-	{
-		for (int i = 0; i <= mipmap; ++i)
-		{
-			auto s = GetSize(mipmap);
-			offset += (prod(s) * GetBitsPerPixel()) / 8 * GetFaceCount();
-		}
+		offset += (prod(GetSize(i)) * GetBitsPerPixel()) / 8 * GetFaceCount();
 	}
 	int face_size = (prod(size) * GetBitsPerPixel()) / 8;
 	offset += face_size * face;
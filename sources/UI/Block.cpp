@@ -1,7 +1,9 @@
 #include "Block.h"
+#include "utils/thread_pool.h"
 #include <functional>
 #include <initializer_list>
 #include <type_traits>
+#include <vector>
 
 
 namespace UI
@@ -225,11 +227,19 @@ namespace UI
 		lambda_post(block.get(), parent.get());
 	}
 
-	void Render(Render::Renderer2D* renderer, const BlockPtr& root, Render::View view, float time, int flags)
+	// Trees smaller than this are emitted on the calling thread
+	const int k_min_parallel_blocks = 512;
+
+	int CountBlocks(const BlockPtr& block)
 	{
-    	renderer->SetUp(view);
-    	Render::Encoder* encoder = renderer->GetEncoder();
-		Traverse(root, nullptr, [encoder, time, flags](UI::Block* block, UI::Block* parent)
+		int count = 0;
+		Traverse(block, nullptr, [&count](Block*, Block*) { ++count; });
+		return count;
+	}
+
+	void EmitTree(Render::Encoder* encoder, const BlockPtr& block, float time, int flags)
+	{
+		Traverse(block, nullptr, [encoder, time, flags](UI::Block* block, UI::Block* parent)
 		{
 			if (block->IsClipping())
 				encoder->PushScissors(block->GetBox());
@@ -239,6 +249,79 @@ namespace UI
 			if (block->IsClipping())
 				encoder->PopScissors();
 		});
+	}
+
+	// Blocks down to the first one with several children are emitted on the calling thread. Its children are split
+	// in runs of about the same number of blocks, each run is recorded by its own encoder in parallel. Encoders are
+	// drawn in the order of the runs, so the output is the same as of a single traversal.
+	void Render(Render::Renderer2D* renderer, const BlockPtr& root, Render::View view, float time, int flags)
+	{
+		renderer->SetUp(view);
+		Render::Encoder* encoder = renderer->GetEncoder();
+		auto& pool = utils::ThreadPool::Get();
+		int threads = pool.GetThreadCount();
+		int total = threads > 1 ? CountBlocks(root) : 0;
+		if (total < k_min_parallel_blocks)
+		{
+			renderer->SetEncoderCount(1);
+			EmitTree(encoder, root, time, flags);
+			renderer->Draw();
+			return;
+		}
+
+		std::vector<Block*> path;
+		Block* block = root.get();
+		while (true)
+		{
+			if (block->IsClipping())
+				encoder->PushScissors(block->GetBox());
+			block->Emit(encoder, time, flags);
+			path.push_back(block);
+			if (block->GetChilds().size() != 1)
+				break;
+			block = block->GetChilds()[0].get();
+		}
+
+		const auto& childs = block->GetChilds();
+		std::vector<int> run_begin = {0};
+		int remaining = total - (int)path.size();
+		int blocks = 0;
+		for (int i = 0; i < (int)childs.size(); ++i)
+		{
+			blocks += CountBlocks(childs[i]);
+			int runs_left = threads - (int)run_begin.size() + 1;
+			if (blocks * runs_left >= remaining && i + 1 < (int)childs.size() && runs_left > 1)
+			{
+				run_begin.push_back(i + 1);
+				remaining -= blocks;
+				blocks = 0;
+			}
+		}
+		run_begin.push_back((int)childs.size());
+		int runs = (int)run_begin.size() - 1;
+
+		renderer->SetEncoderCount(runs + 1);
+		pool.ParallelFor(0, runs, [&](int begin, int end)
+		{
+			for (int r = begin; r < end; ++r)
+			{
+				Render::Encoder* run_encoder = renderer->GetEncoder(r + 1);
+				if (encoder->HasScissors())
+					run_encoder->PushScissors(encoder->GetScissors());
+				for (int i = run_begin[r]; i < run_begin[r + 1]; ++i)
+				{
+					EmitTree(run_encoder, childs[i], time, flags);
+				}
+				if (encoder->HasScissors())
+					run_encoder->PopScissors();
+			}
+		}, 1);
+
+		for (auto it = path.rbegin(); it != path.rend(); ++it)
+		{
+			if ((*it)->IsClipping())
+				encoder->PopScissors();
+		}
 		renderer->Draw();
 	}
 
@@ -310,3 +393,60 @@ namespace UI
 		});
 	}
 }
+
+
+#include <doctest.h>
+
+TEST_CASE("[UI] Render splits large trees")
+{
+	auto fill = [](const glm::aabb2& box, Render::color c, float radius)
+	{
+		UI::BlockPtr block = UI::make_block({}, c);
+		block->SetBox(box);
+		block->SetRadius(glm::vec4(radius));
+		return block;
+	};
+
+	// The path down to the rows clips, so runs start with its scissors. Odd rows clip their cells too.
+	UI::BlockPtr root = fill(glm::aabb2(glm::vec2(0.0f), glm::vec2(1000.0f)), Render::color(20, 20, 20, 255), 0.0f);
+	root->EnableClipping(true);
+	UI::BlockPtr panel = UI::make_block({});
+	panel->SetBox(glm::aabb2(glm::vec2(10.0f), glm::vec2(990.0f)));
+	panel->EnableClipping(true);
+	root->AddChild(panel);
+	for (int i = 0; i < 16; ++i)
+	{
+		glm::vec2 p(10.0f, 10.0f + i * 60.0f);
+		UI::BlockPtr row = fill(glm::aabb2(p, p + glm::vec2(980.0f, 50.0f)), Render::color(40, 40, 40, 255), 4.0f);
+		row->EnableClipping(i % 2 == 1);
+		for (int j = 0; j < 64; ++j)
+		{
+			glm::vec2 q = p + glm::vec2(j * 16.0f - 8.0f, 5.0f);
+			row->AddChild(fill(glm::aabb2(q, q + glm::vec2(12.0f, 40.0f)), Render::color(255, j * 4, i * 16, 255), j % 5 == 0 ? 3.0f : 0.0f));
+		}
+		panel->AddChild(row);
+	}
+
+	Render::Renderer2D renderer;
+	renderer.Init();
+	Render::View view(glm::vec2(1000, 1000));
+	auto& pool = utils::ThreadPool::Get();
+	int threads = pool.GetThreadCount();
+
+	pool.SetThreadCount(1);
+	UI::Render(&renderer, root, view);
+	CHECK(renderer.GetEncoderCount() == 1);
+	Render::Renderer2D::FrameStats single = renderer.GetFrameStats();
+
+	pool.SetThreadCount(4);
+	UI::Render(&renderer, root, view);
+	CHECK(renderer.GetEncoderCount() > 2);
+	const Render::Renderer2D::FrameStats& split = renderer.GetFrameStats();
+	CHECK(split.draws == single.draws);
+	CHECK(split.batches == single.batches);
+	CHECK(split.flushes == single.flushes);
+	CHECK(split.uploaded_bytes == single.uploaded_bytes);
+	CHECK(split.batch_hash == single.batch_hash);
+
+	pool.SetThreadCount(threads);
+}
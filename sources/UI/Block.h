@@ -38,6 +38,7 @@ namespace UI
 		explicit Block(std::initializer_list<Constraint> cnst): m_constraints(cnst) {}
 
 		void AddChild(const BlockPtr& child) { m_childs.push_back(child); }
+		const stack::vector<BlockPtr, 4>& GetChilds() const { return m_childs; }
 		glm::vec2 GetPositionUL() const { return m_box.minp; }
 		glm::vec2 GetPositionC() const { return m_box.center(); }
 		glm::vec2 GetSize() const { return m_box.size(); }
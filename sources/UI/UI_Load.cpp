@@ -27,8 +27,7 @@ namespace UI
 				{
 					str[pos] = '\0';
 					ctx.func("anonymus", str.c_str());
-					ctx.Link();
-					value = ctx.get_func("anonymus").Eval();
+					value = ctx.Evaluate("anonymus");
 					serialization::Parser parser(str.c_str() + pos + 1);
 					parser.AcceptWhiteSpace();
 					if (AcceptUnit(parser, unit))
@@ -290,8 +289,11 @@ namespace UI
 		spdlog::info("Loading: {}", f.GetPath().string().c_str());
 		YAML::Node root_node = YAML::Load(std::string(f));
 
+		// Expressions repeat across files and reloads, they are compiled once
+		static ExpessionEvaluator::ProgramCache cache;
 		ExpessionEvaluator::INTContext ctx;
 		//ExpessionEvaluator::JITContext ctx;
+		ctx.set_cache(&cache);
 
 		auto vars = root_node["vars"];
 		auto colors = root_node["colors"];
@@ -23,6 +23,10 @@
 #include "Vector/nanovg.h"
 #include "Vector/nanovg_backend.h"
 #include "runtime_error.h"
+#include "utils/thread_pool.h"
+#include "Render/Image/Image.h"
+#include "Render/Image/ImagePool.h"
+#include "Render/Image/TiledImage.h"
 
 #define DOCTEST_CONFIG_IMPLEMENT
 #include <doctest.h>
@@ -643,9 +647,220 @@ void pth::Context::Box(float minx, float miny, float maxx, float maxy, std::tupl
 }
 
 
+namespace
+{
+	Image::DataType ImageTypeFromFormat(const std::string& format, int channels)
+	{
+		if (format == py::format_descriptor<uint8_t>::format())
+		{
+			if (channels == 1) return Image::R8;
+			if (channels == 3) return Image::RGB8;
+			if (channels == 4) return Image::RGBA8;
+		}
+		else if (format == py::format_descriptor<float>::format())
+		{
+			if (channels == 1) return Image::RF;
+			if (channels == 2) return Image::RGF;
+			if (channels == 3) return Image::RGBF;
+			if (channels == 4) return Image::RGBAF;
+		}
+		else if (format == py::format_descriptor<uint16_t>::format() && channels == 1)
+		{
+			return Image::R16;
+		}
+		else if (format == py::format_descriptor<int16_t>::format() && channels == 2)
+		{
+			return Image::RG16;
+		}
+		else if (format == py::format_descriptor<uint32_t>::format() && channels == 1)
+		{
+			return Image::R32;
+		}
+		throw utils::runtime_error("Unsupported array: format %s, %d channels", format.c_str(), channels);
+	}
+
+	std::string ImageFormatDescriptor(Image::DataType d)
+	{
+		switch (d)
+		{
+			case Image::R8: case Image::RGB8: case Image::RGBA8: return py::format_descriptor<uint8_t>::format();
+			case Image::R16: return py::format_descriptor<uint16_t>::format();
+			case Image::RG16: return py::format_descriptor<int16_t>::format();
+			case Image::R32: return py::format_descriptor<uint32_t>::format();
+			default: return py::format_descriptor<float>::format();
+		}
+	}
+
+	// Wraps array without a copy. The array is referenced until the last Image that uses its memory is gone.
+	// Read-only arrays are copied, so in-place ops on the image can't write to them.
+	Image ImageFromBuffer(py::buffer b)
+	{
+		py::buffer_info info = b.request();
+		if (info.ndim != 2 && info.ndim != 3)
+		{
+			throw utils::runtime_error("Expected array of shape (h, w) or (h, w, c), got %d dimensions", (int)info.ndim);
+		}
+		Image::DataType d = ImageTypeFromFormat(info.format, info.ndim == 3 ? (int)info.shape[2] : 1);
+		bool packed = (size_t)info.strides[1] == Image::GetBPP(d) && (info.ndim == 2 || (size_t)info.strides[2] == (size_t)info.itemsize);
+		if (!packed || info.strides[0] <= 0)
+		{
+			throw utils::runtime_error("Pixels of the array must be contiguous within rows");
+		}
+		std::shared_ptr<void> owner(new py::object(b), [](void* p)
+		{
+			py::gil_scoped_acquire gil;
+			delete (py::object*)p;
+		});
+		Image im = Image::FromExternalData(info.ptr, d, glm::ivec2(info.shape[1], info.shape[0]), info.strides[0], owner, info.readonly);
+		if (info.readonly)
+		{
+			py::gil_scoped_release release;
+			return im.Copy();
+		}
+		return im;
+	}
+}
+
+
 PYBIND11_MODULE(_getoolkit, m) {
 	m.doc() = "getoolkit";
 
+	m.def("set_num_threads", [](int count) { utils::ThreadPool::Get().SetThreadCount(count); },
+			"Sets number of threads used for image processing. 0 - use all cores, 1 - run single-threaded and deterministic",
+			py::arg("count"));
+	m.def("get_num_threads", []() { return utils::ThreadPool::Get().GetThreadCount(); });
+
+	m.def("set_image_pool_limit", [](size_t bytes) { ImagePool::Get().SetRetainLimit(bytes); },
+			"Maximum number of bytes kept for reuse by the image buffer pool. 0 - don't retain buffers",
+			py::arg("bytes"));
+	m.def("get_image_pool_stats", []()
+		{
+			ImagePool::Stats s = ImagePool::Get().GetStats();
+			py::dict d;
+			d["requests"] = s.requests;
+			d["hits"] = s.hits;
+			d["hit_rate"] = s.HitRate();
+			d["bytes_in_use"] = s.bytes_in_use;
+			d["peak_bytes_in_use"] = s.peak_bytes_in_use;
+			d["bytes_retained"] = s.bytes_retained;
+			d["peak_bytes_retained"] = s.peak_bytes_retained;
+			return d;
+		});
+
+	py::enum_<Image::ResampleFilter>(m, "ResampleFilter")
+		.value("Box", Image::ResampleBox)
+		.value("BSpline", Image::ResampleBSpline)
+		.value("Mitchell", Image::ResampleMitchell)
+		.value("Lanczos3", Image::ResampleLanczos3);
+
+	py::class_<Image>(m, "Image", py::buffer_protocol())
+		.def_static("from_buffer", &ImageFromBuffer, "Wraps numpy array or any other buffer without copying, read-only buffers are copied",
+			py::arg("buffer"))
+		.def_static("map_file", [](const char* filename, std::tuple<int, int, int> shape, py::object dtype, size_t offset, bool writable)
+			{
+				Image::DataType d = ImageTypeFromFormat(py::dtype::from_args(dtype).attr("char").cast<std::string>(), std::get<2>(shape));
+				return Image::MapFile(filename, d, glm::ivec2(std::get<1>(shape), std::get<0>(shape)), offset, writable);
+			}, "Maps raw pixels from file, shape is (h, w, c)",
+			py::arg("filename"), py::arg("shape"), py::arg("dtype"), py::arg("offset") = 0, py::arg("writable") = false)
+		.def_static("map_tga", &Image::MapTGA, "Maps uncompressed TGA with top-left origin, channels are BGR(A)",
+			py::arg("filename"), py::arg("writable") = false)
+		.def_property_readonly("width", [](const Image& self) { return self.GetSize().x; })
+		.def_property_readonly("height", [](const Image& self) { return self.GetSize().y; })
+		.def_property_readonly("channels", &Image::GetChannelCount)
+		.def_property_readonly("readonly", &Image::IsReadOnly)
+		.def("copy", &Image::Copy)
+		.def("convert", [](const Image& self, py::object dtype, int channels, bool srgb)
+			{
+				Image::DataType d = ImageTypeFromFormat(py::dtype::from_args(dtype).attr("char").cast<std::string>(), channels);
+				py::gil_scoped_release release;
+				return self.Convert(d, srgb);
+			}, "Converts between uint8 and float32 pixels, 8-bit values map to [0, 1], optionally sRGB encoded",
+			py::arg("dtype"), py::arg("channels"), py::arg("srgb") = false)
+		.def("resample", [](const Image& self, int width, int height, Image::ResampleFilter filter, float gamma)
+			{
+				py::gil_scoped_release release;
+				return self.Resample(glm::ivec2(width, height), filter, gamma);
+			}, "Resamples to the given size, filtering in linear light if gamma is not 1",
+			py::arg("width"), py::arg("height"), py::arg("filter") = Image::ResampleLanczos3, py::arg("gamma") = 1.0f)
+		.def("generate_mipmaps", [](const Image& self, Image::ResampleFilter filter, float gamma)
+			{
+				py::gil_scoped_release release;
+				return self.GenerateMipmaps(filter, gamma);
+			}, "Mip chain down to 1x1, starting with a copy of the image",
+			py::arg("filter") = Image::ResampleBSpline, py::arg("gamma") = 2.2f)
+		.def("save_mipmaps_to_pvr", [](const Image& self, const char* filename, Image::ResampleFilter filter, float gamma)
+			{
+				py::gil_scoped_release release;
+				self.SaveMipmapsToPVR(filename, filter, gamma);
+			}, "Writes the mip chain to PVR v3 file as it is generated",
+			py::arg("filename"), py::arg("filter") = Image::ResampleBSpline, py::arg("gamma") = 2.2f)
+		.def("compute_energy", [](const Image& self)
+			{
+				py::gil_scoped_release release;
+				return self.ComputeEnergy();
+			}, "Seam carving energy, absolute luma differences to neighbours as RF")
+		.def("compute_seam_map", [](const Image& self, bool vertical, int seams, int levels)
+			{
+				py::gil_scoped_release release;
+				return self.ComputeSeamMap(vertical, seams, levels);
+			}, "R16 map with removal order of each pixel along vertical or horizontal seams",
+			py::arg("vertical"), py::arg("seams"), py::arg("levels") = 0)
+		.def("save_to_tga", &Image::SaveToTGA)
+		.def_buffer([](Image& self) -> py::buffer_info
+			{
+				size_t channels = self.GetChannelCount();
+				size_t itemsize = self.GetBPP() / channels;
+				return py::buffer_info(self.GetRow<uint8_t>(0), itemsize, ImageFormatDescriptor(self.GetType()), 3,
+						{ (size_t)self.GetSize().y, (size_t)self.GetSize().x, channels },
+						{ self.GetRowSizeAligned(), self.GetBPP(), itemsize }, self.IsReadOnly());
+			});
+
+	py::class_<TiledImage, std::shared_ptr<TiledImage> >(m, "TiledImage")
+		.def_static("from_image", [](const Image& image, int tile_size, size_t resident_limit)
+			{
+				py::gil_scoped_release release;
+				return TiledImage::FromImage(image, tile_size, resident_limit);
+			}, "Splits the image into tiles, tiles above the resident limit are spilled to a temporary file",
+			py::arg("image"), py::arg("tile_size") = (int)TiledImage::DefaultTileSize, py::arg("resident_limit") = (size_t)TiledImage::DefaultResidentLimit)
+		.def_property_readonly("width", [](const TiledImage& self) { return self.GetSize().x; })
+		.def_property_readonly("height", [](const TiledImage& self) { return self.GetSize().y; })
+		.def_property_readonly("tile_size", &TiledImage::GetTileSize)
+		.def_property_readonly("resident_bytes", &TiledImage::GetResidentBytes)
+		.def_property_readonly("peak_resident_bytes", &TiledImage::GetPeakResidentBytes)
+		.def("to_image", [](const TiledImage& self)
+			{
+				py::gil_scoped_release release;
+				return self.ToImage();
+			})
+		.def("read", [](const TiledImage& self, int x, int y, int width, int height)
+			{
+				py::gil_scoped_release release;
+				return self.Read(glm::ivec2(x, y), glm::ivec2(width, height));
+			}, "Copy of the region, loads only the tiles it covers",
+			py::arg("x"), py::arg("y"), py::arg("width"), py::arg("height"))
+		.def("write", [](TiledImage& self, int x, int y, const Image& image)
+			{
+				py::gil_scoped_release release;
+				self.Write(glm::ivec2(x, y), image);
+			}, py::arg("x"), py::arg("y"), py::arg("image"))
+		.def("resample", [](const TiledImage& self, int width, int height, Image::ResampleFilter filter, float gamma)
+			{
+				py::gil_scoped_release release;
+				return self.Resample(glm::ivec2(width, height), filter, gamma);
+			}, "Resamples tile by tile, same result as Image.resample",
+			py::arg("width"), py::arg("height"), py::arg("filter") = Image::ResampleLanczos3, py::arg("gamma") = 1.0f)
+		.def("gauss_blur", [](const TiledImage& self, float r)
+			{
+				py::gil_scoped_release release;
+				return self.GaussBlur(r);
+			}, py::arg("r"))
+		.def("compute_df", [](const TiledImage& self, float max_distance)
+			{
+				py::gil_scoped_release release;
+				return self.ComputeDF(Image::ExactEuclidean, max_distance);
+			}, "Signed euclidean distance field clamped to max_distance",
+			py::arg("max_distance"));
+
 	py::class_<glm::vec2>(m, "vec2")
 	    .def(py::init<float, float>())
 	    .def(py::init<float>())
@@ -0,0 +1,105 @@
+#include "mapped_file.h"
+#include "common.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+std::shared_ptr<utils::MappedFile> utils::MappedFile::Open(const char* filename, bool writable)
+{
+	std::shared_ptr<MappedFile> m(new MappedFile());
+	m->writable = writable;
+	HANDLE file = CreateFileA(filename, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ,
+			nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		throw utils::runtime_error("Can't open file %s", filename);
+	}
+	m->file = file;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		throw utils::runtime_error("Can't get size of file %s", filename);
+	}
+	m->size = (size_t)size.QuadPart;
+	if (m->size == 0)
+	{
+		return m;
+	}
+
+	m->mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+	if (m->mapping == nullptr)
+	{
+		throw utils::runtime_error("Can't map file %s", filename);
+	}
+	m->data = (unsigned char*)MapViewOfFile(m->mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+	if (m->data == nullptr)
+	{
+		throw utils::runtime_error("Can't map file %s", filename);
+	}
+	return m;
+}
+
+utils::MappedFile::~MappedFile()
+{
+	if (data != nullptr)
+	{
+		UnmapViewOfFile(data);
+	}
+	if (mapping != nullptr)
+	{
+		CloseHandle(mapping);
+	}
+	if (file != nullptr)
+	{
+		CloseHandle(file);
+	}
+}
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+std::shared_ptr<utils::MappedFile> utils::MappedFile::Open(const char* filename, bool writable)
+{
+	std::shared_ptr<MappedFile> m(new MappedFile());
+	m->writable = writable;
+	int fd = open(filename, writable ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+	{
+		throw utils::runtime_error("Can't open file %s", filename);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		throw utils::runtime_error("Can't get size of file %s", filename);
+	}
+	m->size = (size_t)st.st_size;
+	if (m->size == 0)
+	{
+		close(fd);
+		return m;
+	}
+
+	// Descriptor is not needed once the mapping exists
+	void* p = mmap(nullptr, m->size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		throw utils::runtime_error("Can't map file %s", filename);
+	}
+	m->data = (unsigned char*)p;
+	return m;
+}
+
+utils::MappedFile::~MappedFile()
+{
+	if (data != nullptr)
+	{
+		munmap(data, size);
+	}
+}
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+#include <stddef.h>
+#include <memory>
+
+
+namespace utils
+{
+	// Memory mapping of a whole file. The mapping stays alive while any copy of the returned pointer exists,
+	// so it can be used as an owner for objects that borrow the mapped bytes.
+	// Throws utils::runtime_error if the file can not be opened or mapped.
+	struct MappedFile
+	{
+		static std::shared_ptr<MappedFile> Open(const char* filename, bool writable = false);
+
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		unsigned char* data = nullptr;
+		size_t size = 0;
+		bool writable = false;
+
+	private:
+		MappedFile() = default;
+#ifdef _WIN32
+		void* file = nullptr;
+		void* mapping = nullptr;
+#endif
+	};
+}
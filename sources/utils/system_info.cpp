@@ -18,9 +18,17 @@ utils::MemoryUsage utils::GetMemoryUsage()
 	r.extended_memory_free = statex.ullAvailExtendedVirtual;
 	return r;
 }
+
+int utils::GetLogicalCoreCount()
+{
+	SYSTEM_INFO sysinfo;
+	GetSystemInfo(&sysinfo);
+	return sysinfo.dwNumberOfProcessors > 0 ? (int)sysinfo.dwNumberOfProcessors : 1;
+}
 #else
 #include "sys/types.h"
 #include "sys/sysinfo.h"
+#include <unistd.h>
 
 utils::MemoryUsage utils::GetMemoryUsage()
 {
@@ -35,4 +43,41 @@ utils::MemoryUsage utils::GetMemoryUsage()
 	r.memory_in_use_percents = 100LL * (memInfo.totalram - (memInfo.freeram + memInfo.bufferram)) / memInfo.totalram;
 	return r;
 }
+
+int utils::GetLogicalCoreCount()
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+}
 #endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+utils::CPUFeatures utils::GetCPUFeatures()
+{
+	CPUFeatures r;
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	r.sse41 = (info[2] & (1 << 19)) != 0;
+	if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+	{
+		r.fma = (info[2] & (1 << 12)) != 0;
+		__cpuidex(info, 7, 0);
+		r.avx2 = (info[1] & (1 << 5)) != 0;
+	}
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	r.sse41 = __builtin_cpu_supports("sse4.1");
+	r.avx2 = __builtin_cpu_supports("avx2");
+	r.fma = __builtin_cpu_supports("fma");
+#endif
+	return r;
+}
@@ -19,6 +19,19 @@ namespace utils
 	};
 
 	MemoryUsage GetMemoryUsage();
+
+	// Number of logical processors available to the process, at least 1.
+	int GetLogicalCoreCount();
+
+	struct CPUFeatures
+	{
+		bool sse41 = false;
+		bool avx2 = false;
+		bool fma = false;
+	};
+
+	// Instruction set extensions supported by both the CPU and the OS.
+	CPUFeatures GetCPUFeatures();
 }
 
 template<>
@@ -0,0 +1,316 @@
+#include "thread_pool.h"
+#include "system_info.h"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+	struct Job
+	{
+		const utils::ThreadPool::RangeFunc* f = nullptr;
+		std::atomic<int> pending;
+		std::exception_ptr error;
+		std::mutex mutex;
+		std::condition_variable done;
+	};
+
+	struct Task
+	{
+		Job* job;
+		int begin;
+		int end;
+	};
+
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+		std::thread thread;
+	};
+
+	thread_local bool t_inside_task = false;
+}
+
+
+struct utils::ThreadPool::Impl
+{
+	std::vector<std::unique_ptr<Worker> > workers;
+	std::atomic<int> queued;
+	std::mutex sleep_mutex;
+	std::condition_variable wake;
+	bool stop = false;
+	int thread_count = 1;
+
+	// Held shared by ParallelFor and exclusively by SetThreadCount, so workers are never torn down
+	// while a job still has tiles in their queues.
+	mutable std::shared_timed_mutex config_mutex;
+
+	Impl(): queued(0) {}
+
+	bool Pop(size_t index, Task& task)
+	{
+		Worker& w = *workers[index];
+		std::lock_guard<std::mutex> lock(w.mutex);
+		if (w.tasks.empty())
+		{
+			return false;
+		}
+		task = w.tasks.back();
+		w.tasks.pop_back();
+		--queued;
+		return true;
+	}
+
+	bool Steal(size_t thief, Task& task)
+	{
+		size_t count = workers.size();
+		for (size_t k = 1; k <= count; ++k)
+		{
+			Worker& w = *workers[(thief + k) % count];
+			std::lock_guard<std::mutex> lock(w.mutex);
+			if (!w.tasks.empty())
+			{
+				task = w.tasks.front();
+				w.tasks.pop_front();
+				--queued;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static void Execute(const Task& task)
+	{
+		Job* job = task.job;
+		bool inside_task = t_inside_task;
+		t_inside_task = true;
+		try
+		{
+			(*job->f)(task.begin, task.end);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(job->mutex);
+			if (!job->error)
+			{
+				job->error = std::current_exception();
+			}
+		}
+		t_inside_task = inside_task;
+		// Decrement under the lock: the owner of the job can not return and destroy it before we release it.
+		std::lock_guard<std::mutex> lock(job->mutex);
+		if (--job->pending == 0)
+		{
+			job->done.notify_all();
+		}
+	}
+
+	void WorkerLoop(size_t index)
+	{
+		while (true)
+		{
+			Task task;
+			if (Pop(index, task) || Steal(index, task))
+			{
+				Execute(task);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleep_mutex);
+			wake.wait(lock, [this] { return stop || queued > 0; });
+			if (stop)
+			{
+				return;
+			}
+		}
+	}
+
+	void Start(int count)
+	{
+		thread_count = count;
+		stop = false;
+		for (int i = 0; i < count - 1; ++i)
+		{
+			workers.emplace_back(new Worker);
+		}
+		for (size_t i = 0; i < workers.size(); ++i)
+		{
+			workers[i]->thread = std::thread(&Impl::WorkerLoop, this, i);
+		}
+	}
+
+	void Shutdown()
+	{
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			stop = true;
+		}
+		wake.notify_all();
+		for (auto& w: workers)
+		{
+			w->thread.join();
+		}
+		workers.clear();
+	}
+};
+
+
+utils::ThreadPool& utils::ThreadPool::Get()
+{
+	// Intentionally never destroyed: joining threads from static destructors of a shared library
+	// deadlocks on Windows, and the OS reclaims the workers at exit anyway.
+	static ThreadPool* pool = new ThreadPool();
+	return *pool;
+}
+
+utils::ThreadPool::ThreadPool(): m_impl(new Impl)
+{
+	m_impl->Start(GetLogicalCoreCount());
+}
+
+utils::ThreadPool::~ThreadPool()
+{
+	m_impl->Shutdown();
+}
+
+void utils::ThreadPool::SetThreadCount(int count)
+{
+	// The job running the task holds config_mutex until all of its tiles are done
+	if (t_inside_task)
+	{
+		throw utils::runtime_error("ThreadPool::SetThreadCount can't be called from inside a ParallelFor task");
+	}
+	if (count <= 0)
+	{
+		count = GetLogicalCoreCount();
+	}
+	std::unique_lock<std::shared_timed_mutex> lock(m_impl->config_mutex);
+	if (count == m_impl->thread_count)
+	{
+		return;
+	}
+	m_impl->Shutdown();
+	m_impl->Start(count);
+}
+
+int utils::ThreadPool::GetThreadCount() const
+{
+	std::shared_lock<std::shared_timed_mutex> lock(m_impl->config_mutex);
+	return m_impl->thread_count;
+}
+
+void utils::ThreadPool::ParallelFor(int begin, int end, const RangeFunc& f, int grain)
+{
+	int total = end - begin;
+	if (total <= 0)
+	{
+		return;
+	}
+
+	std::shared_lock<std::shared_timed_mutex> lock(m_impl->config_mutex);
+
+	int threads = m_impl->thread_count;
+	if (grain <= 0)
+	{
+		int target_tiles = threads * 4;
+		grain = std::max(1, (total + target_tiles - 1) / target_tiles);
+	}
+	int tiles = (total + grain - 1) / grain;
+
+	// Nested calls from inside a tile run inline, otherwise a worker could block on a job that needs itself.
+	if (threads <= 1 || tiles <= 1 || t_inside_task)
+	{
+		lock.unlock();
+		f(begin, end);
+		return;
+	}
+
+	Job job;
+	job.f = &f;
+	job.pending = tiles;
+
+	// Contiguous runs of tiles go to the same worker, so neighbouring rows tend to stay on one core.
+	size_t worker_count = m_impl->workers.size();
+	for (int t = 0; t < tiles; ++t)
+	{
+		Worker& w = *m_impl->workers[(size_t)t * worker_count / tiles];
+		std::lock_guard<std::mutex> wlock(w.mutex);
+		w.tasks.push_back({&job, begin + t * grain, std::min(begin + (t + 1) * grain, end)});
+	}
+	{
+		std::lock_guard<std::mutex> slock(m_impl->sleep_mutex);
+		m_impl->queued += tiles;
+	}
+	m_impl->wake.notify_all();
+
+	Task task;
+	while (job.pending > 0 && m_impl->Steal(0, task))
+	{
+		Impl::Execute(task);
+	}
+
+	{
+		std::unique_lock<std::mutex> jlock(job.mutex);
+		job.done.wait(jlock, [&job] { return job.pending == 0; });
+	}
+
+	if (job.error)
+	{
+		std::rethrow_exception(job.error);
+	}
+}
+
+
+#include <doctest.h>
+
+TEST_CASE("[utils] ThreadPool")
+{
+	auto& pool = utils::ThreadPool::Get();
+	int threads = pool.GetThreadCount();
+
+	std::vector<int> v(10000, 0);
+	pool.ParallelFor(0, (int)v.size(), [&v](int begin, int end)
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			v[i] += i;
+		}
+	}, 7);
+	for (int i = 0; i < (int)v.size(); ++i)
+	{
+		CHECK_EQ(v[i], i);
+	}
+
+	pool.SetThreadCount(1);
+	std::vector<int> order;
+	pool.ParallelFor(0, 100, [&order](int begin, int end)
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			order.push_back(i);
+		}
+	}, 3);
+	CHECK_EQ(order.size(), 100u);
+	CHECK(std::is_sorted(order.begin(), order.end()));
+
+	pool.SetThreadCount(threads);
+	CHECK_EQ(pool.GetThreadCount(), threads);
+
+	// Reconfiguring from inside a task would wait for the job it is part of
+	pool.SetThreadCount(4);
+	CHECK_THROWS(pool.ParallelFor(0, 16, [&pool](int, int)
+	{
+		pool.SetThreadCount(1);
+	}, 1));
+	CHECK_EQ(pool.GetThreadCount(), 4);
+	pool.SetThreadCount(threads);
+}
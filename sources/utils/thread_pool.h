@@ -0,0 +1,39 @@
+#pragma once
+#include <functional>
+#include <memory>
+
+
+namespace utils
+{
+	// Persistent pool of worker threads with per-worker task queues. Idle workers steal tiles
+	// from the front of other queues, owners take from the back.
+	class ThreadPool
+	{
+	public:
+		typedef std::function<void(int begin, int end)> RangeFunc;
+
+		static ThreadPool& Get();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		// 0 sizes the pool from the number of logical cores. 1 runs every ParallelFor on the
+		// calling thread in order, which gives deterministic execution for tests and debugging.
+		// Waits for running ParallelFor calls, so it throws when called from inside a task.
+		void SetThreadCount(int count);
+
+		int GetThreadCount() const;
+
+		// Splits [begin, end) into tiles of `grain` items and calls `f` for each of them. If grain is 0,
+		// tile size is picked so that each thread gets several tiles. Blocks until all tiles are done,
+		// calling thread participates in the work. Exception thrown by `f` is rethrown here.
+		void ParallelFor(int begin, int end, const RangeFunc& f, int grain = 0);
+
+	private:
+		ThreadPool();
+		~ThreadPool();
+
+		struct Impl;
+		std::unique_ptr<Impl> m_impl;
+	};
+}